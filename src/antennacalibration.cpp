@@ -0,0 +1,193 @@
+#include "antennacalibration.hpp"
+
+#include <math.h>
+#include <string.h>
+
+// distance light travels in one DW1000 time unit (~15.65ps), m
+#define DISTANCE_PER_TICK 0.0046917639786159
+// smaller pivots mean the nodes' errors can't be separated
+#define MIN_PIVOT 1e-6
+
+void AntennaCalibration::reset()
+{
+    mNodeCount = 0;
+    mRangeCount = 0;
+}
+
+int8_t AntennaCalibration::indexOf(const uint8_t eui[8])
+{
+    for (uint8_t i = 0; i < mNodeCount; i++)
+    {
+        if (memcmp(mNodes[i].eui, eui, 8) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool AntennaCalibration::setNode(const uint8_t eui[8], float x, float y, float z)
+{
+    int8_t index = this->indexOf(eui);
+    if (index < 0)
+    {
+        if (mNodeCount >= MAX_NODES)
+        {
+            return false;
+        }
+        index = mNodeCount++;
+        memcpy(mNodes[index].eui, eui, 8);
+    }
+    Node &node = mNodes[index];
+    node.x = x;
+    node.y = y;
+    node.z = z;
+    node.solved = false;
+    return true;
+}
+
+bool AntennaCalibration::addRange(const uint8_t a[8], const uint8_t b[8], float range)
+{
+    if (mRangeCount >= MAX_RANGES || memcmp(a, b, 8) == 0)
+    {
+        return false;
+    }
+    Range &r = mRanges[mRangeCount++];
+    memcpy(r.a, a, 8);
+    memcpy(r.b, b, 8);
+    r.range = range;
+    return true;
+}
+
+AntennaCalibration::Result AntennaCalibration::solve()
+{
+    Result result = {false, 0, 0, 0, 0};
+
+    // normal equations of e[a] + e[b] = error / DISTANCE_PER_TICK, over ranges between nodes with a position
+    double normal[MAX_NODES][MAX_NODES + 1];
+    memset(normal, 0, sizeof(normal));
+    float errors[MAX_RANGES];
+    int8_t ends[MAX_RANGES][2];
+    double squaredError = 0;
+    for (uint8_t i = 0; i < mRangeCount; i++)
+    {
+        int8_t a = this->indexOf(mRanges[i].a);
+        int8_t b = this->indexOf(mRanges[i].b);
+        ends[i][0] = a;
+        ends[i][1] = b;
+        if (a < 0 || b < 0)
+        {
+            continue;
+        }
+        float dx = mNodes[a].x - mNodes[b].x;
+        float dy = mNodes[a].y - mNodes[b].y;
+        float dz = mNodes[a].z - mNodes[b].z;
+        errors[i] = mRanges[i].range - sqrtf(dx * dx + dy * dy + dz * dz);
+        squaredError += errors[i] * errors[i];
+        result.ranges++;
+
+        double ticks = errors[i] / DISTANCE_PER_TICK;
+        normal[a][a] += 1;
+        normal[b][b] += 1;
+        normal[a][b] += 1;
+        normal[b][a] += 1;
+        normal[a][MAX_NODES] += ticks;
+        normal[b][MAX_NODES] += ticks;
+    }
+    if (result.ranges == 0)
+    {
+        return result;
+    }
+    result.rmsBefore = sqrt(squaredError / result.ranges);
+
+    // only nodes that turned up in a range are solved for
+    uint8_t columns[MAX_NODES];
+    for (uint8_t i = 0; i < mNodeCount; i++)
+    {
+        mNodes[i].solved = false;
+        if (normal[i][i] > 0)
+        {
+            columns[result.nodes++] = i;
+        }
+    }
+    if (result.nodes < 3)
+    {
+        return result;
+    }
+
+    // gauss-jordan with partial pivoting, at most MAX_NODES unknowns
+    uint8_t n = result.nodes;
+    double matrix[MAX_NODES][MAX_NODES + 1];
+    for (uint8_t row = 0; row < n; row++)
+    {
+        for (uint8_t column = 0; column < n; column++)
+        {
+            matrix[row][column] = normal[columns[row]][columns[column]];
+        }
+        matrix[row][n] = normal[columns[row]][MAX_NODES];
+    }
+    for (uint8_t pivot = 0; pivot < n; pivot++)
+    {
+        uint8_t best = pivot;
+        for (uint8_t row = pivot + 1; row < n; row++)
+        {
+            if (fabs(matrix[row][pivot]) > fabs(matrix[best][pivot]))
+            {
+                best = row;
+            }
+        }
+        if (fabs(matrix[best][pivot]) < MIN_PIVOT)
+        {
+            return result;
+        }
+        for (uint8_t column = 0; column <= n; column++)
+        {
+            double swap = matrix[pivot][column];
+            matrix[pivot][column] = matrix[best][column];
+            matrix[best][column] = swap;
+        }
+        for (uint8_t row = 0; row < n; row++)
+        {
+            if (row == pivot)
+            {
+                continue;
+            }
+            double factor = matrix[row][pivot] / matrix[pivot][pivot];
+            for (uint8_t column = pivot; column <= n; column++)
+            {
+                matrix[row][column] -= factor * matrix[pivot][column];
+            }
+        }
+    }
+    for (uint8_t row = 0; row < n; row++)
+    {
+        Node &node = mNodes[columns[row]];
+        node.correction = matrix[row][n] / matrix[row][row];
+        node.solved = true;
+    }
+
+    squaredError = 0;
+    for (uint8_t i = 0; i < mRangeCount; i++)
+    {
+        if (ends[i][0] < 0 || ends[i][1] < 0)
+        {
+            continue;
+        }
+        float left = errors[i] - (mNodes[ends[i][0]].correction + mNodes[ends[i][1]].correction) * DISTANCE_PER_TICK;
+        squaredError += left * left;
+    }
+    result.rmsAfter = sqrt(squaredError / result.ranges);
+    result.success = true;
+    return result;
+}
+
+bool AntennaCalibration::getCorrection(const uint8_t eui[8], float &correction)
+{
+    int8_t index = this->indexOf(eui);
+    if (index < 0 || !mNodes[index].solved)
+    {
+        return false;
+    }
+    correction = mNodes[index].correction;
+    return true;
+}
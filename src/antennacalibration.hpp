@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Works out every anchor's antenna delay error at once from ranges the anchors measured to each other at surveyed positions.
+ *
+ * With the same delay programmed for TX and RX, a DS-TWR range between i and j comes out
+ * (e[i] + e[j]) DW1000 time units too long, where e is how far the real delay is above the programmed one.
+ * Every measured pair is one equation, e is their least squares solution, and adding e[i] to node i's antenna delay cancels it.
+ * Needs at least 3 nodes ranging each other in a triangle, with only a chain or ring of even length the errors can't be told apart.
+ *
+ * No Arduino dependencies, so it also builds on the host.
+ */
+class AntennaCalibration
+{
+public:
+    static const uint8_t MAX_NODES = 8;
+    // both directions of every pair
+    static const uint8_t MAX_RANGES = MAX_NODES * (MAX_NODES - 1);
+
+    typedef struct
+    {
+        bool success;
+        uint8_t nodes;
+        uint8_t ranges;
+        float rmsBefore; // m, of measured against surveyed distances
+        float rmsAfter;  // m, what's left once the delays are corrected
+    } Result;
+
+    AntennaCalibration() { this->reset(); }
+
+    void reset();
+    // surveyed position, m. Returns false if there's no room
+    bool setNode(const uint8_t eui[8], float x, float y, float z);
+    // a range measured between two nodes, either way around. Positions can come before or after
+    bool addRange(const uint8_t a[8], const uint8_t b[8], float range);
+
+    Result solve();
+    /**
+     * DW1000 time units to add to the node's antenna delay, valid after a successful solve().
+     * False if the node wasn't part of it.
+     */
+    bool getCorrection(const uint8_t eui[8], float &correction);
+
+private:
+    typedef struct
+    {
+        uint8_t eui[8];
+        float x, y, z;
+        bool solved;
+        float correction;
+    } Node;
+
+    typedef struct
+    {
+        uint8_t a[8];
+        uint8_t b[8];
+        float range;
+    } Range;
+
+    Node mNodes[MAX_NODES];
+    uint8_t mNodeCount;
+    Range mRanges[MAX_RANGES];
+    uint8_t mRangeCount;
+
+    int8_t indexOf(const uint8_t eui[8]);
+};
@@ -0,0 +1,484 @@
+#include "broadcastranging.hpp"
+
+#include <string.h>
+
+// IEEE 802.15.4 data frame, same first byte as DW1000Ng's DATA
+#define FRAME_DATA 0x41
+#define TIMESTAMP_LENGTH 5
+// DW1000 timestamps are 40 bits and wrap
+#define TIMESTAMP_MASK 0xFFFFFFFFFFULL
+#define TICKS_PER_US 63897.6
+
+BroadcastRanging::BroadcastRanging(Radio &radio) : mRadio(radio)
+{
+    mState = IDLE;
+    mDeadline = 0;
+    mSequence = 0;
+    memset(mEui, 0, sizeof(mEui));
+    mShortId = 0;
+    mRangeCorrection = nullptr;
+    mHasPosition = false;
+    mX = mY = mZ = 0;
+    mLateReplies = 0;
+    memset(&mPoll, 0, sizeof(mPoll));
+    mPollSent = 0;
+    memset(mResponded, 0, sizeof(mResponded));
+    memset(mResponseReceived, 0, sizeof(mResponseReceived));
+    mResponses = 0;
+    memset(&mFinal, 0, sizeof(mFinal));
+    memset(mReported, 0, sizeof(mReported));
+    memset(mReports, 0, sizeof(mReports));
+    mReportCount = 0;
+    mIndex = -1;
+    mPollReceived = 0;
+    mResponseSent = 0;
+    mRange = 0;
+    mClockOffset = 0;
+    mReceivePower = NAN;
+}
+
+void BroadcastRanging::setEUI(const uint8_t eui[8])
+{
+    memcpy(mEui, eui, 8);
+    mShortId = TwoWayRanging::shortId(eui);
+}
+
+void BroadcastRanging::setPosition(bool hasPosition, float x, float y, float z)
+{
+    mHasPosition = hasPosition;
+    mX = x;
+    mY = y;
+    mZ = z;
+}
+
+void BroadcastRanging::setState(State state, uint32_t nowUs, uint32_t timeoutUs)
+{
+    mState = state;
+    mDeadline = nowUs + timeoutUs;
+}
+
+uint64_t BroadcastRanging::scheduleReply(uint64_t reference, uint32_t delayUs)
+{
+    uint64_t now = mRadio.getSystemTimestamp();
+    // time left until the reply is due, a wrapped around difference means it's already past
+    uint64_t left = (reference + (uint64_t)(delayUs * TICKS_PER_US) - now) & TIMESTAMP_MASK;
+    if (left < TwoWayRanging::MIN_REPLY_LEAD_US * TICKS_PER_US || left > TIMESTAMP_MASK / 2)
+    {
+        // out of its slot, it may collide with the next one but the radio would otherwise wait ~17s for its clock to come around
+        mLateReplies++;
+        return mRadio.scheduleTransmit(now, TwoWayRanging::MIN_REPLY_LEAD_US);
+    }
+    return mRadio.scheduleTransmit(reference, delayUs);
+}
+
+bool BroadcastRanging::startTag(const uint16_t anchors[], uint8_t anchorCount, uint32_t nowUs)
+{
+    if (this->isBusy() || anchorCount == 0 || anchorCount > MAX_ANCHORS)
+    {
+        return false;
+    }
+
+    mSequence++;
+    mPoll.sequence = mSequence;
+    memcpy(mPoll.tagEui, mEui, 8);
+    mPoll.anchorCount = anchorCount;
+    memcpy(mPoll.anchors, anchors, anchorCount * sizeof(anchors[0]));
+    memset(mResponded, 0, sizeof(mResponded));
+    memset(mReported, 0, sizeof(mReported));
+    mResponses = 0;
+    mReportCount = 0;
+    mFinal.anchorCount = 0;
+
+    uint8_t frame[POLL_LENGTH_MAX];
+    size_t len = encodePoll(mPoll, frame, sizeof(frame));
+    mRadio.transmit(frame, len, false, true);
+    this->setState(TAG_SENDING_POLL, nowUs);
+    return true;
+}
+
+void BroadcastRanging::sendFinal(uint64_t finalSent, uint32_t nowUs)
+{
+    // only the anchors we heard, the others couldn't range anyway
+    mFinal.sequence = mPoll.sequence;
+    memcpy(mFinal.tagEui, mEui, 8);
+    mFinal.pollSent = mPollSent;
+    mFinal.finalSent = finalSent;
+    mFinal.anchorCount = 0;
+    for (uint8_t i = 0; i < mPoll.anchorCount; i++)
+    {
+        if (mResponded[i])
+        {
+            mFinal.anchors[mFinal.anchorCount] = mPoll.anchors[i];
+            mFinal.responseReceived[mFinal.anchorCount] = mResponseReceived[i];
+            mFinal.anchorCount++;
+        }
+    }
+
+    uint8_t frame[FINAL_LENGTH_MAX];
+    size_t len = encodeFinal(mFinal, frame, sizeof(frame));
+    mRadio.transmit(frame, len, true, true);
+    this->setState(TAG_SENDING_FINAL, nowUs);
+}
+
+bool BroadcastRanging::acceptPoll(const uint8_t *frame, size_t len, uint64_t received, uint32_t nowUs)
+{
+    Poll poll;
+    if (!decodePoll(frame, len, poll))
+    {
+        return false;
+    }
+    // a tag that doesn't know about us yet
+    int8_t index = indexOf(poll.anchors, poll.anchorCount, mShortId);
+    if (index < 0)
+    {
+        return false;
+    }
+
+    mPoll = poll;
+    mIndex = index;
+    mPollReceived = received;
+
+    Response response;
+    response.sequence = poll.sequence;
+    memcpy(response.anchorEui, mEui, 8);
+    uint8_t responseFrame[RESPONSE_LENGTH];
+    size_t responseLen = encodeResponse(response, responseFrame, sizeof(responseFrame));
+    this->scheduleReply(received, RESPONSE_DELAY_US + index * RESPONSE_SLOT_US);
+    mRadio.transmit(responseFrame, responseLen, true, true);
+    this->setState(ANCHOR_SENDING_RESPONSE, nowUs);
+    return true;
+}
+
+bool BroadcastRanging::acceptResponse(const uint8_t *frame, size_t len, uint64_t received, uint32_t nowUs)
+{
+    Response response;
+    if (!decodeResponse(frame, len, response) || response.sequence != mPoll.sequence)
+    {
+        return false;
+    }
+    int8_t index = indexOf(mPoll.anchors, mPoll.anchorCount, TwoWayRanging::shortId(response.anchorEui));
+    if (index < 0 || mResponded[index])
+    {
+        return false;
+    }
+
+    mResponded[index] = true;
+    mResponseReceived[index] = received;
+    mResponses++;
+    // the last slot is in, nobody else is going to answer
+    if (mResponses == mPoll.anchorCount || index == mPoll.anchorCount - 1)
+    {
+        this->sendFinal(this->scheduleReply(received, FINAL_DELAY_US), nowUs);
+    }
+    return true;
+}
+
+bool BroadcastRanging::acceptReport(const uint8_t *frame, size_t len, uint32_t nowUs)
+{
+    TwoWayRanging::RangeReport report;
+    if (!TwoWayRanging::decodeReport(frame, len, report) || report.sequence != mPoll.sequence || report.tagShortId != mShortId)
+    {
+        return false;
+    }
+    uint16_t anchor = TwoWayRanging::shortId(report.anchorEui);
+    int8_t index = indexOf(mPoll.anchors, mPoll.anchorCount, anchor);
+    if (index < 0 || !mResponded[index] || mReported[index])
+    {
+        return false;
+    }
+
+    mReported[index] = true;
+    mReports[index] = report;
+    mReportCount++;
+    // reports come in final order, the last one closes the window early
+    if (mReportCount == mFinal.anchorCount || indexOf(mFinal.anchors, mFinal.anchorCount, anchor) == mFinal.anchorCount - 1)
+    {
+        this->setState(SUCCEEDED, nowUs);
+    }
+    return true;
+}
+
+bool BroadcastRanging::acceptFinal(const uint8_t *frame, size_t len, uint64_t received, uint32_t nowUs, float carrierOffset, float rxPower)
+{
+    Final final;
+    if (!decodeFinal(frame, len, final) || final.sequence != mPoll.sequence || memcmp(final.tagEui, mPoll.tagEui, 8) != 0)
+    {
+        return false;
+    }
+
+    // the tag only includes the anchors it actually heard, and reports go out in that order
+    int8_t index = indexOf(final.anchors, final.anchorCount, mShortId);
+    if (index < 0)
+    {
+        this->setState(FAILED, nowUs);
+        return true;
+    }
+
+    double range;
+    double clockOffset;
+    bool valid = TwoWayRanging::rangeFromFinal(final.pollSent, mPollReceived, mResponseSent, final.responseReceived[index],
+                                               final.finalSent, received, carrierOffset, &range, &clockOffset);
+    mClockOffset = clockOffset;
+    mReceivePower = rxPower;
+    if (!valid)
+    {
+        this->setState(FAILED, nowUs);
+        return true;
+    }
+    if (mRangeCorrection != nullptr)
+    {
+        range = mRangeCorrection(range, rxPower);
+    }
+    // bad calibration can push short ranges negative
+    if (range <= 0)
+    {
+        range = 0.000001;
+    }
+    mRange = range;
+
+    TwoWayRanging::RangeReport report;
+    report.sequence = mPoll.sequence;
+    report.tagShortId = TwoWayRanging::shortId(mPoll.tagEui);
+    memcpy(report.anchorEui, mEui, 8);
+    report.range = mRange;
+    report.hasPosition = mHasPosition;
+    report.x = mX;
+    report.y = mY;
+    report.z = mZ;
+    uint8_t reportFrame[TwoWayRanging::REPORT_LENGTH];
+    TwoWayRanging::encodeReport(report, reportFrame, sizeof(reportFrame));
+    this->scheduleReply(received, REPORT_DELAY_US + index * REPORT_SLOT_US);
+    mRadio.transmit(reportFrame, sizeof(reportFrame), true);
+    this->setState(ANCHOR_SENDING_REPORT, nowUs);
+    return true;
+}
+
+bool BroadcastRanging::onReceive(const uint8_t *frame, size_t len, uint64_t received, uint32_t nowUs, float carrierOffset, float rxPower)
+{
+    if (len < 3 || frame[0] != FRAME_DATA)
+    {
+        return false;
+    }
+
+    switch (mState)
+    {
+    case IDLE:
+        return frame[1] == BROADCAST_POLL && this->acceptPoll(frame, len, received, nowUs);
+    case TAG_WAITING_RESPONSES:
+        return frame[1] == BROADCAST_RESPONSE && this->acceptResponse(frame, len, received, nowUs);
+    case TAG_WAITING_REPORTS:
+        return frame[1] == TwoWayRanging::REPORT && this->acceptReport(frame, len, nowUs);
+    case ANCHOR_WAITING_FINAL:
+        // the other anchors' responses go past as well, they're left to the caller
+        return frame[1] == BROADCAST_FINAL && this->acceptFinal(frame, len, received, nowUs, carrierOffset, rxPower);
+    default:
+        return false;
+    }
+}
+
+void BroadcastRanging::onTransmitDone(uint32_t nowUs)
+{
+    switch (mState)
+    {
+    case TAG_SENDING_POLL:
+        mPollSent = mRadio.getTransmitTimestamp();
+        this->setState(TAG_WAITING_RESPONSES, nowUs, RESPONSE_DELAY_US + (mPoll.anchorCount - 1) * RESPONSE_SLOT_US + SLOT_MARGIN_US);
+        break;
+    case TAG_SENDING_FINAL:
+        this->setState(TAG_WAITING_REPORTS, nowUs, REPORT_DELAY_US + (mFinal.anchorCount - 1) * REPORT_SLOT_US + SLOT_MARGIN_US);
+        break;
+    case ANCHOR_SENDING_RESPONSE:
+        // the tag sends the final once every slot after ours has gone by
+        mResponseSent = mRadio.getTransmitTimestamp();
+        this->setState(ANCHOR_WAITING_FINAL, nowUs, TwoWayRanging::STEP_TIMEOUT_US + (mPoll.anchorCount - mIndex) * RESPONSE_SLOT_US);
+        break;
+    case ANCHOR_SENDING_REPORT:
+        this->setState(SUCCEEDED, nowUs);
+        break;
+    default:
+        break;
+    }
+}
+
+void BroadcastRanging::tick(uint32_t nowUs)
+{
+    // signed difference so micros() wrapping around is fine
+    if (!this->isBusy() || (int32_t)(nowUs - mDeadline) <= 0)
+    {
+        return;
+    }
+
+    switch (mState)
+    {
+    case TAG_WAITING_RESPONSES:
+        if (mResponses > 0)
+        {
+            // the last slot went by without an answer, the final goes out as soon as the radio can send it
+            this->sendFinal(mRadio.scheduleTransmit(mRadio.getSystemTimestamp(), TwoWayRanging::MIN_REPLY_LEAD_US), nowUs);
+        }
+        else
+        {
+            this->setState(FAILED, nowUs);
+        }
+        break;
+    case TAG_WAITING_REPORTS:
+        this->setState(mReportCount > 0 ? SUCCEEDED : FAILED, nowUs);
+        break;
+    default:
+        // a late delayed transmit would otherwise go out a whole timer period later
+        if (mRadio.isTransmitting())
+        {
+            mRadio.idle();
+        }
+        this->setState(FAILED, nowUs);
+        break;
+    }
+}
+
+size_t BroadcastRanging::encodePoll(const Poll &poll, uint8_t *frame, size_t length)
+{
+    size_t needed = 12 + poll.anchorCount * 2;
+    if (poll.anchorCount > MAX_ANCHORS || length < needed)
+    {
+        return 0;
+    }
+
+    frame[0] = FRAME_DATA;
+    frame[1] = BROADCAST_POLL;
+    frame[2] = poll.sequence;
+    memcpy(&frame[3], poll.tagEui, 8);
+    frame[11] = poll.anchorCount;
+    for (uint8_t i = 0; i < poll.anchorCount; i++)
+    {
+        writeValue(&frame[12 + i * 2], poll.anchors[i], 2);
+    }
+    return needed;
+}
+
+size_t BroadcastRanging::encodeResponse(const Response &response, uint8_t *frame, size_t length)
+{
+    if (length < RESPONSE_LENGTH)
+    {
+        return 0;
+    }
+
+    frame[0] = FRAME_DATA;
+    frame[1] = BROADCAST_RESPONSE;
+    frame[2] = response.sequence;
+    memcpy(&frame[3], response.anchorEui, 8);
+    return RESPONSE_LENGTH;
+}
+
+size_t BroadcastRanging::encodeFinal(const Final &final, uint8_t *frame, size_t length)
+{
+    size_t needed = 22 + final.anchorCount * 7;
+    if (final.anchorCount > MAX_ANCHORS || length < needed)
+    {
+        return 0;
+    }
+
+    frame[0] = FRAME_DATA;
+    frame[1] = BROADCAST_FINAL;
+    frame[2] = final.sequence;
+    memcpy(&frame[3], final.tagEui, 8);
+    writeValue(&frame[11], final.pollSent, TIMESTAMP_LENGTH);
+    writeValue(&frame[16], final.finalSent, TIMESTAMP_LENGTH);
+    frame[21] = final.anchorCount;
+    for (uint8_t i = 0; i < final.anchorCount; i++)
+    {
+        writeValue(&frame[22 + i * 7], final.anchors[i], 2);
+        writeValue(&frame[24 + i * 7], final.responseReceived[i], TIMESTAMP_LENGTH);
+    }
+    return needed;
+}
+
+bool BroadcastRanging::decodePoll(const uint8_t *frame, size_t length, Poll &poll)
+{
+    if (length < 12 || frame[0] != FRAME_DATA || frame[1] != BROADCAST_POLL)
+    {
+        return false;
+    }
+
+    uint8_t anchorCount = frame[11];
+    if (anchorCount > MAX_ANCHORS || length != (size_t)(12 + anchorCount * 2))
+    {
+        return false;
+    }
+
+    poll.sequence = frame[2];
+    memcpy(poll.tagEui, &frame[3], 8);
+    poll.anchorCount = anchorCount;
+    for (uint8_t i = 0; i < anchorCount; i++)
+    {
+        poll.anchors[i] = readValue(&frame[12 + i * 2], 2);
+    }
+    return true;
+}
+
+bool BroadcastRanging::decodeResponse(const uint8_t *frame, size_t length, Response &response)
+{
+    if (length != RESPONSE_LENGTH || frame[0] != FRAME_DATA || frame[1] != BROADCAST_RESPONSE)
+    {
+        return false;
+    }
+
+    response.sequence = frame[2];
+    memcpy(response.anchorEui, &frame[3], 8);
+    return true;
+}
+
+bool BroadcastRanging::decodeFinal(const uint8_t *frame, size_t length, Final &final)
+{
+    if (length < 22 || frame[0] != FRAME_DATA || frame[1] != BROADCAST_FINAL)
+    {
+        return false;
+    }
+
+    uint8_t anchorCount = frame[21];
+    if (anchorCount > MAX_ANCHORS || length != (size_t)(22 + anchorCount * 7))
+    {
+        return false;
+    }
+
+    final.sequence = frame[2];
+    memcpy(final.tagEui, &frame[3], 8);
+    final.pollSent = readValue(&frame[11], TIMESTAMP_LENGTH);
+    final.finalSent = readValue(&frame[16], TIMESTAMP_LENGTH);
+    final.anchorCount = anchorCount;
+    for (uint8_t i = 0; i < anchorCount; i++)
+    {
+        final.anchors[i] = readValue(&frame[22 + i * 7], 2);
+        final.responseReceived[i] = readValue(&frame[24 + i * 7], TIMESTAMP_LENGTH);
+    }
+    return true;
+}
+
+int8_t BroadcastRanging::indexOf(const uint16_t anchors[], uint8_t anchorCount, uint16_t anchor)
+{
+    for (uint8_t i = 0; i < anchorCount && i < MAX_ANCHORS; i++)
+    {
+        if (anchors[i] == anchor)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void BroadcastRanging::writeValue(uint8_t *bytes, uint64_t value, uint8_t n)
+{
+    for (uint8_t i = 0; i < n; i++)
+    {
+        bytes[i] = (value >> (i * 8)) & 0xFF;
+    }
+}
+
+uint64_t BroadcastRanging::readValue(const uint8_t *bytes, uint8_t n)
+{
+    uint64_t value = 0;
+    for (uint8_t i = 0; i < n; i++)
+    {
+        value |= (uint64_t)bytes[i] << (i * 8);
+    }
+    return value;
+}
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+
+#include "radio.hpp"
+#include "ranging.hpp"
+
+/**
+ * Non-blocking one-to-many ranging, used instead of a full exchange per anchor when built with -DDW1000_BROADCAST_RANGING.
+ * Driven from handle() the same way as TwoWayRanging, nothing in here waits on the radio.
+ *
+ * 1. Tag broadcasts a POLL listing the anchors it wants answers from, in the order they should answer.
+ * 2. Anchor n sends its RESPONSE at poll RX + RESPONSE_DELAY_US + n * RESPONSE_SLOT_US using delayed TX, so they don't overlap.
+ * 3. Tag sends one FINAL carrying its poll/final send times and the RX time of every response it heard, FINAL_DELAY_US
+ *    after the last response, or as soon as it can once the last slot has gone by without one.
+ * 4. Every anchor computes its own asymmetric two way range from that, and sends the usual range report (see ranging.hpp)
+ *    at final RX + REPORT_DELAY_US + n * REPORT_SLOT_US, n being its place in the FINAL this time.
+ *
+ * The tag's exchange succeeds if any report came back, which anchors answered is read back per anchor afterwards.
+ *
+ * All multi byte values are little endian, timestamps are 40 bit DW1000 time (5 bytes).
+ *
+ * POLL     [0] DATA, [1] BROADCAST_POLL, [2] sequence, [3..10] tag eui, [11] anchor count n,
+ *          [12..] n * anchor short id (2 bytes)
+ * RESPONSE [0] DATA, [1] BROADCAST_RESPONSE, [2] sequence, [3..10] anchor eui
+ * FINAL    [0] DATA, [1] BROADCAST_FINAL, [2] sequence, [3..10] tag eui, [11..15] poll sent, [16..20] final sent,
+ *          [21] anchor count n, [22..] n * (anchor short id (2 bytes), response received (5 bytes))
+ *
+ * No Arduino dependencies, so it also builds on the host.
+ */
+class BroadcastRanging
+{
+public:
+    static const uint8_t MAX_ANCHORS = 8;
+
+    // second byte of the frame, after DATA
+    static const uint8_t BROADCAST_POLL = 0xA2;
+    static const uint8_t BROADCAST_RESPONSE = 0xA3;
+    static const uint8_t BROADCAST_FINAL = 0xA4;
+
+    // on air at 6.8Mbps, 64MHz PRF and a 128 symbol preamble, RangingProfile::getAirtime() rounded up
+    static const uint32_t RESPONSE_AIRTIME_US = 180;
+    static const uint32_t REPORT_AIRTIME_US = 195;
+
+    // the first reply is timed like TwoWayRanging's, long enough for handle() to stage it
+    static const uint32_t RESPONSE_DELAY_US = TwoWayRanging::RESPONSE_DELAY_US;
+    static const uint32_t FINAL_DELAY_US = TwoWayRanging::FINAL_DELAY_US;
+    static const uint32_t REPORT_DELAY_US = TwoWayRanging::REPORT_DELAY_US;
+    // every later one waits for the frame before it, then gives the tag's handle() the usual reply lead to read it
+    // and have the receiver back on
+    static const uint32_t RESPONSE_SLOT_US = RESPONSE_AIRTIME_US + TwoWayRanging::MIN_REPLY_LEAD_US;
+    static const uint32_t REPORT_SLOT_US = REPORT_AIRTIME_US + TwoWayRanging::MIN_REPLY_LEAD_US;
+    // a slot is over this long after it should have started, for the frame to get through and handle() to pick it up
+    static const uint32_t SLOT_MARGIN_US = 500;
+
+    static const size_t POLL_LENGTH_MAX = 12 + MAX_ANCHORS * 2;
+    static const size_t RESPONSE_LENGTH = 11;
+    static const size_t FINAL_LENGTH_MAX = 22 + MAX_ANCHORS * 7;
+
+    typedef struct
+    {
+        uint8_t sequence;
+        uint8_t tagEui[8];
+        uint8_t anchorCount;
+        uint16_t anchors[MAX_ANCHORS];
+    } Poll;
+
+    typedef struct
+    {
+        uint8_t sequence;
+        uint8_t anchorEui[8];
+    } Response;
+
+    typedef struct
+    {
+        uint8_t sequence;
+        uint8_t tagEui[8];
+        uint64_t pollSent;
+        uint64_t finalSent;
+        uint8_t anchorCount;
+        uint16_t anchors[MAX_ANCHORS];
+        uint64_t responseReceived[MAX_ANCHORS];
+    } Final;
+
+    typedef enum
+    {
+        IDLE,
+        TAG_SENDING_POLL,
+        TAG_WAITING_RESPONSES,
+        TAG_SENDING_FINAL,
+        TAG_WAITING_REPORTS,
+        ANCHOR_SENDING_RESPONSE,
+        ANCHOR_WAITING_FINAL,
+        ANCHOR_SENDING_REPORT,
+        SUCCEEDED,
+        FAILED
+    } State;
+
+    BroadcastRanging(Radio &radio);
+
+    void setEUI(const uint8_t eui[8]);
+    void setRangeCorrection(TwoWayRanging::RangeCorrection correction) { mRangeCorrection = correction; }
+    /**
+     * ANCHOR ONLY
+     * Coordinates sent to the tag in every report
+     */
+    void setPosition(bool hasPosition, float x, float y, float z);
+
+    /**
+     * TAG ONLY
+     * Polls up to MAX_ANCHORS anchors by short id, they answer in this order. Returns false if an exchange is already
+     * running or there's no one to poll.
+     */
+    bool startTag(const uint16_t anchors[], uint8_t anchorCount, uint32_t nowUs);
+
+    /**
+     * Same contract as TwoWayRanging::onReceive(): true if the frame was part of the exchange.
+     * An idle anchor starts answering a POLL that lists it.
+     */
+    bool onReceive(const uint8_t *frame, size_t len, uint64_t received, uint32_t nowUs, float carrierOffset = NAN, float rxPower = NAN);
+    void onTransmitDone(uint32_t nowUs);
+    // closes response and report windows and times out, call regularly
+    void tick(uint32_t nowUs);
+
+    State getState() { return mState; }
+    bool isBusy() { return mState != IDLE && mState != SUCCEEDED && mState != FAILED; }
+    bool isFinished() { return mState == SUCCEEDED || mState == FAILED; }
+    // back to IDLE once the result has been read
+    void reset() { mState = IDLE; }
+
+    // TAG ONLY, per anchor in the order they were passed to startTag(), valid once finished
+    uint8_t getAnchorCount() { return mPoll.anchorCount; }
+    bool hasResponse(uint8_t index) { return mResponded[index]; }
+    bool hasReport(uint8_t index) { return mReported[index]; }
+    const TwoWayRanging::RangeReport &getReport(uint8_t index) { return mReports[index]; }
+    // ANCHOR ONLY, valid once SUCCEEDED
+    float getRange() { return mRange; }
+    // ppm, how much faster our clock runs than the tag's
+    float getClockOffset() { return mClockOffset; }
+    // dBm, of the FINAL the range was timed on
+    float getReceivePower() { return mReceivePower; }
+    const uint8_t *getTagEui() { return mPoll.tagEui; }
+    uint8_t getSequence() { return mPoll.sequence; }
+    // running total of replies that missed their slot, see TwoWayRanging::getLateReplies()
+    uint32_t getLateReplies() { return mLateReplies; }
+
+    // encoders return the frame length, or 0 if it doesn't fit in the buffer
+    static size_t encodePoll(const Poll &poll, uint8_t *frame, size_t length);
+    static size_t encodeResponse(const Response &response, uint8_t *frame, size_t length);
+    static size_t encodeFinal(const Final &final, uint8_t *frame, size_t length);
+
+    // decoders return false if the frame isn't that type or is malformed
+    static bool decodePoll(const uint8_t *frame, size_t length, Poll &poll);
+    static bool decodeResponse(const uint8_t *frame, size_t length, Response &response);
+    static bool decodeFinal(const uint8_t *frame, size_t length, Final &final);
+
+    /**
+     * Position of the anchor in the list, which is also its answer order. -1 if it isn't there.
+     */
+    static int8_t indexOf(const uint16_t anchors[], uint8_t anchorCount, uint16_t anchor);
+
+private:
+    Radio &mRadio;
+    State mState;
+    uint32_t mDeadline;
+    uint8_t mSequence;
+    uint8_t mEui[8];
+    uint16_t mShortId;
+    TwoWayRanging::RangeCorrection mRangeCorrection;
+    bool mHasPosition;
+    float mX, mY, mZ;
+    uint32_t mLateReplies;
+
+    // the exchange's poll, ours on a tag and the one being answered on an anchor
+    Poll mPoll;
+    uint64_t mPollSent;
+
+    // tag
+    bool mResponded[MAX_ANCHORS];
+    uint64_t mResponseReceived[MAX_ANCHORS];
+    uint8_t mResponses;
+    Final mFinal;
+    bool mReported[MAX_ANCHORS];
+    TwoWayRanging::RangeReport mReports[MAX_ANCHORS];
+    uint8_t mReportCount;
+
+    // anchor
+    int8_t mIndex;
+    uint64_t mPollReceived;
+    uint64_t mResponseSent;
+    float mRange;
+    float mClockOffset;
+    float mReceivePower;
+
+    void setState(State state, uint32_t nowUs, uint32_t timeoutUs = TwoWayRanging::STEP_TIMEOUT_US);
+    // see TwoWayRanging::scheduleReply()
+    uint64_t scheduleReply(uint64_t reference, uint32_t delayUs);
+    // the FINAL for the responses so far, carrying the send time the radio was set up for
+    void sendFinal(uint64_t finalSent, uint32_t nowUs);
+    bool acceptPoll(const uint8_t *frame, size_t len, uint64_t received, uint32_t nowUs);
+    bool acceptResponse(const uint8_t *frame, size_t len, uint64_t received, uint32_t nowUs);
+    bool acceptReport(const uint8_t *frame, size_t len, uint32_t nowUs);
+    bool acceptFinal(const uint8_t *frame, size_t len, uint64_t received, uint32_t nowUs, float carrierOffset, float rxPower);
+    static void writeValue(uint8_t *bytes, uint64_t value, uint8_t n);
+    static uint64_t readValue(const uint8_t *bytes, uint8_t n);
+};
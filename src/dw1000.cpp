@@ -6,7 +6,6 @@
 #include <DW1000NgUtils.hpp>
 #include <DW1000NgTime.hpp>
 #include <DW1000NgConstants.hpp>
-#include <DW1000NgRanging.hpp>
 #include <DW1000NgRTLS.hpp>
 #include <Preferences.h>
 
@@ -15,13 +14,27 @@
 // blink specifier that this blink is from an anchor, not a tag
 #define DEVICE_IS_ANCHOR 0x03
 
-// packet specifier that this is a range report to a specific tag
-#define RANGE_REPORT 0xA1
+// blink specifiers for TDMA mode, see tdma.hpp
+#define SUPERFRAME_BEACON 0x04
+#define TAG_JOIN_REQUEST 0x05
+// keep clear of the end of our slot so the next tag doesn't collide with our last exchange
+#define SLOT_GUARD_TIME 5 // ms
+// while calibrating anchors blink often so they find each other quickly, and space out their own exchanges
+#define CALIBRATION_MIN_BLINK_DELAY 50 // ms
+#define CALIBRATION_MAX_BLINK_DELAY 150 // ms
+#define CALIBRATION_MIN_EXCHANGE_DELAY 5 // ms
+#define CALIBRATION_MAX_EXCHANGE_DELAY 25 // ms
+// fewer ranges than this to an anchor and it's left out
+#define CALIBRATION_MIN_SAMPLES 4
 
 DW1000::DW1000(Preferences *preferences, const uint8_t ss, const uint8_t irq, const uint8_t rst, const uint8_t *macAddr)
+    : mRanging(mRadio)
+#ifdef DW1000_BROADCAST_RANGING
+    , mBroadcast(mRadio)
+#endif
 {
 
-    DW1000Ng::initialize(ss, irq, rst);
+    mRadio.begin(ss, irq, rst);
 
     char msg[128];
 
@@ -79,9 +92,41 @@ DW1000::DW1000(Preferences *preferences, const uint8_t ss, const uint8_t irq, co
 
 #ifdef DW1000_ANCHOR
     this->mNextBlinkScheduled = millis() + random(mMinBlinkDelay, mMaxBlinkDelay);
+
+    // coordinates are set from home assistant and persisted, NAN until then
+    this->setPosition(preferences->getFloat("x", NAN), preferences->getFloat("y", NAN), preferences->getFloat("z", NAN));
+    this->applyPendingConfig();
+#elif defined(DW1000_TAG)
+    // anchors that keep failing to range are the first to go
+    mAnchors.setPriority([](const Anchor &anchor) -> int32_t { return anchor.reliability; });
+    // the fix noise is a bit worse than a single range, the solve spreads every anchor's error over it
+    mPredictor.setConfig({preferences->getFloat("fixNoise", 0.15), preferences->getFloat("fixAccel", 2.0), 2000,
+                          preferences->getUInt("lookAheadMs", 300)});
+    // the slow heartbeat has to stay under the predictor's maxGap with the jitter on top, or a still tag
+    // would start the predictor over every fix and never get a velocity to notice it's moving again
+    mScheduler.setConfig({preferences->getUInt("rangeFastMs", 300), preferences->getUInt("rangeSlowMs", 1000),
+                          preferences->getFloat("stillSpeed", 0.1), preferences->getFloat("movingSpeed", 0.5), preferences->getUInt("motionHoldMs", 2000),
+                          preferences->getUChar("rangeAnchors", 4), preferences->getUChar("minReliability", 25), preferences->getUInt("probeMs", 5000)});
+#endif
+
+    mRadio.setAntennaDelay(preferences->getInt("antennaDelay", 16436));
+    mFilterConfig = {preferences->getFloat("rangeNoise", 0.1), preferences->getFloat("rangeAccel", 1.0), 5000};
+
+    DW1000Ng::getEUI(mEui);
+    mRanging.setEUI(mEui);
+    mRanging.setRangeCorrection(DW1000Radio::correctRange);
+#ifdef DW1000_BROADCAST_RANGING
+    mBroadcast.setEUI(mEui);
+    mBroadcast.setRangeCorrection(DW1000Radio::correctRange);
 #endif
 
-    DW1000Ng::setAntennaDelay(preferences->getInt("antennaDelay", 16436));
+#ifdef DW1000_TDMA
+    mShortId = DW1000NgUtils::bytesAsValue(mEui, 2);
+#ifdef DW1000_TDMA_COORDINATOR
+    // only the coordinator's settings matter, everyone else takes them from the beacon
+    mSuperframe = Superframe(preferences->getUChar("tdmaSlots", 8), preferences->getUShort("tdmaSlotLength", 50));
+#endif
+#endif
 
     DW1000Ng::enableDebounceClock();
     DW1000Ng::enableLedBlinking();
@@ -90,6 +135,7 @@ DW1000::DW1000(Preferences *preferences, const uint8_t ss, const uint8_t irq, co
     DW1000Ng::setGPIOMode(12, LED_MODE);
 
     Serial.println(F("Committed configuration ..."));
+    mProfile.start(micros(), mRadio.getFramesSent(), mRadio.getBytesSent());
 
     // DEBUG chip info and registers pretty printed
     DW1000Ng::getPrintableDeviceIdentifier(msg);
@@ -111,233 +157,928 @@ void DW1000::transmitAnchorAdvertiseBlink()
 {
     byte Blink[] = {BLINK, DW1000NgRTLS::increaseSequenceNumber(), 0, 0, 0, 0, 0, 0, 0, 0, NO_BATTERY_STATUS | NO_EX_ID, DEVICE_IS_ANCHOR};
     DW1000Ng::getEUI(&Blink[2]);
-    DW1000Ng::setTransmitData(Blink, sizeof(Blink));
-    DW1000Ng::startTransmit();
+    mRadio.transmit(Blink, sizeof(Blink));
 }
 
-// add a custom blink message, this one is targeted at a specific anchor via short address
-void DW1000::transmitTagTargetedBlink(u16_t anchor_short_address)
+void DW1000::printProfile()
 {
-    byte Blink[] = {BLINK, DW1000NgRTLS::increaseSequenceNumber(), 0, 0, 0, 0, 0, 0, 0, 0, NO_BATTERY_STATUS | NO_EX_ID, TAG_LISTENING_NOW, 0, 0};
-    // copy short address to blink message
-    memcpy(&Blink[12], &anchor_short_address, 2);
-    DW1000Ng::getEUI(&Blink[2]);
-    DW1000Ng::setTransmitData(Blink, sizeof(Blink));
-    DW1000Ng::startTransmit();
+    // the profile starts over once printed
+    uint32_t exchanges = mProfile.getExchanges();
+    mProfile.print(micros(), mRadio.getFramesSent(), mRadio.getBytesSent(), [](const char *line) { Debug.printf("%s", line); });
+    DW1000Spi &spi = mRadio.getSpi();
+    uint32_t spiUs = spi.getBusyUs() - mSpiBusyUs;
+    Debug.printf("spi      %lu us in %lu transactions of %lu registers, %lu us per exchange\n", (unsigned long)spiUs,
+                 (unsigned long)(spi.getBursts() - mSpiBursts), (unsigned long)(spi.getTransfers() - mSpiTransfers),
+                 (unsigned long)(exchanges > 0 ? spiUs / exchanges : 0));
+    mSpiBusyUs = spi.getBusyUs();
+    mSpiBursts = spi.getBursts();
+    mSpiTransfers = spi.getTransfers();
+    Debug.printf("frames   up to %d of %d waiting, %lu dropped since boot\n", mFrames.getHighWaterMark(), mFrames.capacity(),
+                 (unsigned long)mFrames.getDropped());
+    uint32_t lateReplies = mRanging.getLateReplies();
+#ifdef DW1000_BROADCAST_RANGING
+    lateReplies += mBroadcast.getLateReplies();
+#endif
+    Debug.printf("replies  %lu late since boot, sent %lu us after handle() got to them instead\n", (unsigned long)lateReplies,
+                 (unsigned long)TwoWayRanging::MIN_REPLY_LEAD_US);
+#if defined(DW1000_TAG) && !defined(DW1000_TDOA)
+    Debug.printf("schedule %lu ms between sessions now, %lu sessions, %lu anchors skipped, %lu probes since boot, gdop %.2f\n",
+                 (unsigned long)mScheduler.getInterval(millis()), (unsigned long)mScheduler.getSessions(), (unsigned long)mScheduler.getSkipped(),
+                 (unsigned long)mScheduler.getProbes(), mScheduler.getGdop());
+#endif
+#if defined(DW1000_ANCHOR) && defined(DW1000_TDOA)
+#ifdef DW1000_TDOA_MASTER
+    Debug.printf("tdoa     master, %lu syncs sent, %lu blinks heard\n", (unsigned long)mTdoaSyncs, (unsigned long)mTdoaBlinks);
+#else
+    Debug.printf("tdoa     %lu blinks heard, %lu before sync, %lu queue drops, %.3f ppm against the master\n", (unsigned long)mTdoaBlinks,
+                 (unsigned long)mTdoaUnsynced, (unsigned long)mTdoaArrivals.getDropped(), mTdoaClock.getDriftPpm());
+#endif
+#endif
 }
 
-RangeRequestResult DW1000::tagTargetedRangeRequest(u16_t anchor_short_address)
+void DW1000::setAntennaDelay(uint16_t antennaDelay)
 {
-    this->transmitTagTargetedBlink(anchor_short_address);
+    portENTER_CRITICAL(&mConfigLock);
+    mPendingAntennaDelay = antennaDelay;
+    portEXIT_CRITICAL(&mConfigLock);
+}
 
-    DW1000NgRTLS::waitForTransmission();
-    if (!DW1000NgRTLS::receiveFrame())
-        return {false, 0};
+void DW1000::applyPendingConfig()
+{
+    portENTER_CRITICAL(&mConfigLock);
+    int32_t antennaDelay = mPendingAntennaDelay;
+    mPendingAntennaDelay = -1;
+#ifdef DW1000_ANCHOR
+    boolean positionPending = mPositionPending;
+    Solver::Point position = mPendingPosition;
+    mPositionPending = false;
+    uint32_t calibration = mPendingCalibration;
+    mPendingCalibration = 0;
+#elif defined(DW1000_TAG)
+    boolean motion = mMotionPending;
+    mMotionPending = false;
+#endif
+    portEXIT_CRITICAL(&mConfigLock);
+
+    // no SPI inside the critical section
+    if (antennaDelay >= 0)
+    {
+        mRadio.setAntennaDelay(antennaDelay);
+    }
+#ifdef DW1000_ANCHOR
+    if (positionPending)
+    {
+        mPosition = position;
+        mHasPosition = !isnan(position.x) && !isnan(position.y) && !isnan(position.z);
+        mRanging.setPosition(mHasPosition, position.x, position.y, position.z);
+#ifdef DW1000_BROADCAST_RANGING
+        mBroadcast.setPosition(mHasPosition, position.x, position.y, position.z);
+#endif
+    }
+    if (calibration > 0)
+    {
+        mCalibrationPeers.clear();
+        mCalibrationEnd = millis() + calibration;
+        mNextCalibrationExchange = 0;
+        // find the other anchors straight away
+        mNextBlinkScheduled = 0;
+        debugV("Calibrating for %lu ms", (unsigned long)calibration);
+    }
+#elif defined(DW1000_TAG)
+    if (motion)
+    {
+        mScheduler.reportMotion(millis());
+    }
+#endif
+}
 
-    size_t init_len = DW1000Ng::getReceivedDataLength();
-    byte init_recv[init_len];
-    DW1000Ng::getReceivedData(init_recv, init_len);
+void DW1000::processRadioEvents()
+{
+    this->applyPendingConfig();
 
-    if (!(init_len > 17 && init_recv[15] == RANGING_INITIATION))
+    Radio::Event event;
+    while ((event = mRadio.pollEvent()) != Radio::NONE)
     {
-        return {false, 0};
+        if (event == Radio::TRANSMIT_DONE)
+        {
+            // only the one that sent something moves on
+            mRanging.onTransmitDone(micros());
+#ifdef DW1000_BROADCAST_RANGING
+            mBroadcast.onTransmitDone(micros());
+#endif
+        }
+        else if (event == Radio::RECEIVE_DONE)
+        {
+            this->readFrame();
+        }
+        // receive timeouts and errors only mean the receiver has to be turned back on, handle() does that
     }
 
-    DW1000Ng::setDeviceAddress(DW1000NgUtils::bytesAsValue(&init_recv[16], 2));
-    return {true, DW1000NgUtils::bytesAsValue(&init_recv[13], 2)};
+    // oldest first, the ranging state machine works off each frame's own timestamp so it doesn't matter how long they waited
+    Frame *frame;
+    while ((frame = mFrames.front()) != nullptr)
+    {
+#ifdef DW1000_TDMA_COORDINATOR
+        // any tag ranging with any anchor is still alive, keep its slot
+        if (frame->length == TwoWayRanging::POLL_LENGTH && frame->data[0] == DATA && frame->data[1] == TwoWayRanging::POLL)
+        {
+            mSuperframe.markSeen(DW1000NgUtils::bytesAsValue(&frame->data[5], 2));
+        }
+#ifdef DW1000_BROADCAST_RANGING
+        else if (frame->length > 11 && frame->data[0] == DATA && frame->data[1] == BroadcastRanging::BROADCAST_POLL)
+        {
+            mSuperframe.markSeen(DW1000NgUtils::bytesAsValue(&frame->data[3], 2));
+        }
+#endif
+#endif
+        if (!this->dispatchFrame(*frame))
+        {
+            this->handleFrame(*frame);
+        }
+        mFrames.release();
+    }
+    mRanging.tick(micros());
+#ifdef DW1000_BROADCAST_RANGING
+    mBroadcast.tick(micros());
+#endif
 }
 
-// transmit range report to tag with next anchor to
-void DW1000::transmitRangeReportToTag(uint16_t range, byte tag_eui[])
+boolean DW1000::dispatchFrame(const Frame &frame)
 {
-    byte data[] = {
-        DATA, RANGE_REPORT,
-        0, 0, 0, 0, 0, 0, 0, 0, // for eui
-        0, 0};                  // for range in cm
-    DW1000Ng::getEUI(&data[2]);
-    DW1000NgUtils::writeValueToBytes(&data[10], range, 2);
-    DW1000Ng::setTransmitData(data, sizeof(data));
-    DW1000Ng::startTransmit();
+#ifdef DW1000_BROADCAST_RANGING
+    if (mBroadcast.isBusy())
+    {
+        return mBroadcast.onReceive(frame.data, frame.length, frame.received, micros(), frame.carrierOffset, frame.rxPower);
+    }
+    if (!mRanging.isBusy() && mBroadcast.onReceive(frame.data, frame.length, frame.received, micros(), frame.carrierOffset, frame.rxPower))
+    {
+        return true;
+    }
+#endif
+    return mRanging.onReceive(frame.data, frame.length, frame.received, micros(), frame.carrierOffset, frame.rxPower);
 }
 
+void DW1000::readFrame()
+{
+    // a full pool drops this one, and counts it
+    Frame *frame = mFrames.acquire();
+    if (frame != nullptr)
+    {
+        frame->length = mRadio.getReceivedFrame(frame->data, sizeof(frame->data), &frame->received);
+        frame->carrierOffset = mRadio.getCarrierOffset();
+        frame->rxPower = mRadio.getReceivePower();
+        if (frame->length > 0)
+        {
+            mFrames.commit();
+        }
+    }
+    // the frame is out of the chip, the next one can come in while we parse this one
+    if (!mRadio.isTransmitting() && !mRadio.isReceiving())
+    {
+        mRadio.startReceive();
+    }
+}
+
+#ifdef DW1000_TDMA
+
+boolean DW1000::isSynced()
+{
+    return mLastBeaconMillis != 0 && millis() - mLastBeaconMillis < 4 * mSuperframe.getLength();
+}
+
+#ifdef DW1000_TDMA_COORDINATOR
+// beacon marking the start of a superframe, carries the slot table
+void DW1000::transmitSuperframeBeacon()
+{
+    byte beacon[BlinkView::HEADER_LENGTH + Superframe::MAX_BEACON_PAYLOAD] = {BLINK, DW1000NgRTLS::increaseSequenceNumber(), 0, 0, 0, 0, 0, 0, 0, 0, NO_BATTERY_STATUS | NO_EX_ID, SUPERFRAME_BEACON};
+    DW1000Ng::getEUI(&beacon[2]);
+    size_t len = mSuperframe.encodeBeacon(&beacon[BlinkView::HEADER_LENGTH], Superframe::MAX_BEACON_PAYLOAD);
+    mRadio.transmit(beacon, BlinkView::HEADER_LENGTH + len);
+}
+#endif
+
+#ifdef DW1000_TAG
+// ask the coordinator for a slot, sent in the contention slot
+void DW1000::transmitJoinRequest()
+{
+    byte Blink[] = {BLINK, DW1000NgRTLS::increaseSequenceNumber(), 0, 0, 0, 0, 0, 0, 0, 0, NO_BATTERY_STATUS | NO_EX_ID, TAG_JOIN_REQUEST};
+    DW1000Ng::getEUI(&Blink[2]);
+    mRadio.transmit(Blink, sizeof(Blink));
+}
+#endif
+
+void DW1000::handleSuperframeBeacon(const BlinkView &blink)
+{
+    if (!mSuperframe.decodeBeacon(blink.getPayload(), blink.getPayloadLength()))
+    {
+        debugE("Malformed superframe beacon");
+        return;
+    }
+    // our clocks aren't synced, so the slots are relative to when we heard the beacon
+    mLastBeaconMillis = millis();
+
+#ifdef DW1000_TAG
+    uint8_t slot = mSuperframe.findSlot(mShortId);
+    if (slot == Superframe::CONTENTION_SLOT)
+    {
+        // no slot yet - ask for one at a random point in the contention slot, stay quiet until we get it
+        mJoinScheduled = mLastBeaconMillis + random(1, max((int)mSuperframe.getSlotLength() - SLOT_GUARD_TIME, 2));
+        mNextBlinkScheduled = mLastBeaconMillis + 4 * mSuperframe.getLength();
+        return;
+    }
+
+    mNextBlinkScheduled = mLastBeaconMillis + mSuperframe.getSlotOffset(slot);
+    mSlotEnd = mNextBlinkScheduled + mSuperframe.getSlotLength() - SLOT_GUARD_TIME;
+#endif
+}
+
+#endif
+
 #ifdef DW1000_ANCHOR
 
+void DW1000::setPosition(float x, float y, float z)
+{
+    portENTER_CRITICAL(&mConfigLock);
+    mPendingPosition = {x, y, z};
+    mPositionPending = true;
+    portEXIT_CRITICAL(&mConfigLock);
+}
+
+void DW1000::startCalibration(uint32_t durationMs)
+{
+    // set here rather than when it's picked up, so a caller polling isCalibrating() can't see it finish before it starts
+    mCalibrating.store(true, std::memory_order_release);
+    portENTER_CRITICAL(&mConfigLock);
+    mPendingCalibration = durationMs;
+    portEXIT_CRITICAL(&mConfigLock);
+}
+
+// median of a few samples, sorts them in place
+static float median(float *samples, uint8_t count)
+{
+    for (uint8_t i = 1; i < count; i++)
+    {
+        float value = samples[i];
+        uint8_t j = i;
+        for (; j > 0 && samples[j - 1] > value; j--)
+        {
+            samples[j] = samples[j - 1];
+        }
+        samples[j] = value;
+    }
+    return count % 2 ? samples[count / 2] : (samples[count / 2 - 1] + samples[count / 2]) / 2;
+}
+
+void DW1000::addCalibrationSample(const byte eui[], float range)
+{
+    CalibrationPeer *peer = mCalibrationPeers.find(eui);
+    if (peer == nullptr || peer->count >= CALIBRATION_SAMPLES)
+    {
+        return;
+    }
+    peer->samples[peer->count++] = range;
+}
+
+/**
+ * One step of calibration: range the next anchor that still needs samples, one exchange at a time.
+ * The exchange itself runs in mRanging like a tag's, handle() picks up the report.
+ */
+void DW1000::handleCalibration()
+{
+    if (millis() >= mCalibrationEnd)
+    {
+        this->finishCalibration();
+        return;
+    }
+    if (millis() < mNextCalibrationExchange || !this->isRadioFree() || mCalibrationPeers.size() == 0)
+    {
+        return;
+    }
+
+    for (uint16_t i = 0; i < mCalibrationPeers.capacity(); i++)
+    {
+        uint16_t slot = (mNextCalibrationPeer + i) % mCalibrationPeers.capacity();
+        if (mCalibrationPeers.isUsed(slot) && mCalibrationPeers.get(slot).count < CALIBRATION_SAMPLES)
+        {
+            mRanging.startTag(TwoWayRanging::shortId(mCalibrationPeers.getEui(slot)), micros());
+            mNextCalibrationPeer = slot + 1;
+            break;
+        }
+    }
+    // random so the anchors' own exchanges don't keep landing on top of each other
+    mNextCalibrationExchange = millis() + random(CALIBRATION_MIN_EXCHANGE_DELAY, CALIBRATION_MAX_EXCHANGE_DELAY);
+}
+
+void DW1000::finishCalibration()
+{
+    for (uint16_t i = 0; i < mCalibrationPeers.capacity(); i++)
+    {
+        if (!mCalibrationPeers.isUsed(i))
+        {
+            continue;
+        }
+        CalibrationPeer &peer = mCalibrationPeers.get(i);
+        const uint8_t *eui = mCalibrationPeers.getEui(i);
+        debugV("Calibration: %02X%02X %d ranges", eui[1], eui[0], peer.count);
+        if (peer.count < CALIBRATION_MIN_SAMPLES)
+        {
+            continue;
+        }
+        CalibrationRange result;
+        memcpy(result.eui, eui, 8);
+        result.count = peer.count;
+        result.range = median(peer.samples, peer.count);
+        mCalibrationResults.push(result);
+    }
+    mCalibrationEnd = 0;
+    // results are all queued before the flag drops
+    mCalibrating.store(false, std::memory_order_release);
+}
+
+void DW1000::updateTagDistance(byte tag_eui[], float distance, float rxPower, uint8_t sequence)
+{
+    bool created;
+    TagLink *link = mTags.insert(tag_eui, millis(), &created);
+    TagDistance *tagDistance = &link->latest;
+    if (created)
+    {
+        memcpy(tagDistance->eui, tag_eui, 8);
+        link->filter.setConfig(mFilterConfig);
+    }
+
+    // multipath outliers are dropped here, so they never get published
+    tagDistance->distance = link->filter.update(distance, millis());
+    tagDistance->variance = link->filter.getVariance();
+    tagDistance->timestamp = millis();
+    tagDistance->rxPower = rxPower;
+    tagDistance->sequence = sequence;
+    mResults.push(*tagDistance);
+    mProfile.recordResult();
+}
+
+#ifdef DW1000_BROADCAST_RANGING
+// picks up the range once mBroadcast has answered a tag's broadcast poll, see broadcastranging.hpp
+void DW1000::finishBroadcastExchange()
+{
+    if (mBroadcast.getState() == BroadcastRanging::SUCCEEDED)
+    {
+        debugV("Broadcast ranging success, range %f m, clock offset %f ppm", mBroadcast.getRange(), mBroadcast.getClockOffset());
+        this->updateTagDistance((byte *)mBroadcast.getTagEui(), mBroadcast.getRange(), mBroadcast.getReceivePower(), mBroadcast.getSequence());
+    }
+    else
+    {
+        debugE("Broadcast ranging failed");
+    }
+    mBroadcast.reset();
+}
+#endif
+
+#ifdef DW1000_TDOA
+#ifdef DW1000_TDOA_MASTER
+// reference blink that every other anchor syncs its clock to, it carries its own send time so it's delayed
+void DW1000::transmitTdoaSync()
+{
+    Tdoa::Sync sync;
+    sync.sequence = DW1000NgRTLS::increaseSequenceNumber();
+    DW1000Ng::getEUI(sync.masterEui);
+    sync.sent = mRadio.scheduleTransmit(mRadio.getSystemTimestamp(), Tdoa::SYNC_DELAY_US);
+    sync.master = {mPosition.x, mPosition.y, mPosition.z};
+    byte frame[Tdoa::SYNC_LENGTH];
+    Tdoa::encodeSync(sync, frame, sizeof(frame));
+    mRadio.transmit(frame, sizeof(frame), true);
+    mTdoaSyncs++;
+}
+#else
+void DW1000::handleTdoaSync(const Frame &frame)
+{
+    Tdoa::Sync sync;
+    if (!Tdoa::decodeSync(frame.data, frame.length, sync) || !mHasPosition)
+    {
+        return;
+    }
+    // both positions are surveyed, so the time of flight between us is known rather than measured
+    float dx = mPosition.x - sync.master.x;
+    float dy = mPosition.y - sync.master.y;
+    float dz = mPosition.z - sync.master.z;
+    mTdoaClock.update(sync.sent, frame.received, sqrtf(dx * dx + dy * dy + dz * dz) / Tdoa::DISTANCE_PER_TICK);
+}
+#endif
+
+void DW1000::handleTdoaBlink(const Frame &frame)
+{
+    Tdoa::Arrival arrival;
+    if (!Tdoa::decodeBlink(frame.data, frame.length, &arrival.sequence, arrival.tagEui))
+    {
+        return;
+    }
+    mTdoaBlinks++;
+#ifdef DW1000_TDOA_MASTER
+    arrival.arrival = frame.received;
+#else
+    if (!mTdoaClock.toMaster(frame.received, &arrival.arrival))
+    {
+        mTdoaUnsynced++;
+        return;
+    }
+#endif
+    mTdoaArrivals.push(arrival);
+    mProfile.recordResult();
+}
+#endif
+
+void DW1000::handleFrame(const Frame &frame)
+{
+    BlinkView blink(frame);
+#ifdef DW1000_TDMA
+    if (blink.hasPayload(SUPERFRAME_BEACON))
+    {
+        this->handleSuperframeBeacon(blink);
+        return;
+    }
+#ifdef DW1000_TDMA_COORDINATOR
+    if (blink.is(TAG_JOIN_REQUEST, 0))
+    {
+        const byte *eui = blink.getEui();
+        uint8_t slot = mSuperframe.assign(DW1000NgUtils::bytesAsValue((byte *)eui, 2));
+        debugV("Tag %02X%02X asked to join, given slot %d", eui[1], eui[0], slot);
+        return;
+    }
+#endif
+#endif
+    if (blink.is(DEVICE_IS_ANCHOR, 0))
+    {
+        // remembered whether we're calibrating or not, an exchange it starts is never a tag's
+        const byte *eui = blink.getEui();
+        *mKnownAnchors.insert(eui, millis()) = millis();
+        // another anchor to calibrate against, a full table just leaves the rest out
+        if (mCalibrationEnd != 0 && mCalibrationPeers.find(eui) == nullptr && mCalibrationPeers.size() < mCalibrationPeers.capacity())
+        {
+            mCalibrationPeers.insert(eui, millis(), nullptr);
+            debugV("Calibrating against anchor %02X%02X", eui[1], eui[0]);
+        }
+        return;
+    }
+#ifdef DW1000_TDOA
+    // the codec checks the lengths
+    if (blink.isValid() && blink.getSpecifier() == Tdoa::TAG_BLINK)
+    {
+        this->handleTdoaBlink(frame);
+        return;
+    }
+#ifndef DW1000_TDOA_MASTER
+    if (blink.isValid() && blink.getSpecifier() == Tdoa::SYNC)
+    {
+        this->handleTdoaSync(frame);
+        return;
+    }
+#endif
+#endif
+}
+
 /**
  * Anchor mode handle function
  * This sends out blink messages according to ALOHA protocol - i.e: randomly
- * When a blink message is responded to by a tag, the anchor will respond with a ranging request message
+ * In TDMA mode the blinks are kept to the contention slot so they don't land on top of a tag's ranging.
+ * Tags poll us after hearing a blink, mRanging answers those on its own and we pick up the range once it's done
  */
 void DW1000::handle()
 {
+    this->processRadioEvents();
+
+    if (mRanging.isFinished())
+    {
+        mProfile.recordExchange(mRanging);
+        if (mRanging.isInitiator())
+        {
+            // one of our calibration exchanges with another anchor
+            if (mRanging.getState() == TwoWayRanging::SUCCEEDED)
+            {
+                this->addCalibrationSample(mRanging.getReport().anchorEui, mRanging.getReport().range);
+            }
+        }
+        else if (mCalibrationEnd != 0 && mRanging.getState() == TwoWayRanging::SUCCEEDED && mCalibrationPeers.find(mRanging.getTagEui()) != nullptr)
+        {
+            // another anchor calibrating against us, the range is just as good from this end
+            this->addCalibrationSample(mRanging.getTagEui(), mRanging.getRange());
+        }
+        else if (mKnownAnchors.find(mRanging.getTagEui()) != nullptr)
+        {
+            // an anchor still calibrating against us after we've stopped, or one we aren't calibrating against
+            const uint8_t *eui = mRanging.getTagEui();
+            debugV("Dropped an exchange started by anchor %02X%02X", eui[1], eui[0]);
+        }
+        else if (mRanging.getState() == TwoWayRanging::SUCCEEDED)
+        {
+            float rxPower = mRanging.getReceivePower();
+            debugV("Range accept success");
+            debugV("RX power: %f dBm, clock offset %f ppm", rxPower, mRanging.getClockOffset());
+            this->updateTagDistance((byte *)mRanging.getTagEui(), mRanging.getRange(), rxPower, mRanging.getSequence());
+        }
+        else
+        {
+            debugE("Range accept failed");
+        }
+        mRanging.reset();
+    }
+#ifdef DW1000_BROADCAST_RANGING
+    if (mBroadcast.isFinished())
+    {
+        this->finishBroadcastExchange();
+    }
+#endif
+
+#ifdef DW1000_TDMA_COORDINATOR
+    if (millis() >= mNextBeaconScheduled && this->isRadioFree())
+    {
+        this->transmitSuperframeBeacon();
+        mLastBeaconMillis = millis();
+        mSuperframe.next();
+        mNextBeaconScheduled = mLastBeaconMillis + mSuperframe.getLength();
+    }
+#endif
+
+#ifdef DW1000_TDOA_MASTER
+    // syncs need our position in them, the others can't work out how long they took to arrive without it
+    if (millis() >= mNextSyncScheduled && mHasPosition && this->isRadioFree())
+    {
+        this->transmitTdoaSync();
+        mNextSyncScheduled = millis() + Tdoa::SYNC_INTERVAL_MS;
+    }
+#endif
+
+#ifdef DW1000_TDMA
+    boolean canBlink = !this->isSynced() || millis() - mLastBeaconMillis < mSuperframe.getSlotLength() - SLOT_GUARD_TIME;
+#else
+    boolean canBlink = true;
+#endif
+
     // is scheduled?
-    if (millis() > mNextBlinkScheduled)
+    if (millis() > mNextBlinkScheduled && canBlink && this->isRadioFree())
     {
         // transmit blink message
         this->transmitAnchorAdvertiseBlink();
 
-        mNextBlinkScheduled = millis() + random(mMinBlinkDelay, mMaxBlinkDelay);
-        DW1000Ng::startReceive();
+        if (mCalibrationEnd != 0)
+        {
+            mNextBlinkScheduled = millis() + random(CALIBRATION_MIN_BLINK_DELAY, CALIBRATION_MAX_BLINK_DELAY);
+        }
+        else
+        {
+            mNextBlinkScheduled = millis() + random(mMinBlinkDelay, mMaxBlinkDelay);
+        }
+    }
+
+    if (mCalibrationEnd != 0)
+    {
+        this->handleCalibration();
     }
 
-    if (DW1000NgRTLS::receiveFrame())
+    // always listening when not sending
+    if (!mRadio.isTransmitting() && !mRadio.isReceiving())
     {
-        size_t len = DW1000Ng::getReceivedDataLength();
-        byte data[len];
-        DW1000Ng::getReceivedData(data, len);
-        if (data[0] == BLINK && len > 11 && data[11] == TAG_LISTENING_NOW && len == 14)
+        mRadio.startReceive();
+    }
+}
+
+#elif defined(DW1000_TAG)
+
+void DW1000::reportMotion()
+{
+    portENTER_CRITICAL(&mConfigLock);
+    mMotionPending = true;
+    portEXIT_CRITICAL(&mConfigLock);
+}
+
+DW1000::Anchor *DW1000::storeRangeReport(const TwoWayRanging::RangeReport &report)
+{
+    Anchor *anchor = mAnchors.find(report.anchorEui);
+    if (anchor == nullptr)
+        return nullptr;
+
+    // the anchor reports raw ranges, filter them so an outlier doesn't throw the position fix off
+    anchor->distance = anchor->filter.update(report.range, millis());
+    anchor->hasPosition = report.hasPosition;
+    if (anchor->hasPosition)
+    {
+        anchor->position = {report.x, report.y, report.z};
+    }
+    anchor->lastRangeMillis = millis();
+    return anchor;
+}
+
+// pick up the result of ranging the current session anchor and move on to the next one
+void DW1000::finishAnchorRange()
+{
+    mProfile.recordExchange(mRanging);
+    // not mAnchors.get(mSessionAnchor), the anchor may have been evicted while it was being ranged
+    Anchor *anchor = mAnchors.find(mSessionEui);
+    if (anchor == nullptr)
+    {
+        debugV("Anchor dropped from the table during its exchange");
+    }
+    else if (mRanging.getState() == TwoWayRanging::SUCCEEDED)
+    {
+        this->storeRangeReport(mRanging.getReport());
+        // increase reliability of anchor to max of 100
+        anchor->reliability = min((anchor->reliability + 100) / 2, 100);
+        debugV("Tag range success, %f m, reliability: %d", anchor->distance, anchor->reliability);
+    }
+    else
+    {
+        // decrease reliability of anchor to min of 0
+        anchor->reliability = max(anchor->reliability / 2, 0);
+        debugE("Tag range failed, reliability: %d", anchor->reliability);
+    }
+    mRanging.reset();
+    mSessionAnchor = this->nextSessionAnchor();
+}
+
+void DW1000::planSession()
+{
+    unsigned long now = millis();
+    mScheduler.clearCandidates();
+    for (uint16_t i = 0; i < MAX_ANCHORS; i++)
+    {
+        if (mAnchors.isUsed(i))
         {
+            Anchor *anchor = &mAnchors.get(i);
+            mScheduler.addCandidate({i, (bool)anchor->hasPosition, {anchor->position.x, anchor->position.y, anchor->position.z},
+                                     anchor->reliability, (uint32_t)anchor->lastAttemptMillis});
+        }
+    }
+    mSessionCount = mScheduler.select(mHasPosition, {mPosition.x, mPosition.y, mPosition.z}, now, mSessionSlots);
+    mSessionIndex = 0;
+    debugV("Ranging %d of %d anchors, gdop %f", mSessionCount, mAnchors.size(), mScheduler.getGdop());
+}
 
-            byte anchor_eui[8];
-            DW1000Ng::getEUI(anchor_eui);
+int16_t DW1000::nextSessionAnchor()
+{
+    // an anchor can be dropped from the table while its session is still going
+    while (mSessionIndex < mSessionCount)
+    {
+        uint16_t slot = mSessionSlots[mSessionIndex++];
+        if (mAnchors.isUsed(slot))
+        {
+            return slot;
+        }
+    }
+    return MAX_ANCHORS;
+}
 
-            // check if last 2 bytes are the last 2 bytes of our eui, if they aren't, we're not the target so we should exit
-            if (memcmp(&data[12], &anchor_eui[0], 2) != 0)
-            {
-                return;
-            }
+void DW1000::finishRangingSession()
+{
+    mSessionAnchor = -1;
+    this->updatePosition();
+    mProfile.record(RangingProfile::SESSION, micros() - mSessionStart);
 
-            byte tag_eui[8];
-            memcpy(tag_eui, &data[2], 8);
-            DW1000NgRTLS::transmitRangingInitiation(&data[2], &data[2]); // todo figure out address? eui?
-            DW1000NgRTLS::waitForTransmission();
-            RangeAcceptResult result = DW1000NgRTLS::anchorRangeAccept(NextActivity::ACTIVITY_FINISHED, 0);
-            debugV("Received blink message from tag and performed ranging");
+#ifdef DW1000_TDMA
+    if (this->isSynced())
+    {
+        // same slot next superframe in case we miss the beacon, the beacon corrects this if we hear it
+        mNextBlinkScheduled = mSlotEnd + SLOT_GUARD_TIME - mSuperframe.getSlotLength() + mSuperframe.getLength();
+        mSlotEnd += mSuperframe.getLength();
+    }
+    else
+#endif
+    {
+        // +-25% so tags that happen to start together drift apart again
+        uint32_t interval = mScheduler.getInterval(millis());
+        mNextBlinkScheduled = millis() + random(interval * 3 / 4, interval * 5 / 4);
+    }
+    debugV("Next ranging session scheduled in %d ms", mNextBlinkScheduled - millis());
+}
 
-            if (result.success)
-            {
-                debugV("Range accept success");
-                debugV("RX power: %f dBm", DW1000Ng::getReceivePower());
-                // convert range to 10cm resolution float
-                // try and find the tag in the list of known tags
-                bool found = false;
-                for (uint8_t i = 0; i < mTagDistancesCount; i++)
-                {
-                    if (memcmp(mTagDistances[i].eui, tag_eui, 8) == 0)
-                    {
-                        found = true;
-                        mTagDistances[i].distance = result.range;
-                        break;
-                    }
-                }
-                // todo limit to 8 tags so we don't segfault
-                if (found == false)
-                {
-                    // add tag to list
-                    memcpy(mTagDistances[mTagDistancesCount].eui, tag_eui, 8);
-                    mTagDistances[mTagDistancesCount].distance = result.range;
-                    mTagDistancesCount++;
-                }
-            }
-            else
-            {
-                debugE("Range accept failed");
-                return;
-            }
+// solve for our position from every anchor that reported a recent range and its coordinates
+void DW1000::updatePosition()
+{
+    mSolver.reset();
+    for (uint16_t i = 0; i < MAX_ANCHORS; i++)
+    {
+        Anchor *anchor = &mAnchors.get(i);
+        if (mAnchors.isUsed(i) && anchor->hasPosition && anchor->lastRangeMillis != 0 && millis() - anchor->lastRangeMillis < mMaxRangeAge)
+        {
+            mSolver.addMeasurement(anchor->position, anchor->distance);
+        }
+    }
+
+    if (mSolver.getMeasurementCount() < Solver::MIN_ANCHORS)
+    {
+        debugV("Only %d anchors with recent ranges, not solving position", mSolver.getMeasurementCount());
+        return;
+    }
+
+    // start from the last fix if we have one, it's usually very close
+    Solver::Result result = mSolver.solve(mHasPosition ? mPosition : mSolver.centroid());
+    if (!result.success)
+    {
+        debugE("Position solve failed after %d iterations", result.iterations);
+        return;
+    }
+
+    mPosition = result.position;
+    mHasPosition = true;
+
+    uint32_t now = millis();
+    mPredictor.update(PositionPredictor::Vector{mPosition.x, mPosition.y, mPosition.z}, now);
+    PositionPredictor::Vector velocity = mPredictor.getVelocity();
+    mScheduler.updateSpeed(sqrtf(velocity.x * velocity.x + velocity.y * velocity.y + velocity.z * velocity.z), now);
+    Fix fix;
+    fix.position = mPosition;
+    fix.velocity = velocity;
+    fix.timestamp = now;
+    fix.lookAhead = mPredictor.getConfig().lookAhead;
+    fix.predicted = mPredictor.predict(now + fix.lookAhead);
+    fix.predictionError = mPredictor.getPredictionError(now + fix.lookAhead);
+    mResults.push(fix);
+#ifdef IMU_FUSION
+    mFusionResults.push(fix);
+#endif
+    mProfile.recordResult();
+    debugV("Position %f, %f, %f after %d iterations, rms error %f m", mPosition.x, mPosition.y, mPosition.z, result.iterations, result.rmsError);
+}
+
+#ifdef DW1000_BROADCAST_RANGING
+/**
+ * Ranges every planned anchor with one poll and one final, see broadcastranging.hpp for the frame layout.
+ */
+void DW1000::startBroadcastSession()
+{
+    uint16_t anchors[BroadcastRanging::MAX_ANCHORS];
+    uint8_t count = 0;
+    int16_t slot;
+    while (count < BroadcastRanging::MAX_ANCHORS && (slot = this->nextSessionAnchor()) < MAX_ANCHORS)
+    {
+        memcpy(mBroadcastEuis[count], mAnchors.getEui(slot), 8);
+        anchors[count] = TwoWayRanging::shortId(mAnchors.getEui(slot));
+        mAnchors.get(slot).lastAttemptMillis = millis();
+        count++;
+    }
+
+    if (!mBroadcast.startTag(anchors, count, micros()))
+    {
+        // no anchors to poll
+        this->finishRangingSession();
+    }
+}
+
+void DW1000::finishBroadcastSession()
+{
+    uint8_t reports = 0;
+    for (uint8_t i = 0; i < mBroadcast.getAnchorCount(); i++)
+    {
+        // an anchor can be dropped from the table while its session is still going, and its slot reused
+        Anchor *anchor = mAnchors.find(mBroadcastEuis[i]);
+        if (anchor == nullptr)
+        {
+            continue;
+        }
+        if (mBroadcast.hasResponse(i))
+        {
+            anchor->reliability = min((anchor->reliability + 100) / 2, 100);
         }
         else
         {
-            /*rdebugV("Received unknown message");
-            // print out unknown message over debugV
-            for (size_t i = 0; i < len; i++)
-            {
-                Debug.printf("%02X ", data[i]);
-            }
-            Debug.printf("\n");*/
+            anchor->reliability = max(anchor->reliability / 2, 0);
+        }
+        if (mBroadcast.hasReport(i) && this->storeRangeReport(mBroadcast.getReport(i)) != nullptr)
+        {
+            reports++;
+        }
+    }
+    debugV("Broadcast ranging: %d anchors polled, %d range reports", mBroadcast.getAnchorCount(), reports);
+    mBroadcast.reset();
+    this->finishRangingSession();
+}
+#endif
+
+#ifdef DW1000_TDOA
+void DW1000::transmitTdoaBlink()
+{
+    byte frame[Tdoa::BLINK_LENGTH];
+    Tdoa::encodeBlink(DW1000NgRTLS::increaseSequenceNumber(), mEui, frame, sizeof(frame));
+    mRadio.transmit(frame, sizeof(frame));
+    mProfile.recordResult();
+}
+#endif
+
+void DW1000::handleFrame(const Frame &frame)
+{
+    BlinkView blink(frame);
+#ifdef DW1000_TDMA
+    if (blink.hasPayload(SUPERFRAME_BEACON))
+    {
+        this->handleSuperframeBeacon(blink);
+    }
+    else
+#endif
+    if (blink.isValid() && blink.getSpecifier() == DEVICE_IS_ANCHOR)
+    {
+        rdebugV("Received anchor blink message");
+        // print out blink message over debugV
+        for (size_t i = 0; i < frame.length; i++)
+        {
+            Debug.printf("%02X ", frame.data[i]);
+        }
+        Debug.printf("\n");
+
+        // add the anchor if we haven't seen it before, a full table drops its least reliable anchor
+        bool created;
+        Anchor *anchor = mAnchors.insert(blink.getEui(), millis(), &created);
+        if (created)
+        {
+            anchor->reliability = 100;
+            anchor->filter.setConfig(mFilterConfig);
         }
     }
 }
 
-#elif defined(DW1000_TAG)
 /**
  * Tag mode handle function
- * This listens for blink messages and responds with a ranging request message
+ * This listens for anchor blink messages and ranges every known anchor in turn, one step per call
+ * In TDMA mode ranging sessions only happen inside the slot the coordinator gave us.
  */
 void DW1000::handle()
 {
-    // is scheduled?
-    if (millis() > mNextBlinkScheduled)
-    {
-        debugV("Known anchors: %d", mAnchorsCount);
-        // list known anchors addresses
-        for (uint8_t i = 0; i < mAnchorsCount; i++)
-        {
-            debugV("Anchor %d: %02X:%02X:%02X:%02X:%02X:%02X:%02X:%02X", i, mAnchors[i].eui[0], mAnchors[i].eui[1], mAnchors[i].eui[2], mAnchors[i].eui[3], mAnchors[i].eui[4], mAnchors[i].eui[5], mAnchors[i].eui[6], mAnchors[i].eui[7]);
-            RangeRequestResult requestResult = this->tagTargetedRangeRequest(DW1000NgUtils::bytesAsValue(mAnchors[i].eui, 2));
-            if (requestResult.success)
-            {
-                RangeInfrastructureResult result = DW1000NgRTLS::tagRangeInfrastructure(requestResult.target_anchor, 3000);
-                if (result.success)
-                {
-                    // increase reliability of anchor to max of 100
-                    mAnchors[i].reliability = min((mAnchors[i].reliability + 100) / 2, 100);
-                    debugV("Tag range infrastructure success, reliability: %d", mAnchors[i].reliability);
-                }
-                else
-                {
-                    // decrease reliability of anchor to min of 0
-                    mAnchors[i].reliability = max(mAnchors[i].reliability / 2, 0);
-                    debugE("Tag range infrastructure failed, reliability: %d", mAnchors[i].reliability);
-                }
-            }
-            else
-            {
-                debugE("Tag range request failed");
-            }
-        }
+    this->processRadioEvents();
 
+#ifdef DW1000_TDOA
+    // the anchors do all the work, we blink and keep the receiver off in between
+    if (millis() > mNextBlinkScheduled && !mRadio.isTransmitting())
+    {
+        this->transmitTdoaBlink();
         mNextBlinkScheduled = millis() + random(mMinBlinkDelay, mMaxBlinkDelay);
-        debugV("Next ranging session scheduled in %d ms", mNextBlinkScheduled - millis());
     }
+    return;
+#endif
 
-    if (DW1000NgRTLS::receiveFrame())
+#ifdef DW1000_BROADCAST_RANGING
+    if (mBroadcast.isFinished())
     {
-        size_t len = DW1000Ng::getReceivedDataLength();
-        byte data[len];
-        DW1000Ng::getReceivedData(data, len);
-        if (data[0] == BLINK && data[11] == DEVICE_IS_ANCHOR)
+        this->finishBroadcastSession();
+    }
+#endif
+
+#ifdef DW1000_TDMA
+    if (mJoinScheduled != 0 && millis() >= mJoinScheduled && this->isRadioFree())
+    {
+        mJoinScheduled = 0;
+        this->transmitJoinRequest();
+    }
+#endif
+
+    // is scheduled?
+    if (mSessionAnchor < 0 && millis() > mNextBlinkScheduled && this->isRadioFree())
+    {
+        debugV("Known anchors: %d", mAnchors.size());
+        mSessionStart = micros();
+#ifdef DW1000_BROADCAST_RANGING
+        // one poll and one final for every anchor in the plan at once
+        this->planSession();
+        this->startBroadcastSession();
+#else
+        this->planSession();
+        mSessionAnchor = this->nextSessionAnchor();
+#endif
+    }
+
+    if (mSessionAnchor >= 0)
+    {
+        if (mRanging.isFinished())
         {
-            rdebugV("Received anchor blink message");
-            // print out blink message over debugV
-            for (size_t i = 0; i < len; i++)
-            {
-                Debug.printf("%02X ", data[i]);
-            }
-            Debug.printf("\n");
-
-            byte anchor_address[8];
-            // extract eui from blink message
-            memcpy(anchor_address, &data[2], 8);
-            // check if we've seen this anchor before
-            bool found = false;
-            for (uint8_t i = 0; i < mAnchorsCount; i++)
+            this->finishAnchorRange();
+        }
+
+        if (this->isRadioFree())
+        {
+#ifdef DW1000_TDMA
+            // don't spill over into the next tag's slot, the rest of the anchors get ranged next superframe
+            if (mSessionAnchor < MAX_ANCHORS && this->isSynced() && millis() >= mSlotEnd)
             {
-                if (memcmp(mAnchors[i].eui, anchor_address, 8) == 0)
-                {
-                    found = true;
-                    break;
-                }
+                debugE("Ran out of slot time at anchor slot %d", mSessionAnchor);
+                this->finishRangingSession();
             }
-            if (!found)
+            else
+#endif
+            if (mSessionAnchor >= MAX_ANCHORS)
             {
-                Anchor anchor;
-                // add anchor to list
-                memcpy(anchor.eui, anchor_address, 8);
-                anchor.reliability = 100;
-                mAnchors[mAnchorsCount] = anchor;
-                mAnchorsCount++;
+                this->finishRangingSession();
             }
-        }
-        else
-        {
-            /*rdebugV("Received unknown message");
-            // print out unknown message over debugV
-            for (size_t i = 0; i < len; i++)
+            else
             {
-                Debug.printf("%02X ", data[i]);
+                const uint8_t *eui = mAnchors.getEui(mSessionAnchor);
+                debugV("Anchor %d: %02X:%02X:%02X:%02X:%02X:%02X:%02X:%02X", mSessionAnchor, eui[0], eui[1], eui[2], eui[3], eui[4], eui[5], eui[6], eui[7]);
+                memcpy(mSessionEui, eui, 8);
+                mAnchors.get(mSessionAnchor).lastAttemptMillis = millis();
+                mRanging.startTag(TwoWayRanging::shortId(eui), micros());
             }
-            Debug.printf("\n");*/
         }
     }
+
+    // always listening when not sending
+    if (!mRadio.isTransmitting() && !mRadio.isReceiving())
+    {
+        mRadio.startReceive();
+    }
 }
 
 #else
@@ -3,56 +3,341 @@
 #include <Arduino.h>
 #include <Preferences.h>
 
-#include <DW1000NgRTLS.hpp>
+#include "dw1000radio.hpp"
+#include "ranging.hpp"
+#include "multilateration.hpp"
+#include "ringbuffer.hpp"
+#include "peertable.hpp"
+#include "rangefilter.hpp"
+#include "positionpredictor.hpp"
+#include "rangingprofile.hpp"
+#include "rangingscheduler.hpp"
+#include "frame.hpp"
+#ifdef DW1000_ANCHOR
+#include <atomic>
+#include "antennacalibration.hpp"
+#endif
+#ifdef DW1000_TDMA
+#include "tdma.hpp"
+#endif
+#ifdef DW1000_BROADCAST_RANGING
+#include "broadcastranging.hpp"
+#endif
+#ifdef DW1000_TDOA
+#include "tdoa.hpp"
+#endif
+
+// how many peers are tracked at once, the least useful one is forgotten to make room for a new one
+#ifndef DW1000_MAX_TAGS
+#define DW1000_MAX_TAGS 8
+#endif
+#ifndef DW1000_MAX_ANCHORS
+#define DW1000_MAX_ANCHORS 8
+#endif
 
 class DW1000
 {
 public:
+    static const uint16_t MAX_TAGS = DW1000_MAX_TAGS;
+    static const uint8_t MAX_ANCHORS = DW1000_MAX_ANCHORS;
+    typedef Multilateration<MAX_ANCHORS> Solver;
+
     typedef struct
     {
         byte eui[8];
-        float distance;
+        float distance;          // m, filtered
+        float variance;          // m^2, of the filtered distance
+        unsigned long timestamp; // millis() when the range was measured
+        float rxPower;           // dBm, of the tag's final
+        uint8_t sequence;        // sequence number of the exchange
     } TagDistance;
 
+    // the EUI is the key of the anchor table
     typedef struct
     {
-        byte eui[8];
         uint8_t reliability; // track reliability of ranging over time
+        float distance;      // m, as reported back by the anchor and filtered
+        RangeFilter filter;
+        Solver::Point position; // m, as reported back by the anchor
+        boolean hasPosition;
+        unsigned long lastRangeMillis;
+        unsigned long lastAttemptMillis; // successful or not
     } Anchor;
 
+#ifdef DW1000_ANCHOR
+    // every range to a tag, in the order they were measured
+    typedef RingBuffer<TagDistance, 16> ResultQueue;
+
+    // median range to another anchor over a calibration run
+    typedef struct
+    {
+        byte eui[8];
+        float range; // m
+        uint8_t count;
+    } CalibrationRange;
+    typedef RingBuffer<CalibrationRange, AntennaCalibration::MAX_NODES> CalibrationQueue;
+#ifdef DW1000_TDOA
+    // every tag blink heard, on the master's clock
+    typedef RingBuffer<Tdoa::Arrival, 64> ArrivalQueue;
+#endif
+#elif defined(DW1000_TAG)
+    // every position fix, and where the predictor expects the tag to be lookAhead ms after it
+    typedef struct
+    {
+        Solver::Point position;              // m, as solved
+        PositionPredictor::Vector velocity;  // m/s
+        PositionPredictor::Vector predicted; // m
+        float predictionError;               // m, standard deviation
+        uint32_t timestamp;                  // ms
+        uint32_t lookAhead;                  // ms
+    } Fix;
+    typedef RingBuffer<Fix, 8> ResultQueue;
+#endif
+
     DW1000(Preferences *preferences, uint8_t ss, const uint8_t irq, const uint8_t rst, const uint8_t *macAddr);
 
+    /**
+     * Never waits on the radio - handles whatever radio events are pending and moves the ranging state machine along.
+     */
     void handle();
+    /**
+     * With -DDW1000_IRQ the radio's interrupt wakes this task, which should wait in ulTaskNotifyTake() between handle()s,
+     * so a frame is answered straight away rather than on the next tick.
+     */
+    void setTaskToWake(TaskHandle_t task) { DW1000Radio::setTaskToWake(task); }
+
+#if defined(DW1000_ANCHOR) || defined(DW1000_TAG)
+    /**
+     * Results for the network task. handle() is the only producer, so there must be exactly one consumer.
+     */
+    ResultQueue &getResults() { return mResults; }
+#if defined(DW1000_TAG) && defined(IMU_FUSION)
+    // the same fixes again for the IMU task, which is the one consumer of this one
+    typedef RingBuffer<Fix, 4> FusionQueue;
+    FusionQueue &getFusionResults() { return mFusionResults; }
+#endif
+#endif
+
+    /**
+     * Time spent in each ranging phase, for the "stats" command. Only the ranging task may record into it.
+     */
+    RangingProfile &getProfile() { return mProfile; }
+    // prints the profile over RemoteDebug and starts a new one
+    void printProfile();
+    // our EUI, as it goes out in frames
+    const byte *getEUI() { return mEui; }
+
+    /**
+     * Safe to call from another task, the new delay is written to the chip on the next handle().
+     */
+    void setAntennaDelay(uint16_t antennaDelay);
 
 #ifdef DW1000_ANCHOR
-    uint8_t getKnownTagCount() { return mTagDistancesCount; }
-    TagDistance *getKnownTag(uint8_t index) { return &mTagDistances[index]; }
+    /**
+     * Sets the surveyed coordinates of this anchor, these get sent to tags in every range report.
+     * Safe to call from another task, they're picked up on the next handle().
+     */
+    void setPosition(float x, float y, float z);
+
+    /**
+     * Ranges every other anchor heard blinking for durationMs, as the initiator, as well as answering them.
+     * Afterwards the median range to each goes into getCalibrationResults() and isCalibrating() goes false.
+     * Safe to call from another task.
+     */
+    void startCalibration(uint32_t durationMs);
+    bool isCalibrating() { return mCalibrating.load(std::memory_order_acquire); }
+    CalibrationQueue &getCalibrationResults() { return mCalibrationResults; }
+#ifdef DW1000_TDOA
+    /**
+     * Tag blinks for the network task to batch up, same single consumer rule as getResults().
+     * Blinks heard before the first syncs have come in are dropped, they can't be put on the master's clock yet.
+     */
+    ArrivalQueue &getTdoaArrivals() { return mTdoaArrivals; }
+#endif
 #elif defined(DW1000_TAG)
-    uint8_t getKnownAnchorsCount() { return mAnchorsCount; }
-    Anchor *getKnownAnchor(uint8_t index) { return &mAnchors[index]; }
     float getDistanceToAnchor(byte anchor_eui[]);
-
+    /**
+     * The IMU saw the tag move, so it ranges at the fast rate for a while. Safe to call from another task.
+     */
+    void reportMotion();
 #endif
 
 private:
+    DW1000Radio mRadio;
+    TwoWayRanging mRanging;
+#ifdef DW1000_BROADCAST_RANGING
+    // runs next to mRanging, a frame only starts one of them while the other is idle
+    BroadcastRanging mBroadcast;
+#endif
+    byte mEui[8];
+    // received frames waiting to be parsed, so the receiver can go straight back on for the next one
+    FramePool<4> mFrames;
+#if defined(DW1000_ANCHOR) || defined(DW1000_TAG)
+    ResultQueue mResults;
+#if defined(DW1000_TAG) && defined(IMU_FUSION)
+    FusionQueue mFusionResults;
+#endif
+#endif
+    RangingProfile mProfile;
+    // SPI totals at the last printProfile()
+    uint32_t mSpiBusyUs = 0;
+    uint32_t mSpiBursts = 0;
+    uint32_t mSpiTransfers = 0;
+
+    // settings changed from other tasks, guarded by mConfigLock and applied from handle() since the ranging task owns SPI
+    portMUX_TYPE mConfigLock = portMUX_INITIALIZER_UNLOCKED;
+    int32_t mPendingAntennaDelay = -1;
+    void applyPendingConfig();
+
+    // for every new link's range filter, from the rangeNoise / rangeAccel preferences
+    RangeFilter::Config mFilterConfig;
+
 #ifdef DW1000_ANCHOR
     unsigned long mMinBlinkDelay = 5000;  // ms
     unsigned long mMaxBlinkDelay = 25000; // ms
-    TagDistance mTagDistances[8];
-    uint8_t mTagDistancesCount = 0;
+    typedef struct
+    {
+        TagDistance latest;
+        RangeFilter filter;
+    } TagLink;
+    // latest range to every tag, the least recently ranged is dropped when a new tag shows up
+    PeerTable<TagLink, MAX_TAGS> mTags;
+    Solver::Point mPosition;
+    boolean mHasPosition = false;
+    Solver::Point mPendingPosition;
+    boolean mPositionPending = false;
+
+    // ranges to one other anchor during calibration
+    static const uint8_t CALIBRATION_SAMPLES = 16;
+    typedef struct
+    {
+        float samples[CALIBRATION_SAMPLES];
+        uint8_t count;
+    } CalibrationPeer;
+    std::atomic<bool> mCalibrating{false};
+    uint32_t mPendingCalibration = 0; // ms, guarded by mConfigLock
+    unsigned long mCalibrationEnd = 0;
+    unsigned long mNextCalibrationExchange = 0;
+    uint16_t mNextCalibrationPeer = 0;
+    PeerTable<CalibrationPeer, AntennaCalibration::MAX_NODES> mCalibrationPeers;
+    CalibrationQueue mCalibrationResults;
+    // other anchors heard blinking, millis() of the latest blink, so their calibration exchanges aren't taken for tags
+    PeerTable<unsigned long, AntennaCalibration::MAX_NODES> mKnownAnchors;
+
+    void handleCalibration();
+    void addCalibrationSample(const byte eui[], float range);
+    void finishCalibration();
+
+    void updateTagDistance(byte tag_eui[], float distance, float rxPower, uint8_t sequence);
+#ifdef DW1000_BROADCAST_RANGING
+    void finishBroadcastExchange();
+#endif
+#ifdef DW1000_TDOA
+    ArrivalQueue mTdoaArrivals;
+    // for printProfile()
+    uint32_t mTdoaBlinks = 0;
+    uint32_t mTdoaUnsynced = 0;
+#ifdef DW1000_TDOA_MASTER
+    // our clock is the one everyone else's is put on
+    unsigned long mNextSyncScheduled = 0;
+    uint32_t mTdoaSyncs = 0;
+    void transmitTdoaSync();
+#else
+    TdoaClock mTdoaClock;
+    void handleTdoaSync(const Frame &frame);
+#endif
+    void handleTdoaBlink(const Frame &frame);
+#endif
 
 #elif defined(DW1000_TAG)
+#ifdef DW1000_TDOA
+    // TDOA tags have no fixes of their own to schedule by, they blink at a fixed rate
     unsigned long mMinBlinkDelay = 100; // ms
     unsigned long mMaxBlinkDelay = 500; // ms
-    // support at most 8 anchors for now
-    Anchor mAnchors[8];
-    uint8_t mAnchorsCount = 0;
+#endif
+    unsigned long mMaxRangeAge = 1000; // ms, older ranges aren't used for a position fix
+    // anchors heard from, the least reliable is dropped when a new one shows up
+    PeerTable<Anchor, MAX_ANCHORS> mAnchors;
+    // how often to range and which anchors, from how fast we move and how the anchors have been doing
+    RangingScheduler<MAX_ANCHORS> mScheduler;
+    boolean mMotionPending = false; // guarded by mConfigLock
+    // anchor slots picked for this session, in the order they get ranged
+    uint16_t mSessionSlots[MAX_ANCHORS];
+    uint8_t mSessionCount = 0;
+    uint8_t mSessionIndex = 0;
+    // slot of the anchor currently being ranged, -1 between sessions
+    int16_t mSessionAnchor = -1;
+    // and its EUI, a blink can evict it and hand the slot to another anchor before the exchange ends
+    uint8_t mSessionEui[8];
+    unsigned long mSessionStart = 0; // us
+    Solver mSolver;
+    Solver::Point mPosition;
+    boolean mHasPosition = false;
+    PositionPredictor mPredictor;
+
+    /**
+     * Stores a range report against the anchor that sent it, returns that anchor or nullptr.
+     */
+    Anchor *storeRangeReport(const TwoWayRanging::RangeReport &report);
+    void finishAnchorRange();
+    // asks mScheduler which anchors to range this session
+    void planSession();
+    // next planned anchor slot still in use, MAX_ANCHORS once there are none left this session
+    int16_t nextSessionAnchor();
+    void finishRangingSession();
+    void updatePosition();
+#ifdef DW1000_BROADCAST_RANGING
+    // EUI of each anchor in the broadcast poll, looked up again when it's done as the slots can be reused meanwhile
+    uint8_t mBroadcastEuis[BroadcastRanging::MAX_ANCHORS][8];
+    // polls the planned anchors all at once, finishBroadcastSession() picks up the reports
+    void startBroadcastSession();
+    void finishBroadcastSession();
+#endif
+#ifdef DW1000_TDOA
+    // the only thing a tag sends in TDOA mode, see tdoa.hpp
+    void transmitTdoaBlink();
+#endif
 #endif
     unsigned long mLastBlinkSent = 0;
     unsigned long mNextBlinkScheduled = 0;
 
+#ifdef DW1000_TDMA
+    Superframe mSuperframe;
+    unsigned long mLastBeaconMillis = 0;
+    // short id of this device, what the coordinator hands slots out to
+    uint16_t mShortId;
+    /**
+     * True while beacons are being heard, otherwise we fall back to ALOHA so the cell keeps working without a coordinator.
+     */
+    boolean isSynced();
+#ifdef DW1000_TDMA_COORDINATOR
+    unsigned long mNextBeaconScheduled = 0;
+    void transmitSuperframeBeacon();
+#endif
+#ifdef DW1000_TAG
+    unsigned long mJoinScheduled = 0;
+    unsigned long mSlotEnd = 0;
+    void transmitJoinRequest();
+#endif
+    void handleSuperframeBeacon(const BlinkView &blink);
+#endif
+
+    /**
+     * Reads every pending frame into mFrames and turns the receiver back on, then dispatches them
+     * to the ranging state machine. Anything it doesn't want goes to handleFrame()
+     */
+    void processRadioEvents();
+    // one received frame into mFrames, along with its timestamp
+    void readFrame();
+    // to whichever exchange wants it, false if none does
+    boolean dispatchFrame(const Frame &frame);
+    void handleFrame(const Frame &frame);
+    // nothing in flight, so a new frame can go out
+#ifdef DW1000_BROADCAST_RANGING
+    boolean isRadioFree() { return !mRanging.isBusy() && !mBroadcast.isBusy() && !mRadio.isTransmitting(); }
+#else
+    boolean isRadioFree() { return !mRanging.isBusy() && !mRadio.isTransmitting(); }
+#endif
+
     void transmitAnchorAdvertiseBlink();
-    void transmitTagTargetedBlink(u16_t anchor_short_address);
-    RangeRequestResult tagTargetedRangeRequest(u16_t anchor_short_address);
-    void transmitRangeReportToTag(uint16_t range, byte tag_eui[]);
 };
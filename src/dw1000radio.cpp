@@ -0,0 +1,334 @@
+#include "dw1000radio.hpp"
+
+#include <DW1000Ng.hpp>
+#include <DW1000NgUtils.hpp>
+#include <DW1000NgTime.hpp>
+#include <DW1000NgConstants.hpp>
+
+// DW1000 timestamps are 40 bits and wrap
+#define TIMESTAMP_MASK 0xFFFFFFFFFFULL
+
+// SYS_CTRL
+#define CTRL_TXSTRT 0x02
+#define CTRL_TXDLYS 0x04
+#define CTRL_TRXOFF 0x40
+#define CTRL_WAIT4RESP 0x80
+#define CTRL_RXENAB 0x01 // second byte
+
+// SYS_STATUS, every event clears the bits that led up to it
+#define STATUS_TXFRS (1UL << 7)
+#define STATUS_RXFCG (1UL << 14)
+#define STATUS_TX_DONE 0xF8UL                                                    // AAT, TXFRB, TXPRS, TXPHS, TXFRS
+#define STATUS_RX_DONE 0x6F00UL                                                  // RXPRD, RXSFDD, LDEDONE, RXPHD, RXDFR, RXFCG
+#define STATUS_RX_TIMEOUT ((1UL << 17) | (1UL << 21) | (1UL << 26))              // RXRFTO, RXPTO, RXSFDTO
+#define STATUS_RX_FAILED ((1UL << 12) | (1UL << 15) | (1UL << 16) | (1UL << 18)) // RXPHE, RXFCE, RXRFSL, LDEERR
+
+// RX_FINFO, no extended frames. The length includes the CRC
+#define RXFLEN_MASK 0x7F
+#define CRC_LENGTH 2
+
+// DRX_CONF, the receiver's carrier recovery integrator
+#define DRX_CARRIER_INT 0x28
+// integrator -> Hz at 6.8 Mbps, Hz -> ppm at channel 4's 3993.6 MHz centre. Negative, the integrator counts the
+// other way from how much faster the sender runs
+#define CARRIER_INT_TO_PPM ((998.4e6 / 2.0 / 1024.0 / 131072.0) * (-1.0e6 / 3993.6e6))
+
+// RX_FQUAL, the channel impulse response power
+#define CIR_PWR 0x06
+// RX_FINFO, preamble symbols accumulated
+#define RXPACC_SHIFT 20
+#define RXPACC_MASK 0xFFF
+// receive power estimate at 64 MHz PRF, see the DW1000 user manual. The estimate reads low above about -88 dBm,
+// a straight line fit of how far takes most of that out
+#define RX_POWER_A 121.74f
+#define RX_POWER_KNEE -88.0f
+#define RX_POWER_SLOPE 1.1667f
+
+// Decawave's range bias for channel 4 at 64 MHz PRF, in 2 mm, from -61 dBm down to -95 dBm 2 dBm apart.
+// Before the zero the range reads short, after it long
+static const uint8_t RANGE_BIAS[] = {147, 133, 117, 99, 75, 50, 29, 0, 24, 45, 63, 76, 87, 98, 116, 122, 132, 142};
+#define RANGE_BIAS_ZERO 7
+#define RANGE_BIAS_START -61.0f
+#define RANGE_BIAS_STEP 2.0f
+
+volatile boolean DW1000Radio::sInterruptPending = false;
+volatile TaskHandle_t DW1000Radio::sTaskToWake = nullptr;
+
+void IRAM_ATTR DW1000Radio::onInterrupt()
+{
+    // no SPI in here, the status register gets read from handle()
+    sInterruptPending = true;
+    if (sTaskToWake != nullptr)
+    {
+        BaseType_t woken = pdFALSE;
+        vTaskNotifyGiveFromISR(sTaskToWake, &woken);
+        portYIELD_FROM_ISR(woken);
+    }
+}
+
+void DW1000Radio::begin(uint8_t ss, uint8_t irq, uint8_t rst)
+{
+    // we don't want DW1000Ng's own ISR, it talks SPI from interrupt context
+    DW1000Ng::initializeNoInterrupt(ss, rst);
+    // the chip is on its PLL now
+    mSpi.begin(ss);
+    mTxAntennaDelay = DW1000Ng::getTxAntennaDelay();
+
+#ifdef DW1000_IRQ
+    interrupt_configuration_t interruptConfig = {
+        true,  // sent
+        true,  // received
+        true,  // receive failed
+        true,  // receive timeout
+        false, // receive timestamp available
+        false};
+    DW1000Ng::applyInterruptConfiguration(interruptConfig);
+    pinMode(irq, INPUT);
+    attachInterrupt(digitalPinToInterrupt(irq), DW1000Radio::onInterrupt, RISING);
+    mUseInterrupt = true;
+#endif
+}
+
+Radio::Event DW1000Radio::pollEvent()
+{
+    // nothing has happened, don't even touch SPI
+    if (mUseInterrupt && !sInterruptPending)
+    {
+        return NONE;
+    }
+
+    // clear first so an interrupt that comes in while we read isn't lost,
+    // and set it again if we found something since there might be more behind it
+    sInterruptPending = false;
+    uint8_t bytes[4];
+    mSpi.beginBurst();
+    mSpi.read(DW1000Spi::SYS_STATUS, 0, bytes, sizeof(bytes));
+    uint32_t status = DW1000NgUtils::bytesAsValue(bytes, sizeof(bytes));
+
+    Event event = NONE;
+    uint32_t clear = 0;
+    if (status & STATUS_TXFRS)
+    {
+        clear = STATUS_TX_DONE;
+        mTransmitting = false;
+        mReceiving = mReceiveAfter;
+        event = TRANSMIT_DONE;
+    }
+    else if (status & STATUS_RXFCG)
+    {
+        clear = STATUS_RX_DONE;
+        mReceiving = false;
+        event = RECEIVE_DONE;
+    }
+    else if (status & STATUS_RX_TIMEOUT)
+    {
+        clear = STATUS_RX_TIMEOUT | STATUS_RX_DONE;
+        mReceiving = false;
+        event = RECEIVE_TIMEOUT;
+    }
+    else if (status & STATUS_RX_FAILED)
+    {
+        clear = STATUS_RX_FAILED | STATUS_RX_DONE;
+        mReceiving = false;
+        event = RECEIVE_FAILED;
+    }
+
+    if (event != NONE)
+    {
+        // status bits clear by writing 1 to them
+        DW1000NgUtils::writeValueToBytes(bytes, clear, sizeof(bytes));
+        mSpi.write(DW1000Spi::SYS_STATUS, 0, bytes, sizeof(bytes));
+        sInterruptPending = true;
+    }
+    mSpi.endBurst();
+    return event;
+}
+
+void DW1000Radio::transmit(const uint8_t *data, size_t len, bool delayed, bool receiveAfter)
+{
+    if (!mHasFrameControl)
+    {
+        // DW1000Ng only writes TX_FCTRL (rate, PRF, preamble) when it sends, so the first frame goes out through it
+        // and we keep what it wrote. It can't wait for a response, handle() turns the receiver on after this one
+        receiveAfter = false;
+        if (mReceiving)
+        {
+            DW1000Ng::forceTRxOff();
+        }
+        if (delayed)
+        {
+            byte futureTime[LENGTH_TIMESTAMP];
+            DW1000NgUtils::writeValueToBytes(futureTime, mDelayedTime, LENGTH_TIMESTAMP);
+            DW1000Ng::setDelayedTRX(futureTime);
+        }
+        DW1000Ng::setTransmitData((byte *)data, len);
+        DW1000Ng::startTransmit(delayed ? TransmitMode::DELAYED : TransmitMode::IMMEDIATE);
+        mSpi.beginBurst();
+        mSpi.read(DW1000Spi::TX_FCTRL, 0, mFrameControl, sizeof(mFrameControl));
+        mSpi.endBurst();
+        mHasFrameControl = true;
+    }
+    else
+    {
+        // TFLEN, the chip adds the CRC
+        uint16_t frameLength = len + CRC_LENGTH;
+        mFrameControl[0] = frameLength & 0xFF;
+        mFrameControl[1] = (mFrameControl[1] & 0xFC) | ((frameLength >> 8) & 0x03);
+        uint8_t control = CTRL_TXSTRT | (delayed ? CTRL_TXDLYS : 0) | (receiveAfter ? CTRL_WAIT4RESP : 0);
+
+        mSpi.beginBurst();
+        if (mReceiving)
+        {
+            uint8_t off = CTRL_TRXOFF;
+            mSpi.write(DW1000Spi::SYS_CTRL, 0, &off, 1);
+        }
+        if (delayed)
+        {
+            uint8_t futureTime[LENGTH_TIMESTAMP];
+            DW1000NgUtils::writeValueToBytes(futureTime, mDelayedTime, LENGTH_TIMESTAMP);
+            mSpi.write(DW1000Spi::DX_TIME, 0, futureTime, sizeof(futureTime));
+        }
+        mSpi.write(DW1000Spi::TX_BUFFER, 0, data, len);
+        mSpi.write(DW1000Spi::TX_FCTRL, 0, mFrameControl, 2);
+        mSpi.write(DW1000Spi::SYS_CTRL, 0, &control, 1);
+        mSpi.endBurst();
+    }
+    mReceiving = false;
+    mReceiveAfter = receiveAfter;
+    mTransmitting = true;
+    mFramesSent++;
+    mBytesSent += len;
+}
+
+uint64_t DW1000Radio::scheduleTransmit(uint64_t reference, uint32_t delayUs)
+{
+    // written to the chip along with the frame in transmit()
+    mDelayedTime = (reference + DW1000NgTime::microsecondsToUWBTime(delayUs)) & TIMESTAMP_MASK;
+    // the chip ignores the low 9 bits of the delayed time, and the TX timestamp includes the antenna delay
+    return ((mDelayedTime & ~0x1FFULL) + mTxAntennaDelay) & TIMESTAMP_MASK;
+}
+
+void DW1000Radio::writeControl(uint8_t low, uint8_t high)
+{
+    uint8_t control[2] = {low, high};
+    mSpi.beginBurst();
+    mSpi.write(DW1000Spi::SYS_CTRL, 0, control, high != 0 ? 2 : 1);
+    mSpi.endBurst();
+}
+
+void DW1000Radio::startReceive()
+{
+    this->writeControl(0, CTRL_RXENAB);
+    mReceiving = true;
+}
+
+void DW1000Radio::idle()
+{
+    this->writeControl(CTRL_TRXOFF, 0);
+    mTransmitting = false;
+    mReceiving = false;
+    mReceiveAfter = false;
+}
+
+void DW1000Radio::setAntennaDelay(uint16_t antennaDelay)
+{
+    DW1000Ng::setAntennaDelay(antennaDelay);
+    mTxAntennaDelay = antennaDelay;
+}
+
+size_t DW1000Radio::readReceived(uint8_t *data, size_t maxLen, uint64_t *received)
+{
+    uint8_t info[4];
+    mSpi.beginBurst();
+    mSpi.read(DW1000Spi::RX_FINFO, 0, info, received != nullptr ? sizeof(info) : 1);
+    size_t len = info[0] & RXFLEN_MASK;
+    // length comes off the air, don't trust it
+    len = len > CRC_LENGTH ? len - CRC_LENGTH : 0;
+    if (len == 0 || len > maxLen)
+    {
+        mSpi.endBurst();
+        return 0;
+    }
+    mSpi.read(DW1000Spi::RX_BUFFER, 0, data, len);
+    if (received != nullptr)
+    {
+        uint8_t timestamp[LENGTH_TIMESTAMP];
+        mSpi.read(DW1000Spi::RX_TIME, 0, timestamp, sizeof(timestamp));
+        *received = DW1000NgUtils::bytesAsValue(timestamp, sizeof(timestamp));
+        uint8_t carrier[3];
+        mSpi.read(DW1000Spi::DRX_CONF, DRX_CARRIER_INT, carrier, sizeof(carrier));
+        // 21 bit two's complement
+        int32_t integrator = (int32_t)DW1000NgUtils::bytesAsValue(carrier, sizeof(carrier)) & 0x1FFFFF;
+        if (integrator & 0x100000)
+        {
+            integrator -= 0x200000;
+        }
+        mCarrierOffset = integrator * CARRIER_INT_TO_PPM;
+        // the chip overwrites these with the next frame, which can be in before the range is worked out
+        uint8_t power[2];
+        mSpi.read(DW1000Spi::RX_FQUAL, CIR_PWR, power, sizeof(power));
+        float cir = DW1000NgUtils::bytesAsValue(power, sizeof(power));
+        float accumulated = (DW1000NgUtils::bytesAsValue(info, sizeof(info)) >> RXPACC_SHIFT) & RXPACC_MASK;
+        mReceivePower = NAN;
+        if (cir > 0 && accumulated > 0)
+        {
+            mReceivePower = 10 * log10f(cir * 131072.0f / (accumulated * accumulated)) - RX_POWER_A;
+            if (mReceivePower > RX_POWER_KNEE)
+            {
+                mReceivePower += (mReceivePower - RX_POWER_KNEE) * RX_POWER_SLOPE;
+            }
+        }
+    }
+    mSpi.endBurst();
+    return len;
+}
+
+size_t DW1000Radio::getReceivedData(uint8_t *data, size_t maxLen)
+{
+    return this->readReceived(data, maxLen, nullptr);
+}
+
+size_t DW1000Radio::getReceivedFrame(uint8_t *data, size_t maxLen, uint64_t *received)
+{
+    return this->readReceived(data, maxLen, received);
+}
+
+double DW1000Radio::correctRange(double range, float rxPower)
+{
+    if (isnan(rxPower))
+    {
+        return range;
+    }
+    // between the two nearest table entries, the ends hold
+    const uint8_t last = sizeof(RANGE_BIAS) - 1;
+    float position = fminf(fmaxf((RANGE_BIAS_START - rxPower) / RANGE_BIAS_STEP, 0), last);
+    uint8_t index = position >= last ? last - 1 : (uint8_t)position;
+    float fraction = position - index;
+    float low = (index < RANGE_BIAS_ZERO ? -1.0f : 1.0f) * RANGE_BIAS[index];
+    float high = (index + 1 < RANGE_BIAS_ZERO ? -1.0f : 1.0f) * RANGE_BIAS[index + 1];
+    return range - (low + (high - low) * fraction) * 0.002;
+}
+
+uint64_t DW1000Radio::readTimestamp(uint8_t reg)
+{
+    uint8_t timestamp[LENGTH_TIMESTAMP];
+    mSpi.beginBurst();
+    mSpi.read(reg, 0, timestamp, sizeof(timestamp));
+    mSpi.endBurst();
+    return DW1000NgUtils::bytesAsValue(timestamp, sizeof(timestamp));
+}
+
+uint64_t DW1000Radio::getReceiveTimestamp()
+{
+    return this->readTimestamp(DW1000Spi::RX_TIME);
+}
+
+uint64_t DW1000Radio::getTransmitTimestamp()
+{
+    return this->readTimestamp(DW1000Spi::TX_TIME);
+}
+
+uint64_t DW1000Radio::getSystemTimestamp()
+{
+    return this->readTimestamp(DW1000Spi::SYS_TIME);
+}
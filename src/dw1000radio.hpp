@@ -0,0 +1,77 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "radio.hpp"
+#include "dw1000spi.hpp"
+
+/**
+ * Radio implementation on top of DW1000Ng.
+ * With -DDW1000_IRQ the IRQ pin just sets a flag and the status register is only read when it fires.
+ * Without it (boards missing the IRQ bodge) the status register is polled on every pollEvent().
+ * DW1000Ng sets the chip up, the per frame register access goes through DW1000Spi, one SPI transaction per call.
+ */
+class DW1000Radio : public Radio
+{
+public:
+    void begin(uint8_t ss, uint8_t irq, uint8_t rst);
+
+    Event pollEvent() override;
+    /**
+     * A delayed frame goes out along with the time scheduleTransmit() worked out, in the same SPI transaction.
+     * receiveAfter is the chip's wait for response, so the receiver is on before handle() even hears the frame went out.
+     */
+    void transmit(const uint8_t *data, size_t len, bool delayed = false, bool receiveAfter = false) override;
+    uint64_t scheduleTransmit(uint64_t reference, uint32_t delayUs) override;
+    void startReceive() override;
+    void idle() override;
+
+    size_t getReceivedData(uint8_t *data, size_t maxLen) override;
+    size_t getReceivedFrame(uint8_t *data, size_t maxLen, uint64_t *received) override;
+    uint64_t getReceiveTimestamp() override;
+    // from DRX_CARRIER_INT, read in the same transaction as the frame
+    float getCarrierOffset() override { return mCarrierOffset; }
+    // from CIR_PWR and RXPACC, read in the same transaction as the frame
+    float getReceivePower() override { return mReceivePower; }
+    uint64_t getTransmitTimestamp() override;
+    uint64_t getSystemTimestamp() override;
+
+    // DW1000Ng::setAntennaDelay(), and keeps the TX half for scheduleTransmit() so it doesn't have to read it back
+    void setAntennaDelay(uint16_t antennaDelay);
+
+    /**
+     * Takes out the range bias of the leading edge detector, which reads strong frames short and weak ones long.
+     * rxPower is getReceivePower() of the frame the range was timed on, the range is left alone if it's NAN.
+     * For TwoWayRanging::setRangeCorrection().
+     */
+    static double correctRange(double range, float rxPower);
+
+    // SPI time for the "stats" command, DW1000Ng's own accesses aren't counted
+    DW1000Spi &getSpi() { return mSpi; }
+    // with -DDW1000_IRQ the interrupt wakes this task from ulTaskNotifyTake()
+    static void setTaskToWake(TaskHandle_t task) { sTaskToWake = task; }
+
+private:
+    boolean mUseInterrupt = false;
+    static volatile boolean sInterruptPending;
+    static volatile TaskHandle_t sTaskToWake;
+    static void onInterrupt();
+
+    DW1000Spi mSpi;
+    // TX_FCTRL as DW1000Ng left it after the first frame, only the length changes per frame
+    uint8_t mFrameControl[5];
+    boolean mHasFrameControl = false;
+    uint64_t mDelayedTime = 0;
+    // the receiver is on by itself after the frame that's going out
+    boolean mReceiveAfter = false;
+    uint16_t mTxAntennaDelay = 0;
+    // ppm, of the last frame read with its timestamp
+    float mCarrierOffset = NAN;
+    // dBm, same frame
+    float mReceivePower = NAN;
+
+    void writeControl(uint8_t low, uint8_t high);
+    // received can be nullptr
+    size_t readReceived(uint8_t *data, size_t maxLen, uint64_t *received);
+    uint64_t readTimestamp(uint8_t reg);
+};
@@ -0,0 +1,65 @@
+#include "dw1000spi.hpp"
+
+// first header byte
+#define HEADER_WRITE 0x80
+#define HEADER_SUB_INDEX 0x40
+// second header byte, a third one follows with the rest of a long offset
+#define HEADER_EXTENDED 0x80
+
+void DW1000Spi::begin(uint8_t ss)
+{
+    mSs = ss;
+    mSettings = SPISettings(DW1000_SPI_HZ, MSBFIRST, SPI_MODE0);
+}
+
+void DW1000Spi::beginBurst()
+{
+    mBurstStart = micros();
+    SPI.beginTransaction(mSettings);
+}
+
+void DW1000Spi::endBurst()
+{
+    SPI.endTransaction();
+    mBursts++;
+    mBusyUs += micros() - mBurstStart;
+}
+
+void DW1000Spi::select(bool write, uint8_t reg, uint16_t offset)
+{
+    uint8_t header[3];
+    size_t len = 1;
+    header[0] = (write ? HEADER_WRITE : 0) | (offset > 0 ? HEADER_SUB_INDEX : 0) | reg;
+    if (offset > 0)
+    {
+        header[1] = offset & 0x7F;
+        if (offset > 0x7F)
+        {
+            header[1] |= HEADER_EXTENDED;
+            header[2] = offset >> 7;
+            len = 3;
+        }
+        else
+        {
+            len = 2;
+        }
+    }
+    digitalWrite(mSs, LOW);
+    SPI.writeBytes(header, len);
+    mTransfers++;
+}
+
+void DW1000Spi::read(uint8_t reg, uint16_t offset, uint8_t *data, size_t len)
+{
+    this->select(false, reg, offset);
+    // nothing to send, the chip ignores what comes in while it talks
+    SPI.transferBytes(nullptr, data, len);
+    digitalWrite(mSs, HIGH);
+}
+
+void DW1000Spi::write(uint8_t reg, uint16_t offset, const uint8_t *data, size_t len)
+{
+    this->select(true, reg, offset);
+    SPI.writeBytes(data, len);
+    digitalWrite(mSs, HIGH);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <Arduino.h>
+#include <SPI.h>
+
+// the DW1000 takes up to 20 MHz once it runs off its PLL, lower it for long wires
+#ifndef DW1000_SPI_HZ
+#define DW1000_SPI_HZ 20000000
+#endif
+
+/**
+ * Register access for DW1000Radio's per-frame work, DW1000Ng still does init and configuration.
+ * Everything between beginBurst() and endBurst() is one SPI transaction: the bus is taken and clocked once,
+ * instead of DW1000Ng's transaction per access. Each register access drives CS low by hand, writes the header,
+ * then reads or writes the data and raises CS again. Counts the time spent so it can be put against the exchanges it served.
+ */
+class DW1000Spi
+{
+public:
+    // register files used per frame, see the DW1000 user manual
+    static const uint8_t SYS_TIME = 0x06;
+    static const uint8_t TX_FCTRL = 0x08;
+    static const uint8_t TX_BUFFER = 0x09;
+    static const uint8_t DX_TIME = 0x0A;
+    static const uint8_t SYS_CTRL = 0x0D;
+    static const uint8_t SYS_STATUS = 0x0F;
+    static const uint8_t RX_FINFO = 0x10;
+    static const uint8_t RX_BUFFER = 0x11;
+    static const uint8_t RX_FQUAL = 0x12;
+    static const uint8_t RX_TIME = 0x15;
+    static const uint8_t TX_TIME = 0x17;
+    static const uint8_t DRX_CONF = 0x27;
+
+    /**
+     * Only after DW1000Ng's init, the chip isn't on its PLL clock before that and can't take the fast clock.
+     */
+    void begin(uint8_t ss);
+
+    void beginBurst();
+    void endBurst();
+    // only inside a burst
+    void read(uint8_t reg, uint16_t offset, uint8_t *data, size_t len);
+    void write(uint8_t reg, uint16_t offset, const uint8_t *data, size_t len);
+
+    // running totals
+    uint32_t getBursts() { return mBursts; }
+    uint32_t getTransfers() { return mTransfers; }
+    uint32_t getBusyUs() { return mBusyUs; }
+
+private:
+    uint8_t mSs;
+    SPISettings mSettings;
+    uint32_t mBurstStart = 0;
+    uint32_t mBursts = 0;
+    uint32_t mTransfers = 0;
+    uint32_t mBusyUs = 0;
+
+    void select(bool write, uint8_t reg, uint16_t offset);
+};
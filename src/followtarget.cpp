@@ -0,0 +1,58 @@
+#include "followtarget.hpp"
+
+#include <math.h>
+
+FollowTarget::FollowTarget()
+{
+    mConfig = Config{0, 0.3f, 50, 0.1f};
+    mHasOwnPosition = false;
+    mOwnX = 0;
+    mOwnY = 0;
+}
+
+void FollowTarget::setOwnPosition(float x, float y)
+{
+    if (!mHasOwnPosition)
+    {
+        mOwnX = x;
+        mOwnY = y;
+        mHasOwnPosition = true;
+        return;
+    }
+    mOwnX += mConfig.ownSmoothing * (x - mOwnX);
+    mOwnY += mConfig.ownSmoothing * (y - mOwnY);
+}
+
+bool FollowTarget::update(float x, float y, float vx, float vy, float *angle)
+{
+    if (!mHasOwnPosition)
+    {
+        return false;
+    }
+
+    float lead = mConfig.leadTime / 1000.0f;
+    float dx = x + vx * lead - mOwnX;
+    float dy = y + vy * lead - mOwnY;
+    if (dx * dx + dy * dy < mConfig.minDistance * mConfig.minDistance)
+    {
+        return false;
+    }
+
+    float bearing = atan2f(dx, dy) * 180 / (float)M_PI - mConfig.angleOffset;
+    bearing = fmodf(bearing, 360);
+    if (bearing < 0)
+    {
+        bearing += 360;
+    }
+    *angle = bearing;
+    return true;
+}
+
+int32_t FollowTarget::fixLatency(uint64_t fixTime, uint64_t now)
+{
+    if (fixTime == 0 || now == 0 || now < fixTime || now - fixTime > INT32_MAX)
+    {
+        return -1;
+    }
+    return (int32_t)(now - fixTime);
+}
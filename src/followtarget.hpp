@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * USED BY THE MOTOR TAG ONLY
+ * Turns another tag's track into the angle that points the motor at it, on the motor tag itself rather than in node-red.
+ * Bearings are clockwise from the y axis, the same as the old calculateAngle node, and angleOffset is the bearing the
+ * motor's zero points along.
+ *
+ * The target is led by its velocity for leadTime, to cover the MQTT hop and the move itself. That's far shorter than
+ * the track's own look-ahead, which is sized for the old round trip through home assistant.
+ * The motor tag stands still, so its own fixes are averaged rather than followed.
+ *
+ * No Arduino dependencies, so it also builds on the host.
+ */
+class FollowTarget
+{
+public:
+    typedef struct
+    {
+        float angleOffset; // degrees
+        float minDistance; // m, closer than this and the bearing is mostly fix noise, the motor holds still
+        uint32_t leadTime; // ms
+        float ownSmoothing; // 0..1, weight of each new fix of our own position
+    } Config;
+
+    FollowTarget();
+
+    void setConfig(const Config &config) { mConfig = config; }
+    const Config &getConfig() { return mConfig; }
+    void setAngleOffset(float angleOffset) { mConfig.angleOffset = angleOffset; }
+
+    // a fix of the motor tag itself, m
+    void setOwnPosition(float x, float y);
+    bool hasOwnPosition() { return mHasOwnPosition; }
+
+    /**
+     * The target's position (m) and velocity (m/s) from its track. Sets angle (degrees, 0..360) and returns true
+     * if the motor should turn to it.
+     */
+    bool update(float x, float y, float vx, float vy, float *angle);
+
+    /**
+     * ms from the target tag solving a fix to the motor getting the angle for it. Both are ms since the epoch off each
+     * board's own SNTP clock, 0 while that clock isn't set. -1 if either isn't set, or if the two clocks are further
+     * apart than the latency and it comes out negative.
+     */
+    static int32_t fixLatency(uint64_t fixTime, uint64_t now);
+
+private:
+    Config mConfig;
+    bool mHasOwnPosition;
+    float mOwnX;
+    float mOwnY;
+};
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * A received frame as it came off the radio, with its RX timestamp taken at the same time
+ * so the receiver can be turned back on before the frame is looked at.
+ */
+typedef struct
+{
+    // 127 is the longest frame the DW1000 sends without extended frames
+    uint8_t data[128];
+    size_t length;
+    uint64_t received; // radio time
+    float carrierOffset; // ppm, see Radio::getCarrierOffset()
+    float rxPower;       // dBm, see Radio::getReceivePower()
+} Frame;
+
+/**
+ * Fixed pool of Frames, filled in place and handed out in the order they came in, so nothing is copied and
+ * nothing is allocated per frame. Frames that arrive while the pool is full are dropped and counted.
+ * Only one task may use it, it's the ranging task's own queue between reading the radio and parsing.
+ *
+ * No Arduino dependencies, so it also builds on the host.
+ */
+template <uint8_t Size>
+class FramePool
+{
+public:
+    FramePool() : mHead(0), mCount(0), mHighWaterMark(0), mDropped(0) {}
+
+    /**
+     * The next free frame to read into, nullptr (and a drop) if all are waiting to be parsed.
+     * It only joins the queue on commit(), so an unwanted frame is dropped by not committing it.
+     */
+    Frame *acquire()
+    {
+        if (mCount >= Size)
+        {
+            mDropped++;
+            return nullptr;
+        }
+        return &mFrames[(mHead + mCount) % Size];
+    }
+    void commit()
+    {
+        mCount++;
+        if (mCount > mHighWaterMark)
+        {
+            mHighWaterMark = mCount;
+        }
+    }
+
+    // oldest frame waiting to be parsed, nullptr if none
+    Frame *front() { return mCount == 0 ? nullptr : &mFrames[mHead]; }
+    // done with front()
+    void release()
+    {
+        mHead = (mHead + 1) % Size;
+        mCount--;
+    }
+
+    uint8_t size() { return mCount; }
+    static uint8_t capacity() { return Size; }
+    // most frames ever waiting at once
+    uint8_t getHighWaterMark() { return mHighWaterMark; }
+    uint32_t getDropped() { return mDropped; }
+
+private:
+    Frame mFrames[Size];
+    uint8_t mHead;
+    uint8_t mCount;
+    uint8_t mHighWaterMark;
+    uint32_t mDropped;
+};
+
+/**
+ * Blink frame read in place: [0] BLINK, [1] sequence, [2..9] sender eui, [10] flags, [11] specifier, then the payload.
+ * Every blink this firmware sends has the same header and tells them apart by the specifier, see DW1000 and tdoa.hpp.
+ */
+class BlinkView
+{
+public:
+    // same as DW1000Ng's BLINK
+    static const uint8_t FRAME_TYPE = 0xC5;
+    static const size_t HEADER_LENGTH = 12;
+
+    BlinkView(const uint8_t *data, size_t length) : mData(data), mLength(length) {}
+    explicit BlinkView(const Frame &frame) : mData(frame.data), mLength(frame.length) {}
+
+    bool isValid() const { return mLength >= HEADER_LENGTH && mData[0] == FRAME_TYPE; }
+    // a valid blink with this specifier and exactly payloadLength bytes after the header
+    bool is(uint8_t specifier, size_t payloadLength) const
+    {
+        return this->isValid() && mData[11] == specifier && mLength == HEADER_LENGTH + payloadLength;
+    }
+    // a valid blink with this specifier and at least one byte of payload
+    bool hasPayload(uint8_t specifier) const { return this->isValid() && mData[11] == specifier && mLength > HEADER_LENGTH; }
+
+    // only meaningful if isValid()
+    uint8_t getSequence() const { return mData[1]; }
+    const uint8_t *getEui() const { return &mData[2]; }
+    uint8_t getSpecifier() const { return mData[11]; }
+    const uint8_t *getPayload() const { return &mData[HEADER_LENGTH]; }
+    size_t getPayloadLength() const { return mLength - HEADER_LENGTH; }
+
+private:
+    const uint8_t *mData;
+    size_t mLength;
+};
@@ -1,8 +1,8 @@
 #include <PsychicMqttClient.h>
 #include <ArduinoJson.h>
 #include <esp_wifi.h>
-#include <DW1000Ng.hpp>
 #include "driver/temp_sensor.h"
+#include <sys/time.h>
 #include "Preferences.h"
 #include "motor.hpp"
 
@@ -10,6 +10,112 @@
 #include "secrets.h"
 #include "network.hpp"
 
+// settings echoed back to home assistant, every change matters and should survive a broker restart
+static const PublishPolicy::Config SETTING_POLICY = {1, true, 0, 0, 0};
+// periodic device state, the next one is never far behind
+static const PublishPolicy::Config DEVICE_STATE_POLICY = {0, false, 0, 0, 0};
+
+#ifdef DW1000_ANCHOR
+// every anchor listens here, so one button press starts them all
+#define CALIBRATION_COMMAND_TOPIC "dw1000/calibrate"
+#define CALIBRATION_RESULTS_TOPIC "dw1000/+/calibration"
+#define CALIBRATION_MEASURE_MS 5000
+// how long to wait for the other anchors' results after ours are out
+#define CALIBRATION_COLLECT_MS 3000
+#ifdef DW1000_TDOA
+// ms, often enough that the master has every anchor's arrivals well inside TdoaLocator::COLLECT_MS
+#define TDOA_BATCH_INTERVAL 100
+#define TDOA_TOPIC "dw1000/+/tdoa"
+
+static void toHex(const uint8_t *bytes, size_t length, char *str)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        snprintf(&str[i * 2], 3, "%02x", bytes[i]);
+    }
+    str[length * 2] = '\0';
+}
+
+// returns the number of bytes, 0 if it isn't hex or doesn't fit
+static size_t fromHex(const char *str, size_t length, uint8_t *bytes, size_t maxLength)
+{
+    if (length % 2 != 0 || length / 2 > maxLength)
+    {
+        return 0;
+    }
+    for (size_t i = 0; i < length / 2; i++)
+    {
+        char byteStr[3] = {str[i * 2], str[i * 2 + 1], '\0'};
+        char *end;
+        bytes[i] = strtoul(byteStr, &end, 16);
+        if (*end != '\0')
+        {
+            return 0;
+        }
+    }
+    return length / 2;
+}
+#endif
+
+static void formatEui(const uint8_t eui[8], char str[17])
+{
+    snprintf(str, 17, "%02x%02x%02x%02x%02x%02x%02x%02x", eui[0], eui[1], eui[2], eui[3], eui[4], eui[5], eui[6], eui[7]);
+}
+
+static bool parseEui(const char *str, uint8_t eui[8])
+{
+    if (str == nullptr || strlen(str) != 16)
+    {
+        return false;
+    }
+    for (uint8_t i = 0; i < 8; i++)
+    {
+        char byteStr[3] = {str[i * 2], str[i * 2 + 1], '\0'};
+        char *end;
+        eui[i] = strtoul(byteStr, &end, 16);
+        if (*end != '\0')
+        {
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+#if defined(DW1000_TAG) || defined(DW1000_TDOA_MASTER)
+// ms since the epoch off the SNTP clock, see Network::connect(). 0 until it has been set
+static uint64_t wallClockMs()
+{
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    // anything before 2020 is the clock still counting up from boot
+    if (now.tv_sec < 1577836800)
+    {
+        return 0;
+    }
+    return (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+// a millis() timestamp from earlier on the SNTP clock, 0 if it isn't set
+static uint64_t toWallClockMs(uint32_t timestamp)
+{
+    uint64_t now = wallClockMs();
+    return now == 0 ? 0 : now - (uint32_t)(millis() - timestamp);
+}
+
+// the track layout, shared by tags solving their own position and the TDOA master solving theirs.
+// t is when the fix was solved, ms since the epoch, so a follower can measure the whole way to its motor. 0 if our clock isn't set
+static int formatTrack(char *buffer, size_t size, float x, float y, float z, const PositionPredictor::Vector &velocity,
+                       const PositionPredictor::Vector &predicted, float predictionError, uint32_t lookAhead, uint64_t fixTime)
+{
+    return snprintf(buffer, size,
+                    "{\"x\":%.3f,\"y\":%.3f,\"z\":%.3f,\"vx\":%.3f,\"vy\":%.3f,\"vz\":%.3f,"
+                    "\"px\":%.3f,\"py\":%.3f,\"pz\":%.3f,\"error\":%.3f,\"lookahead\":%lu,\"t\":%llu}",
+                    x, y, z, velocity.x, velocity.y, velocity.z, predicted.x, predicted.y, predicted.z, predictionError,
+                    (unsigned long)lookAhead, (unsigned long long)fixTime);
+}
+#endif
+
 #ifdef MOTOR_TMC2209
 HomeAssistant::HomeAssistant(Preferences *preferences, DW1000 *dw1000, Motor* motor)
 #else
@@ -22,18 +128,75 @@ HomeAssistant::HomeAssistant(Preferences *preferences, DW1000 *dw1000)
     this->mMotor = motor;
     #endif
     this->mNextScheduledStateSend = 0;
+    this->mReportsSent = 0;
+    this->mReportBytes = 0;
+    this->mReportMicros = 0;
+    this->mStatePublishes = 0;
+    this->mStatePublishHeapBytes = 0;
+    this->mLargestFreeBlockAtConnect = 0;
+
+    // range data is stale within a few hundred ms, so no handshakes and no flooding the broker with noise
+    this->mSensorPolicy = {0, false, preferences->getFloat("pubDeadband", 0.01), preferences->getUInt("pubMinMs", 100), preferences->getUInt("pubMaxMs", 10000)};
+
+    // everything that goes into a topic is known now, so build them once rather than on every publish
+    uint8_t macAddr[6];
+    esp_wifi_get_mac(WIFI_IF_STA, macAddr);
+    snprintf(this->mMacAddrStr, sizeof(this->mMacAddrStr), "%02x%02x%02x%02x%02x%02x", macAddr[0], macAddr[1], macAddr[2], macAddr[3], macAddr[4], macAddr[5]);
+#ifdef DW1000_TAG
+    snprintf(this->mDeviceName, sizeof(this->mDeviceName), "dw1000-tag-%s", this->mMacAddrStr);
+#else
+    snprintf(this->mDeviceName, sizeof(this->mDeviceName), "dw1000-anchor-%s", this->mMacAddrStr);
+#endif
+    snprintf(this->mOverallStateTopic, TOPIC_LENGTH, "homeassistant/sensor/%s/state", this->mDeviceName);
+    this->mEntityCount = 0;
+#ifdef TELEMETRY_BATCHED
+    this->mTelemetry.setAnchorMac(macAddr);
+    snprintf(this->mTelemetryTopic, TOPIC_LENGTH, "dw1000/%s/ranges", this->mDeviceName);
+    this->mTelemetryInterval = preferences->getUInt("telemetryMs", 1000);
+    this->mNextTelemetryFlush = 0;
+#endif
+#ifdef DW1000_TAG
+    snprintf(this->mTrackTopic, TOPIC_LENGTH, "dw1000/%s/track", this->mDeviceName);
+#ifdef MOTOR_TMC2209
+    this->mFollow.setConfig({preferences->getFloat("angleOffset", 0), preferences->getFloat("followMinDistance", 0.3),
+                             preferences->getUInt("followLeadMs", 50), 0.1f});
+    String followTag = preferences->getString("followTag", "");
+    if (followTag.length() > 0)
+    {
+        snprintf(this->mFollowTopic, TOPIC_LENGTH, "dw1000/%s/track", followTag.c_str());
+    }
+    else
+    {
+        this->mFollowTopic[0] = '\0';
+    }
+    this->mFollowAngle = 0;
+    this->mFollowAngleUpdated = false;
+    this->mLastTrack = 0;
+    this->mUnsyncedTracks = 0;
+#endif
+#endif
+#ifdef DW1000_ANCHOR
+    this->mCalibrationState = CALIBRATION_IDLE;
+    this->mCalibrationDeadline = 0;
+    snprintf(this->mCalibrationTopic, TOPIC_LENGTH, "dw1000/%s/calibration", this->mDeviceName);
+#ifdef DW1000_TDOA
+    this->mTdoaCount = 0;
+    this->mNextTdoaFlush = 0;
+    snprintf(this->mTdoaTopic, TOPIC_LENGTH, "dw1000/%s/tdoa", this->mDeviceName);
+    this->mTdoaPosition = {preferences->getFloat("x", NAN), preferences->getFloat("y", NAN), preferences->getFloat("z", NAN)};
+#ifdef DW1000_TDOA_MASTER
+    // same settings as a tag's own predictor
+    this->mTdoaPredictorConfig = {preferences->getFloat("fixNoise", 0.15), preferences->getFloat("fixAccel", 2.0), 2000,
+                                  preferences->getUInt("lookAheadMs", 300)};
+#endif
+#endif
+#endif
 
     // legacy esp32 temp sensor
     temp_sensor_config_t temp_sensor = TSENS_CONFIG_DEFAULT();
     temp_sensor.dac_offset = TSENS_DAC_L2; // TSENS_DAC_L2 is default; L4(-40°C ~ 20°C), L2(-10°C ~ 80°C), L1(20°C ~ 100°C), L0(50°C ~ 125°C)
     temp_sensor_set_config(temp_sensor);
     temp_sensor_start();
-
-    // zero out tags
-    for (int i = 0; i < 8; i++)
-    {
-        this->mTagDistances[i].distance = -1;
-    }
 }
 boolean HomeAssistant::connect()
 {
@@ -66,6 +229,11 @@ boolean HomeAssistant::connect()
     this->sendAnchorCoordinateDiscovery("x");
     this->sendAnchorCoordinateDiscovery("y");
     this->sendAnchorCoordinateDiscovery("z");
+    this->sendCalibrationDiscovery();
+#ifdef DW1000_TDOA_MASTER
+    // a late batch is only good for the solve it missed, QoS 0 like they're published
+    this->mMqttClient.subscribe(TDOA_TOPIC, 0);
+#endif
 #endif
 
 // tags get sensor for x/y/z to make it easier to set
@@ -85,6 +253,16 @@ boolean HomeAssistant::connect()
         doc["max"] = 100,
         doc["step"] = 0.1;
     });
+#ifdef IMU_FUSION
+    if (this->mImu != nullptr)
+    {
+        this->sendNumericStateDiscovery("heading", "sensor", "", "°", macAddr, [](JsonDocument &doc) {
+            doc["min"] = -180,
+            doc["max"] = 180,
+            doc["step"] = 0.1;
+        });
+    }
+#endif
 #endif
 
 #ifdef MOTOR_TMC2209
@@ -106,6 +284,14 @@ boolean HomeAssistant::connect()
         doc["max"] = 360,
         doc["step"] = 0.1;
     });
+#ifdef DW1000_TAG
+    if (this->mFollowTopic[0] != '\0')
+    {
+        // stale tracks are useless, QoS 0 like they're published
+        this->mMqttClient.subscribe(this->mFollowTopic, 0);
+        debugV("MQTT: following %s", this->mFollowTopic);
+    }
+#endif
 #endif
 
     this->mMqttClient.onMessage([&](char *topic, char *payload, int retain, int qos, bool dup)
@@ -114,36 +300,77 @@ boolean HomeAssistant::connect()
         String topicStr = String(topic);
         String payloadStr = String(payload);
         debugV("MQTT: received message on topic %s, payload: %s", topicStr.c_str(), payloadStr.c_str());
+        #ifdef DW1000_ANCHOR
+        // calibration topics don't end in /set
+        if(topicStr == CALIBRATION_COMMAND_TOPIC) {
+            this->startCalibration();
+            return;
+        } else if(topicStr.startsWith("dw1000/") && topicStr.endsWith("/calibration")) {
+            this->receiveCalibration(payload, strlen(payload));
+            return;
+        }
+        #ifdef DW1000_TDOA_MASTER
+        if(topicStr.startsWith("dw1000/") && topicStr.endsWith("/tdoa")) {
+            this->receiveTdoa(payload, strlen(payload));
+            return;
+        }
+        #endif
+        #endif
+        #if defined(DW1000_TAG) && defined(MOTOR_TMC2209)
+        if(this->mFollowTopic[0] != '\0' && topicStr == this->mFollowTopic) {
+            this->receiveTrack(payload, strlen(payload));
+            return;
+        }
+        #endif
         // remove /set from the end of topic
         topicStr.remove(topicStr.length() - 4);
         if(topicStr.endsWith("-x")) {
             this->sendNumericState("x", "number", atof(payload));
+            this->setCoordinate("x", atof(payload));
             debugV("MQTT: Set x to %f", atof(payload));
         } else if(topicStr.endsWith("-y")) {
             this->sendNumericState("y", "number", atof(payload));
+            this->setCoordinate("y", atof(payload));
             debugV("MQTT: Set y to %f", atof(payload));
         } else if(topicStr.endsWith("-z")) {
             this->sendNumericState("z", "number", atof(payload));
+            this->setCoordinate("z", atof(payload));
             debugV("MQTT: Set z to %f", atof(payload));
         } else if(topicStr.endsWith("-antennaDelay")) {
             int antennaDelay = atoi(payload);
             this->mPreferences->putInt("antennaDelay", antennaDelay);
-            DW1000Ng::setAntennaDelay(antennaDelay);
+            // the ranging task owns SPI, it picks this up on its next pass
+            this->mDw1000->setAntennaDelay(antennaDelay);
             this->sendNumericState("antennaDelay", "number", antennaDelay);
             debugV("MQTT: Set antenna delay to %d", antennaDelay);
         } else if(topicStr.endsWith("-angle")) {
             this->sendNumericState("angle", "number", atof(payload));
             debugV("MQTT: Set angle to %f", atof(payload));
+            #if defined(DW1000_TAG) && defined(MOTOR_TMC2209)
+            if(this->mFollowTopic[0] != '\0') {
+                debugV("MQTT: following a tag, ignoring the angle");
+                return;
+            }
+            #endif
             #ifdef MOTOR_TMC2209
             this->mMotor->update(atof(payload));
             #endif
         } else if(topicStr.endsWith("-angleOffset")) {
             this->sendNumericState("angleOffset", "number", atof(payload));
             debugV("MQTT: Set angle offset to %f", atof(payload));
+            #if defined(DW1000_TAG) && defined(MOTOR_TMC2209)
+            this->mPreferences->putFloat("angleOffset", atof(payload));
+            portENTER_CRITICAL(&this->mFollowLock);
+            this->mFollow.setAngleOffset(atof(payload));
+            portEXIT_CRITICAL(&this->mFollowLock);
+            #endif
         } else {
             debugV("MQTT: received message on unknown topic %s", topicStr.c_str());
         } });
 
+    // discovery is done, from here on publishing shouldn't eat into the heap
+    this->mLargestFreeBlockAtConnect = ESP.getMaxAllocHeap();
+
     return true;
 }
 
@@ -162,47 +389,296 @@ void HomeAssistant::handle()
         this->mNextScheduledStateSend = millis() + 10000;
     }
 
-// device ranging state sent every loop
+// device ranging state sent as it comes in from the ranging task
 #ifdef DW1000_ANCHOR
-    uint8_t knownTagCount = this->mDw1000->getKnownTagCount();
-    for (uint8_t i = 0; i < knownTagCount; i++)
+    DW1000::TagDistance tagDistance;
+    while (this->mDw1000->getResults().pop(tagDistance))
     {
-        DW1000::TagDistance *tagDistance = this->mDw1000->getKnownTag(i);
-
+#ifdef TELEMETRY_BATCHED
+        // everything goes out in the next batch, home assistant discovery is skipped in this mode
+        TelemetryBatch::Record record;
+        memcpy(record.tagEui, tagDistance.eui, 8);
+        record.distance = tagDistance.distance;
+        record.variance = tagDistance.variance;
+        record.timestamp = tagDistance.timestamp;
+        record.rxPower = tagDistance.rxPower;
+        record.sequence = tagDistance.sequence;
+        if (this->mTelemetry.isFull())
+        {
+            this->flushTelemetry();
+        }
+        this->mTelemetry.add(record);
+        continue;
+#endif
         // if we haven't sent a discovery message for this tag yet, do so
-        if (this->mTagDistances[i].distance == -1)
+        bool created;
+        TagTopic *tagTopic = this->mTagTopics.insert(tagDistance.eui, millis(), &created);
+        if (created)
         {
-            this->sendTagDiscovery(tagDistance->eui);
-            this->mTagDistances[i] = *tagDistance;
+            tagTopic->policy = PublishPolicy(this->mSensorPolicy);
+            this->sendTagDiscovery(tagDistance.eui, tagTopic);
         }
 
-        // if distance hasn't changed, don't send
-        if (abs(this->mTagDistances[i].distance - tagDistance->distance) > 0.01)
+        // make sure we're not sending garbage
+        if (tagDistance.distance > 0.1 && tagDistance.distance < 100)
         {
-            // make sure we're not sending garbage
-            if (tagDistance->distance > 0.1 && tagDistance->distance < 100)
-            {
-                debugV("MQTT: sending distance to tag %02x%02x%02x%02x%02x%02x%02x%02x: %f", tagDistance->eui[0], tagDistance->eui[1], tagDistance->eui[2], tagDistance->eui[3], tagDistance->eui[4], tagDistance->eui[5], tagDistance->eui[6], tagDistance->eui[7], tagDistance->distance);
-
-                this->sendTagDistanceToAnchorEUI(tagDistance->distance, tagDistance->eui);
-                // store tag distance
-                this->mTagDistances[i] = *tagDistance;
-            }
+            tagTopic->policy.update(tagDistance.distance);
+            tagTopic->variance = tagDistance.variance;
+        }
+    }
+
+    // the policy decides what actually goes out, a burst of ranges to one tag becomes a single publish
+    for (uint16_t i = 0; i < this->mTagTopics.capacity(); i++)
+    {
+        float distance;
+        if (this->mTagTopics.isUsed(i) && this->mTagTopics.get(i).policy.poll(millis(), distance))
+        {
+            const uint8_t *eui = this->mTagTopics.getEui(i);
+            debugV("MQTT: sending distance to tag %02x%02x%02x%02x%02x%02x%02x%02x: %f", eui[0], eui[1], eui[2], eui[3], eui[4], eui[5], eui[6], eui[7], distance);
+            this->sendTagDistanceToAnchorEUI(distance, &this->mTagTopics.get(i));
+        }
+    }
+#ifdef TELEMETRY_BATCHED
+    if (millis() >= this->mNextTelemetryFlush)
+    {
+        if (this->mTelemetry.getCount() > 0)
+        {
+            this->flushTelemetry();
+        }
+        this->mNextTelemetryFlush = millis() + this->mTelemetryInterval;
+    }
+#endif
+
+    portENTER_CRITICAL(&this->mCalibrationLock);
+    CalibrationState calibrationState = this->mCalibrationState;
+    portEXIT_CRITICAL(&this->mCalibrationLock);
+    if (calibrationState == CALIBRATION_MEASURING && !this->mDw1000->isCalibrating())
+    {
+        this->publishCalibration();
+    }
+    else if (calibrationState == CALIBRATION_COLLECTING && millis() >= this->mCalibrationDeadline)
+    {
+        this->finishCalibration();
+    }
+
+#ifdef DW1000_TDOA
+    Tdoa::Arrival arrival;
+    while (this->mDw1000->getTdoaArrivals().pop(arrival))
+    {
+        if (this->mTdoaCount >= Tdoa::MAX_RECORDS)
+        {
+            this->flushTdoa();
+        }
+        this->mTdoaBatch[this->mTdoaCount++] = arrival;
+    }
+    if (millis() >= this->mNextTdoaFlush)
+    {
+        if (this->mTdoaCount > 0)
+        {
+            this->flushTdoa();
+        }
+        this->mNextTdoaFlush = millis() + TDOA_BATCH_INTERVAL;
+    }
+#ifdef DW1000_TDOA_MASTER
+    this->handleTdoaFixes();
+#endif
+#endif
+#elif defined(DW1000_TAG)
+    // position is solved on the tag itself now, just forward it
+    DW1000::Fix fix;
+    boolean positionUpdated = false;
+    while (this->mDw1000->getResults().pop(fix))
+    {
+        // only the newest fix is worth sending
+        positionUpdated = true;
+    }
+    if (positionUpdated)
+    {
+        this->sendNumericState("x", "sensor", fix.position.x);
+        this->sendNumericState("y", "sensor", fix.position.y);
+        this->sendNumericState("z", "sensor", fix.position.z);
+        this->sendTrack(fix);
+#ifdef MOTOR_TMC2209
+        portENTER_CRITICAL(&this->mFollowLock);
+        this->mFollow.setOwnPosition(fix.position.x, fix.position.y);
+        portEXIT_CRITICAL(&this->mFollowLock);
+#endif
+    }
+#ifdef MOTOR_TMC2209
+    portENTER_CRITICAL(&this->mFollowLock);
+    bool angleUpdated = this->mFollowAngleUpdated;
+    float angle = this->mFollowAngle;
+    this->mFollowAngleUpdated = false;
+    portEXIT_CRITICAL(&this->mFollowLock);
+    if (angleUpdated)
+    {
+        // home assistant sees where the motor is headed, the policy keeps this from flooding it
+        this->sendNumericState("angle", "sensor", angle);
+    }
+#endif
+#ifdef IMU_FUSION
+    // the IMU runs far faster than this, the policy's deadband and rate limit decide what goes out
+    if (this->mImu != nullptr)
+    {
+        Imu::State imuState = this->mImu->getState();
+        if (imuState.valid)
+        {
+            this->sendNumericState("heading", "sensor", imuState.heading);
         }
     }
 #endif
+#endif
+
+    // values held back by their policy, and heartbeats
+    for (uint8_t i = 0; i < this->mEntityCount; i++)
+    {
+        this->publishEntity(&this->mEntityTopics[i], millis());
+    }
 }
 
-String HomeAssistant::getDeviceName()
+void HomeAssistant::printStats()
 {
-    // get mac address for device name
-    uint8_t macAddr[6];
-    esp_wifi_get_mac(WIFI_IF_STA, macAddr);
+    if (this->mReportsSent == 0)
+    {
+        Debug.printf("telemetry no range reports sent yet\n");
+    }
+    else
+    {
+        Debug.printf("telemetry %lu range reports, %lu bytes/report, %lu us/report serialising\n", (unsigned long)this->mReportsSent,
+                     (unsigned long)(this->mReportBytes / this->mReportsSent), (unsigned long)(this->mReportMicros / this->mReportsSent));
+    }
+
+    // a growing gap between these two is fragmentation
+    Debug.printf("heap     free %lu, min free %lu, largest block %lu (was %lu after connect)\n", (unsigned long)ESP.getFreeHeap(),
+                 (unsigned long)ESP.getMinFreeHeap(), (unsigned long)ESP.getMaxAllocHeap(), (unsigned long)this->mLargestFreeBlockAtConnect);
+    uint32_t updates = 0;
+    uint32_t publishes = 0;
+    for (uint8_t i = 0; i < this->mEntityCount; i++)
+    {
+        updates += this->mEntityTopics[i].policy.getUpdates();
+        publishes += this->mEntityTopics[i].policy.getPublishes();
+    }
+    // tags that have been dropped from the table don't count any more
+    for (uint16_t i = 0; i < this->mTagTopics.capacity(); i++)
+    {
+        if (this->mTagTopics.isUsed(i))
+        {
+            updates += this->mTagTopics.get(i).policy.getUpdates();
+            publishes += this->mTagTopics.get(i).policy.getPublishes();
+        }
+    }
+    Debug.printf("publish  %lu values offered, %lu published, the rest coalesced or inside the deadband\n", (unsigned long)updates, (unsigned long)publishes);
+
+    if (this->mStatePublishes > 0)
+    {
+        Debug.printf("heap     %lu state publishes, %ld bytes held per publish\n", (unsigned long)this->mStatePublishes,
+                     (long)(this->mStatePublishHeapBytes / (int32_t)this->mStatePublishes));
+    }
+#ifdef DW1000_TDOA_MASTER
+    const TdoaLocator<DW1000::MAX_ANCHORS, DW1000_TDOA_MAX_TAGS>::Stats &tdoa = this->mTdoaLocator.getStats();
+    Debug.printf("tdoa     %lu blinks, %lu solved, %lu too few anchors, %lu failed, %lu overrun, %lu inbox drops; solve p50 %lu us, max %lu us\n",
+                 (unsigned long)tdoa.blinks, (unsigned long)tdoa.solved, (unsigned long)tdoa.tooFewAnchors, (unsigned long)tdoa.failed,
+                 (unsigned long)tdoa.overrun, (unsigned long)this->mTdoaInbox.getDropped(), (unsigned long)this->mTdoaSolveTimes.percentile(0.5f),
+                 (unsigned long)this->mTdoaSolveTimes.getMax());
+    this->mTdoaSolveTimes.reset();
+#endif
+#if defined(DW1000_TAG) && defined(MOTOR_TMC2209)
+    if (this->mFollowTopic[0] != '\0')
+    {
+        // receiveTrack() adds to these from the MQTT client's task, so read and reset them under its lock and print afterwards
+        portENTER_CRITICAL(&this->mFollowLock);
+        uint32_t tracks = this->mFollowTimes.getCount();
+        uint32_t intervalP50 = this->mTrackIntervals.percentile(0.5f);
+        uint32_t intervalP99 = this->mTrackIntervals.percentile(0.99f);
+        uint32_t followP50 = this->mFollowTimes.percentile(0.5f);
+        uint32_t followP99 = this->mFollowTimes.percentile(0.99f);
+        uint32_t followMax = this->mFollowTimes.getMax();
+        uint32_t motorP50 = this->mFixToMotor.percentile(0.5f);
+        uint32_t motorP99 = this->mFixToMotor.percentile(0.99f);
+        uint32_t motorMax = this->mFixToMotor.getMax();
+        uint32_t turns = this->mFixToMotor.getCount();
+        uint32_t unsynced = this->mUnsyncedTracks;
+        this->mFollowTimes.reset();
+        this->mTrackIntervals.reset();
+        this->mFixToMotor.reset();
+        this->mUnsyncedTracks = 0;
+        portEXIT_CRITICAL(&this->mFollowLock);
+
+        Debug.printf("follow   %lu tracks, every p50 %lu ms, p99 %lu ms; track to motor p50 %lu us, p99 %lu us, max %lu us\n",
+                     (unsigned long)tracks, (unsigned long)intervalP50, (unsigned long)intervalP99, (unsigned long)followP50,
+                     (unsigned long)followP99, (unsigned long)followMax);
+        Debug.printf("follow   fix to motor p50 %lu ms, p99 %lu ms, max %lu ms over %lu turns, %lu more without synced clocks\n",
+                     (unsigned long)motorP50, (unsigned long)motorP99, (unsigned long)motorMax, (unsigned long)turns,
+                     (unsigned long)unsynced);
+    }
+#endif
+}
+
+HomeAssistant::EntityTopic *HomeAssistant::getEntity(const char *name, const char *deviceType)
+{
+    for (uint8_t i = 0; i < this->mEntityCount; i++)
+    {
+        if (strcmp(this->mEntityTopics[i].name, name) == 0 && strcmp(this->mEntityTopics[i].deviceType, deviceType) == 0)
+        {
+            return &this->mEntityTopics[i];
+        }
+    }
+
+    if (this->mEntityCount >= MAX_ENTITIES)
+    {
+        debugE("No room to cache topic for %s %s", deviceType, name);
+        return nullptr;
+    }
+    // only counted once it's filled in, handle() walks the table
+    EntityTopic *entity = &this->mEntityTopics[this->mEntityCount];
+    strlcpy(entity->name, name, sizeof(entity->name));
+    strlcpy(entity->deviceType, deviceType, sizeof(entity->deviceType));
+    snprintf(entity->stateTopic, TOPIC_LENGTH, "homeassistant/%s/%s-%s/state", deviceType, this->mDeviceName, name);
+    entity->policy = PublishPolicy(strcmp(deviceType, "sensor") == 0 ? this->mSensorPolicy : SETTING_POLICY);
+    this->mEntityCount++;
+    return entity;
+}
+
+void HomeAssistant::publishEntity(EntityTopic *entity, uint32_t now)
+{
+    float value;
+    portENTER_CRITICAL(&this->mPolicyLock);
+    boolean publish = entity->policy.poll(now, value);
+    portEXIT_CRITICAL(&this->mPolicyLock);
+    if (!publish)
+    {
+        return;
+    }
+
+    // simple enough that JsonDocument (and its heap pool) isn't needed
+    char buffer[64];
+    int n = snprintf(buffer, sizeof(buffer), "{\"%s\":%g}", entity->name, value);
+
+    debugV("MQTT: state %s %s", entity->stateTopic, buffer);
+
+    this->publishState(entity->stateTopic, buffer, n, entity->policy.getConfig());
+}
 
+void HomeAssistant::publishState(const char *topic, const char *payload, size_t length, const PublishPolicy::Config &policy)
+{
+    uint32_t freeBefore = ESP.getFreeHeap();
+    this->mMqttClient.publish(topic, policy.qos, policy.retain, payload, length);
+    // anything still held is the MQTT client's outbox, our side of the publish doesn't allocate
+    this->mStatePublishHeapBytes += (int32_t)(freeBefore - ESP.getFreeHeap());
+    this->mStatePublishes++;
+}
+
+void HomeAssistant::setCoordinate(const char *axis, float value)
+{
 #ifdef DW1000_ANCHOR
-    return this->getDeviceName(macAddr, false);
-#elif defined(DW1000_TAG)
-    return this->getDeviceName(macAddr, true);
+    // anchors keep their coordinates so they survive a reboot and can be handed to tags in range reports
+    this->mPreferences->putFloat(axis, value);
+    this->mDw1000->setPosition(this->mPreferences->getFloat("x", NAN), this->mPreferences->getFloat("y", NAN), this->mPreferences->getFloat("z", NAN));
+#ifdef DW1000_TDOA
+    portENTER_CRITICAL(&this->mTdoaLock);
+    this->mTdoaPosition = {this->mPreferences->getFloat("x", NAN), this->mPreferences->getFloat("y", NAN), this->mPreferences->getFloat("z", NAN)};
+    portEXIT_CRITICAL(&this->mTdoaLock);
+#endif
 #endif
 }
 
@@ -262,13 +738,9 @@ void HomeAssistant::sendOverallDiscovery()
     this->mMqttClient.publish(discoveryTopic.c_str(), 2, true, buffer, n);
 }
 
-void HomeAssistant::sendTagDiscovery(byte tag_eui[])
+void HomeAssistant::sendTagDiscovery(byte tag_eui[], TagTopic *tagTopic)
 {
-    uint8_t macAddr[6];
-    esp_wifi_get_mac(WIFI_IF_STA, macAddr);
-    // convert to string
-    char macAddrStr[20];
-    sprintf(macAddrStr, "%02x%02x%02x%02x%02x%02x\0", macAddr[0], macAddr[1], macAddr[2], macAddr[3], macAddr[4], macAddr[5]);
+    const char *macAddrStr = this->mMacAddrStr;
 
     byte tagMacAddr[6];
     for (int i = 0; i < 6; i++)
@@ -292,7 +764,10 @@ void HomeAssistant::sendTagDiscovery(byte tag_eui[])
     doc["unit_of_measurement"] = "m";
     doc["value_template"] = "{{ value_json.distance }}";
     doc["unique_id"] = "dwD-" + tagDeviceName + '-' + macAddrStr;
-    doc["state_topic"] = "homeassistant/sensor/" + tagDeviceName + "-" + macAddrStr + "/state";
+    snprintf(tagTopic->stateTopic, TOPIC_LENGTH, "homeassistant/sensor/%s-%s/state", tagDeviceName.c_str(), macAddrStr);
+    doc["state_topic"] = tagTopic->stateTopic;
+    // variance shows up as an attribute of the distance
+    doc["json_attributes_topic"] = tagTopic->stateTopic;
     JsonObject dev = doc["dev"].to<JsonObject>();
     JsonArray ids = dev["ids"].to<JsonArray>();
     ids.add(tagMacAddrStr);
@@ -334,7 +809,7 @@ void HomeAssistant::addCommonDiscovery(JsonDocument &doc, byte macAddr[], boolea
 
 // send the anchor discovery message for x/y/z coordinates to HomeAssistant
 // this mainly lets home assistant set coordinates for the anchor, we don't actually use this in the code
-void HomeAssistant::sendAnchorCoordinateDiscovery(String axis)
+void HomeAssistant::sendAnchorCoordinateDiscovery(const char *axis)
 {
     uint8_t macAddr[6];
     esp_wifi_get_mac(WIFI_IF_STA, macAddr);
@@ -346,7 +821,7 @@ void HomeAssistant::sendAnchorCoordinateDiscovery(String axis)
     });
 }
 
-void HomeAssistant::sendNumericStateDiscovery(String name, String deviceType, String deviceClass, String unitOfMeasurement, byte macAddr[],
+void HomeAssistant::sendNumericStateDiscovery(const char *name, const char *deviceType, String deviceClass, String unitOfMeasurement, byte macAddr[],
                                               std::function<void(JsonDocument &)> customCallback = nullptr )
 {
     // convert to string
@@ -355,7 +830,7 @@ void HomeAssistant::sendNumericStateDiscovery(String name, String deviceType, St
 
     String deviceName = this->getDeviceName();
 
-    String baseTopic = "homeassistant/" + deviceType + "/" + deviceName + "-" + name;
+    String baseTopic = "homeassistant/" + String(deviceType) + "/" + deviceName + "-" + name;
 
     String discoveryTopic = baseTopic + "/config";
 
@@ -371,8 +846,12 @@ void HomeAssistant::sendNumericStateDiscovery(String name, String deviceType, St
     {
         doc["unit_of_measurement"] = unitOfMeasurement;
     }
-    doc["value_template"] = "{{ value_json." + name + " }}";
-    doc["state_topic"] = baseTopic + "/state";
+    doc["value_template"] = "{{ value_json." + String(name) + " }}";
+    EntityTopic *entity = this->getEntity(name, deviceType);
+    if (entity != nullptr)
+    {
+        doc["state_topic"] = entity->stateTopic;
+    }
     doc["command_topic"] = baseTopic + "/set";
     customCallback(doc);
     /*doc["min"] = 0;
@@ -390,75 +869,375 @@ void HomeAssistant::sendNumericStateDiscovery(String name, String deviceType, St
     this->mMqttClient.subscribe((baseTopic + "/set").c_str(), 2);
 }
 
-void HomeAssistant::sendNumericState(String axis, String deviceType, float value)
+void HomeAssistant::sendNumericState(const char *name, const char *deviceType, float value)
 {
-    String stateTopic = "homeassistant/" + deviceType + "/" + this->getDeviceName() + "-" + axis + "/state";
-    JsonDocument doc;
-
-    doc[axis] = value;
+    EntityTopic *entity = this->getEntity(name, deviceType);
+    if (entity == nullptr)
+    {
+        return;
+    }
 
-    char buffer[128];
+    portENTER_CRITICAL(&this->mPolicyLock);
+    entity->policy.update(value);
+    portEXIT_CRITICAL(&this->mPolicyLock);
+    this->publishEntity(entity, millis());
+}
 
-    size_t n = serializeJson(doc, buffer);
+#ifdef DW1000_TAG
+void HomeAssistant::sendTrack(const DW1000::Fix &fix)
+{
+    char buffer[256];
+    int n = formatTrack(buffer, sizeof(buffer), fix.position.x, fix.position.y, fix.position.z, fix.velocity, fix.predicted,
+                        fix.predictionError, fix.lookAhead, toWallClockMs(fix.timestamp));
+#ifdef IMU_FUSION
+    if (this->mImu != nullptr && this->mImu->getState().valid && n < (int)sizeof(buffer))
+    {
+        // replaces the closing brace
+        n--;
+        n += snprintf(buffer + n, sizeof(buffer) - n, ",\"heading\":%.1f}", this->mImu->getState().heading);
+    }
+#endif
+    // a stale track is worse than none, no handshakes and nothing retained
+    this->publishState(this->mTrackTopic, buffer, n, DEVICE_STATE_POLICY);
+}
+#endif
 
-    Serial.println("Sending state message");
-    Serial.println(stateTopic);
-    Serial.println(buffer);
+#if defined(DW1000_TAG) && defined(MOTOR_TMC2209)
+void HomeAssistant::receiveTrack(const char *payload, size_t length)
+{
+    uint32_t start = micros();
+    JsonDocument doc;
+    if (deserializeJson(doc, payload, length))
+    {
+        debugE("MQTT: bad track message");
+        return;
+    }
 
-    bool success = this->mMqttClient.publish(stateTopic.c_str(), 2, false, buffer, n);
+    float angle;
+    uint32_t now = millis();
+    portENTER_CRITICAL(&this->mFollowLock);
+    bool turn = this->mFollow.update(doc["x"].as<float>(), doc["y"].as<float>(), doc["vx"].as<float>(), doc["vy"].as<float>(), &angle);
+    if (turn)
+    {
+        this->mFollowAngle = angle;
+        this->mFollowAngleUpdated = true;
+    }
+    portEXIT_CRITICAL(&this->mFollowLock);
+    int32_t latency = 0;
+    if (turn)
+    {
+        this->mMotor->update(angle);
+        // the whole way from the target solving its fix, the MQTT hop included
+        latency = FollowTarget::fixLatency(doc["t"].as<uint64_t>(), wallClockMs());
+    }
 
-    // store value in flash
+    // printStats() reads and resets the histograms from the network task
+    uint32_t elapsed = micros() - start;
+    portENTER_CRITICAL(&this->mFollowLock);
+    if (turn && latency >= 0)
+    {
+        this->mFixToMotor.add(latency);
+    }
+    else if (turn)
+    {
+        // one of the clocks isn't set
+        this->mUnsyncedTracks++;
+    }
+    if (this->mLastTrack != 0)
+    {
+        this->mTrackIntervals.add(now - this->mLastTrack);
+    }
+    this->mLastTrack = now;
+    this->mFollowTimes.add(elapsed);
+    portEXIT_CRITICAL(&this->mFollowLock);
 }
+#endif
 
-void HomeAssistant::sendTagDistanceToAnchorEUI(float distance, byte tag_eui[])
+#ifdef DW1000_ANCHOR
+void HomeAssistant::sendCalibrationDiscovery()
 {
-    // since adding an attribute to a device isn't enforced that it is sent actually BY the device,
-    // we can spoof it and send it from the anchor, since it knows the distance
-    // this saves power and time on the tag
     uint8_t macAddr[6];
     esp_wifi_get_mac(WIFI_IF_STA, macAddr);
-    // convert to string
     char macAddrStr[20];
     sprintf(macAddrStr, "%02x%02x%02x%02x%02x%02x\0", macAddr[0], macAddr[1], macAddr[2], macAddr[3], macAddr[4], macAddr[5]);
 
-    byte tagMacAddr[6];
-    for (int i = 0; i < 6; i++)
+    String deviceName = this->getDeviceName();
+    String discoveryTopic = "homeassistant/button/" + deviceName + "-calibrate/config";
+
+    JsonDocument doc;
+    char buffer[512];
+
+    doc["name"] = "calibrate";
+    doc["command_topic"] = CALIBRATION_COMMAND_TOPIC;
+    doc["unique_id"] = String("dwcalibrate-") + deviceName;
+    JsonObject dev = doc["dev"].to<JsonObject>();
+    JsonArray ids = dev["ids"].to<JsonArray>();
+    ids.add(macAddrStr);
+
+    size_t n = serializeJson(doc, buffer);
+
+    this->mMqttClient.publish(discoveryTopic.c_str(), 2, true, buffer, n);
+    this->mMqttClient.subscribe(CALIBRATION_COMMAND_TOPIC, 2);
+    this->mMqttClient.subscribe(CALIBRATION_RESULTS_TOPIC, 1);
+}
+
+void HomeAssistant::startCalibration()
+{
+    portENTER_CRITICAL(&this->mCalibrationLock);
+    if (this->mCalibrationState != CALIBRATION_IDLE)
     {
-        tagMacAddr[i] = tag_eui[5 - i];
+        portEXIT_CRITICAL(&this->mCalibrationLock);
+        debugV("MQTT: calibration already running");
+        return;
     }
-    // char tagMacAddrStr[20];
-    // sprintf(tagMacAddrStr, "%02x%02x%02x%02x%02x%02x\0", tagMacAddr[0], tagMacAddr[1], tagMacAddr[2], tagMacAddr[3], tagMacAddr[4], tagMacAddr[5]);
+    this->mCalibration.reset();
+    this->mCalibrationState = CALIBRATION_MEASURING;
+    portEXIT_CRITICAL(&this->mCalibrationLock);
 
-    String tagDeviceName = this->getDeviceName(tagMacAddr, true);
+    // an anchor without a position still answers the others, its own ranges just can't be used
+    this->mDw1000->startCalibration(CALIBRATION_MEASURE_MS);
+    debugV("MQTT: calibrating antenna delay");
+}
 
-    String stateTopic = "homeassistant/sensor/" + tagDeviceName + "-" + macAddrStr + "/state";
+void HomeAssistant::publishCalibration()
+{
+    portENTER_CRITICAL(&this->mCalibrationLock);
+    this->mCalibrationState = CALIBRATION_COLLECTING;
+    portEXIT_CRITICAL(&this->mCalibrationLock);
+    this->mCalibrationDeadline = millis() + CALIBRATION_COLLECT_MS;
+
+    float x = this->mPreferences->getFloat("x", NAN);
+    float y = this->mPreferences->getFloat("y", NAN);
+    float z = this->mPreferences->getFloat("z", NAN);
+    DW1000::CalibrationRange range;
+    if (isnan(x) || isnan(y) || isnan(z))
+    {
+        while (this->mDw1000->getCalibrationResults().pop(range))
+        {
+        }
+        debugE("MQTT: no position set, not publishing calibration ranges");
+        return;
+    }
 
     JsonDocument doc;
-    doc["distance"] = distance;
-    char buffer[128];
+    char buffer[1024];
+    char euiStr[17];
+    formatEui(this->mDw1000->getEUI(), euiStr);
+    doc["eui"] = euiStr;
+    doc["x"] = x;
+    doc["y"] = y;
+    doc["z"] = z;
+    JsonArray ranges = doc["ranges"].to<JsonArray>();
+    while (this->mDw1000->getCalibrationResults().pop(range))
+    {
+        JsonObject entry = ranges.add<JsonObject>();
+        formatEui(range.eui, euiStr);
+        entry["eui"] = euiStr;
+        entry["range"] = range.range;
+        entry["n"] = range.count;
+    }
+
     size_t n = serializeJson(doc, buffer);
-    this->mMqttClient.publish(stateTopic.c_str(), 2, false, buffer, n);
+    // ours comes back through the subscription like everyone else's
+    this->mMqttClient.publish(this->mCalibrationTopic, 1, false, buffer, n);
+    debugV("MQTT: published %d calibration ranges", ranges.size());
 }
 
-void HomeAssistant::sendOverallState()
+void HomeAssistant::receiveCalibration(const char *payload, size_t length)
 {
-    String stateTopic = "homeassistant/sensor/" + this->getDeviceName() + "/state";
     JsonDocument doc;
+    if (deserializeJson(doc, payload, length))
+    {
+        debugE("MQTT: bad calibration message");
+        return;
+    }
+    uint8_t eui[8];
+    if (!parseEui(doc["eui"].as<const char *>(), eui))
+    {
+        return;
+    }
+
+    // parsed first, the lock is only held for copying into the solver
+    uint8_t peers[AntennaCalibration::MAX_NODES][8];
+    float distances[AntennaCalibration::MAX_NODES];
+    uint8_t count = 0;
+    for (JsonObject entry : doc["ranges"].as<JsonArray>())
+    {
+        if (count < AntennaCalibration::MAX_NODES && parseEui(entry["eui"].as<const char *>(), peers[count]))
+        {
+            distances[count++] = entry["range"].as<float>();
+        }
+    }
+
+    portENTER_CRITICAL(&this->mCalibrationLock);
+    // only while we are calibrating too
+    if (this->mCalibrationState != CALIBRATION_IDLE)
+    {
+        this->mCalibration.setNode(eui, doc["x"].as<float>(), doc["y"].as<float>(), doc["z"].as<float>());
+        for (uint8_t i = 0; i < count; i++)
+        {
+            this->mCalibration.addRange(eui, peers[i], distances[i]);
+        }
+    }
+    portEXIT_CRITICAL(&this->mCalibrationLock);
+}
+
+void HomeAssistant::finishCalibration()
+{
+    // once idle the MQTT task leaves the solver alone
+    portENTER_CRITICAL(&this->mCalibrationLock);
+    this->mCalibrationState = CALIBRATION_IDLE;
+    portEXIT_CRITICAL(&this->mCalibrationLock);
+
+    AntennaCalibration::Result result = this->mCalibration.solve();
+    float correction;
+    if (!result.success || !this->mCalibration.getCorrection(this->mDw1000->getEUI(), correction))
+    {
+        debugE("MQTT: calibration failed, %d anchors, %d ranges", result.nodes, result.ranges);
+        return;
+    }
+
+    int antennaDelay = this->mPreferences->getInt("antennaDelay", 16436) + (int)lroundf(correction);
+    antennaDelay = antennaDelay < 10000 ? 10000 : antennaDelay > 65000 ? 65000 : antennaDelay;
+    this->mPreferences->putInt("antennaDelay", antennaDelay);
+    // the ranging task owns SPI, it picks this up on its next pass
+    this->mDw1000->setAntennaDelay(antennaDelay);
+    this->sendNumericState("antennaDelay", "number", antennaDelay);
+    debugV("MQTT: calibrated antenna delay to %d (%+.1f), rms error %f m -> %f m over %d anchors", antennaDelay, correction, result.rmsBefore,
+           result.rmsAfter, result.nodes);
+}
+
+#ifdef DW1000_TDOA
+void HomeAssistant::flushTdoa()
+{
+    uint8_t count = this->mTdoaCount;
+    this->mTdoaCount = 0;
+    portENTER_CRITICAL(&this->mTdoaLock);
+    Tdoa::Point position = this->mTdoaPosition;
+    portEXIT_CRITICAL(&this->mTdoaLock);
+    if (isnan(position.x) || isnan(position.y) || isnan(position.z))
+    {
+        debugE("MQTT: no position set, dropping %d TDOA arrivals", count);
+        return;
+    }
+
+    unsigned long start = micros();
+    uint8_t batch[Tdoa::MAX_BATCH_LENGTH];
+    char buffer[Tdoa::MAX_BATCH_LENGTH * 2 + 1];
+    size_t n = Tdoa::encodeBatch(this->mDw1000->getEUI(), position, this->mTdoaBatch, count, batch, sizeof(batch));
+    toHex(batch, n, buffer);
+    this->mReportMicros += micros() - start;
+    this->mReportBytes += strlen(this->mTdoaTopic) + n * 2;
+    this->mReportsSent += count;
+    // a lost batch only costs the blinks in it, not worth a handshake
+    this->mMqttClient.publish(this->mTdoaTopic, 0, false, buffer, n * 2);
+}
 
+#ifdef DW1000_TDOA_MASTER
+void HomeAssistant::receiveTdoa(const char *payload, size_t length)
+{
+    uint8_t batch[Tdoa::MAX_BATCH_LENGTH];
+    size_t n = fromHex(payload, length, batch, sizeof(batch));
+    TdoaRecord record;
+    int16_t count = Tdoa::decodeBatch(batch, n, record.anchorEui, record.anchor);
+    if (count < 0)
+    {
+        debugE("MQTT: bad TDOA batch");
+        return;
+    }
+    for (int16_t i = 0; i < count; i++)
+    {
+        Tdoa::decodeRecord(batch, i, record.arrival);
+        this->mTdoaInbox.push(record);
+    }
+}
+
+void HomeAssistant::handleTdoaFixes()
+{
+    uint32_t now = millis();
+    TdoaRecord record;
+    while (this->mTdoaInbox.pop(record))
+    {
+        this->mTdoaLocator.addArrival(record.anchorEui, record.anchor, record.arrival, now);
+    }
+
+    while (true)
+    {
+        uint32_t start = micros();
+        TdoaLocator<DW1000::MAX_ANCHORS, DW1000_TDOA_MAX_TAGS>::Fix fix;
+        if (!this->mTdoaLocator.poll(now, fix))
+        {
+            break;
+        }
+        this->mTdoaSolveTimes.add(micros() - start);
+
+        bool created;
+        PositionPredictor *predictor = this->mTdoaPredictors.insert(fix.tagEui, now, &created);
+        if (created)
+        {
+            predictor->setConfig(this->mTdoaPredictorConfig);
+        }
+        predictor->update(PositionPredictor::Vector{fix.position.x, fix.position.y, fix.position.z}, fix.timestamp);
+        uint32_t lookAhead = this->mTdoaPredictorConfig.lookAhead;
+
+        // first 2 bytes of the EUI are dummy, the tag's mac address is the rest backwards, see sendTagDiscovery()
+        char topic[TOPIC_LENGTH];
+        snprintf(topic, sizeof(topic), "dw1000/dw1000-tag-%02x%02x%02x%02x%02x%02x/track", fix.tagEui[5], fix.tagEui[4], fix.tagEui[3],
+                 fix.tagEui[2], fix.tagEui[1], fix.tagEui[0]);
+        char buffer[256];
+        int n = formatTrack(buffer, sizeof(buffer), fix.position.x, fix.position.y, fix.position.z, predictor->getVelocity(),
+                            predictor->predict(fix.timestamp + lookAhead), predictor->getPredictionError(fix.timestamp + lookAhead), lookAhead,
+                            toWallClockMs(fix.timestamp));
+        this->publishState(topic, buffer, n, DEVICE_STATE_POLICY);
+        debugV("TDOA: tag %02x%02x at %f, %f, %f from %d anchors, rms error %f m", fix.tagEui[1], fix.tagEui[0], fix.position.x,
+               fix.position.y, fix.position.z, fix.anchors, fix.rmsError);
+    }
+}
+#endif
+#endif
+#endif
+
+void HomeAssistant::sendTagDistanceToAnchorEUI(float distance, TagTopic *tagTopic)
+{
+    unsigned long start = micros();
+    // since adding an attribute to a device isn't enforced that it is sent actually BY the device,
+    // we can spoof it and send it from the anchor, since it knows the distance
+    // this saves power and time on the tag
+    const char *stateTopic = tagTopic->stateTopic;
+
+    char buffer[64];
+    int n = snprintf(buffer, sizeof(buffer), "{\"distance\":%g,\"variance\":%g}", distance, tagTopic->variance);
+    this->mReportMicros += micros() - start;
+    this->mReportBytes += strlen(stateTopic) + n;
+    this->mReportsSent++;
+    this->publishState(stateTopic, buffer, n, tagTopic->policy.getConfig());
+}
+
+#ifdef TELEMETRY_BATCHED
+void HomeAssistant::flushTelemetry()
+{
+    unsigned long start = micros();
+    uint8_t reports = this->mTelemetry.getCount();
+    uint8_t buffer[TelemetryBatch::MAX_FRAME_LENGTH];
+    size_t n = this->mTelemetry.encode(millis(), buffer, sizeof(buffer));
+    this->mReportMicros += micros() - start;
+    this->mReportBytes += strlen(this->mTelemetryTopic) + n;
+    this->mReportsSent += reports;
+    // a lost batch is superseded by the next one, not worth a handshake
+    this->mMqttClient.publish(this->mTelemetryTopic, 0, false, (const char *)buffer, n);
+}
+#endif
+
+void HomeAssistant::sendOverallState()
+{
     float temperature;
     temp_sensor_read_celsius(&temperature);
     debugV("DW1000 temperature: %f", temperature);
-    debugV("stateTopic: %s", stateTopic.c_str());
 
-    doc["temperature"] = temperature;
+    char buffer[64];
+    int n = snprintf(buffer, sizeof(buffer), "{\"temperature\":%g}", temperature);
 
-    char buffer[128];
-
-    size_t n = serializeJson(doc, buffer);
-
-    Serial.println("Sending state message");
-    Serial.println(stateTopic);
-    Serial.println(buffer);
+    debugV("MQTT: state %s %s", this->mOverallStateTopic, buffer);
 
-    bool success = this->mMqttClient.publish(stateTopic.c_str(), 2, false, buffer, n);
+    this->publishState(this->mOverallStateTopic, buffer, n, DEVICE_STATE_POLICY);
 }
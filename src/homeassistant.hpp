@@ -7,8 +7,24 @@
 
 #ifdef MOTOR_TMC2209
 #include "motor.hpp"
+#include "followtarget.hpp"
 #endif
 #include "dw1000.hpp"
+#include "publishpolicy.hpp"
+#ifdef TELEMETRY_BATCHED
+#include "telemetry.hpp"
+#endif
+#ifdef IMU_FUSION
+#include "imu.hpp"
+#endif
+#ifdef DW1000_TDOA
+#include "tdoa.hpp"
+#endif
+
+// tags the TDOA master keeps blinks and tracks for, each costs it ~400 bytes
+#ifndef DW1000_TDOA_MAX_TAGS
+#define DW1000_TDOA_MAX_TAGS 64
+#endif
 
 class HomeAssistant {
     public:
@@ -22,7 +38,45 @@ class HomeAssistant {
     
     void handle();
 
+    /**
+     * Prints bytes on the wire and serialisation time per range report, and heap use around publishes, over RemoteDebug.
+     */
+    void printStats();
+
+    #ifdef IMU_FUSION
+    /**
+     * USED BY TAGS ONLY
+     * Publishes the IMU's heading as a sensor, and adds it to the track. Only if the IMU is working, before connect().
+     */
+    void setImu(Imu* imu) { mImu = imu; }
+    #endif
+
     private:
+        // longest topic is homeassistant/sensor/dw1000-tag-<mac>-<mac>/state, with room to spare
+        static const size_t TOPIC_LENGTH = 96;
+        static const uint8_t MAX_ENTITIES = 12;
+
+        /**
+         * State topic of one of our own entities, built once so publishing a state doesn't allocate,
+         * and the policy deciding when its state actually goes out.
+         */
+        typedef struct {
+            char name[16];
+            char deviceType[8];
+            char stateTopic[TOPIC_LENGTH];
+            PublishPolicy policy;
+        } EntityTopic;
+
+        /**
+         * USED BY ANCHORS ONLY
+         * State topic of a tag we range, built by sendTagDiscovery(), and the policy for its distance.
+         */
+        typedef struct {
+            char stateTopic[TOPIC_LENGTH];
+            PublishPolicy policy;
+            float variance; // m^2, of the latest distance
+        } TagTopic;
+
         PsychicMqttClient mMqttClient;
         DW1000* mDw1000;
         #ifdef MOTOR_TMC2209
@@ -30,8 +84,33 @@ class HomeAssistant {
         #endif
         
         Preferences* mPreferences;
-        String getDeviceName();
+
+        // built once in the constructor, the mac address doesn't change
+        char mMacAddrStr[13];
+        char mDeviceName[32];
+        char mOverallStateTopic[TOPIC_LENGTH];
+        EntityTopic mEntityTopics[MAX_ENTITIES];
+        uint8_t mEntityCount;
+
+        const char *getDeviceName() { return mDeviceName; }
         String getDeviceName(byte macAddr[], boolean tag);
+        /**
+         * Finds one of our entities, setting it up the first time. nullptr if the table is full.
+         * Sensors get mSensorPolicy, numbers are settings echoed back to home assistant and always go out.
+         */
+        EntityTopic *getEntity(const char *name, const char *deviceType);
+        /**
+         * Publishes the entity's pending state if its policy allows it.
+         */
+        void publishEntity(EntityTopic *entity, uint32_t now);
+        /**
+         * Publishes a state message with the policy's QoS and retain flag, keeping track of what it does to the heap for printStats()
+         */
+        void publishState(const char *topic, const char *payload, size_t length, const PublishPolicy::Config &policy);
+        // policy for measurements: QoS 0, deadbanded and rate limited, from the pubDeadband / pubMinMs / pubMaxMs preferences
+        PublishPolicy::Config mSensorPolicy;
+        // entity policies are also updated from the MQTT client's task when home assistant sets something
+        portMUX_TYPE mPolicyLock = portMUX_INITIALIZER_UNLOCKED;
         /**
          * Sends discovery message for the "overall" device, i.e just registers with entities that all devices have.
          */
@@ -40,8 +119,9 @@ class HomeAssistant {
          * Sends a discovery of the anchor on the tag entity in HomeAssistant.
          * This is just so the distances to the anchors is displayed in HomeAssistant on the tag as opposed to being on the anchor
          * since the ranging results aren't sent to the tag.
+         * Also builds the tag's state topic into tagTopic.
          */
-        void sendTagDiscovery(byte tag_eui[]);
+        void sendTagDiscovery(byte tag_eui[], TagTopic *tagTopic);
         /**
          * Adds common discovery attributes to the JSON document.
          */
@@ -52,22 +132,148 @@ class HomeAssistant {
          * Sends a message to home assistant to have x/y/z coordinates displayed for the anchor.
          *  We don't actually use this in the code, this is just so they exist for node-red to use in its calculations.
          */
-        void sendAnchorCoordinateDiscovery(String axis);
+        void sendAnchorCoordinateDiscovery(const char *axis);
         
         /**
          * sends a message to home assistant about a numeric state discovery with attributes configurable.
          */
-        void sendNumericStateDiscovery(String name, String deviceType, String deviceClass, String unitOfMeasurement, byte macAddr[], std::function<void(JsonDocument &)> customCallback);
+        void sendNumericStateDiscovery(const char *name, const char *deviceType, String deviceClass, String unitOfMeasurement, byte macAddr[], std::function<void(JsonDocument &)> customCallback);
         
-        void sendNumericState(String name, String deviceType, float value);
+        void sendNumericState(const char *name, const char *deviceType, float value);
+
+        /**
+         * Stores a coordinate set from home assistant. Anchors persist it and pass it on to DW1000 for range reports.
+         */
+        void setCoordinate(const char *axis, float value);
         
         /**
          * USED BY ANCHORS ONLY
-         * Sends a message to the MQTT server with the distance to the tag.
+         * Sends a message to the MQTT server with the filtered distance to the tag and its variance.
          * This also attributes the distance to the tag's EUI in HomeAssistant under the same device.
+         * tagTopic is the tag's entry in mTagTopics, built by sendTagDiscovery()
          */
-        void sendTagDistanceToAnchorEUI(float distance, byte tag_eui[]);
+        void sendTagDistanceToAnchorEUI(float distance, TagTopic *tagTopic);
+        #ifdef TELEMETRY_BATCHED
+        /**
+         * USED BY ANCHORS ONLY
+         * Publishes every range collected since the last flush as one binary message, see telemetry.hpp.
+         */
+        void flushTelemetry();
+        TelemetryBatch mTelemetry;
+        char mTelemetryTopic[TOPIC_LENGTH];
+        unsigned long mTelemetryInterval;
+        unsigned long mNextTelemetryFlush;
+        #endif
+        #ifdef DW1000_TAG
+        /**
+         * USED BY TAGS ONLY
+         * Publishes a fix with the predictor's velocity and look-ahead position as JSON on dw1000/<device>/track,
+         * for whatever aims at the tag to use instead of the x/y/z sensors.
+         */
+        void sendTrack(const DW1000::Fix &fix);
+        char mTrackTopic[TOPIC_LENGTH];
+        #ifdef IMU_FUSION
+        Imu* mImu = nullptr;
+        #endif
+        #ifdef MOTOR_TMC2209
+        /**
+         * USED BY THE MOTOR TAG ONLY
+         * Points the motor at the tag named by the followTag preference, straight from its track and without node-red.
+         * Runs on the MQTT client's task, angles set from home assistant are ignored while following.
+         */
+        void receiveTrack(const char *payload, size_t length);
+        FollowTarget mFollow;
+        // empty when not following
+        char mFollowTopic[TOPIC_LENGTH];
+        // the angle the motor was last sent, published from handle()
+        float mFollowAngle;
+        bool mFollowAngleUpdated;
+        uint32_t mLastTrack; // ms
+        // also touched from the MQTT client's task
+        portMUX_TYPE mFollowLock = portMUX_INITIALIZER_UNLOCKED;
+        // added to by the MQTT client's task, read and reset by printStats(), both under mFollowLock:
+        // us from a track arriving to the motor having its new target, and ms between tracks
+        LatencyHistogram mFollowTimes;
+        LatencyHistogram mTrackIntervals;
+        // ms from the target solving a fix to the motor turning to it, off the SNTP clocks of both tags
+        LatencyHistogram mFixToMotor;
+        // turns that couldn't be timed, one of the clocks wasn't set
+        uint32_t mUnsyncedTracks;
+        #endif
+        #endif
+        #ifdef DW1000_ANCHOR
+        /**
+         * USED BY ANCHORS ONLY
+         * Antenna delay calibration, started by the "calibrate" button on any anchor.
+         * Every anchor ranges the others for a few seconds, publishes the medians with its own position to
+         * dw1000/<device>/calibration, then solves everyone's for its own delay, see antennacalibration.hpp.
+         */
+        void sendCalibrationDiscovery();
+        void startCalibration();
+        // publishes what DW1000 measured, once it's done
+        void publishCalibration();
+        // one anchor's published ranges, from the MQTT client's task
+        void receiveCalibration(const char *payload, size_t length);
+        // solves and applies our correction once everyone has had time to publish
+        void finishCalibration();
+        typedef enum {
+            CALIBRATION_IDLE,
+            CALIBRATION_MEASURING,
+            CALIBRATION_COLLECTING
+        } CalibrationState;
+        CalibrationState mCalibrationState;
+        unsigned long mCalibrationDeadline;
+        AntennaCalibration mCalibration;
+        char mCalibrationTopic[TOPIC_LENGTH];
+        // state and solver are also touched from the MQTT client's task
+        portMUX_TYPE mCalibrationLock = portMUX_INITIALIZER_UNLOCKED;
+        #ifdef DW1000_TDOA
+        /**
+         * USED BY ANCHORS ONLY
+         * Publishes the tag blinks heard since the last flush as one batch on dw1000/<device>/tdoa, see tdoa.hpp.
+         * Hex encoded, the MQTT client hands received payloads over as C strings.
+         */
+        void flushTdoa();
+        Tdoa::Arrival mTdoaBatch[Tdoa::MAX_RECORDS];
+        uint8_t mTdoaCount;
+        unsigned long mNextTdoaFlush;
+        char mTdoaTopic[TOPIC_LENGTH];
+        // our surveyed position, also set from the MQTT client's task
+        Tdoa::Point mTdoaPosition;
+        portMUX_TYPE mTdoaLock = portMUX_INITIALIZER_UNLOCKED;
+        #ifdef DW1000_TDOA_MASTER
+        /**
+         * USED BY THE MASTER ANCHOR ONLY
+         * Every anchor's batches (our own included) come in here from the MQTT client's task and are queued for handle(),
+         * which solves each blink and publishes the tag's track on dw1000/<tag>/track like a tag solving its own position would.
+         */
+        void receiveTdoa(const char *payload, size_t length);
+        void handleTdoaFixes();
+        typedef struct {
+            uint8_t anchorEui[8];
+            Tdoa::Point anchor;
+            Tdoa::Arrival arrival;
+        } TdoaRecord;
+        RingBuffer<TdoaRecord, 256> mTdoaInbox;
+        // owned by handle()
+        TdoaLocator<DW1000::MAX_ANCHORS, DW1000_TDOA_MAX_TAGS> mTdoaLocator;
+        PeerTable<PositionPredictor, DW1000_TDOA_MAX_TAGS> mTdoaPredictors;
+        PositionPredictor::Config mTdoaPredictorConfig;
+        // us per solved blink
+        LatencyHistogram mTdoaSolveTimes;
+        #endif
+        #endif
+        #endif
+        // range reports sent, and what they cost, for printStats()
+        uint32_t mReportsSent;
+        uint32_t mReportBytes;
+        uint32_t mReportMicros;
+        // state publishes, and how much heap they kept hold of between them
+        uint32_t mStatePublishes;
+        int32_t mStatePublishHeapBytes;
+        uint32_t mLargestFreeBlockAtConnect;
         void sendOverallState();
         unsigned long mNextScheduledStateSend;
-        DW1000::TagDistance mTagDistances[8];
+        // same capacity as DW1000's own tag table, a tag it has forgotten is forgotten here too once a new one shows up
+        PeerTable<TagTopic, DW1000::MAX_TAGS> mTagTopics;
 };
\ No newline at end of file
@@ -0,0 +1,92 @@
+#include "imu.hpp"
+
+#include "network.hpp"
+
+#define GRAVITY 9.80665f
+
+Imu::Imu(Preferences *preferences)
+{
+    mFusion.setConfig({preferences->getFloat("imuAccelNoise", 0.2), preferences->getFloat("imuGyroNoise", 0.01), 0.01f, 0.0005f,
+                       preferences->getFloat("fixNoise", 0.15), 2000});
+    mLastSample = 0;
+    mMotionAccel = preferences->getFloat("motionAccel", 0.5);
+    mMotionGyro = preferences->getFloat("motionGyro", 0.2);
+    mState = State{false, {0, 0, 0}, {0, 0, 0}, 0, 0, 0, false};
+}
+
+bool Imu::begin(TwoWire *wire, uint8_t address)
+{
+    if (!mLsm.begin_I2C(address, wire))
+    {
+        return false;
+    }
+    // walking is well under 4g and 500 dps, the finer resolution is worth more than the headroom
+    mLsm.setAccelRange(LSM6DS_ACCEL_RANGE_4_G);
+    mLsm.setGyroRange(LSM6DS_GYRO_RANGE_500_DPS);
+    mLsm.setAccelDataRate(LSM6DS_RATE_208_HZ);
+    mLsm.setGyroDataRate(LSM6DS_RATE_208_HZ);
+    return true;
+}
+
+void Imu::correct(float x, float y, float z)
+{
+    uint32_t start = micros();
+    if (!mFusion.correct(ImuFusion::Vector{x, y, z}))
+    {
+        debugV("IMU: fix %f, %f, %f rejected", x, y, z);
+    }
+    mCorrectTimes.add(micros() - start);
+}
+
+void Imu::handle()
+{
+    sensors_event_t accel, gyro, temp;
+    // one burst read for both, so they're from the same sample
+    if (!mLsm.getEvent(&accel, &gyro, &temp))
+    {
+        return;
+    }
+    uint32_t now = micros();
+    // the first sample only aligns, dt doesn't matter for it
+    float dt = mLastSample == 0 ? PERIOD_US / 1e6f : (now - mLastSample) / 1e6f;
+    mLastSample = now;
+
+    mFusion.predict(ImuFusion::Vector{accel.acceleration.x, accel.acceleration.y, accel.acceleration.z},
+                    ImuFusion::Vector{gyro.gyro.x, gyro.gyro.y, gyro.gyro.z}, dt);
+    mPredictTimes.add(micros() - now);
+
+    State state;
+    state.valid = mFusion.hasFix();
+    state.position = mFusion.getPosition();
+    state.velocity = mFusion.getVelocity();
+    state.heading = mFusion.getHeading() * 180 / M_PI;
+    state.positionError = mFusion.getPositionError();
+    state.timestamp = millis();
+    // still, the accelerometer reads gravity whichever way up the tag is
+    float accelNorm = sqrtf(accel.acceleration.x * accel.acceleration.x + accel.acceleration.y * accel.acceleration.y +
+                            accel.acceleration.z * accel.acceleration.z);
+    float gyroNorm = sqrtf(gyro.gyro.x * gyro.gyro.x + gyro.gyro.y * gyro.gyro.y + gyro.gyro.z * gyro.gyro.z);
+    state.moving = fabsf(accelNorm - GRAVITY) > mMotionAccel || gyroNorm > mMotionGyro;
+    portENTER_CRITICAL(&mStateLock);
+    mState = state;
+    portEXIT_CRITICAL(&mStateLock);
+}
+
+Imu::State Imu::getState()
+{
+    portENTER_CRITICAL(&mStateLock);
+    State state = mState;
+    portEXIT_CRITICAL(&mStateLock);
+    return state;
+}
+
+void Imu::printStats()
+{
+    Debug.printf("imu      predict p50 %lu us, p99 %lu us, max %lu us over %lu samples\n", (unsigned long)mPredictTimes.percentile(0.5f),
+                 (unsigned long)mPredictTimes.percentile(0.99f), (unsigned long)mPredictTimes.getMax(), (unsigned long)mPredictTimes.getCount());
+    Debug.printf("imu      correct p50 %lu us, p99 %lu us, max %lu us over %lu fixes, %lu rejected in total\n", (unsigned long)mCorrectTimes.percentile(0.5f),
+                 (unsigned long)mCorrectTimes.percentile(0.99f), (unsigned long)mCorrectTimes.getMax(), (unsigned long)mCorrectTimes.getCount(),
+                 (unsigned long)mFusion.getRejectedFixes());
+    mPredictTimes.reset();
+    mCorrectTimes.reset();
+}
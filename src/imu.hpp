@@ -0,0 +1,63 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Wire.h>
+#include <Preferences.h>
+#include <Adafruit_LSM6DSL.h>
+
+#include "imufusion.hpp"
+#include "rangingprofile.hpp"
+
+/**
+ * USED BY TAGS ONLY, with -DIMU_FUSION
+ * Reads the LSM6DSL every PERIOD_US and runs ImuFusion on it, corrected by the tag's own position fixes.
+ * handle() and correct() run in their own task, the fused state goes out through getState() to any task.
+ */
+class Imu
+{
+public:
+    // 200 Hz, the LSM6DSL runs at 208 Hz so there's always a fresh sample
+    static const uint32_t PERIOD_US = 5000;
+
+    typedef struct
+    {
+        bool valid; // false until the first fix, and after too long without one
+        ImuFusion::Vector position; // m
+        ImuFusion::Vector velocity; // m/s
+        float heading;              // degrees, anticlockwise from the x axis
+        float positionError;        // m, standard deviation
+        uint32_t timestamp;         // ms
+        bool moving;                // the latest sample was more than gravity and gyro noise, fix or not
+    } State;
+
+    Imu(Preferences *preferences);
+
+    // false if there's no LSM6DSL on the bus
+    bool begin(TwoWire *wire, uint8_t address);
+
+    // one IMU sample, call every PERIOD_US
+    void handle();
+    // a position fix, from the same task as handle()
+    void correct(float x, float y, float z);
+
+    State getState();
+
+    /**
+     * Prints p50/p99/max of predict and correct over RemoteDebug, the CPU cost of the filter, and starts over.
+     */
+    void printStats();
+
+private:
+    Adafruit_LSM6DSL mLsm;
+    ImuFusion mFusion;
+    uint32_t mLastSample; // us
+    float mMotionAccel;   // m/s^2, off gravity
+    float mMotionGyro;    // rad/s
+
+    State mState;
+    portMUX_TYPE mStateLock = portMUX_INITIALIZER_UNLOCKED;
+
+    // written by the IMU task only
+    LatencyHistogram mPredictTimes;
+    LatencyHistogram mCorrectTimes;
+};
@@ -0,0 +1,364 @@
+#include "imufusion.hpp"
+
+#include <math.h>
+#include <string.h>
+
+#define GRAVITY 9.80665f
+// chi squared, 3 degrees of freedom, 99.9%
+#define INNOVATION_GATE 16.27f
+// (5 deg)^2, until the heading is this good a fix that's off is as likely the heading's fault as the fix's
+#define GATE_HEADING_VARIANCE 0.0076f
+// this many fixes thrown out in a row and it's the IMU that's wrong, start over from the next one
+#define MAX_REJECTED_IN_A_ROW 5
+
+// error state layout
+#define POS 0
+#define VEL 3
+#define ATT 6
+#define ACCEL_BIAS 9
+#define GYRO_BIAS 12
+
+ImuFusion::ImuFusion()
+{
+    mConfig = Config{0.2f, 0.01f, 0.01f, 0.0005f, 0.15f, 2000};
+    mRejectedFixes = 0;
+    this->reset();
+}
+
+void ImuFusion::reset()
+{
+    mAligned = false;
+    mHasFix = false;
+    mSinceFix = 0;
+    mRejectedInARow = 0;
+    memset(mPosition, 0, sizeof(mPosition));
+    memset(mVelocity, 0, sizeof(mVelocity));
+    mAttitude[0] = 1;
+    mAttitude[1] = mAttitude[2] = mAttitude[3] = 0;
+    memset(mAccelBias, 0, sizeof(mAccelBias));
+    memset(mGyroBias, 0, sizeof(mGyroBias));
+    this->resetCovariance();
+}
+
+void ImuFusion::resetCovariance()
+{
+    memset(mP, 0, sizeof(mP));
+    float initial[STATES] = {
+        mConfig.positionNoise * mConfig.positionNoise, mConfig.positionNoise * mConfig.positionNoise, mConfig.positionNoise * mConfig.positionNoise,
+        1, 1, 1,
+        // roll and pitch are good from gravity, heading is anyone's guess
+        0.05f * 0.05f, 0.05f * 0.05f, (float)(M_PI * M_PI),
+        0.2f * 0.2f, 0.2f * 0.2f, 0.2f * 0.2f,
+        0.01f * 0.01f, 0.01f * 0.01f, 0.01f * 0.01f};
+    for (uint8_t i = 0; i < STATES; i++)
+    {
+        mP[i][i] = initial[i];
+    }
+}
+
+// roll and pitch from which way gravity points, heading 0
+void ImuFusion::align(const Vector &accel)
+{
+    float roll = atan2f(accel.y, accel.z);
+    float pitch = atan2f(-accel.x, sqrtf(accel.y * accel.y + accel.z * accel.z));
+    float cr = cosf(roll / 2), sr = sinf(roll / 2);
+    float cp = cosf(pitch / 2), sp = sinf(pitch / 2);
+    mAttitude[0] = cr * cp;
+    mAttitude[1] = sr * cp;
+    mAttitude[2] = cr * sp;
+    mAttitude[3] = -sr * sp;
+    mAligned = true;
+}
+
+// body to world
+void ImuFusion::rotation(float r[3][3])
+{
+    float w = mAttitude[0], x = mAttitude[1], y = mAttitude[2], z = mAttitude[3];
+    r[0][0] = 1 - 2 * (y * y + z * z);
+    r[0][1] = 2 * (x * y - w * z);
+    r[0][2] = 2 * (x * z + w * y);
+    r[1][0] = 2 * (x * y + w * z);
+    r[1][1] = 1 - 2 * (x * x + z * z);
+    r[1][2] = 2 * (y * z - w * x);
+    r[2][0] = 2 * (x * z - w * y);
+    r[2][1] = 2 * (y * z + w * x);
+    r[2][2] = 1 - 2 * (x * x + y * y);
+}
+
+// attitude = attitude * rotation by the small angle theta, in body axes
+static void rotate(float q[4], const float theta[3])
+{
+    float angle = sqrtf(theta[0] * theta[0] + theta[1] * theta[1] + theta[2] * theta[2]);
+    float dq[4];
+    if (angle < 1e-9f)
+    {
+        dq[0] = 1;
+        dq[1] = theta[0] / 2;
+        dq[2] = theta[1] / 2;
+        dq[3] = theta[2] / 2;
+    }
+    else
+    {
+        float s = sinf(angle / 2) / angle;
+        dq[0] = cosf(angle / 2);
+        dq[1] = theta[0] * s;
+        dq[2] = theta[1] * s;
+        dq[3] = theta[2] * s;
+    }
+    float w = q[0] * dq[0] - q[1] * dq[1] - q[2] * dq[2] - q[3] * dq[3];
+    float x = q[0] * dq[1] + q[1] * dq[0] + q[2] * dq[3] - q[3] * dq[2];
+    float y = q[0] * dq[2] - q[1] * dq[3] + q[2] * dq[0] + q[3] * dq[1];
+    float z = q[0] * dq[3] + q[1] * dq[2] - q[2] * dq[1] + q[3] * dq[0];
+    float norm = sqrtf(w * w + x * x + y * y + z * z);
+    q[0] = w / norm;
+    q[1] = x / norm;
+    q[2] = y / norm;
+    q[3] = z / norm;
+}
+
+void ImuFusion::predict(const Vector &accel, const Vector &gyro, float dt)
+{
+    if (!mAligned)
+    {
+        this->align(accel);
+        return;
+    }
+
+    float r[3][3];
+    this->rotation(r);
+    float f[3] = {accel.x - mAccelBias[0], accel.y - mAccelBias[1], accel.z - mAccelBias[2]};
+    float theta[3] = {(gyro.x - mGyroBias[0]) * dt, (gyro.y - mGyroBias[1]) * dt, (gyro.z - mGyroBias[2]) * dt};
+    rotate(mAttitude, theta);
+
+    mSinceFix += dt;
+    // nothing to anchor position to, only keep the attitude going until the next fix starts things over
+    if (!this->hasFix())
+    {
+        return;
+    }
+
+    // nominal state
+    float a[3];
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        a[i] = r[i][0] * f[0] + r[i][1] * f[1] + r[i][2] * f[2];
+    }
+    a[2] -= GRAVITY;
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        mPosition[i] += mVelocity[i] * dt + a[i] * dt * dt / 2;
+        mVelocity[i] += a[i] * dt;
+    }
+
+    // error state transition, identity plus these blocks
+    float fv[3][3]; // dv/dtheta = -R [f]x dt
+    float skew[3][3] = {{0, -f[2], f[1]}, {f[2], 0, -f[0]}, {-f[1], f[0], 0}};
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        for (uint8_t j = 0; j < 3; j++)
+        {
+            fv[i][j] = -(r[i][0] * skew[0][j] + r[i][1] * skew[1][j] + r[i][2] * skew[2][j]) * dt;
+        }
+    }
+    float F[STATES][STATES];
+    memset(F, 0, sizeof(F));
+    for (uint8_t i = 0; i < STATES; i++)
+    {
+        F[i][i] = 1;
+    }
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        F[POS + i][VEL + i] = dt;
+        F[ATT + i][GYRO_BIAS + i] = -dt;
+        for (uint8_t j = 0; j < 3; j++)
+        {
+            F[VEL + i][ATT + j] = fv[i][j];
+            F[VEL + i][ACCEL_BIAS + j] = -r[i][j] * dt;
+        }
+    }
+    // dtheta/dtheta = I - [w dt]x
+    F[ATT + 0][ATT + 1] = theta[2];
+    F[ATT + 0][ATT + 2] = -theta[1];
+    F[ATT + 1][ATT + 0] = -theta[2];
+    F[ATT + 1][ATT + 2] = theta[0];
+    F[ATT + 2][ATT + 0] = theta[1];
+    F[ATT + 2][ATT + 1] = -theta[0];
+
+    // P = F P F^T + Q, only the non zero entries of F are worth multiplying
+    float FP[STATES][STATES];
+    for (uint8_t i = 0; i < STATES; i++)
+    {
+        for (uint8_t j = 0; j < STATES; j++)
+        {
+            float sum = 0;
+            for (uint8_t k = 0; k < STATES; k++)
+            {
+                if (F[i][k] != 0)
+                {
+                    sum += F[i][k] * mP[k][j];
+                }
+            }
+            FP[i][j] = sum;
+        }
+    }
+    for (uint8_t i = 0; i < STATES; i++)
+    {
+        for (uint8_t j = i; j < STATES; j++)
+        {
+            float sum = 0;
+            for (uint8_t k = 0; k < STATES; k++)
+            {
+                if (F[j][k] != 0)
+                {
+                    sum += FP[i][k] * F[j][k];
+                }
+            }
+            mP[i][j] = mP[j][i] = sum;
+        }
+    }
+    float qv = mConfig.accelNoise * mConfig.accelNoise * dt * dt;
+    float qtheta = mConfig.gyroNoise * mConfig.gyroNoise * dt * dt;
+    float qba = mConfig.accelBiasWalk * mConfig.accelBiasWalk * dt;
+    float qbg = mConfig.gyroBiasWalk * mConfig.gyroBiasWalk * dt;
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        mP[VEL + i][VEL + i] += qv;
+        mP[ATT + i][ATT + i] += qtheta;
+        mP[ACCEL_BIAS + i][ACCEL_BIAS + i] += qba;
+        mP[GYRO_BIAS + i][GYRO_BIAS + i] += qbg;
+    }
+}
+
+bool ImuFusion::correct(const Vector &position)
+{
+    float z[3] = {position.x, position.y, position.z};
+    if (!this->hasFix())
+    {
+        // first fix, or dead reckoning has gone on too long to trust, start from here
+        memcpy(mPosition, z, sizeof(mPosition));
+        memset(mVelocity, 0, sizeof(mVelocity));
+        // attitude and biases carry on, they don't depend on the fixes
+        for (uint8_t i = 0; i < STATES; i++)
+        {
+            for (uint8_t j = POS; j < ATT; j++)
+            {
+                mP[i][j] = mP[j][i] = 0;
+            }
+        }
+        for (uint8_t i = 0; i < 3; i++)
+        {
+            mP[POS + i][POS + i] = mConfig.positionNoise * mConfig.positionNoise;
+            mP[VEL + i][VEL + i] = 1;
+        }
+        mHasFix = true;
+        mSinceFix = 0;
+        mRejectedInARow = 0;
+        return true;
+    }
+
+    // S = P[p][p] + R, inverted with cofactors
+    float r = mConfig.positionNoise * mConfig.positionNoise;
+    float s[3][3];
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        for (uint8_t j = 0; j < 3; j++)
+        {
+            s[i][j] = mP[POS + i][POS + j] + (i == j ? r : 0);
+        }
+    }
+    float det = s[0][0] * (s[1][1] * s[2][2] - s[1][2] * s[2][1]) - s[0][1] * (s[1][0] * s[2][2] - s[1][2] * s[2][0]) +
+                s[0][2] * (s[1][0] * s[2][1] - s[1][1] * s[2][0]);
+    if (fabsf(det) < 1e-12f)
+    {
+        return false;
+    }
+    float inverse[3][3] = {
+        {(s[1][1] * s[2][2] - s[1][2] * s[2][1]) / det, (s[0][2] * s[2][1] - s[0][1] * s[2][2]) / det, (s[0][1] * s[1][2] - s[0][2] * s[1][1]) / det},
+        {(s[1][2] * s[2][0] - s[1][0] * s[2][2]) / det, (s[0][0] * s[2][2] - s[0][2] * s[2][0]) / det, (s[0][2] * s[1][0] - s[0][0] * s[1][2]) / det},
+        {(s[1][0] * s[2][1] - s[1][1] * s[2][0]) / det, (s[0][1] * s[2][0] - s[0][0] * s[2][1]) / det, (s[0][0] * s[1][1] - s[0][1] * s[1][0]) / det}};
+
+    float innovation[3];
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        innovation[i] = z[i] - mPosition[i];
+    }
+    float distance = 0;
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        for (uint8_t j = 0; j < 3; j++)
+        {
+            distance += innovation[i] * inverse[i][j] * innovation[j];
+        }
+    }
+    // with the heading still unknown, dead reckoning walks off in the wrong direction and the gate would throw out
+    // the very fixes that settle it, then start over again and again
+    if (mP[ATT + 2][ATT + 2] < GATE_HEADING_VARIANCE && distance > INNOVATION_GATE)
+    {
+        mRejectedFixes++;
+        if (++mRejectedInARow >= MAX_REJECTED_IN_A_ROW)
+        {
+            // most likely the heading has wandered off, forget it along with the position
+            for (uint8_t i = 0; i < STATES; i++)
+            {
+                mP[i][ATT + 2] = mP[ATT + 2][i] = 0;
+            }
+            mP[ATT + 2][ATT + 2] = M_PI * M_PI;
+            mHasFix = false;
+        }
+        return false;
+    }
+    mRejectedInARow = 0;
+
+    // K = P H^T S^-1, H picks out the position
+    float K[STATES][3];
+    for (uint8_t i = 0; i < STATES; i++)
+    {
+        for (uint8_t j = 0; j < 3; j++)
+        {
+            K[i][j] = mP[i][POS + 0] * inverse[0][j] + mP[i][POS + 1] * inverse[1][j] + mP[i][POS + 2] * inverse[2][j];
+        }
+    }
+    float dx[STATES];
+    for (uint8_t i = 0; i < STATES; i++)
+    {
+        dx[i] = K[i][0] * innovation[0] + K[i][1] * innovation[1] + K[i][2] * innovation[2];
+    }
+
+    // P = P - K H P, symmetric so only half of it is worked out
+    float HP[3][STATES];
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        memcpy(HP[i], mP[POS + i], sizeof(HP[i]));
+    }
+    for (uint8_t i = 0; i < STATES; i++)
+    {
+        for (uint8_t j = i; j < STATES; j++)
+        {
+            mP[i][j] = mP[j][i] = mP[i][j] - (K[i][0] * HP[0][j] + K[i][1] * HP[1][j] + K[i][2] * HP[2][j]);
+        }
+    }
+
+    // fold the error back into the nominal state, which zeroes it
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        mPosition[i] += dx[POS + i];
+        mVelocity[i] += dx[VEL + i];
+        mAccelBias[i] += dx[ACCEL_BIAS + i];
+        mGyroBias[i] += dx[GYRO_BIAS + i];
+    }
+    rotate(mAttitude, &dx[ATT]);
+    mSinceFix = 0;
+    return true;
+}
+
+float ImuFusion::getHeading()
+{
+    float r[3][3];
+    this->rotation(r);
+    return atan2f(r[1][0], r[0][0]);
+}
+
+float ImuFusion::getPositionError()
+{
+    return sqrtf(mP[POS][POS]);
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Error state Kalman filter fusing the LSM6DSL's accelerometer and gyro with UWB position fixes.
+ * predict() integrates every IMU sample, so position, velocity and heading are available at the IMU's rate,
+ * and correct() pulls the estimate back onto each multilateration fix when it arrives a few times a second.
+ *
+ * Nominal state is position, velocity, attitude (quaternion) and accelerometer/gyro biases. The filter itself
+ * runs on the 15 element error state, with attitude as a small rotation, so it never has to linearise a quaternion.
+ * World frame is the anchors' frame with z up. Roll and pitch come from gravity; heading is only observable
+ * while the tag accelerates, so it starts at 0 and settles once the tag has been walked around.
+ *
+ * Everything is fixed size and nothing touches the heap.
+ * No Arduino dependencies, so it also builds on the host.
+ */
+class ImuFusion
+{
+public:
+    static const uint8_t STATES = 15;
+
+    typedef struct
+    {
+        float x;
+        float y;
+        float z;
+    } Vector;
+
+    typedef struct
+    {
+        float accelNoise;     // m/s^2, standard deviation of one accelerometer sample
+        float gyroNoise;      // rad/s, standard deviation of one gyro sample
+        float accelBiasWalk;  // m/s^2/sqrt(s), how fast the accelerometer bias wanders
+        float gyroBiasWalk;   // rad/s/sqrt(s), how fast the gyro bias wanders
+        float positionNoise;  // m, standard deviation of a UWB fix
+        uint32_t maxFixGap;   // ms, without a fix for this long dead reckoning is no good and the filter starts over
+    } Config;
+
+    ImuFusion();
+
+    void setConfig(const Config &config) { mConfig = config; }
+    void reset();
+
+    /**
+     * Integrates one IMU sample taken dt seconds after the previous one.
+     * accel is specific force in m/s^2 (reads +9.81 on z lying flat), gyro is rad/s, both in the IMU's own axes.
+     * The first sample sets roll and pitch, assuming the tag is more or less still.
+     */
+    void predict(const Vector &accel, const Vector &gyro, float dt);
+
+    /**
+     * Corrects with a position fix. Returns false if the fix was too far off what the IMU says to be believed,
+     * which is only checked once the heading has settled.
+     */
+    bool correct(const Vector &position);
+
+    // valid once there has been a fix, and not too many IMU samples ago
+    bool hasFix() { return mHasFix && mSinceFix * 1000 <= mConfig.maxFixGap; }
+    Vector getPosition() { return Vector{mPosition[0], mPosition[1], mPosition[2]}; }
+    Vector getVelocity() { return Vector{mVelocity[0], mVelocity[1], mVelocity[2]}; }
+    // rad, anticlockwise from the x axis to the IMU's x axis
+    float getHeading();
+    // m, standard deviation of the position along x
+    float getPositionError();
+    // fixes thrown out by the innovation gate
+    uint32_t getRejectedFixes() { return mRejectedFixes; }
+
+private:
+    Config mConfig;
+    bool mAligned;
+    bool mHasFix;
+    float mSinceFix; // s, of IMU samples
+    uint8_t mRejectedInARow;
+    uint32_t mRejectedFixes;
+
+    float mPosition[3];
+    float mVelocity[3];
+    float mAttitude[4]; // w, x, y, z
+    float mAccelBias[3];
+    float mGyroBias[3];
+    float mP[STATES][STATES];
+
+    void align(const Vector &accel);
+    void resetCovariance();
+    void rotation(float r[3][3]);
+};
@@ -13,21 +13,31 @@
 #include <WiFi.h>
 #include <esp_wifi.h>
 #include "homeassistant.hpp"
+#include "taskstats.hpp"
 #include <TMCStepper.h>
 #include <Preferences.h>
+#ifdef IMU_FUSION
+#include "imu.hpp"
+#endif
 
 
 #ifdef MOTOR_TMC2209
 #include "motor.hpp"
-#define STEPS_PER_REV 10000 // todo calibrate
+#define FULL_STEPS_PER_REV 625 // todo calibrate, 10000 steps/rev at the default 16 microsteps
 #define STEP_PIN 7
 #define DIR_PIN 6
-Motor* stepper = new Motor(STEP_PIN, DIR_PIN, STEPS_PER_REV);
+// single wire PDN_UART, TX goes to it through 1k and RX straight to it.
+// Not 18, that's the DW1000's SCK and SPI.begin() takes it over from the UART
+#define TMC_TX_PIN 17
+#define TMC_RX_PIN 16
+Motor* stepper = new Motor(STEP_PIN, DIR_PIN, FULL_STEPS_PER_REV);
 
+#ifndef MOTOR_RMT
 void interrupt() {
     stepper->motorInterrupt();
 } 
 #endif
+#endif
 
 Preferences* preferences;
 QMC5883LCompass compass;
@@ -53,6 +63,115 @@ const uint8_t DWM1000_RST = 9; // need to bodge this in hardware - forgot to con
 const uint8_t DWM1000_IRQ = 3; 
 const uint8_t DWM1000_CS = 21;
 
+// ranging gets core 1 to itself (apart from loop()) so MQTT stalls on core 0 can't throw its timing off
+#define RANGING_CORE 1
+#define NETWORK_CORE 0
+#define RANGING_TASK_PRIORITY (configMAX_PRIORITIES - 2)
+#define NETWORK_TASK_PRIORITY 2
+#define TASK_STACK_SIZE 8192
+
+TaskStats rangingStats("ranging");
+TaskStats networkStats("network");
+
+#ifdef IMU_FUSION
+// shares the network core, above it so a slow publish doesn't hold up integrating samples
+#define IMU_TASK_PRIORITY 3
+Imu* imu;
+TaskStats imuStats("imu");
+
+void imuTask(void *parameter) {
+    TickType_t lastWake = xTaskGetTickCount();
+    for (;;) {
+        imuStats.beginWork();
+        DW1000::Fix fix;
+        while (dw1000->getFusionResults().pop(fix)) {
+            imu->correct(fix.position.x, fix.position.y, fix.position.z);
+        }
+        imu->handle();
+        // picked up or set down, range faster before the fixes show it
+        if (imu->getState().moving) {
+            dw1000->reportMotion();
+        }
+        imuStats.endWork();
+        vTaskDelayUntil(&lastWake, pdMS_TO_TICKS(Imu::PERIOD_US / 1000));
+    }
+}
+#endif
+
+#ifdef MOTOR_RMT
+// on the network core, above the IMU: a late block stretches a step, a late IMU sample only stretches its dt
+#define MOTOR_TASK_PRIORITY 4
+
+void motorTask(void *parameter) {
+    for (;;) {
+        // blocks while the RMT plays out the previous block
+        stepper->feed();
+    }
+}
+#endif
+
+#if defined(DW1000_ANCHOR) || defined(DW1000_TAG)
+void rangingTask(void *parameter) {
+    for (;;) {
+        uint32_t start = micros();
+        rangingStats.beginWork();
+        dw1000->handle();
+        rangingStats.endWork();
+        dw1000->getProfile().record(RangingProfile::HANDLE, micros() - start);
+        // handle() never blocks. Sleep a tick so loop() runs, or less if the DW1000 IRQ wakes us with a frame to answer
+        ulTaskNotifyTake(pdTRUE, 1);
+    }
+}
+#endif
+
+void networkTask(void *parameter) {
+    for (;;) {
+        networkStats.beginWork();
+        network.handle();
+#if defined(DW1000_ANCHOR) || defined(DW1000_TAG)
+        // all MQTT traffic happens in here, so a slow publish only holds this task up
+        homeAssistant->handle();
+#endif
+        networkStats.endWork();
+        vTaskDelay(1);
+    }
+}
+
+// "stats" and "motorbench" over telnet
+void processDebugCommand() {
+#ifdef MOTOR_TMC2209
+    if (Debug.getLastCommand() == "motorbench") {
+        stepper->startBenchmark();
+        return;
+    }
+    if (Debug.getLastCommand() == "motorhome") {
+        stepper->startHoming();
+        return;
+    }
+#endif
+    if (Debug.getLastCommand() != "stats") {
+        return;
+    }
+    rangingStats.print();
+    networkStats.print();
+#ifdef MOTOR_TMC2209
+    stepper->printStats();
+#endif
+#ifdef IMU_FUSION
+    if (accelWorking) {
+        imuStats.print();
+        imu->printStats();
+    }
+#endif
+#if defined(DW1000_ANCHOR) || defined(DW1000_TAG)
+    DW1000::ResultQueue &results = dw1000->getResults();
+    Debug.printf("results  queued %u/%u, high water %u, dropped %lu\n", (unsigned)results.size(), (unsigned)results.capacity(),
+                 (unsigned)results.getHighWaterMark(), (unsigned long)results.getDropped());
+    dw1000->printProfile();
+    homeAssistant->printStats();
+#endif
+}
+
 
 
 
@@ -66,14 +185,29 @@ void setup() {
     preferences->begin("dw1000", false);
 
   #ifdef MOTOR_TMC2209
-  
+    Serial1.begin(115200, SERIAL_8N1, TMC_RX_PIN, TMC_TX_PIN);
+    // microsteps change the steps per rev, so before the limits
+    bool driverWorking = stepper->beginDriver(&Serial1, Motor::DriverConfig{(uint16_t)preferences->getUInt("motorCurrent", 800),
+        preferences->getFloat("motorHold", 0.5), (uint16_t)preferences->getUInt("motorMicrosteps", 16), preferences->getFloat("motorChopSpeed", 90),
+        (uint8_t)preferences->getUInt("motorStall", 80), preferences->getFloat("motorHomeSpeed", 45), preferences->getFloat("motorHomeAngle", 0)});
+    stepper->setLimits(preferences->getFloat("motorSpeed", 180), preferences->getFloat("motorAccel", 360));
+  #ifdef MOTOR_RMT
+    // the RMT makes the pulses, motorTask keeps it fed, see below
+    stepper->begin();
+  #else
         // register timer interrupt for motor
     hw_timer_t *timer = NULL;
     timer = timerBegin(0, 80, true);
     timerAttachInterrupt(timer, interrupt, true);
+    // the motor reprograms this for every step, from its speed profile
+    stepper->begin(timer);
     timerAlarmWrite(timer, 1000, true);
     timerAlarmEnable(timer);
-    
+  #endif
+    // needs a hard stop to find, so off unless asked for
+    if (driverWorking && preferences->getBool("motorHoming", false)) {
+        stepper->startHoming();
+    }
   #endif
     
 
@@ -103,10 +237,17 @@ void setup() {
         Serial.println("LSM6DSLTR found at 0x6B");
         accelWorking = true;
         
+#ifdef IMU_FUSION
+        // a burst read of both sensors every 5ms is too much for 100kHz
+        Wire.setClock(400000);
+        imu = new Imu(preferences);
+        accelWorking = imu->begin(&Wire, 0x6B);
+#else
         lsm6dsl.begin_I2C(0x6B, &Wire);
         lsm_temp = lsm6dsl.getTemperatureSensor();
         lsm_accel = lsm6dsl.getAccelerometerSensor();
         lsm_gyro = lsm6dsl.getGyroSensor();
+#endif
     } else {
         Serial.println("LSM6DSLTR not found at 0x6B - is it broken?");
     }
@@ -130,27 +271,52 @@ void setup() {
     homeAssistant = new HomeAssistant(preferences, dw1000);
     #endif
     
+#ifdef IMU_FUSION
+    if (accelWorking) {
+        homeAssistant->setImu(imu);
+    }
+#endif
     homeAssistant->connect();
     
 #endif
-}
 
-void loop() {
-  network.handle();
-  
-// if anchor or tag run actual program
+#ifdef MOTOR_TMC2209
+    Debug.setHelpProjectsCmds("stats - per task CPU load, stack, result queue high water marks and ranging phase timings\n"
+                              "motorbench - CPU cost of step generation at rising step rates, turns the motor\n"
+                              "motorhome - find the motor's end stop with StallGuard");
+#else
+    Debug.setHelpProjectsCmds("stats - per task CPU load, stack, result queue high water marks and ranging phase timings");
+#endif
+    Debug.setCallBackProjectCmds(&processDebugCommand);
+
+    TaskHandle_t handle;
 #if defined(DW1000_ANCHOR) || defined(DW1000_TAG)
-  dw1000->handle();
-  homeAssistant->handle();
+    xTaskCreatePinnedToCore(rangingTask, "ranging", TASK_STACK_SIZE, NULL, RANGING_TASK_PRIORITY, &handle, RANGING_CORE);
+    rangingStats.setHandle(handle);
+    dw1000->setTaskToWake(handle);
 #endif
+    xTaskCreatePinnedToCore(networkTask, "network", TASK_STACK_SIZE, NULL, NETWORK_TASK_PRIORITY, &handle, NETWORK_CORE);
+    networkStats.setHandle(handle);
+#ifdef IMU_FUSION
+    if (accelWorking) {
+        xTaskCreatePinnedToCore(imuTask, "imu", TASK_STACK_SIZE, NULL, IMU_TASK_PRIORITY, &handle, NETWORK_CORE);
+        imuStats.setHandle(handle);
+    }
+#endif
+#ifdef MOTOR_RMT
+    xTaskCreatePinnedToCore(motorTask, "motor", TASK_STACK_SIZE, NULL, MOTOR_TASK_PRIORITY, &handle, NETWORK_CORE);
+#endif
+}
 
+void loop() {
+  // ranging and networking have their own tasks now, see setup()
 #ifdef MOTOR_TMC2209
-  // rotate 1 degree
-  //stepper->step();
-  // toggle step pin
-  digitalWrite(STEP_PIN, !digitalRead(STEP_PIN));
+  stepper->handle();
 #endif
 
+  // don't spin, the ranging task shares this core
+  vTaskDelay(1);
+
   
   /*if(compassWorking) {
     compass.read();
@@ -0,0 +1,101 @@
+#include "motionplanner.hpp"
+
+#include <math.h>
+
+MotionPlanner::MotionPlanner()
+{
+    mPosition = 0;
+    mTarget = 0;
+    mDirection = 1;
+    mRamp = 0;
+    mInterval = 0;
+    mFraction = 0;
+    this->setLimits(1000, 1000);
+}
+
+void MotionPlanner::setLimits(float maxSpeed, float acceleration)
+{
+    // 0.676 corrects the first step for the recurrence's error at small n
+    mFirstInterval = (uint32_t)(0.676f * sqrtf(2.0f / acceleration) * 1e6f * (1 << FRACTION_BITS));
+    mMinInterval = (uint32_t)(1e6f / maxSpeed * (1 << FRACTION_BITS));
+    if (mMinInterval > mFirstInterval)
+    {
+        mMinInterval = mFirstInterval;
+    }
+}
+
+void MotionPlanner::setPosition(int32_t position)
+{
+    if (mRamp != 0)
+    {
+        return;
+    }
+    mPosition = position;
+    mTarget = position;
+}
+
+uint32_t MotionPlanner::next(int8_t *direction)
+{
+    int32_t distance = mTarget - mPosition;
+    if (mRamp == 0)
+    {
+        if (distance == 0)
+        {
+            return 0;
+        }
+        mDirection = distance > 0 ? 1 : -1;
+    }
+
+    bool towards = (distance > 0 && mDirection > 0) || (distance < 0 && mDirection < 0);
+    if (!towards && mRamp <= 1)
+    {
+        // slow enough to stop dead, and either there or the target is behind us
+        mRamp = 0;
+        if (distance == 0)
+        {
+            return 0;
+        }
+        mDirection = distance > 0 ? 1 : -1;
+        towards = true;
+    }
+    uint32_t remaining = towards ? (uint32_t)(distance > 0 ? distance : -distance) : 0;
+
+    if (mRamp > 0 && (!towards || mRamp >= remaining || mInterval < mMinInterval))
+    {
+        // decelerate: overshooting, about to arrive, or the top speed was lowered
+        if (mRamp > 1)
+        {
+            // the acceleration step run backwards, c[n-1] = c[n] + 2 c[n] / (4n - 1) with n = mRamp - 1
+            mInterval += 2 * mInterval / (4 * mRamp - 5);
+        }
+        mRamp--;
+    }
+    else if (mRamp == 0)
+    {
+        mInterval = mFirstInterval;
+        mRamp = 1;
+    }
+    else if (mInterval > mMinInterval)
+    {
+        // mInterval is c[mRamp - 1]
+        uint32_t interval = mInterval - 2 * mInterval / (4 * mRamp + 1);
+        if (interval <= mMinInterval)
+        {
+            // top speed reached part way through this step, close enough to leave the ramp where it is
+            mInterval = mMinInterval;
+        }
+        else
+        {
+            mInterval = interval;
+            mRamp++;
+        }
+    }
+
+    mPosition += mDirection;
+    *direction = mDirection;
+    // carry the fraction of a us over to the next step, so the timing doesn't run fast by up to a us every step
+    uint32_t interval = mInterval + mFraction;
+    uint32_t us = interval >> FRACTION_BITS;
+    mFraction = interval & ((1 << FRACTION_BITS) - 1);
+    return us > 0 ? us : 1;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Trapezoidal speed profile for a stepper, one step at a time: accelerate, cruise at the top speed, decelerate onto the target.
+ * The target can move at any time, including behind the motor, which then slows to a stop before reversing.
+ *
+ * Step intervals follow D. Austin's recurrence, c[n] = c[n-1] - 2 c[n-1] / (4n + 1), in fixed point.
+ * next() is meant for the step timer's ISR, and ESP32 ISRs can't touch the FPU, so it's all integer.
+ * setLimits() does the float maths once, outside the ISR.
+ *
+ * No Arduino dependencies, so it also builds on the host.
+ */
+class MotionPlanner
+{
+public:
+    MotionPlanner();
+
+    // steps/s and steps/s^2
+    void setLimits(float maxSpeed, float acceleration);
+    // only while stopped, moves the target along with it
+    void setPosition(int32_t position);
+    void moveTo(int32_t target) { mTarget = target; }
+    // stops dead where it is, for when the motor already has, against an end stop
+    void halt()
+    {
+        mRamp = 0;
+        mTarget = mPosition;
+    }
+
+    /**
+     * Decides the step to make now. Returns us until the next call, and sets direction to +1/-1 for the step to make,
+     * or returns 0 with nothing to do while stopped on the target.
+     */
+    uint32_t next(int8_t *direction);
+
+    int32_t getPosition() { return mPosition; }
+    int32_t getTarget() { return mTarget; }
+    bool isMoving() { return mRamp != 0 || mPosition != mTarget; }
+
+private:
+    // intervals are us * 256
+    static const uint8_t FRACTION_BITS = 8;
+
+    int32_t mPosition;
+    int32_t mTarget;
+    int8_t mDirection;
+    // steps it takes to stop from the current speed, 0 when stopped
+    uint32_t mRamp;
+    uint32_t mInterval;
+    // of the last interval's us, not yet waited
+    uint32_t mFraction;
+    uint32_t mFirstInterval;
+    uint32_t mMinInterval;
+};
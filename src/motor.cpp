@@ -2,70 +2,408 @@
 #include <Arduino.h>
 #include "network.hpp"
 
-Motor::Motor(uint8_t stepPin, uint8_t dirPin, uint32_t stepsPerRev) {
+// 2.5 rev/s up to 20 at 10000 steps/rev, the ISR backend runs out of CPU well before the top
+const uint32_t Motor::BENCHMARK_RATES[Motor::BENCHMARK_STEPS] = {1000, 5000, 10000, 20000, 40000};
+
+Motor::Motor(uint8_t stepPin, uint8_t dirPin, uint32_t fullStepsPerRev) {
     mStepPin = stepPin;
     mDirPin = dirPin;
-    mStepsPerRev = stepsPerRev;
-    mCurrentPosition = 0;
-    mStepsRemaining = 0;
+    mFullStepsPerRev = fullStepsPerRev;
+    mStepsPerRev = fullStepsPerRev * DEFAULT_MICROSTEPS;
+    mDriver = NULL;
+    mDriverConfig = DriverConfig{0, 0, DEFAULT_MICROSTEPS, 0, 0, 0, 0};
     mInitialized = false;
+    mDirection = 1;
+    mMaxSpeed = 0;
+    mAcceleration = 0;
+#ifdef MOTOR_RMT
+    mPendingInterval = 0;
+    mPendingDirection = 1;
+#else
+    mTimer = NULL;
+#endif
+    mSteps = 0;
+    mBusyMicros = 0;
+    mLastStatsMicros = micros();
+    mLastSteps = 0;
+    mLastBusyMicros = 0;
+    mBenchmarkRequested = false;
+    mBenchmarkStep = BENCHMARK_STEPS;
+    mBenchmarkMeasuring = false;
+    mBenchmarkSince = 0;
+    mBenchmarkSteps = 0;
+    mBenchmarkBusyMicros = 0;
+    mBenchmarkStart = 0;
+    mHomingRequested = false;
+    mHoming = false;
+    mHomingSince = 0;
+    mLastStallPoll = 0;
     pinMode(stepPin, OUTPUT);
     pinMode(dirPin, OUTPUT);
+    digitalWrite(stepPin, LOW);
+    digitalWrite(dirPin, LOW);
 }
 
-void Motor::motorInterrupt() {
-    boolean currentStepPin = digitalRead(mStepPin);
-    boolean currentDirPin = digitalRead(mDirPin);
-    if(mStepsRemaining != 0) {
-        pinMode(mStepPin, OUTPUT);
-        digitalWrite(mStepPin, !currentStepPin);
-        if(currentStepPin) {
-            // we've completed a step
-            int inc = currentDirPin ? -1 : 1;
-            if(mCurrentPosition == 0 && inc == -1) {
-                mCurrentPosition = mStepsPerRev;
-            } else if(mCurrentPosition == mStepsPerRev && inc == 1) {
-                mCurrentPosition = 0;
+bool Motor::beginDriver(HardwareSerial *serial, const DriverConfig &config) {
+    mDriverConfig = config;
+    mStepsPerRev = mFullStepsPerRev * config.microsteps;
+
+    TMC2209Stepper *driver = new TMC2209Stepper(serial, R_SENSE, DRIVER_ADDRESS);
+    driver->begin();
+    if(driver->test_connection() != 0) {
+        debugE("TMC2209 not answering on UART, running on its pin defaults");
+        delete driver;
+        return false;
+    }
+
+    driver->toff(4);
+    driver->blank_time(24);
+    // PDN_UART is the UART, so no standstill power down through it, and the current comes from here rather than VREF
+    driver->pdn_disable(true);
+    driver->I_scale_analog(false);
+    driver->mstep_reg_select(true);
+    driver->microsteps(config.microsteps);
+    driver->rms_current(config.runCurrent, config.holdFraction);
+
+    // StealthChop, handing over to SpreadCycle once TSTEP drops below TPWMTHRS
+    driver->en_spreadCycle(false);
+    driver->pwm_autoscale(true);
+    driver->pwm_autograd(true);
+    driver->TPWMTHRS(config.spreadCycleSpeed > 0 ? this->toTstep(config.spreadCycleSpeed) : 0);
+    // StallGuard at any speed, it only runs in StealthChop anyway
+    driver->TCOOLTHRS(MAX_TSTEP);
+    driver->SGTHRS(config.stallThreshold);
+    if(config.spreadCycleSpeed > 0 && config.homeSpeed >= config.spreadCycleSpeed) {
+        debugE("motor home speed %f deg/s is in SpreadCycle, StallGuard won't see the end stop", config.homeSpeed);
+    }
+
+    mDriver = driver;
+    debugV("TMC2209 at %u mA, %u microsteps, SpreadCycle above %f deg/s", config.runCurrent, config.microsteps, config.spreadCycleSpeed);
+    return true;
+}
+
+uint32_t Motor::toTstep(float speed) {
+    // TSTEP counts driver clocks per 1/256 microstep
+    float tstep = (float)DRIVER_CLOCK * mDriverConfig.microsteps * 360 / (256.0f * speed * mStepsPerRev);
+    return tstep >= MAX_TSTEP ? MAX_TSTEP : (uint32_t)tstep;
+}
+
+#ifdef MOTOR_RMT
+void Motor::begin() {
+    rmt_config_t config = RMT_DEFAULT_CONFIG_TX((gpio_num_t)mStepPin, RMT_CHANNEL);
+    // 80 MHz APB clock down to 1 us ticks, the planner's unit
+    config.clk_div = 80;
+    config.mem_block_num = RMT_MEMORY_BLOCKS;
+    rmt_config(&config);
+    rmt_driver_install(RMT_CHANNEL, 0, 0);
+}
+
+void Motor::feed() {
+    uint32_t start = micros();
+    size_t count = 0;
+    uint32_t duration = 0;
+    uint32_t steps = 0;
+    int8_t blockDirection = mDirection;
+
+    while(count < BLOCK_ITEMS && duration < BLOCK_US) {
+        uint32_t interval = mPendingInterval;
+        int8_t direction = mPendingDirection;
+        if(interval == 0) {
+            // one step at a time, so update() never waits on a whole block
+            portENTER_CRITICAL(&mLock);
+            interval = mPlanner.next(&direction);
+            portEXIT_CRITICAL(&mLock);
+            if(interval == 0) {
+                break;
             }
-            mCurrentPosition += inc;
-            
-            mStepsRemaining += currentDirPin ? 1 : -1;
         }
-    } else {
-        // set to input to prevent glitching
-        pinMode(mStepPin, INPUT);
+        mPendingInterval = 0;
+        if(interval <= PULSE_US) {
+            interval = PULSE_US + 1;
+        }
+
+        // the low time is spread evenly over as many halves as it needs, a zero duration would end the block early
+        uint32_t low = interval - PULSE_US;
+        uint32_t extra = low <= MAX_DURATION ? 0 : (low - MAX_DURATION + 2 * MAX_DURATION - 1) / (2 * MAX_DURATION);
+        if(count + 1 + extra > BLOCK_ITEMS || (steps > 0 && direction != blockDirection)) {
+            // DIR can only change between blocks
+            mPendingInterval = interval;
+            mPendingDirection = direction;
+            break;
+        }
+        blockDirection = direction;
+
+        uint32_t halves = 2 * extra + 1;
+        uint32_t part = low / halves;
+        uint32_t remainder = low % halves;
+        mItems[count].level0 = 1;
+        mItems[count].duration0 = PULSE_US;
+        mItems[count].level1 = 0;
+        mItems[count].duration1 = part + (remainder > 0 ? 1 : 0);
+        count++;
+        for(uint32_t half = 1; half < halves; half += 2) {
+            mItems[count].level0 = 0;
+            mItems[count].duration0 = part + (half < remainder ? 1 : 0);
+            mItems[count].level1 = 0;
+            mItems[count].duration1 = part + (half + 1 < remainder ? 1 : 0);
+            count++;
+        }
+        duration += interval;
+        steps++;
     }
-    
+
+    if(count == 0) {
+        mBusyMicros += micros() - start;
+        // stopped, look for a new target next tick
+        vTaskDelay(1);
+        return;
+    }
+
+    uint32_t busy = micros() - start;
+    // the block before this one is still going out, the wait costs no CPU
+    rmt_wait_tx_done(RMT_CHANNEL, portMAX_DELAY);
+    start = micros();
+    if(blockDirection != mDirection) {
+        mDirection = blockDirection;
+        digitalWrite(mDirPin, blockDirection > 0 ? LOW : HIGH);
+    }
+    // fits in the channel's memory, so this copies the block in and returns without the driver refilling from mItems
+    rmt_write_items(RMT_CHANNEL, mItems, count, false);
+    mBusyMicros += busy + micros() - start;
+    mSteps += steps;
+}
+#else
+void Motor::begin(hw_timer_t *timer) {
+    mTimer = timer;
 }
 
-void Motor::update(int angle) {
+// one step per interrupt, the timer is reprogrammed with the interval to the next one
+void Motor::motorInterrupt() {
+    uint32_t start = micros();
+    int8_t direction;
+    portENTER_CRITICAL_ISR(&mLock);
+    uint32_t interval = mPlanner.next(&direction);
+    portEXIT_CRITICAL_ISR(&mLock);
+
+    if(interval == 0) {
+        timerAlarmWrite(mTimer, IDLE_INTERVAL_US, true);
+        mBusyMicros += micros() - start;
+        return;
+    }
+
+    if(direction != mDirection) {
+        mDirection = direction;
+        digitalWrite(mDirPin, direction > 0 ? LOW : HIGH);
+    }
+    digitalWrite(mStepPin, HIGH);
+    // doubles as the step pulse width, the driver only needs 100ns
+    timerAlarmWrite(mTimer, interval, true);
+    digitalWrite(mStepPin, LOW);
+    mSteps++;
+    mBusyMicros += micros() - start;
+}
+#endif
+
+void Motor::setLimits(float maxSpeed, float acceleration) {
+    // the float maths happens here, the step generator only does integer steps
+    portENTER_CRITICAL(&mLock);
+    mPlanner.setLimits(maxSpeed * mStepsPerRev / 360, acceleration * mStepsPerRev / 360);
+    portEXIT_CRITICAL(&mLock);
+    mMaxSpeed = maxSpeed;
+    mAcceleration = acceleration;
+    debugV("motor limits %f deg/s, %f deg/s^2", maxSpeed, acceleration);
+}
+
+void Motor::update(float angle) {
+    int32_t target = (int32_t)(angle * mStepsPerRev / 360);
+
+    portENTER_CRITICAL(&mLock);
+    if(mHoming) {
+        portEXIT_CRITICAL(&mLock);
+        debugV("Homing, ignoring motor angle %f", angle);
+        return;
+    }
     if(mInitialized == false) {
         mInitialized = true;
 
         // first angle set, use this as the current position
-        mCurrentPosition = angle * mStepsPerRev / 360;
-        mStepsRemaining = 0;
+        mPlanner.setPosition(target);
+        portEXIT_CRITICAL(&mLock);
+        return;
+    }
+
+    // shortest way round from where we're already headed
+    int32_t goal = mPlanner.getTarget();
+    int32_t distance = (target - goal) % (int32_t)mStepsPerRev;
+    if(distance > (int32_t)mStepsPerRev / 2) {
+        distance -= mStepsPerRev;
+    } else if(distance < -(int32_t)mStepsPerRev / 2) {
+        distance += mStepsPerRev;
+    }
+    mPlanner.moveTo(goal + distance);
+    int32_t position = mPlanner.getPosition();
+    portEXIT_CRITICAL(&mLock);
+
+    debugV("Updating motor to angle %f, current position %d, steps remaining: %d", angle, position, goal + distance - position);
+}
+
+float Motor::getAngle() {
+    portENTER_CRITICAL(&mLock);
+    int32_t position = mPlanner.getPosition();
+    portEXIT_CRITICAL(&mLock);
+    int32_t step = position % (int32_t)mStepsPerRev;
+    if(step < 0) {
+        step += mStepsPerRev;
+    }
+    return step * 360.0f / mStepsPerRev;
+}
+
+void Motor::startBenchmark() {
+    // the debug command runs on the network task, handle() picks it up
+    mBenchmarkRequested = true;
+}
+
+void Motor::startBenchmarkRate() {
+    uint32_t rate = BENCHMARK_RATES[mBenchmarkStep];
+    portENTER_CRITICAL(&mLock);
+    // a quarter of a second to get up to speed, and far enough ahead to still be cruising when measuring ends
+    mPlanner.setLimits(rate, rate * 4.0f);
+    mPlanner.moveTo(mPlanner.getPosition() + (int32_t)rate * 3);
+    portEXIT_CRITICAL(&mLock);
+    mBenchmarkMeasuring = false;
+    mBenchmarkSince = micros();
+}
+
+void Motor::startHoming() {
+    // the debug command runs on the network task, handle() picks it up
+    mHomingRequested = true;
+}
+
+void Motor::handleHoming() {
+    uint32_t now = millis();
+    if(now - mHomingSince < HOMING_SPINUP_MS || now - mLastStallPoll < HOMING_POLL_MS) {
         return;
-    }    
+    }
+    mLastStallPoll = now;
 
-    int targetPosition = angle * mStepsPerRev / 360;
-    int distance = targetPosition - (mCurrentPosition + mStepsRemaining);
-    int clockwiseDistance = (distance + mStepsPerRev) % mStepsPerRev;
-    int counterClockwiseDistance = abs((int)((mStepsPerRev - clockwiseDistance) % mStepsPerRev));
+    // the driver flags a stall at SG_RESULT <= 2 * SGTHRS
+    uint16_t load = mDriver->SG_RESULT();
+    bool stalled = load <= 2 * (uint16_t)mDriverConfig.stallThreshold;
+    portENTER_CRITICAL(&mLock);
+    bool moving = mPlanner.isMoving();
+    portEXIT_CRITICAL(&mLock);
+    if(!stalled && moving) {
+        return;
+    }
 
-    debugV("motor Clockwise distance: %d, Counter clockwise distance: %d", clockwiseDistance, counterClockwiseDistance);
+    int32_t home = (int32_t)(mDriverConfig.homeAngle * mStepsPerRev / 360);
+    portENTER_CRITICAL(&mLock);
+    mPlanner.halt();
+    if(stalled) {
+        mPlanner.setPosition(home);
+        mInitialized = true;
+    }
+    mHoming = false;
+    portEXIT_CRITICAL(&mLock);
+    this->setLimits(mMaxSpeed, mAcceleration);
 
-    if(clockwiseDistance < counterClockwiseDistance) {
-        mStepsRemaining += clockwiseDistance;
+    if(stalled) {
+        debugV("motor homed at %f deg, StallGuard %u", mDriverConfig.homeAngle, load);
     } else {
-        mStepsRemaining -= counterClockwiseDistance;
+        debugE("motor found no end stop within a turn, the first angle is zero again");
     }
+}
 
-    if(mStepsRemaining > 0) {
-        digitalWrite(mDirPin, LOW);
-    } else {
-        digitalWrite(mDirPin, HIGH);
+void Motor::handle() {
+    if(mHomingRequested) {
+        mHomingRequested = false;
+        if(mDriver == NULL) {
+            debugE("motor can't home without the TMC2209 UART");
+        } else if(!mHoming && mBenchmarkStep == BENCHMARK_STEPS) {
+            portENTER_CRITICAL(&mLock);
+            mPlanner.setLimits(mDriverConfig.homeSpeed * mStepsPerRev / 360, mAcceleration * mStepsPerRev / 360);
+            // a bit over a turn finds the stop from anywhere
+            mPlanner.moveTo(mPlanner.getPosition() - (int32_t)mStepsPerRev * 11 / 10);
+            mHoming = true;
+            portEXIT_CRITICAL(&mLock);
+            mHomingSince = millis();
+            mLastStallPoll = 0;
+        }
+    }
+    if(mHoming) {
+        this->handleHoming();
     }
 
-    debugV("Updating motor to angle %d, current position %d, steps remaining: %d", angle, mCurrentPosition, mStepsRemaining);
-}
\ No newline at end of file
+    if(mBenchmarkRequested) {
+        mBenchmarkRequested = false;
+        if(mBenchmarkStep == BENCHMARK_STEPS && !mHoming) {
+            portENTER_CRITICAL(&mLock);
+            mBenchmarkStart = mPlanner.getTarget();
+            portEXIT_CRITICAL(&mLock);
+#ifdef MOTOR_RMT
+            Debug.printf("motor    benchmark, RMT step generator\n");
+#else
+            Debug.printf("motor    benchmark, timer ISR step generator\n");
+#endif
+            mBenchmarkStep = 0;
+            startBenchmarkRate();
+        }
+    }
+    if(mBenchmarkStep == BENCHMARK_STEPS) {
+        return;
+    }
+
+    uint32_t elapsed = micros() - mBenchmarkSince;
+    if(!mBenchmarkMeasuring) {
+        if(elapsed >= BENCHMARK_SETTLE_MS * 1000) {
+            mBenchmarkMeasuring = true;
+            mBenchmarkSince = micros();
+            mBenchmarkSteps = mSteps;
+            mBenchmarkBusyMicros = mBusyMicros;
+        }
+        return;
+    }
+    if(elapsed < BENCHMARK_MEASURE_MS * 1000) {
+        return;
+    }
+
+    uint32_t steps = mSteps - mBenchmarkSteps;
+    uint32_t busy = mBusyMicros - mBenchmarkBusyMicros;
+    Debug.printf("motor    %5lu steps/s asked, %5lu made, %4lu ns CPU per step, load %5.1f%%\n", (unsigned long)BENCHMARK_RATES[mBenchmarkStep],
+                 (unsigned long)(steps * 1000000ULL / elapsed), (unsigned long)(steps == 0 ? 0 : busy * 1000ULL / steps), 100.0f * busy / elapsed);
+
+    mBenchmarkStep++;
+    if(mBenchmarkStep < BENCHMARK_STEPS) {
+        startBenchmarkRate();
+        return;
+    }
+
+    // back to the preference limits, and the short way round to the angle it started at
+    this->setLimits(mMaxSpeed, mAcceleration);
+    portENTER_CRITICAL(&mLock);
+    int32_t position = mPlanner.getPosition();
+    int32_t distance = (mBenchmarkStart - position) % (int32_t)mStepsPerRev;
+    if(distance > (int32_t)mStepsPerRev / 2) {
+        distance -= mStepsPerRev;
+    } else if(distance < -(int32_t)mStepsPerRev / 2) {
+        distance += mStepsPerRev;
+    }
+    mPlanner.moveTo(position + distance);
+    portEXIT_CRITICAL(&mLock);
+}
+
+void Motor::printStats() {
+    uint32_t now = micros();
+    uint32_t steps = mSteps;
+    uint32_t busy = mBusyMicros;
+    uint32_t elapsed = now - mLastStatsMicros;
+    uint32_t madeSteps = steps - mLastSteps;
+    uint32_t busyMicros = busy - mLastBusyMicros;
+
+    Debug.printf("motor    %lu steps/s, %lu ns CPU per step, load %5.1f%%\n", (unsigned long)(elapsed == 0 ? 0 : madeSteps * 1000000ULL / elapsed),
+                 (unsigned long)(madeSteps == 0 ? 0 : busyMicros * 1000ULL / madeSteps), elapsed == 0 ? 0 : 100.0f * busyMicros / elapsed);
+
+    mLastStatsMicros = now;
+    mLastSteps = steps;
+    mLastBusyMicros = busy;
+}
@@ -1,20 +1,154 @@
 #pragma once
 #include <Arduino.h>
+#include <TMCStepper.h>
+#ifdef MOTOR_RMT
+#include <driver/rmt.h>
+#endif
 
+#include "motionplanner.hpp"
+
+/**
+ * Two ways to make the step pulses:
+ * - default, a timer ISR makes every step itself
+ * - with -DMOTOR_RMT, feed() fills blocks of pulses from a task and the RMT peripheral plays them out,
+ *   so the CPU only wakes once per block. getAngle() then runs up to a block ahead of the shaft.
+ */
 class Motor {
     public:
-    Motor(uint8_t stepPin, uint8_t dirPin, uint32_t stepsPerRev);
-    void update(int angle);
+    typedef struct {
+        uint16_t runCurrent;    // mA RMS
+        float holdFraction;     // of runCurrent, while stopped
+        uint16_t microsteps;
+        float spreadCycleSpeed; // degrees/s, quiet StealthChop below, SpreadCycle's torque above, 0 for StealthChop only
+        uint8_t stallThreshold; // SGTHRS, higher stalls sooner
+        float homeSpeed;        // degrees/s, below spreadCycleSpeed as StallGuard only works in StealthChop
+        float homeAngle;        // degrees, where the end stop is
+    } DriverConfig;
 
+    // full steps per turn of whatever the motor turns, microsteps come from the driver config
+    Motor(uint8_t stepPin, uint8_t dirPin, uint32_t fullStepsPerRev);
+    /**
+     * Sets up the TMC2209 over its UART, before setLimits() and begin() as the microsteps change the steps per rev.
+     * False if the driver doesn't answer, it then runs on its pin strapped defaults and can't home.
+     */
+    bool beginDriver(HardwareSerial *serial, const DriverConfig &config);
+#ifdef MOTOR_RMT
+    // sets up the RMT channel, after that feed() has to be called in a loop from its own task
+    void begin();
+    // fills and queues the next block of pulses, blocks until the RMT can take it
+    void feed();
+#else
+    /**
+     * Takes over the step timer, which has to tick in us. The ISR reprograms it for every step.
+     */
+    void begin(hw_timer_t *timer);
     void motorInterrupt();
+#endif
+    // degrees/s and degrees/s^2, from the motorSpeed / motorAccel preferences
+    void setLimits(float maxSpeed, float acceleration);
+    // degrees, takes the short way round. Safe to call while moving, the planner slows down first if it has to turn back
+    void update(float angle);
+    // degrees, where the motor actually is
+    float getAngle();
+
+    /**
+     * Turns towards the end stop at homeSpeed until StallGuard trips, then takes that as homeAngle, so angles mean the same
+     * on every boot. Runs from handle(), angles from update() are ignored until it's done.
+     * Gives up after a bit over a turn, leaving the first angle as zero like without homing.
+     */
+    void startHoming();
+
+    /**
+     * Spins the motor up through BENCHMARK_RATES and prints the CPU it takes to make the steps at each over RemoteDebug,
+     * then goes back to where it started. Runs from handle(), so it returns straight away.
+     */
+    void startBenchmark();
+    // drives the benchmark and homing, call every tick or so
+    void handle();
+    // steps/s and CPU load of making them since the previous call, over RemoteDebug
+    void printStats();
 
     private:
+#ifdef MOTOR_RMT
+    static const rmt_channel_t RMT_CHANNEL = RMT_CHANNEL_0;
+    // 2 of the S3's 48 item blocks, so a whole block of pulses fits and the driver never has to refill mid-block
+    static const uint8_t RMT_MEMORY_BLOCKS = 2;
+    static const size_t BLOCK_ITEMS = 64;
+    // keeps a new target from waiting behind a long block at low speed
+    static const uint32_t BLOCK_US = 20000;
+    // us, the driver only needs 100ns but the RMT ticks in us
+    static const uint16_t PULSE_US = 2;
+    // an item's durations are 15 bits
+    static const uint16_t MAX_DURATION = 32767;
+#else
+    // how often the ISR checks for a new target while stopped
+    static const uint32_t IDLE_INTERVAL_US = 1000;
+#endif
+    // the common TMC2209 modules, 0.11 ohm sense resistors and MS1/MS2 low
+    static constexpr float R_SENSE = 0.11f;
+    static const uint8_t DRIVER_ADDRESS = 0;
+    // Hz, the driver's internal clock that TSTEP counts
+    static const uint32_t DRIVER_CLOCK = 12000000;
+    static const uint32_t MAX_TSTEP = 0xFFFFF;
+    // used until beginDriver() says otherwise
+    static const uint16_t DEFAULT_MICROSTEPS = 16;
+    // StallGuard reads nonsense while getting up to speed
+    static const uint32_t HOMING_SPINUP_MS = 300;
+    static const uint32_t HOMING_POLL_MS = 10;
+    static const uint8_t BENCHMARK_STEPS = 5;
+    static const uint32_t BENCHMARK_RATES[BENCHMARK_STEPS]; // steps/s
+    // ms at each rate to get up to speed, then to measure
+    static const uint32_t BENCHMARK_SETTLE_MS = 500;
+    static const uint32_t BENCHMARK_MEASURE_MS = 1000;
+
     boolean mInitialized;
     uint8_t mStepPin;
     uint8_t mDirPin;
+    uint32_t mFullStepsPerRev;
     uint32_t mStepsPerRev;
-    volatile uint32_t mCurrentPosition;
-    volatile int32_t mStepsRemaining;
+    TMC2209Stepper *mDriver;
+    DriverConfig mDriverConfig;
+    int8_t mDirection;
+    float mMaxSpeed;
+    float mAcceleration;
+#ifdef MOTOR_RMT
+    // written by feed() only
+    rmt_item32_t mItems[BLOCK_ITEMS];
+    // a step that didn't fit in the previous block, 0 if none
+    uint32_t mPendingInterval;
+    int8_t mPendingDirection;
+#else
+    hw_timer_t *mTimer;
+#endif
+    // shared between update() and the step generator
+    MotionPlanner mPlanner;
+    portMUX_TYPE mLock = portMUX_INITIALIZER_UNLOCKED;
+
+    // written by the step generator only, these wrap along with micros()
+    volatile uint32_t mSteps;
+    volatile uint32_t mBusyMicros;
+    // owned by whoever calls printStats()
+    uint32_t mLastStatsMicros;
+    uint32_t mLastSteps;
+    uint32_t mLastBusyMicros;
+
+    volatile bool mBenchmarkRequested;
+    // owned by handle(), mBenchmarkStep is BENCHMARK_STEPS while idle
+    uint8_t mBenchmarkStep;
+    bool mBenchmarkMeasuring;
+    uint32_t mBenchmarkSince; // us
+    uint32_t mBenchmarkSteps;
+    uint32_t mBenchmarkBusyMicros;
+    int32_t mBenchmarkStart;
 
+    // set from the network task, the rest is owned by handle(). mHoming is also read by update()
+    volatile bool mHomingRequested;
+    volatile bool mHoming;
+    uint32_t mHomingSince; // ms
+    uint32_t mLastStallPoll; // ms
 
-};
\ No newline at end of file
+    void startBenchmarkRate();
+    void handleHoming();
+    // TSTEP at degrees/s, shorter is faster
+    uint32_t toTstep(float speed);
+};
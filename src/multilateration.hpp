@@ -0,0 +1,228 @@
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+
+/**
+ * Levenberg-Marquardt multilateration solver.
+ * Finds the point that best fits a set of anchor coordinates and the measured distances to them.
+ * Everything is fixed size (the normal equations are always 3x3) so this can run on the tag
+ * every ranging session without touching the heap.
+ * No Arduino dependencies, so it also builds on the host.
+ */
+template <uint8_t MaxAnchors>
+class Multilateration
+{
+public:
+    // need at least 4 anchors for a unique point in 3d space
+    static const uint8_t MIN_ANCHORS = 4;
+
+    typedef struct
+    {
+        float x;
+        float y;
+        float z;
+    } Point;
+
+    typedef struct
+    {
+        bool success;
+        Point position;
+        uint8_t iterations;
+        float rmsError; // m
+    } Result;
+
+    Multilateration() : mCount(0) {}
+
+    void reset() { mCount = 0; }
+
+    uint8_t getMeasurementCount() const { return mCount; }
+
+    /**
+     * Adds an anchor and the measured distance to it, returns false if there is no room left.
+     */
+    bool addMeasurement(const Point &anchor, float distance)
+    {
+        if (mCount >= MaxAnchors)
+        {
+            return false;
+        }
+        mAnchors[mCount] = anchor;
+        mDistances[mCount] = distance;
+        mCount++;
+        return true;
+    }
+
+    /**
+     * Initial guess in the middle of the anchors. Z is half the highest anchor
+     * since anchors are usually mounted up high and tags are somewhere below them.
+     */
+    Point centroid() const
+    {
+        Point guess = {0, 0, 0};
+        if (mCount == 0)
+        {
+            return guess;
+        }
+        float maxZ = mAnchors[0].z;
+        for (uint8_t i = 0; i < mCount; i++)
+        {
+            guess.x += mAnchors[i].x;
+            guess.y += mAnchors[i].y;
+            if (mAnchors[i].z > maxZ)
+            {
+                maxZ = mAnchors[i].z;
+            }
+        }
+        guess.x /= mCount;
+        guess.y /= mCount;
+        guess.z = maxZ / 2;
+        return guess;
+    }
+
+    /**
+     * Runs the solver from the initial guess until the step size drops below tolerance (m).
+     */
+    Result solve(const Point &initialGuess, uint8_t maxIterations = 50, float tolerance = 0.001f) const
+    {
+        Result result = {false, initialGuess, 0, 0};
+        if (mCount < MIN_ANCHORS)
+        {
+            return result;
+        }
+
+        Point p = initialGuess;
+        float cost = this->cost(p);
+        float lambda = 0.001f;
+
+        while (result.iterations < maxIterations)
+        {
+            result.iterations++;
+
+            // normal equations J^T J * delta = -J^T r
+            float jtj[3][3] = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}};
+            float jtr[3] = {0, 0, 0};
+            for (uint8_t i = 0; i < mCount; i++)
+            {
+                float d[3] = {p.x - mAnchors[i].x, p.y - mAnchors[i].y, p.z - mAnchors[i].z};
+                float range = sqrtf(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+                if (range < 1e-6f)
+                {
+                    // sitting right on an anchor, gradient is undefined for this one
+                    continue;
+                }
+                float residual = range - mDistances[i];
+                for (uint8_t r = 0; r < 3; r++)
+                {
+                    float jr = d[r] / range;
+                    jtr[r] += jr * residual;
+                    for (uint8_t c = 0; c < 3; c++)
+                    {
+                        jtj[r][c] += jr * d[c] / range;
+                    }
+                }
+            }
+
+            // marquardt damping - scale by the diagonal so each axis is damped relative to its own curvature
+            float a[3][3];
+            for (uint8_t r = 0; r < 3; r++)
+            {
+                for (uint8_t c = 0; c < 3; c++)
+                {
+                    a[r][c] = jtj[r][c];
+                }
+                a[r][r] += lambda * (jtj[r][r] + 1e-6f);
+            }
+
+            float b[3] = {-jtr[0], -jtr[1], -jtr[2]};
+            float delta[3];
+            if (!solve3x3(a, b, delta))
+            {
+                lambda *= 10;
+                continue;
+            }
+
+            Point candidate = {p.x + delta[0], p.y + delta[1], p.z + delta[2]};
+            float candidateCost = this->cost(candidate);
+            if (candidateCost < cost)
+            {
+                // a poorly constrained axis can zig-zag down a flat valley in steps well over tolerance,
+                // once the fit barely improves the rest is noise
+                bool flat = cost - candidateCost < cost * MIN_IMPROVEMENT;
+                p = candidate;
+                cost = candidateCost;
+                lambda = fmaxf(lambda / 10, 1e-7f);
+
+                float step = sqrtf(delta[0] * delta[0] + delta[1] * delta[1] + delta[2] * delta[2]);
+                if (step < tolerance || flat)
+                {
+                    result.success = true;
+                    break;
+                }
+            }
+            else
+            {
+                lambda *= 10;
+                if (lambda > 1e7f)
+                {
+                    // can't make any more progress from here, we're at the minimum
+                    result.success = true;
+                    break;
+                }
+            }
+        }
+
+        result.position = p;
+        result.rmsError = sqrtf(cost / mCount);
+        return result;
+    }
+
+private:
+    // fraction of the cost an accepted step has to shave off to keep going
+    static constexpr float MIN_IMPROVEMENT = 1e-3f;
+
+    Point mAnchors[MaxAnchors];
+    float mDistances[MaxAnchors];
+    uint8_t mCount;
+
+    // sum of squared residuals
+    float cost(const Point &p) const
+    {
+        float sum = 0;
+        for (uint8_t i = 0; i < mCount; i++)
+        {
+            float dx = p.x - mAnchors[i].x;
+            float dy = p.y - mAnchors[i].y;
+            float dz = p.z - mAnchors[i].z;
+            float residual = sqrtf(dx * dx + dy * dy + dz * dz) - mDistances[i];
+            sum += residual * residual;
+        }
+        return sum;
+    }
+
+    // cramer's rule, returns false if the system is singular (e.g. all anchors coplanar with the guess)
+    static bool solve3x3(const float a[3][3], const float b[3], float x[3])
+    {
+        float det = a[0][0] * (a[1][1] * a[2][2] - a[1][2] * a[2][1]) -
+                    a[0][1] * (a[1][0] * a[2][2] - a[1][2] * a[2][0]) +
+                    a[0][2] * (a[1][0] * a[2][1] - a[1][1] * a[2][0]);
+        if (fabsf(det) < 1e-12f)
+        {
+            return false;
+        }
+
+        x[0] = (b[0] * (a[1][1] * a[2][2] - a[1][2] * a[2][1]) -
+                a[0][1] * (b[1] * a[2][2] - a[1][2] * b[2]) +
+                a[0][2] * (b[1] * a[2][1] - a[1][1] * b[2])) /
+               det;
+        x[1] = (a[0][0] * (b[1] * a[2][2] - a[1][2] * b[2]) -
+                b[0] * (a[1][0] * a[2][2] - a[1][2] * a[2][0]) +
+                a[0][2] * (a[1][0] * b[2] - b[1] * a[2][0])) /
+               det;
+        x[2] = (a[0][0] * (a[1][1] * b[2] - b[1] * a[2][1]) -
+                a[0][1] * (a[1][0] * b[2] - b[1] * a[2][0]) +
+                b[0] * (a[1][0] * a[2][1] - a[1][1] * a[2][0])) /
+               det;
+        return true;
+    }
+};
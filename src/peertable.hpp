@@ -0,0 +1,223 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// smallest power of two at least twice the capacity, keeps the index at most half full
+constexpr uint16_t peerTableIndexSize(uint16_t capacity, uint16_t size = 1)
+{
+    return size >= capacity * 2 ? size : peerTableIndexSize(capacity, size * 2);
+}
+
+/**
+ * Fixed size table of peers keyed by EUI, replaces the linear memcmp scans over fixed arrays.
+ * Entries live in slots that don't move while they're in use, so a slot number can be held on to and iterated over.
+ * Lookups go through an open addressed (linear probing) index, so they're O(1) whatever the capacity.
+ * When full, inserting evicts the peer with the lowest priority (if a priority function is given), least recently used first.
+ *
+ * No Arduino dependencies, so it also builds on the host.
+ */
+template <typename Value, uint16_t Capacity>
+class PeerTable
+{
+    static_assert(Capacity > 0 && Capacity <= 4096, "PeerTable capacity must be between 1 and 4096");
+
+public:
+    // lower is evicted first when the table is full
+    typedef int32_t (*Priority)(const Value &value);
+
+    PeerTable() : mPriority(nullptr) { this->clear(); }
+
+    // without one it's purely least recently used
+    void setPriority(Priority priority) { mPriority = priority; }
+
+    void clear()
+    {
+        for (uint16_t i = 0; i < Capacity; i++)
+        {
+            mEntries[i].used = false;
+        }
+        for (uint16_t i = 0; i < INDEX_SIZE; i++)
+        {
+            mIndex[i] = EMPTY;
+        }
+        mSize = 0;
+        mTombstones = 0;
+    }
+
+    Value *find(const uint8_t eui[8])
+    {
+        int16_t slot = this->findSlot(eui);
+        return slot < 0 ? nullptr : &mEntries[slot].value;
+    }
+
+    /**
+     * Finds the peer, or adds it with a value initialised Value (evicting another if full). created is set if it was added.
+     * Marks it as used at now either way.
+     */
+    Value *insert(const uint8_t eui[8], uint32_t now, bool *created = nullptr)
+    {
+        int16_t slot = this->findSlot(eui);
+        if (created != nullptr)
+        {
+            *created = slot < 0;
+        }
+        if (slot < 0)
+        {
+            if (mSize >= Capacity)
+            {
+                this->remove(this->chooseVictim(now));
+            }
+            // rehash before tombstones make probes long
+            if (mTombstones > INDEX_SIZE / 4)
+            {
+                this->rebuildIndex();
+            }
+
+            for (slot = 0; mEntries[slot].used; slot++)
+                ;
+            Entry &entry = mEntries[slot];
+            memcpy(entry.eui, eui, 8);
+            entry.value = Value();
+            entry.used = true;
+            mSize++;
+
+            uint16_t i = hash(eui) & (INDEX_SIZE - 1);
+            while (mIndex[i] >= 0)
+            {
+                i = (i + 1) & (INDEX_SIZE - 1);
+            }
+            if (mIndex[i] == TOMBSTONE)
+            {
+                mTombstones--;
+            }
+            mIndex[i] = slot;
+        }
+        mEntries[slot].lastUsed = now;
+        return &mEntries[slot].value;
+    }
+
+    void remove(uint16_t slot)
+    {
+        if (slot >= Capacity || !mEntries[slot].used)
+        {
+            return;
+        }
+        uint16_t i = hash(mEntries[slot].eui) & (INDEX_SIZE - 1);
+        while (mIndex[i] != slot)
+        {
+            i = (i + 1) & (INDEX_SIZE - 1);
+        }
+        mIndex[i] = TOMBSTONE;
+        mTombstones++;
+        mEntries[slot].used = false;
+        mSize--;
+    }
+
+    // -1 if it isn't in the table
+    int16_t slotOf(const uint8_t eui[8]) { return this->findSlot(eui); }
+
+    void touch(uint16_t slot, uint32_t now) { mEntries[slot].lastUsed = now; }
+
+    // for iterating, slots 0..capacity() that aren't isUsed() are empty
+    bool isUsed(uint16_t slot) { return mEntries[slot].used; }
+    Value &get(uint16_t slot) { return mEntries[slot].value; }
+    const uint8_t *getEui(uint16_t slot) { return mEntries[slot].eui; }
+    uint16_t size() { return mSize; }
+    static uint16_t capacity() { return Capacity; }
+
+private:
+    static const uint16_t INDEX_SIZE = peerTableIndexSize(Capacity);
+    static const int16_t EMPTY = -1;
+    static const int16_t TOMBSTONE = -2;
+
+    typedef struct
+    {
+        uint8_t eui[8];
+        uint32_t lastUsed;
+        bool used;
+        Value value;
+    } Entry;
+
+    Entry mEntries[Capacity];
+    // slot of the entry, EMPTY or TOMBSTONE
+    int16_t mIndex[INDEX_SIZE];
+    uint16_t mSize;
+    uint16_t mTombstones;
+    Priority mPriority;
+
+    // FNV-1a, the low bytes of an EUI alone are too alike between boards from one batch
+    static uint32_t hash(const uint8_t eui[8])
+    {
+        uint32_t h = 2166136261u;
+        for (uint8_t i = 0; i < 8; i++)
+        {
+            h = (h ^ eui[i]) * 16777619u;
+        }
+        return h;
+    }
+
+    int16_t findSlot(const uint8_t eui[8])
+    {
+        uint16_t i = hash(eui) & (INDEX_SIZE - 1);
+        // the index is never full, so this always hits an EMPTY
+        while (mIndex[i] != EMPTY)
+        {
+            if (mIndex[i] >= 0 && memcmp(mEntries[mIndex[i]].eui, eui, 8) == 0)
+            {
+                return mIndex[i];
+            }
+            i = (i + 1) & (INDEX_SIZE - 1);
+        }
+        return -1;
+    }
+
+    uint16_t chooseVictim(uint32_t now)
+    {
+        uint16_t victim = 0;
+        for (uint16_t slot = 1; slot < Capacity; slot++)
+        {
+            if (mPriority != nullptr)
+            {
+                int32_t priority = mPriority(mEntries[slot].value);
+                int32_t victimPriority = mPriority(mEntries[victim].value);
+                if (priority != victimPriority)
+                {
+                    if (priority < victimPriority)
+                    {
+                        victim = slot;
+                    }
+                    continue;
+                }
+            }
+            // unsigned differences so millis() wrapping around is fine
+            if (now - mEntries[slot].lastUsed > now - mEntries[victim].lastUsed)
+            {
+                victim = slot;
+            }
+        }
+        return victim;
+    }
+
+    void rebuildIndex()
+    {
+        for (uint16_t i = 0; i < INDEX_SIZE; i++)
+        {
+            mIndex[i] = EMPTY;
+        }
+        mTombstones = 0;
+        for (uint16_t slot = 0; slot < Capacity; slot++)
+        {
+            if (!mEntries[slot].used)
+            {
+                continue;
+            }
+            uint16_t i = hash(mEntries[slot].eui) & (INDEX_SIZE - 1);
+            while (mIndex[i] != EMPTY)
+            {
+                i = (i + 1) & (INDEX_SIZE - 1);
+            }
+            mIndex[i] = slot;
+        }
+    }
+};
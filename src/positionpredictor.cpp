@@ -0,0 +1,95 @@
+#include "positionpredictor.hpp"
+
+#include <math.h>
+
+PositionPredictor::PositionPredictor()
+{
+    mConfig = Config{0.15f, 2.0f, 2000, 300};
+    mHasFix = false;
+    mLastUpdate = 0;
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        mAxes[i] = Axis{0, 0, {{0, 0}, {0, 0}}};
+    }
+}
+
+void PositionPredictor::update(const Vector &position, uint32_t now)
+{
+    // unsigned difference so millis() wrapping around is fine
+    uint32_t gap = now - mLastUpdate;
+    if (mHasFix && gap > mConfig.maxGap)
+    {
+        mHasFix = false;
+    }
+    mLastUpdate = now;
+
+    float measured[3] = {position.x, position.y, position.z};
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        Axis &axis = mAxes[i];
+        if (!mHasFix)
+        {
+            // nothing known about the velocity yet, a walking pace either way covers it
+            axis.position = measured[i];
+            axis.velocity = 0;
+            axis.p[0][0] = mConfig.positionNoise * mConfig.positionNoise;
+            axis.p[0][1] = axis.p[1][0] = 0;
+            axis.p[1][1] = 1;
+        }
+        else
+        {
+            this->updateAxis(axis, measured[i], gap / 1000.0f);
+        }
+    }
+    mHasFix = true;
+}
+
+// same predict/update as RangeFilter, only the position is measured
+void PositionPredictor::updateAxis(Axis &axis, float measured, float dt)
+{
+    float q = mConfig.accelNoise * mConfig.accelNoise;
+    float r = mConfig.positionNoise * mConfig.positionNoise;
+    float dt2 = dt * dt;
+    axis.position += axis.velocity * dt;
+    float p00 = axis.p[0][0] + dt * (axis.p[1][0] + axis.p[0][1]) + dt2 * axis.p[1][1] + q * dt2 * dt2 / 4;
+    float p01 = axis.p[0][1] + dt * axis.p[1][1] + q * dt2 * dt / 2;
+    float p11 = axis.p[1][1] + q * dt2;
+
+    float s = p00 + r;
+    float k0 = p00 / s;
+    float k1 = p01 / s;
+    float innovation = measured - axis.position;
+    axis.position += k0 * innovation;
+    axis.velocity += k1 * innovation;
+    axis.p[0][0] = (1 - k0) * p00;
+    axis.p[0][1] = axis.p[1][0] = (1 - k0) * p01;
+    axis.p[1][1] = p11 - k1 * p01;
+}
+
+PositionPredictor::Vector PositionPredictor::getPosition()
+{
+    return Vector{mAxes[0].position, mAxes[1].position, mAxes[2].position};
+}
+
+PositionPredictor::Vector PositionPredictor::getVelocity()
+{
+    return Vector{mAxes[0].velocity, mAxes[1].velocity, mAxes[2].velocity};
+}
+
+PositionPredictor::Vector PositionPredictor::predict(uint32_t at)
+{
+    // signed, so asking for a time just before the fix works too
+    float dt = (int32_t)(at - mLastUpdate) / 1000.0f;
+    return Vector{mAxes[0].position + mAxes[0].velocity * dt, mAxes[1].position + mAxes[1].velocity * dt,
+                  mAxes[2].position + mAxes[2].velocity * dt};
+}
+
+float PositionPredictor::getPredictionError(uint32_t at)
+{
+    const Axis &axis = mAxes[0];
+    float dt = (int32_t)(at - mLastUpdate) / 1000.0f;
+    float q = mConfig.accelNoise * mConfig.accelNoise;
+    float dt2 = dt * dt;
+    float variance = axis.p[0][0] + dt * (axis.p[1][0] + axis.p[0][1]) + dt2 * axis.p[1][1] + q * dt2 * dt2 / 4;
+    return sqrtf(variance);
+}
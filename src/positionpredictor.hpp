@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Tracks a tag's position fixes with a constant velocity Kalman filter per axis, and extrapolates them forward.
+ * By the time a fix has gone over MQTT and turned the motor the tag has moved on, so consumers aim at
+ * predict(fix time + lookAhead) instead of the raw fix.
+ *
+ * Acceleration is white noise in the model: a walking person changes speed and direction too often for a
+ * constant acceleration model to extrapolate anything but noise over a few hundred ms.
+ * A tag that goes quiet for longer than maxGap starts over from its next fix.
+ *
+ * No Arduino dependencies, so it also builds on the host.
+ */
+class PositionPredictor
+{
+public:
+    typedef struct
+    {
+        float x;
+        float y;
+        float z;
+    } Vector;
+
+    typedef struct
+    {
+        float positionNoise; // m, standard deviation of a single fix
+        float accelNoise;    // m/s^2, how hard the tag can change velocity
+        uint32_t maxGap;     // ms
+        uint32_t lookAhead;  // ms, how far ahead consumers want the position
+    } Config;
+
+    PositionPredictor();
+
+    void setConfig(const Config &config) { mConfig = config; }
+    const Config &getConfig() { return mConfig; }
+    void reset() { mHasFix = false; }
+
+    /**
+     * Feeds in a position fix solved at now (ms).
+     */
+    void update(const Vector &position, uint32_t now);
+
+    bool hasFix() { return mHasFix; }
+    // filtered position at the latest fix, m
+    Vector getPosition();
+    // m/s
+    Vector getVelocity();
+    // where the tag is expected to be at (ms), valid after the first update()
+    Vector predict(uint32_t at);
+    // m, standard deviation of the prediction along x, the axes are weighted the same
+    float getPredictionError(uint32_t at);
+
+private:
+    typedef struct
+    {
+        float position;
+        float velocity;
+        float p[2][2];
+    } Axis;
+
+    Config mConfig;
+    bool mHasFix;
+    uint32_t mLastUpdate;
+    Axis mAxes[3];
+
+    void updateAxis(Axis &axis, float measured, float dt);
+};
@@ -0,0 +1,54 @@
+#include "publishpolicy.hpp"
+
+#include <math.h>
+
+PublishPolicy::PublishPolicy() : PublishPolicy(Config{0, false, 0, 0, 0})
+{
+}
+
+PublishPolicy::PublishPolicy(const Config &config)
+{
+    mConfig = config;
+    mHasValue = false;
+    mPending = false;
+    mPublished = false;
+    mValue = 0;
+    mLastPublished = 0;
+    mLastPublishTime = 0;
+    mUpdates = 0;
+    mPublishes = 0;
+}
+
+void PublishPolicy::update(float value)
+{
+    mValue = value;
+    mHasValue = true;
+    mPending = true;
+    mUpdates++;
+}
+
+bool PublishPolicy::poll(uint32_t now, float &value)
+{
+    if (!mHasValue)
+    {
+        return false;
+    }
+
+    // unsigned differences so millis() wrapping around is fine
+    uint32_t sinceLast = now - mLastPublishTime;
+    bool heartbeat = mPublished && mConfig.maxInterval > 0 && sinceLast >= mConfig.maxInterval;
+    bool changed = mPending && (!mPublished || fabsf(mValue - mLastPublished) >= mConfig.deadband);
+    bool allowed = !mPublished || sinceLast >= mConfig.minInterval;
+    if (!heartbeat && !(changed && allowed))
+    {
+        return false;
+    }
+
+    value = mValue;
+    mLastPublished = mValue;
+    mLastPublishTime = now;
+    mPublished = true;
+    mPending = false;
+    mPublishes++;
+    return true;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Decides when a value should actually be published to MQTT, one instance per entity.
+ * New values are coalesced: only the latest one is kept until the policy allows a publish, which happens when
+ * - it has moved at least deadband away from the last published value, and minInterval has passed since that publish, or
+ * - maxInterval has passed since the last publish (heartbeat, so a still value doesn't look stale). 0 disables this.
+ *
+ * No Arduino dependencies, so it also builds on the host.
+ */
+class PublishPolicy
+{
+public:
+    typedef struct
+    {
+        uint8_t qos;
+        bool retain;
+        float deadband;
+        uint32_t minInterval; // ms
+        uint32_t maxInterval; // ms
+    } Config;
+
+    PublishPolicy();
+    PublishPolicy(const Config &config);
+
+    const Config &getConfig() { return mConfig; }
+
+    // a new value is available, replaces any that hasn't been published yet
+    void update(float value);
+    /**
+     * Returns true with the value to publish if it's time to, and counts it as published.
+     */
+    bool poll(uint32_t now, float &value);
+
+    uint32_t getUpdates() { return mUpdates; }
+    uint32_t getPublishes() { return mPublishes; }
+
+private:
+    Config mConfig;
+    bool mHasValue;
+    bool mPending;
+    bool mPublished;
+    float mValue;
+    float mLastPublished;
+    uint32_t mLastPublishTime;
+    uint32_t mUpdates;
+    uint32_t mPublishes;
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+
+/**
+ * The few radio operations the ranging state machine needs.
+ * Nothing in here blocks - completion is reported through pollEvent(), so the state machine
+ * can be driven from handle() and tested on the host against a fake radio.
+ */
+class Radio
+{
+public:
+    typedef enum
+    {
+        NONE,
+        TRANSMIT_DONE,
+        RECEIVE_DONE,
+        RECEIVE_TIMEOUT,
+        RECEIVE_FAILED
+    } Event;
+
+    virtual ~Radio() {}
+
+    /**
+     * Returns the next pending event, or NONE. Call this until it returns NONE.
+     */
+    virtual Event pollEvent() = 0;
+
+    /**
+     * Starts sending a frame, immediately or at the time set up by scheduleTransmit().
+     * With receiveAfter the receiver comes on by itself as soon as the frame is out, for the reply to it.
+     */
+    virtual void transmit(const uint8_t *data, size_t len, bool delayed = false, bool receiveAfter = false) = 0;
+    /**
+     * Sets up a delayed transmit at reference + delayUs (radio time).
+     * Returns the timestamp the frame will actually carry, so it can be put inside the frame before sending it.
+     */
+    virtual uint64_t scheduleTransmit(uint64_t reference, uint32_t delayUs) = 0;
+    virtual void startReceive() = 0;
+    // turns the transmitter/receiver off, e.g. after a timeout
+    virtual void idle() = 0;
+
+    virtual size_t getReceivedData(uint8_t *data, size_t maxLen) = 0;
+    virtual uint64_t getReceiveTimestamp() = 0;
+    /**
+     * getReceivedData() and getReceiveTimestamp() at once, for implementations that can do both in one bus transaction
+     */
+    virtual size_t getReceivedFrame(uint8_t *data, size_t maxLen, uint64_t *received)
+    {
+        size_t len = this->getReceivedData(data, maxLen);
+        *received = this->getReceiveTimestamp();
+        return len;
+    }
+    /**
+     * ppm, how much faster the sender of the frame last read by getReceivedFrame() runs than us, from the carrier
+     * frequency the receiver locked onto. NAN if the radio can't tell.
+     */
+    virtual float getCarrierOffset() { return NAN; }
+    /**
+     * dBm, the estimated receive power of the frame last read by getReceivedFrame(). NAN if the radio can't tell.
+     */
+    virtual float getReceivePower() { return NAN; }
+    virtual uint64_t getTransmitTimestamp() = 0;
+    virtual uint64_t getSystemTimestamp() = 0;
+
+    // true from transmit() until TRANSMIT_DONE
+    bool isTransmitting() { return mTransmitting; }
+    // true from startReceive() until a receive event
+    bool isReceiving() { return mReceiving; }
+
+    // running totals of what went out, for airtime
+    uint32_t getFramesSent() { return mFramesSent; }
+    uint32_t getBytesSent() { return mBytesSent; }
+
+protected:
+    bool mTransmitting = false;
+    bool mReceiving = false;
+    // implementations count every transmit() here
+    uint32_t mFramesSent = 0;
+    uint32_t mBytesSent = 0;
+};
@@ -0,0 +1,95 @@
+#include "rangefilter.hpp"
+
+RangeFilter::RangeFilter()
+{
+    mConfig = Config{0.1f, 1.0f, 5000};
+    mNext = 0;
+    mCount = 0;
+    mLastUpdate = 0;
+    mRange = 0;
+    mVelocity = 0;
+    mP[0][0] = mP[0][1] = mP[1][0] = mP[1][1] = 0;
+}
+
+float RangeFilter::update(float range, uint32_t now)
+{
+    // unsigned difference so millis() wrapping around is fine
+    uint32_t gap = now - mLastUpdate;
+    if (mCount > 0 && gap > mConfig.maxGap)
+    {
+        mCount = 0;
+    }
+    mLastUpdate = now;
+
+    if (mCount == 0)
+    {
+        mNext = 0;
+    }
+    else
+    {
+        // move the older ranges along with the tag, so the median doesn't lag behind a moving tag or hold on to where it was before a gap
+        float moved = mVelocity * gap / 1000.0f;
+        for (uint8_t i = 0; i < mCount; i++)
+        {
+            mWindow[i] += moved;
+        }
+    }
+    mWindow[mNext] = range;
+    mNext = (mNext + 1) % WINDOW;
+    if (mCount < WINDOW)
+    {
+        mCount++;
+    }
+    float measured = this->median();
+
+    float r = mConfig.rangeNoise * mConfig.rangeNoise;
+    if (mCount == 1)
+    {
+        // nothing known about the velocity yet, let the first few ranges settle it
+        mRange = measured;
+        mVelocity = 0;
+        mP[0][0] = r;
+        mP[0][1] = mP[1][0] = 0;
+        mP[1][1] = 1;
+        return mRange;
+    }
+
+    // predict, with the acceleration as white noise
+    float dt = gap / 1000.0f;
+    float q = mConfig.accelNoise * mConfig.accelNoise;
+    float dt2 = dt * dt;
+    mRange += mVelocity * dt;
+    float p00 = mP[0][0] + dt * (mP[1][0] + mP[0][1]) + dt2 * mP[1][1] + q * dt2 * dt2 / 4;
+    float p01 = mP[0][1] + dt * mP[1][1] + q * dt2 * dt / 2;
+    float p11 = mP[1][1] + q * dt2;
+
+    // update, only the range is measured
+    float s = p00 + r;
+    float k0 = p00 / s;
+    float k1 = p01 / s;
+    float innovation = measured - mRange;
+    mRange += k0 * innovation;
+    mVelocity += k1 * innovation;
+    mP[0][0] = (1 - k0) * p00;
+    mP[0][1] = mP[1][0] = (1 - k0) * p01;
+    mP[1][1] = p11 - k1 * p01;
+    return mRange;
+}
+
+// insertion sort of a copy, the window is tiny
+float RangeFilter::median()
+{
+    float sorted[WINDOW];
+    for (uint8_t i = 0; i < mCount; i++)
+    {
+        float value = mWindow[i];
+        uint8_t j = i;
+        for (; j > 0 && sorted[j - 1] > value; j--)
+        {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = value;
+    }
+    // average the middle two of an even count, only while the window fills up
+    return mCount % 2 ? sorted[mCount / 2] : (sorted[mCount / 2 - 1] + sorted[mCount / 2]) / 2;
+}
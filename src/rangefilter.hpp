@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Streaming filter for the ranges of one tag/anchor link, one instance per link.
+ * 1. A median over the last WINDOW raw ranges throws away multipath outliers.
+ * 2. A constant velocity Kalman filter smooths what's left, giving the range and how sure it is of it.
+ *
+ * A link that goes quiet for longer than maxGap starts over from its next range.
+ * The window is moved along with the estimated velocity, so only a real step sees the median's delay of about WINDOW / 2 ranges,
+ * the Kalman filter adds a little more depending on the noise settings.
+ *
+ * No Arduino dependencies, so it also builds on the host.
+ */
+class RangeFilter
+{
+public:
+    static const uint8_t WINDOW = 5;
+
+    typedef struct
+    {
+        float rangeNoise; // m, standard deviation of a single range
+        float accelNoise; // m/s^2, how hard the range rate can change
+        uint32_t maxGap;  // ms
+    } Config;
+
+    RangeFilter();
+
+    void setConfig(const Config &config) { mConfig = config; }
+    void reset() { mCount = 0; }
+
+    /**
+     * Feeds in a raw range measured at now (ms), returns the filtered range.
+     */
+    float update(float range, uint32_t now);
+
+    // valid after the first update()
+    float getRange() { return mRange; }
+    // m^2
+    float getVariance() { return mP[0][0]; }
+    // m/s
+    float getVelocity() { return mVelocity; }
+
+private:
+    Config mConfig;
+    float mWindow[WINDOW];
+    uint8_t mNext;
+    uint8_t mCount;
+    uint32_t mLastUpdate;
+
+    float mRange;
+    float mVelocity;
+    float mP[2][2];
+
+    float median();
+};
@@ -0,0 +1,365 @@
+#include "ranging.hpp"
+
+#include <string.h>
+#include <math.h>
+
+// IEEE 802.15.4 data frame, same first byte as DW1000Ng's DATA
+#define FRAME_DATA 0x41
+#define TIMESTAMP_LENGTH 5
+// DW1000 timestamps are 40 bits and wrap
+#define TIMESTAMP_MASK 0xFFFFFFFFFFULL
+// distance light travels in one DW1000 time unit (~15.65ps), m
+#define DISTANCE_PER_TICK 0.0046917639786159
+#define TICKS_PER_US 63897.6
+#define REPORT_HAS_POSITION 0x01
+// ppm, the DW1000 wants its crystal within 20ppm, so two of them can be 40ppm apart
+#define MAX_CLOCK_OFFSET 50
+// ppm, the timestamps' estimate is good to ~0.1 ppm over an exchange and the carrier integrator to about the same,
+// a 1 ns timestamp error moves the estimate ~0.7 ppm with the default reply times
+#define MAX_CLOCK_DISAGREEMENT 2
+
+TwoWayRanging::TwoWayRanging(Radio &radio) : mRadio(radio)
+{
+    mState = IDLE;
+    mDeadline = 0;
+    mSequence = 0;
+    memset(mEui, 0, sizeof(mEui));
+    mShortId = 0;
+    mPeerShortId = 0;
+    mRangeCorrection = nullptr;
+    memset(mStateTimes, 0, sizeof(mStateTimes));
+    mInitiator = false;
+    mHasPosition = false;
+    mX = mY = mZ = 0;
+    mRange = 0;
+    mClockOffset = 0;
+    mReceivePower = NAN;
+    mReplyTime = 0;
+    mLateReplies = 0;
+}
+
+void TwoWayRanging::setEUI(const uint8_t eui[8])
+{
+    memcpy(mEui, eui, 8);
+    mShortId = shortId(eui);
+}
+
+void TwoWayRanging::setPosition(bool hasPosition, float x, float y, float z)
+{
+    mHasPosition = hasPosition;
+    mX = x;
+    mY = y;
+    mZ = z;
+}
+
+void TwoWayRanging::setState(State state, uint32_t nowUs)
+{
+    mState = state;
+    mDeadline = nowUs + STEP_TIMEOUT_US;
+    mStateTimes[state] = nowUs;
+}
+
+uint64_t TwoWayRanging::scheduleReply(uint64_t received, uint32_t delayUs)
+{
+    uint64_t now = mRadio.getSystemTimestamp();
+    // time left until the reply is due, a wrapped around difference means it's already past
+    uint64_t left = (received + (uint64_t)(delayUs * TICKS_PER_US) - now) & TIMESTAMP_MASK;
+    if (left < MIN_REPLY_LEAD_US * TICKS_PER_US || left > TIMESTAMP_MASK / 2)
+    {
+        // the radio would wait for its clock to come around again, ~17s. A longer reply still ranges fine
+        mLateReplies++;
+        return mRadio.scheduleTransmit(now, MIN_REPLY_LEAD_US);
+    }
+    return mRadio.scheduleTransmit(received, delayUs);
+}
+
+bool TwoWayRanging::startTag(uint16_t anchorShortId, uint32_t nowUs)
+{
+    if (this->isBusy())
+    {
+        return false;
+    }
+
+    mPeerShortId = anchorShortId;
+    mSequence++;
+    mInitiator = true;
+
+    uint8_t poll[POLL_LENGTH] = {FRAME_DATA, POLL, mSequence};
+    writeValue(&poll[3], anchorShortId, 2);
+    memcpy(&poll[5], mEui, 8);
+    mRadio.transmit(poll, sizeof(poll), false, true);
+    this->setState(TAG_SENDING_POLL, nowUs);
+    return true;
+}
+
+bool TwoWayRanging::acceptPoll(const uint8_t *frame, size_t len, uint64_t received, uint32_t nowUs)
+{
+    if (len != POLL_LENGTH || readValue(&frame[3], 2) != mShortId)
+    {
+        return false;
+    }
+
+    mPollReceived = received;
+    mSequence = frame[2];
+    mInitiator = false;
+    memcpy(mTagEui, &frame[5], 8);
+    mPeerShortId = shortId(mTagEui);
+
+    uint8_t response[RESPONSE_LENGTH] = {FRAME_DATA, RESPONSE, mSequence};
+    writeValue(&response[3], mPeerShortId, 2);
+    writeValue(&response[5], mShortId, 2);
+    uint64_t responseSent = this->scheduleReply(received, RESPONSE_DELAY_US);
+    mReplyTime = ((responseSent - received) & TIMESTAMP_MASK) / TICKS_PER_US;
+    mRadio.transmit(response, sizeof(response), true, true);
+    this->setState(ANCHOR_SENDING_RESPONSE, nowUs);
+    return true;
+}
+
+bool TwoWayRanging::onReceive(const uint8_t *frame, size_t len, uint64_t received, uint32_t nowUs, float carrierOffset, float rxPower)
+{
+    if (len < 3 || frame[0] != FRAME_DATA)
+    {
+        return false;
+    }
+
+    switch (mState)
+    {
+    case IDLE:
+        return frame[1] == POLL && this->acceptPoll(frame, len, received, nowUs);
+
+    case TAG_WAITING_RESPONSE:
+    {
+        if (frame[1] != RESPONSE || len != RESPONSE_LENGTH || frame[2] != mSequence ||
+            readValue(&frame[3], 2) != mShortId || readValue(&frame[5], 2) != mPeerShortId)
+        {
+            return false;
+        }
+        mResponseReceived = received;
+
+        // final goes out at a fixed time so its own send time can be put inside it
+        uint64_t finalSent = this->scheduleReply(received, FINAL_DELAY_US);
+        mReplyTime = ((finalSent - received) & TIMESTAMP_MASK) / TICKS_PER_US;
+        uint8_t final[FINAL_LENGTH] = {FRAME_DATA, FINAL, mSequence};
+        writeValue(&final[3], mPeerShortId, 2);
+        writeValue(&final[5], mShortId, 2);
+        writeValue(&final[7], mPollSent, TIMESTAMP_LENGTH);
+        writeValue(&final[12], mResponseReceived, TIMESTAMP_LENGTH);
+        writeValue(&final[17], finalSent, TIMESTAMP_LENGTH);
+        mRadio.transmit(final, sizeof(final), true, true);
+        this->setState(TAG_SENDING_FINAL, nowUs);
+        return true;
+    }
+
+    case TAG_WAITING_REPORT:
+    {
+        RangeReport report;
+        if (!decodeReport(frame, len, report) || report.sequence != mSequence || report.tagShortId != mShortId ||
+            shortId(report.anchorEui) != mPeerShortId)
+        {
+            return false;
+        }
+        mReport = report;
+        this->setState(SUCCEEDED, nowUs);
+        return true;
+    }
+
+    case ANCHOR_WAITING_FINAL:
+    {
+        if (frame[1] != FINAL || len != FINAL_LENGTH || frame[2] != mSequence ||
+            readValue(&frame[3], 2) != mShortId || readValue(&frame[5], 2) != mPeerShortId)
+        {
+            return false;
+        }
+
+        double range;
+        double clockOffset;
+        bool valid = rangeFromFinal(readValue(&frame[7], TIMESTAMP_LENGTH), mPollReceived, mResponseSent, readValue(&frame[12], TIMESTAMP_LENGTH),
+                                    readValue(&frame[17], TIMESTAMP_LENGTH), received, carrierOffset, &range, &clockOffset);
+        mClockOffset = clockOffset;
+        mReceivePower = rxPower;
+        if (!valid)
+        {
+            // one of the six timestamps is off, the range would be garbage. No report, the tag times out
+            this->setState(FAILED, nowUs);
+            return true;
+        }
+        if (mRangeCorrection != nullptr)
+        {
+            range = mRangeCorrection(range, rxPower);
+        }
+        // bad calibration can push short ranges negative
+        if (range <= 0)
+        {
+            range = 0.000001;
+        }
+        mRange = range;
+
+        RangeReport report;
+        report.sequence = mSequence;
+        report.tagShortId = mPeerShortId;
+        memcpy(report.anchorEui, mEui, 8);
+        report.range = mRange;
+        report.hasPosition = mHasPosition;
+        report.x = mX;
+        report.y = mY;
+        report.z = mZ;
+        uint8_t reportFrame[REPORT_LENGTH];
+        encodeReport(report, reportFrame, sizeof(reportFrame));
+        this->scheduleReply(received, REPORT_DELAY_US);
+        mRadio.transmit(reportFrame, sizeof(reportFrame), true);
+        this->setState(ANCHOR_SENDING_REPORT, nowUs);
+        return true;
+    }
+
+    default:
+        return false;
+    }
+}
+
+void TwoWayRanging::onTransmitDone(uint32_t nowUs)
+{
+    switch (mState)
+    {
+    case TAG_SENDING_POLL:
+        mPollSent = mRadio.getTransmitTimestamp();
+        this->setState(TAG_WAITING_RESPONSE, nowUs);
+        break;
+    case TAG_SENDING_FINAL:
+        this->setState(TAG_WAITING_REPORT, nowUs);
+        break;
+    case ANCHOR_SENDING_RESPONSE:
+        mResponseSent = mRadio.getTransmitTimestamp();
+        this->setState(ANCHOR_WAITING_FINAL, nowUs);
+        break;
+    case ANCHOR_SENDING_REPORT:
+        this->setState(SUCCEEDED, nowUs);
+        break;
+    default:
+        break;
+    }
+}
+
+void TwoWayRanging::tick(uint32_t nowUs)
+{
+    // signed difference so micros() wrapping around is fine
+    if (this->isBusy() && (int32_t)(nowUs - mDeadline) > 0)
+    {
+        // a late delayed transmit would otherwise go out a whole timer period later
+        if (mRadio.isTransmitting())
+        {
+            mRadio.idle();
+        }
+        this->setState(FAILED, nowUs);
+    }
+}
+
+double TwoWayRanging::computeRange(uint64_t pollSent, uint64_t pollReceived, uint64_t responseSent,
+                                   uint64_t responseReceived, uint64_t finalSent, uint64_t finalReceived, double clockOffset)
+{
+    // the initiator's intervals in responder ticks
+    double scale = 1 + clockOffset * 1e-6;
+    double round1 = ((responseReceived - pollSent) & TIMESTAMP_MASK) * scale;
+    double reply1 = (responseSent - pollReceived) & TIMESTAMP_MASK;
+    double round2 = (finalReceived - responseSent) & TIMESTAMP_MASK;
+    double reply2 = ((finalSent - responseReceived) & TIMESTAMP_MASK) * scale;
+
+    double timeOfFlight = (round1 * round2 - reply1 * reply2) / (round1 + round2 + reply1 + reply2);
+    return timeOfFlight * DISTANCE_PER_TICK;
+}
+
+double TwoWayRanging::estimateClockOffset(uint64_t pollSent, uint64_t pollReceived, uint64_t finalSent, uint64_t finalReceived)
+{
+    // poll sent -> final sent on the initiator's clock and poll received -> final received on the responder's
+    // span the same time, both flights are in each once
+    double initiatorSpan = (double)((finalSent - pollSent) & TIMESTAMP_MASK);
+    double responderSpan = (double)((finalReceived - pollReceived) & TIMESTAMP_MASK);
+    return initiatorSpan == 0 ? 0 : (responderSpan / initiatorSpan - 1) * 1e6;
+}
+
+bool TwoWayRanging::rangeFromFinal(uint64_t pollSent, uint64_t pollReceived, uint64_t responseSent, uint64_t responseReceived,
+                                   uint64_t finalSent, uint64_t finalReceived, float carrierOffset, double *range, double *clockOffset)
+{
+    *clockOffset = estimateClockOffset(pollSent, pollReceived, finalSent, finalReceived);
+    if (!isClockOffsetPlausible(*clockOffset) || (!isnan(carrierOffset) && !isClockOffsetConsistent(*clockOffset, -carrierOffset)))
+    {
+        return false;
+    }
+    // the carrier integrator measured the initiator's clock on this very frame, without going through the timestamps
+    if (!isnan(carrierOffset))
+    {
+        *clockOffset = -carrierOffset;
+    }
+    *range = computeRange(pollSent, pollReceived, responseSent, responseReceived, finalSent, finalReceived, *clockOffset);
+    return true;
+}
+
+bool TwoWayRanging::isClockOffsetPlausible(double clockOffset)
+{
+    return clockOffset > -MAX_CLOCK_OFFSET && clockOffset < MAX_CLOCK_OFFSET;
+}
+
+bool TwoWayRanging::isClockOffsetConsistent(double estimated, double carrier)
+{
+    return fabs(estimated - carrier) < MAX_CLOCK_DISAGREEMENT;
+}
+
+size_t TwoWayRanging::encodeReport(const RangeReport &report, uint8_t *frame, size_t length)
+{
+    if (length < REPORT_LENGTH)
+    {
+        return 0;
+    }
+
+    double rangeCm = report.range * 100;
+    memset(frame, 0, REPORT_LENGTH);
+    frame[0] = FRAME_DATA;
+    frame[1] = REPORT;
+    frame[2] = report.sequence;
+    writeValue(&frame[3], report.tagShortId, 2);
+    memcpy(&frame[5], report.anchorEui, 8);
+    writeValue(&frame[13], rangeCm > 65535 ? 65535 : (uint16_t)rangeCm, 2);
+    if (report.hasPosition)
+    {
+        frame[15] = REPORT_HAS_POSITION;
+        writeValue(&frame[16], (uint16_t)(int16_t)(report.x * 100), 2);
+        writeValue(&frame[18], (uint16_t)(int16_t)(report.y * 100), 2);
+        writeValue(&frame[20], (uint16_t)(int16_t)(report.z * 100), 2);
+    }
+    return REPORT_LENGTH;
+}
+
+bool TwoWayRanging::decodeReport(const uint8_t *frame, size_t length, RangeReport &report)
+{
+    if (length != REPORT_LENGTH || frame[0] != FRAME_DATA || frame[1] != REPORT)
+    {
+        return false;
+    }
+
+    report.sequence = frame[2];
+    report.tagShortId = readValue(&frame[3], 2);
+    memcpy(report.anchorEui, &frame[5], 8);
+    report.range = readValue(&frame[13], 2) / 100.0f;
+    report.hasPosition = frame[15] & REPORT_HAS_POSITION;
+    report.x = (int16_t)readValue(&frame[16], 2) / 100.0f;
+    report.y = (int16_t)readValue(&frame[18], 2) / 100.0f;
+    report.z = (int16_t)readValue(&frame[20], 2) / 100.0f;
+    return true;
+}
+
+void TwoWayRanging::writeValue(uint8_t *bytes, uint64_t value, uint8_t n)
+{
+    for (uint8_t i = 0; i < n; i++)
+    {
+        bytes[i] = (value >> (i * 8)) & 0xFF;
+    }
+}
+
+uint64_t TwoWayRanging::readValue(const uint8_t *bytes, uint8_t n)
+{
+    uint64_t value = 0;
+    for (uint8_t i = 0; i < n; i++)
+    {
+        value |= (uint64_t)bytes[i] << (i * 8);
+    }
+    return value;
+}
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "radio.hpp"
+
+/**
+ * Non-blocking asymmetric double sided two way ranging between one tag and one anchor.
+ * Feed it radio events from handle() and it moves through the exchange on its own,
+ * nothing in here waits on the radio.
+ *
+ * 1. Tag sends POLL to the anchor
+ * 2. Anchor sends RESPONSE, RESPONSE_DELAY_US after the POLL arrived
+ * 3. Tag sends FINAL, FINAL_DELAY_US after the RESPONSE arrived, with its own timestamps inside
+ * 4. Anchor computes the range and sends REPORT back, REPORT_DELAY_US after the FINAL arrived
+ *
+ * Every reply is a delayed transmit timed off the RX timestamp of the frame it answers, so the reply time is
+ * the same every exchange however long handle() took to get to it. The radio turns its receiver on
+ * as soon as a frame that gets a reply is out, so the other side doesn't have to wait for our handle() either.
+ *
+ * The anchor also works out how fast its crystal runs against the tag's from the exchange's own timestamps,
+ * an offset more than two crystals' tolerance can explain means a timestamp is bad and the exchange fails.
+ * If the radio measures the tag's carrier on the FINAL too, the two have to agree as well, and the carrier's is the
+ * one the tag's intervals are put on the anchor's clock with before the range is worked out.
+ *
+ * Short ids are the first 2 bytes of the EUI. Multi byte values are little endian, timestamps are 40 bit (5 bytes).
+ *
+ * POLL     [0] DATA, [1] POLL, [2] sequence, [3..4] anchor short id, [5..12] tag eui
+ * RESPONSE [0] DATA, [1] RESPONSE, [2] sequence, [3..4] tag short id, [5..6] anchor short id
+ * FINAL    [0] DATA, [1] FINAL, [2] sequence, [3..4] anchor short id, [5..6] tag short id,
+ *          [7..11] poll sent, [12..16] response received, [17..21] final sent
+ * REPORT   [0] DATA, [1] REPORT, [2] sequence, [3..4] tag short id, [5..12] anchor eui, [13..14] range (cm),
+ *          [15] flags, [16..17] x, [18..19] y, [20..21] z (cm, signed)
+ *
+ * No Arduino dependencies, so it also builds on the host.
+ */
+class TwoWayRanging
+{
+public:
+    // second byte of the frame, after DATA
+    static const uint8_t POLL = 0xA6;
+    static const uint8_t RESPONSE = 0xA7;
+    static const uint8_t FINAL = 0xA8;
+    static const uint8_t REPORT = 0xA1;
+
+    // from the frame being answered arriving to the reply going out, long enough for handle() to stage the reply
+    static const uint32_t RESPONSE_DELAY_US = 500;
+    static const uint32_t FINAL_DELAY_US = 500;
+    static const uint32_t REPORT_DELAY_US = 500;
+    // a reply handle() got to too late goes out this long after the radio's current time instead
+    static const uint32_t MIN_REPLY_LEAD_US = 300;
+    // give up on a step after this long
+    static const uint32_t STEP_TIMEOUT_US = 15000;
+
+    static const size_t POLL_LENGTH = 13;
+    static const size_t RESPONSE_LENGTH = 7;
+    static const size_t FINAL_LENGTH = 22;
+    static const size_t REPORT_LENGTH = 22;
+    static const size_t MAX_FRAME_LENGTH = 22;
+
+    typedef enum
+    {
+        IDLE,
+        TAG_SENDING_POLL,
+        TAG_WAITING_RESPONSE,
+        TAG_SENDING_FINAL,
+        TAG_WAITING_REPORT,
+        ANCHOR_SENDING_RESPONSE,
+        ANCHOR_WAITING_FINAL,
+        ANCHOR_SENDING_REPORT,
+        SUCCEEDED,
+        FAILED
+    } State;
+
+    typedef struct
+    {
+        uint8_t sequence;
+        // reports are broadcast, a tag has to check it's the one being answered
+        uint16_t tagShortId;
+        uint8_t anchorEui[8];
+        float range; // m
+        bool hasPosition;
+        float x; // m
+        float y;
+        float z;
+    } RangeReport;
+
+    // applied to every range the anchor computes, with the receive power of the FINAL it was timed on, e.g. DW1000Radio::correctRange
+    typedef double (*RangeCorrection)(double range, float rxPower);
+
+    TwoWayRanging(Radio &radio);
+
+    void setEUI(const uint8_t eui[8]);
+    void setRangeCorrection(RangeCorrection correction) { mRangeCorrection = correction; }
+    /**
+     * ANCHOR ONLY
+     * Coordinates sent to the tag in every report
+     */
+    void setPosition(bool hasPosition, float x, float y, float z);
+
+    /**
+     * TAG ONLY
+     * Starts an exchange with an anchor, returns false if one is already running.
+     */
+    bool startTag(uint16_t anchorShortId, uint32_t nowUs);
+
+    /**
+     * Hands a received frame to the state machine. Returns true if it was part of the exchange,
+     * false if the caller should deal with it. An idle anchor starts a new exchange from a POLL addressed to it.
+     * received is the frame's RX timestamp, read when the frame was, since the radio may have received another one since.
+     * carrierOffset is Radio::getCarrierOffset() for the frame and rxPower Radio::getReceivePower(), both read along with
+     * it, NAN if there isn't one.
+     */
+    bool onReceive(const uint8_t *frame, size_t len, uint64_t received, uint32_t nowUs, float carrierOffset = NAN, float rxPower = NAN);
+    void onTransmitDone(uint32_t nowUs);
+    // checks for timeouts, call regularly
+    void tick(uint32_t nowUs);
+
+    State getState() { return mState; }
+    bool isBusy() { return mState != IDLE && mState != SUCCEEDED && mState != FAILED; }
+    bool isFinished() { return mState == SUCCEEDED || mState == FAILED; }
+    // back to IDLE once the result has been read
+    void reset() { mState = IDLE; }
+
+    // TAG ONLY, valid once SUCCEEDED
+    const RangeReport &getReport() { return mReport; }
+    // ANCHOR ONLY, valid once SUCCEEDED
+    float getRange() { return mRange; }
+    // ppm, how much faster our clock runs than the tag's
+    float getClockOffset() { return mClockOffset; }
+    // dBm, of the FINAL the range was timed on
+    float getReceivePower() { return mReceivePower; }
+    const uint8_t *getTagEui() { return mTagEui; }
+    uint8_t getSequence() { return mSequence; }
+
+    // nowUs when the latest exchange entered state, for profiling
+    uint32_t getStateTime(State state) { return mStateTimes[state]; }
+    // true if we started the latest exchange (tag), false if we answered it (anchor)
+    bool isInitiator() { return mInitiator; }
+    // us by the radio's clock, our reply in the latest exchange: the anchor's RESPONSE or the tag's FINAL
+    uint32_t getReplyTime() { return mReplyTime; }
+    // running total of replies that missed their slot and went out MIN_REPLY_LEAD_US after handle() got to them
+    uint32_t getLateReplies() { return mLateReplies; }
+
+    static size_t encodeReport(const RangeReport &report, uint8_t *frame, size_t length);
+    static bool decodeReport(const uint8_t *frame, size_t length, RangeReport &report);
+    static uint16_t shortId(const uint8_t eui[8]) { return eui[0] | (eui[1] << 8); }
+
+    /**
+     * Asymmetric double sided two way ranging, from the six timestamps of an exchange. Returns m.
+     * clockOffset is how much faster the responder's (anchor's) clock runs than the initiator's, in ppm. The initiator's
+     * two intervals are scaled onto the responder's clock with it first, which leaves only the responder's own crystal
+     * error in the range. The asymmetric formula already cancels most of the offset, this takes out what's left,
+     * which grows with the flight time and the difference between the two reply times.
+     */
+    static double computeRange(uint64_t pollSent, uint64_t pollReceived, uint64_t responseSent,
+                               uint64_t responseReceived, uint64_t finalSent, uint64_t finalReceived, double clockOffset = 0);
+    /**
+     * How much faster the responder's clock runs than the initiator's in ppm, from the first and last timestamps on each side.
+     * The time of flight cancels out, but a bad timestamp throws it off, which is what makes it a check on them.
+     */
+    static double estimateClockOffset(uint64_t pollSent, uint64_t pollReceived, uint64_t finalSent, uint64_t finalReceived);
+    /**
+     * What the anchor does with the FINAL: checks the timestamps' clock offset, and the carrier's if it isn't NAN, then
+     * computeRange() with the better of the two. Returns false if a timestamp is bad, clockOffset is set either way.
+     */
+    static bool rangeFromFinal(uint64_t pollSent, uint64_t pollReceived, uint64_t responseSent, uint64_t responseReceived,
+                               uint64_t finalSent, uint64_t finalReceived, float carrierOffset, double *range, double *clockOffset);
+    // true if a clock offset is within what two crystals can be apart
+    static bool isClockOffsetPlausible(double clockOffset);
+    // true if the timestamps' clock offset is close enough to the carrier integrator's for both to be right
+    static bool isClockOffsetConsistent(double estimated, double carrier);
+
+private:
+    Radio &mRadio;
+    State mState;
+    uint32_t mDeadline;
+    uint8_t mSequence;
+    uint8_t mEui[8];
+    uint16_t mShortId;
+    uint16_t mPeerShortId;
+    RangeCorrection mRangeCorrection;
+    uint32_t mStateTimes[FAILED + 1];
+    bool mInitiator;
+
+    bool mHasPosition;
+    float mX, mY, mZ;
+
+    uint64_t mPollSent;
+    uint64_t mPollReceived;
+    uint64_t mResponseSent;
+    uint64_t mResponseReceived;
+
+    RangeReport mReport;
+    float mRange;
+    float mClockOffset;
+    float mReceivePower;
+    uint8_t mTagEui[8];
+    uint32_t mReplyTime;
+    uint32_t mLateReplies;
+
+    void setState(State state, uint32_t nowUs);
+    // sets up the delayed transmit of a reply to a frame received then, returns the time it will carry
+    uint64_t scheduleReply(uint64_t received, uint32_t delayUs);
+    bool acceptPoll(const uint8_t *frame, size_t len, uint64_t received, uint32_t nowUs);
+    static void writeValue(uint8_t *bytes, uint64_t value, uint8_t n);
+    static uint64_t readValue(const uint8_t *bytes, uint8_t n);
+};
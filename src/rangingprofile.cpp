@@ -0,0 +1,167 @@
+#include "rangingprofile.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+// preamble and SFD (136 symbols of ~1.017us), PHR and the 2 byte FCS
+#define FRAME_OVERHEAD_US 162.0f
+// 6.8Mbps with Reed-Solomon adding 48 bits to every 330
+#define BYTE_US (8 * 378.0f / 330 / 6.8f)
+
+static const char *PHASE_NAMES[RangingProfile::PHASES] = {"poll", "response", "final", "report", "reply", "exchange", "session", "handle"};
+
+void LatencyHistogram::reset()
+{
+    memset(mBuckets, 0, sizeof(mBuckets));
+    mCount = 0;
+    mTotal = 0;
+    mMax = 0;
+}
+
+void LatencyHistogram::add(uint32_t us)
+{
+    mBuckets[bucketOf(us)]++;
+    mCount++;
+    mTotal += us;
+    if (us > mMax)
+    {
+        mMax = us;
+    }
+}
+
+uint16_t LatencyHistogram::bucketOf(uint32_t us)
+{
+    if (us < SUB_BUCKETS)
+    {
+        return us;
+    }
+    uint8_t exponent = 31 - __builtin_clz(us);
+    if (exponent > MAX_EXPONENT)
+    {
+        return BUCKETS - 1;
+    }
+    // the 3 bits after the leading one pick the sub bucket
+    return SUB_BUCKETS + (exponent - 3) * SUB_BUCKETS + ((us >> (exponent - 3)) & (SUB_BUCKETS - 1));
+}
+
+uint32_t LatencyHistogram::lowerBound(uint16_t bucket)
+{
+    if (bucket < SUB_BUCKETS)
+    {
+        return bucket;
+    }
+    uint8_t exponent = (bucket - SUB_BUCKETS) / SUB_BUCKETS + 3;
+    return (uint32_t)(SUB_BUCKETS + (bucket % SUB_BUCKETS)) << (exponent - 3);
+}
+
+uint32_t LatencyHistogram::percentile(float fraction)
+{
+    if (mCount == 0)
+    {
+        return 0;
+    }
+    uint32_t rank = fraction * mCount;
+    uint32_t seen = 0;
+    for (uint16_t bucket = 0; bucket < BUCKETS; bucket++)
+    {
+        seen += mBuckets[bucket];
+        if (seen > rank)
+        {
+            if (bucket == BUCKETS - 1)
+            {
+                return mMax;
+            }
+            uint32_t middle = (lowerBound(bucket) + lowerBound(bucket + 1)) / 2;
+            // nothing in the bucket is bigger than the largest value seen
+            return middle > mMax ? mMax : middle;
+        }
+    }
+    return mMax;
+}
+
+RangingProfile::RangingProfile()
+{
+    mResults = 0;
+    mFailures = 0;
+    mStartUs = 0;
+    mStartFrames = 0;
+    mStartBytes = 0;
+}
+
+void RangingProfile::start(uint32_t nowUs, uint32_t framesSent, uint32_t bytesSent)
+{
+    for (uint8_t phase = 0; phase < PHASES; phase++)
+    {
+        mPhases[phase].reset();
+    }
+    mResults = 0;
+    mFailures = 0;
+    mStartUs = nowUs;
+    mStartFrames = framesSent;
+    mStartBytes = bytesSent;
+}
+
+void RangingProfile::recordExchange(TwoWayRanging &ranging)
+{
+    if (ranging.getState() != TwoWayRanging::SUCCEEDED)
+    {
+        mFailures++;
+        return;
+    }
+    mPhases[REPLY].add(ranging.getReplyTime());
+
+    // unsigned differences so micros() wrapping around is fine
+    uint32_t done = ranging.getStateTime(TwoWayRanging::SUCCEEDED);
+    if (ranging.isInitiator())
+    {
+        uint32_t pollStart = ranging.getStateTime(TwoWayRanging::TAG_SENDING_POLL);
+        uint32_t pollSent = ranging.getStateTime(TwoWayRanging::TAG_WAITING_RESPONSE);
+        uint32_t responseReceived = ranging.getStateTime(TwoWayRanging::TAG_SENDING_FINAL);
+        uint32_t finalSent = ranging.getStateTime(TwoWayRanging::TAG_WAITING_REPORT);
+        mPhases[POLL].add(pollSent - pollStart);
+        mPhases[RESPONSE].add(responseReceived - pollSent);
+        mPhases[FINAL].add(finalSent - responseReceived);
+        mPhases[REPORT].add(done - finalSent);
+        mPhases[EXCHANGE].add(done - pollStart);
+    }
+    else
+    {
+        uint32_t pollReceived = ranging.getStateTime(TwoWayRanging::ANCHOR_SENDING_RESPONSE);
+        uint32_t responseSent = ranging.getStateTime(TwoWayRanging::ANCHOR_WAITING_FINAL);
+        uint32_t finalReceived = ranging.getStateTime(TwoWayRanging::ANCHOR_SENDING_REPORT);
+        mPhases[RESPONSE].add(responseSent - pollReceived);
+        mPhases[FINAL].add(finalReceived - responseSent);
+        mPhases[REPORT].add(done - finalReceived);
+        mPhases[EXCHANGE].add(done - pollReceived);
+    }
+}
+
+void RangingProfile::print(uint32_t nowUs, uint32_t framesSent, uint32_t bytesSent, Printer printer)
+{
+    char line[128];
+    for (uint8_t phase = 0; phase < PHASES; phase++)
+    {
+        LatencyHistogram &histogram = mPhases[phase];
+        if (histogram.getCount() == 0)
+        {
+            continue;
+        }
+        snprintf(line, sizeof(line), "%-8s n %6lu  p50 %6lu us  p99 %6lu us  max %6lu us\n", PHASE_NAMES[phase], (unsigned long)histogram.getCount(),
+                 (unsigned long)histogram.percentile(0.5f), (unsigned long)histogram.percentile(0.99f), (unsigned long)histogram.getMax());
+        printer(line);
+    }
+
+    float seconds = (nowUs - mStartUs) / 1e6f;
+    float airtime = getAirtime(framesSent - mStartFrames, bytesSent - mStartBytes);
+    snprintf(line, sizeof(line), "results  %lu (%lu exchanges failed), %.2f/s, %.0f us airtime and %.0f us CPU per result\n",
+             (unsigned long)mResults, (unsigned long)mFailures, seconds > 0 ? mResults / seconds : 0.0f,
+             mResults ? airtime / mResults : 0.0f, mResults ? (float)mPhases[HANDLE].getTotal() / mResults : 0.0f);
+    printer(line);
+
+    this->start(nowUs, framesSent, bytesSent);
+}
+
+float RangingProfile::getAirtime(uint32_t frames, uint32_t bytes)
+{
+    return frames * FRAME_OVERHEAD_US + bytes * BYTE_US;
+}
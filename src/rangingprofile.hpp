@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ranging.hpp"
+
+/**
+ * Histogram of durations in us, log-linear buckets (8 per power of two) so percentiles are within ~6% at any scale.
+ * Durations over ~16s all land in the last bucket.
+ *
+ * No Arduino dependencies, so it also builds on the host.
+ */
+class LatencyHistogram
+{
+public:
+    LatencyHistogram() { this->reset(); }
+
+    void add(uint32_t us);
+    void reset();
+
+    uint32_t getCount() { return mCount; }
+    uint64_t getTotal() { return mTotal; }
+    uint32_t getMax() { return mMax; }
+    // fraction 0..1, e.g. 0.99, returns the middle of the bucket it falls in
+    uint32_t percentile(float fraction);
+
+private:
+    static const uint8_t SUB_BUCKETS = 8;
+    static const uint8_t MAX_EXPONENT = 23;
+    static const uint16_t BUCKETS = SUB_BUCKETS + (MAX_EXPONENT - 2) * SUB_BUCKETS;
+
+    uint32_t mBuckets[BUCKETS];
+    uint32_t mCount;
+    uint64_t mTotal;
+    uint32_t mMax;
+
+    static uint16_t bucketOf(uint32_t us);
+    static uint32_t lowerBound(uint16_t bucket);
+};
+
+/**
+ * Where a ranging node spends its time, phase by phase, plus what each result costs:
+ * results per second, airtime per result and CPU time per result.
+ * A result is a position fix on a tag and a range on an anchor.
+ *
+ * Written by the ranging task only. Printing from another task can see a half updated histogram, fine for a debug print.
+ *
+ * No Arduino dependencies, so it also builds on the host.
+ */
+class RangingProfile
+{
+public:
+    typedef enum
+    {
+        POLL,     // tag: poll handed to the radio -> poll sent
+        RESPONSE, // tag: poll sent -> response received, anchor: poll received -> response sent
+        FINAL,    // tag: response received -> final sent, anchor: response sent -> final received
+        REPORT,   // tag: final sent -> report received, anchor: final received -> report sent
+        REPLY,    // our reply by the radio's clock, tag: response received -> final sent, anchor: poll received -> response sent
+        EXCHANGE, // a whole successful exchange
+        SESSION,  // tag: ranging every anchor and solving
+        HANDLE,   // one DW1000::handle() pass, CPU time
+        PHASES
+    } Phase;
+
+    typedef void (*Printer)(const char *line);
+
+    RangingProfile();
+
+    // results per second and airtime are counted from here, print() starts over by itself
+    void start(uint32_t nowUs, uint32_t framesSent, uint32_t bytesSent);
+    void record(Phase phase, uint32_t us) { mPhases[phase].add(us); }
+    /**
+     * Records the phases of an exchange that has just finished, call before reset() on it.
+     */
+    void recordExchange(TwoWayRanging &ranging);
+    void recordResult() { mResults++; }
+    // exchanges finished since start(), successful or not
+    uint32_t getExchanges() { return mPhases[EXCHANGE].getCount() + mFailures; }
+
+    /**
+     * Prints a line per phase with p50/p99/max, then results/s, airtime and CPU per result, and starts over.
+     * framesSent / bytesSent are the radio's running totals.
+     */
+    void print(uint32_t nowUs, uint32_t framesSent, uint32_t bytesSent, Printer printer);
+
+    /**
+     * us on air for frames with this many payload bytes in total, for the configuration in DW1000's constructor:
+     * 6.8Mbps, 64MHz PRF, 128 symbol preamble.
+     */
+    static float getAirtime(uint32_t frames, uint32_t bytes);
+
+private:
+    LatencyHistogram mPhases[PHASES];
+    uint32_t mResults;
+    uint32_t mFailures;
+    uint32_t mStartUs;
+    uint32_t mStartFrames;
+    uint32_t mStartBytes;
+};
@@ -0,0 +1,352 @@
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+
+/**
+ * Decides how often a tag ranges and which anchors it ranges, so airtime follows what the fixes are needed for.
+ * A moving tag starts a session every fastInterval, one that has been still for motionHold backs off to a
+ * slowInterval heartbeat, and in between the interval scales with speed. Speed comes from the position filter
+ * after every fix, and the IMU can report motion too, it notices the tag being picked up long before the fixes do.
+ *
+ * Each session ranges the anchorsPerFix anchors with the lowest GDOP from the last fix. Anchors below minReliability
+ * are left out while there are enough good ones, but the one tried longest ago is ranged again every probeInterval
+ * so it can earn its way back in. Anchors that haven't sent their coordinates yet, and every anchor until the first fix,
+ * are always ranged.
+ *
+ * The GDOP search tries every subset, C(n, anchorsPerFix) of them: 70 for the default 4 of 8 anchors.
+ * No Arduino dependencies, so it also builds on the host.
+ */
+template <uint8_t MaxAnchors>
+class RangingScheduler
+{
+public:
+    // the solver needs this many for a fix, fewer per session would never give one
+    static const uint8_t MIN_ANCHORS = 4;
+
+    typedef struct
+    {
+        float x;
+        float y;
+        float z;
+    } Point;
+
+    typedef struct
+    {
+        uint32_t fastInterval;  // ms, between sessions while moving
+        uint32_t slowInterval;  // ms, heartbeat while still, keep it under the position filter's maxGap
+        float stillSpeed;       // m/s, up to here is fix noise and the tag counts as still
+        float movingSpeed;      // m/s, from here on the tag ranges every fastInterval
+        uint32_t motionHold;    // ms, stays at fastInterval this long after the last motion
+        uint8_t anchorsPerFix;  // 0 ranges every anchor
+        uint8_t minReliability; // 0..100
+        uint32_t probeInterval; // ms, between retries of an unreliable anchor
+    } Config;
+
+    typedef struct
+    {
+        uint16_t slot; // whatever the caller knows the anchor by
+        bool hasPosition;
+        Point position; // m
+        uint8_t reliability;
+        uint32_t lastAttempt; // ms, last time it was ranged
+    } Candidate;
+
+    RangingScheduler() : mCount(0), mSpeed(0), mLastMotion(0), mHasMotion(false), mGdop(INFINITY), mSessions(0), mSkipped(0), mProbes(0)
+    {
+        mConfig = Config{300, 1000, 0.1f, 0.5f, 2000, 4, 25, 5000};
+    }
+
+    void setConfig(const Config &config) { mConfig = config; }
+    const Config &getConfig() { return mConfig; }
+
+    // m/s, from the position filter after every fix
+    void updateSpeed(float speed, uint32_t now)
+    {
+        mSpeed = speed;
+        if (speed >= mConfig.movingSpeed)
+        {
+            this->reportMotion(now);
+        }
+    }
+
+    void reportMotion(uint32_t now)
+    {
+        mLastMotion = now;
+        mHasMotion = true;
+    }
+
+    // ms, until the next session should start
+    uint32_t getInterval(uint32_t now)
+    {
+        if (mHasMotion && now - mLastMotion < mConfig.motionHold)
+        {
+            return mConfig.fastInterval;
+        }
+        float range = mConfig.movingSpeed - mConfig.stillSpeed;
+        float t = range > 0 ? (mSpeed - mConfig.stillSpeed) / range : (mSpeed > mConfig.stillSpeed ? 1 : 0);
+        t = t < 0 ? 0 : (t > 1 ? 1 : t);
+        return mConfig.slowInterval - (uint32_t)((float)(mConfig.slowInterval - mConfig.fastInterval) * t);
+    }
+
+    void clearCandidates() { mCount = 0; }
+
+    // false if there's no room left
+    bool addCandidate(const Candidate &candidate)
+    {
+        if (mCount >= MaxAnchors)
+        {
+            return false;
+        }
+        mCandidates[mCount++] = candidate;
+        return true;
+    }
+
+    /**
+     * Picks the candidates to range this session from position, the last fix if hasPosition.
+     * Their slots go into slots, which has room for MaxAnchors, and the count is returned.
+     */
+    uint8_t select(bool hasPosition, const Point &position, uint32_t now, uint16_t *slots)
+    {
+        uint8_t count = 0;
+        mGdop = INFINITY;
+        mSessions++;
+
+        // no fix to work the geometry out from, or told to range everything
+        if (!hasPosition || mConfig.anchorsPerFix == 0)
+        {
+            int16_t probe = this->dueProbe(now);
+            for (uint8_t i = 0; i < mCount; i++)
+            {
+                if (!hasPosition || !mCandidates[i].hasPosition || mCandidates[i].reliability >= mConfig.minReliability || i == probe)
+                {
+                    slots[count++] = mCandidates[i].slot;
+                }
+            }
+            this->countProbe(hasPosition ? probe : -1);
+            mSkipped += mCount - count;
+            return count;
+        }
+
+        // anchors without coordinates don't count towards a fix, but ranging them is how we get their coordinates
+        bool chosen[MaxAnchors] = {false};
+        for (uint8_t i = 0; i < mCount; i++)
+        {
+            if (!mCandidates[i].hasPosition)
+            {
+                chosen[i] = true;
+            }
+        }
+
+        // the reliable ones, topped up with the best of the rest if there aren't enough for a fix
+        uint8_t pool[MaxAnchors];
+        uint8_t poolSize = 0;
+        uint8_t wanted = mConfig.anchorsPerFix < MIN_ANCHORS ? MIN_ANCHORS : mConfig.anchorsPerFix;
+        for (uint8_t i = 0; i < mCount; i++)
+        {
+            if (mCandidates[i].hasPosition && mCandidates[i].reliability >= mConfig.minReliability)
+            {
+                pool[poolSize++] = i;
+            }
+        }
+        while (poolSize < wanted)
+        {
+            int16_t best = -1;
+            for (uint8_t i = 0; i < mCount; i++)
+            {
+                if (mCandidates[i].hasPosition && mCandidates[i].reliability < mConfig.minReliability && !this->contains(pool, poolSize, i) &&
+                    (best < 0 || mCandidates[i].reliability > mCandidates[best].reliability))
+                {
+                    best = i;
+                }
+            }
+            if (best < 0)
+            {
+                break;
+            }
+            pool[poolSize++] = best;
+        }
+
+        this->chooseGeometry(pool, poolSize, wanted, position, chosen);
+
+        // an unreliable anchor that isn't in already gets a retry now and then
+        int16_t probe = this->dueProbe(now);
+        if (probe >= 0 && chosen[probe])
+        {
+            probe = -1;
+        }
+        if (probe >= 0)
+        {
+            chosen[probe] = true;
+        }
+        this->countProbe(probe);
+
+        for (uint8_t i = 0; i < mCount; i++)
+        {
+            if (chosen[i])
+            {
+                slots[count++] = mCandidates[i].slot;
+            }
+        }
+        mSkipped += mCount - count;
+        return count;
+    }
+
+    // of the anchors with coordinates in the last select(), INFINITY if there weren't enough for a fix
+    float getGdop() { return mGdop; }
+    // running totals
+    uint32_t getSessions() { return mSessions; }
+    uint32_t getSkipped() { return mSkipped; }
+    uint32_t getProbes() { return mProbes; }
+
+private:
+    Config mConfig;
+    Candidate mCandidates[MaxAnchors];
+    uint8_t mCount;
+    float mSpeed;
+    uint32_t mLastMotion;
+    bool mHasMotion;
+    float mGdop;
+    uint32_t mSessions;
+    uint32_t mSkipped;
+    uint32_t mProbes;
+
+    static bool contains(const uint8_t *indices, uint8_t count, uint8_t index)
+    {
+        for (uint8_t i = 0; i < count; i++)
+        {
+            if (indices[i] == index)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // the unreliable anchor with coordinates tried longest ago, if it's been probeInterval, otherwise -1
+    int16_t dueProbe(uint32_t now)
+    {
+        int16_t probe = -1;
+        for (uint8_t i = 0; i < mCount; i++)
+        {
+            const Candidate &candidate = mCandidates[i];
+            if (candidate.hasPosition && candidate.reliability < mConfig.minReliability && now - candidate.lastAttempt >= mConfig.probeInterval &&
+                (probe < 0 || now - candidate.lastAttempt > now - mCandidates[probe].lastAttempt))
+            {
+                probe = i;
+            }
+        }
+        return probe;
+    }
+
+    void countProbe(int16_t probe)
+    {
+        if (probe >= 0)
+        {
+            mProbes++;
+        }
+    }
+
+    /**
+     * Marks the wanted candidates out of pool with the lowest GDOP from position as chosen, or all of pool if there aren't more.
+     */
+    void chooseGeometry(const uint8_t *pool, uint8_t poolSize, uint8_t wanted, const Point &position, bool *chosen)
+    {
+        // line of sight to each anchor, its outer product is what it adds to H^T H
+        float los[MaxAnchors][6];
+        for (uint8_t i = 0; i < poolSize; i++)
+        {
+            const Point &anchor = mCandidates[pool[i]].position;
+            float d[3] = {position.x - anchor.x, position.y - anchor.y, position.z - anchor.z};
+            float range = sqrtf(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+            if (range < 1e-6f)
+            {
+                // sitting right on it, no direction to speak of
+                range = INFINITY;
+            }
+            float u[3] = {d[0] / range, d[1] / range, d[2] / range};
+            los[i][0] = u[0] * u[0];
+            los[i][1] = u[0] * u[1];
+            los[i][2] = u[0] * u[2];
+            los[i][3] = u[1] * u[1];
+            los[i][4] = u[1] * u[2];
+            los[i][5] = u[2] * u[2];
+        }
+
+        if (poolSize <= wanted)
+        {
+            uint8_t all[MaxAnchors];
+            for (uint8_t i = 0; i < poolSize; i++)
+            {
+                all[i] = i;
+                chosen[pool[i]] = true;
+            }
+            mGdop = poolSize >= MIN_ANCHORS ? gdop(los, all, poolSize) : INFINITY;
+            return;
+        }
+
+        // every combination of wanted out of poolSize, in lexicographic order
+        uint8_t subset[MaxAnchors];
+        uint8_t best[MaxAnchors];
+        for (uint8_t i = 0; i < wanted; i++)
+        {
+            subset[i] = i;
+            best[i] = i;
+        }
+        for (;;)
+        {
+            float value = gdop(los, subset, wanted);
+            if (value < mGdop)
+            {
+                mGdop = value;
+                for (uint8_t i = 0; i < wanted; i++)
+                {
+                    best[i] = subset[i];
+                }
+            }
+
+            int16_t i = wanted - 1;
+            while (i >= 0 && subset[i] == poolSize - wanted + i)
+            {
+                i--;
+            }
+            if (i < 0)
+            {
+                break;
+            }
+            subset[i]++;
+            for (uint8_t j = i + 1; j < wanted; j++)
+            {
+                subset[j] = subset[j - 1] + 1;
+            }
+        }
+
+        for (uint8_t i = 0; i < wanted; i++)
+        {
+            chosen[pool[best[i]]] = true;
+        }
+    }
+
+    // sqrt(trace((H^T H)^-1)), ranging has no clock term so H is just the lines of sight
+    static float gdop(const float los[][6], const uint8_t *subset, uint8_t count)
+    {
+        float a[6] = {0, 0, 0, 0, 0, 0};
+        for (uint8_t i = 0; i < count; i++)
+        {
+            for (uint8_t j = 0; j < 6; j++)
+            {
+                a[j] += los[subset[i]][j];
+            }
+        }
+        // a is xx, xy, xz, yy, yz, zz of a symmetric 3x3
+        float c00 = a[3] * a[5] - a[4] * a[4];
+        float c11 = a[0] * a[5] - a[2] * a[2];
+        float c22 = a[0] * a[3] - a[1] * a[1];
+        float det = a[0] * c00 - a[1] * (a[1] * a[5] - a[4] * a[2]) + a[2] * (a[1] * a[4] - a[3] * a[2]);
+        if (det < 1e-9f)
+        {
+            return INFINITY;
+        }
+        return sqrtf((c00 + c11 + c22) / det);
+    }
+};
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+/**
+ * Lock-free single producer / single consumer queue, used to hand results from the ranging task to the network task.
+ * Exactly one task may push and exactly one other task may pop. Size must be a power of two.
+ * When full, push() drops the new item rather than blocking the producer.
+ */
+template <typename T, size_t Size>
+class RingBuffer
+{
+    static_assert(Size >= 2 && (Size & (Size - 1)) == 0, "RingBuffer size must be a power of two");
+
+public:
+    /**
+     * PRODUCER ONLY
+     * Returns false and counts a drop if the consumer has fallen behind.
+     */
+    bool push(const T &item)
+    {
+        size_t head = mHead.load(std::memory_order_relaxed);
+        size_t tail = mTail.load(std::memory_order_acquire);
+        size_t used = head - tail;
+        if (used >= Size)
+        {
+            mDropped.store(mDropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return false;
+        }
+
+        mItems[head & (Size - 1)] = item;
+        mHead.store(head + 1, std::memory_order_release);
+
+        if (used + 1 > mHighWaterMark.load(std::memory_order_relaxed))
+        {
+            mHighWaterMark.store(used + 1, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    /**
+     * CONSUMER ONLY
+     * Returns false if there is nothing queued.
+     */
+    bool pop(T &item)
+    {
+        size_t tail = mTail.load(std::memory_order_relaxed);
+        if (tail == mHead.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+
+        item = mItems[tail & (Size - 1)];
+        mTail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // safe from either side, but only a snapshot
+    size_t size() { return mHead.load(std::memory_order_acquire) - mTail.load(std::memory_order_acquire); }
+    size_t capacity() { return Size; }
+    // most items ever queued at once
+    size_t getHighWaterMark() { return mHighWaterMark.load(std::memory_order_relaxed); }
+    uint32_t getDropped() { return mDropped.load(std::memory_order_relaxed); }
+
+private:
+    T mItems[Size];
+    // free running counters, only the low bits index mItems
+    std::atomic<size_t> mHead{0};
+    std::atomic<size_t> mTail{0};
+    std::atomic<size_t> mHighWaterMark{0};
+    std::atomic<uint32_t> mDropped{0};
+};
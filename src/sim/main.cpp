@@ -0,0 +1,290 @@
+/**
+ * Host simulation of a ranging cell: runs the real TwoWayRanging state machines of N tags and 4 anchors
+ * over SimChannel, the same way DW1000::handle() drives them, and prints throughput, range error and the same
+ * per phase timings as the "stats" command. CPU time per result is only meaningful on the target, it's left out here.
+ *
+ * pio run -e native && .pio/build/native/program [tags] [seconds] [seed] [loss rate] [max drift ppm]
+ * or .pio/build/native/program tdoa ... for a TDOA cell instead, see tdoasim.cpp
+ * or .pio/build/native/program schedule ... for one tag's adaptive ranging schedule, see schedulesim.cpp
+ *
+ * Anchor discovery (blinks) isn't simulated, every tag knows every anchor from the start.
+ */
+// the tests in test/ bring their own main() and use the channel without the rest of this
+#ifndef PIO_UNIT_TESTING
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+
+#include "../ranging.hpp"
+#include "../rangingprofile.hpp"
+#include "../frame.hpp"
+#include "simchannel.hpp"
+#include "tdoasim.hpp"
+#include "schedulesim.hpp"
+
+#define ANCHORS 4
+#define MAX_TAGS (SimChannel::MAX_NODES - ANCHORS)
+// how often every node gets to run its handle(), us
+#define STEP_US 20
+
+typedef struct
+{
+    SimRadio *radio;
+    TwoWayRanging *ranging;
+    // same size as DW1000's
+    FramePool<4> frames;
+    uint8_t eui[8];
+    // tags only
+    int8_t sessionAnchor;
+    uint32_t nextSession;  // us
+    uint32_t sessionStart; // us
+    uint8_t sessionRanges;
+} Node;
+
+typedef struct
+{
+    uint32_t attempts;
+    uint32_t successes;
+    double errorSum;
+    double errorSquaredSum;
+    uint32_t anchorRanges;
+    // ppm, anchors' clock offset estimate against the real drift difference
+    double offsetErrorSquaredSum;
+} Results;
+
+static SimChannel *channel;
+static Node anchors[ANCHORS];
+static Node tags[MAX_TAGS];
+static int tagCount;
+static Results results;
+// every tag's exchanges in one profile
+static RangingProfile profile;
+
+static void initNode(Node &node, SimRadio *radio, uint8_t id)
+{
+    node.radio = radio;
+    node.ranging = new TwoWayRanging(*radio);
+    for (uint8_t i = 0; i < 8; i++)
+    {
+        node.eui[i] = i == 0 ? id : 0xD0 + i;
+    }
+    node.ranging->setEUI(node.eui);
+    node.sessionAnchor = -1;
+    node.nextSession = 0;
+}
+
+// DW1000::processRadioEvents()
+static void processRadioEvents(Node &node)
+{
+    Radio::Event event;
+    while ((event = node.radio->pollEvent()) != Radio::NONE)
+    {
+        if (event == Radio::TRANSMIT_DONE)
+        {
+            node.ranging->onTransmitDone(channel->micros());
+        }
+        else if (event == Radio::RECEIVE_DONE)
+        {
+            Frame *frame = node.frames.acquire();
+            if (frame != nullptr)
+            {
+                frame->length = node.radio->getReceivedFrame(frame->data, sizeof(frame->data), &frame->received);
+                frame->carrierOffset = node.radio->getCarrierOffset();
+                if (frame->length > 0)
+                {
+                    node.frames.commit();
+                }
+            }
+            if (!node.radio->isTransmitting() && !node.radio->isReceiving())
+            {
+                node.radio->startReceive();
+            }
+        }
+    }
+
+    Frame *frame;
+    while ((frame = node.frames.front()) != nullptr)
+    {
+        node.ranging->onReceive(frame->data, frame->length, frame->received, channel->micros(), frame->carrierOffset);
+        node.frames.release();
+    }
+    node.ranging->tick(channel->micros());
+}
+
+static void listen(Node &node)
+{
+    if (!node.radio->isTransmitting() && !node.radio->isReceiving())
+    {
+        node.radio->startReceive();
+    }
+}
+
+// anchor half of DW1000::handle()
+static void handleAnchor(Node &node)
+{
+    processRadioEvents(node);
+    if (node.ranging->isFinished())
+    {
+        if (node.ranging->getState() == TwoWayRanging::SUCCEEDED)
+        {
+            results.anchorRanges++;
+            for (int i = 0; i < tagCount; i++)
+            {
+                if (tags[i].eui[0] == node.ranging->getTagEui()[0])
+                {
+                    double actual = ((1 + node.radio->driftPpm * 1e-6) / (1 + tags[i].radio->driftPpm * 1e-6) - 1) * 1e6;
+                    double error = node.ranging->getClockOffset() - actual;
+                    results.offsetErrorSquaredSum += error * error;
+                }
+            }
+        }
+        node.ranging->reset();
+    }
+    listen(node);
+}
+
+// tag half of DW1000::handle(), one anchor after the other
+static void handleTag(Node &node)
+{
+    processRadioEvents(node);
+    uint32_t now = channel->micros();
+
+    if (node.sessionAnchor < 0 && (int32_t)(now - node.nextSession) >= 0 && !node.ranging->isBusy())
+    {
+        node.sessionAnchor = 0;
+        node.sessionStart = now;
+        node.sessionRanges = 0;
+    }
+
+    if (node.sessionAnchor >= 0)
+    {
+        if (node.ranging->isFinished())
+        {
+            Node &anchor = anchors[node.sessionAnchor];
+            results.attempts++;
+            profile.recordExchange(*node.ranging);
+            if (node.ranging->getState() == TwoWayRanging::SUCCEEDED)
+            {
+                float error = node.ranging->getReport().range - SimChannel::distance(node.radio, anchor.radio);
+                results.successes++;
+                results.errorSum += error;
+                results.errorSquaredSum += error * error;
+                node.sessionRanges++;
+            }
+            node.ranging->reset();
+            node.sessionAnchor++;
+        }
+
+        if (!node.ranging->isBusy() && !node.radio->isTransmitting())
+        {
+            if (node.sessionAnchor >= ANCHORS)
+            {
+                // DW1000::updatePosition() needs Solver::MIN_ANCHORS ranges for a fix
+                if (node.sessionRanges >= 3)
+                {
+                    profile.recordResult();
+                }
+                profile.record(RangingProfile::SESSION, now - node.sessionStart);
+                node.sessionAnchor = -1;
+                // the tag's fixed ALOHA spacing from before RangingScheduler, it's still about the rate of a moving tag
+                node.nextSession = now + 100000 + (uint32_t)(channel->random() * 400000);
+            }
+            else
+            {
+                node.ranging->startTag(TwoWayRanging::shortId(anchors[node.sessionAnchor].eui), now);
+            }
+        }
+    }
+    listen(node);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "tdoa") == 0)
+    {
+        return runTdoa(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "schedule") == 0)
+    {
+        return runSchedule(argc - 2, argv + 2);
+    }
+
+    tagCount = argc > 1 ? atoi(argv[1]) : 3;
+    int seconds = argc > 2 ? atoi(argv[2]) : 60;
+    uint32_t seed = argc > 3 ? strtoul(argv[3], nullptr, 10) : 1;
+    float lossRate = argc > 4 ? atof(argv[4]) : 0.01f;
+    float maxDrift = argc > 5 ? atof(argv[5]) : 10;
+    if (tagCount < 1 || tagCount > MAX_TAGS)
+    {
+        fprintf(stderr, "1 to %d tags\n", MAX_TAGS);
+        return 1;
+    }
+
+    channel = new SimChannel(seed);
+    SimChannel::Config config = {lossRate, 0.05f, 130, 6.8e6f};
+    channel->setConfig(config);
+
+    // corners of a 10 x 10 m room, near the ceiling
+    const float corners[ANCHORS][3] = {{0, 0, 2.5f}, {10, 0, 2.5f}, {10, 10, 2.5f}, {0, 10, 2.5f}};
+    for (int i = 0; i < ANCHORS; i++)
+    {
+        float drift = (channel->random() * 2 - 1) * maxDrift;
+        initNode(anchors[i], channel->addNode(corners[i][0], corners[i][1], corners[i][2], drift), 0xA0 + i);
+    }
+    for (int i = 0; i < tagCount; i++)
+    {
+        float drift = (channel->random() * 2 - 1) * maxDrift;
+        initNode(tags[i], channel->addNode(channel->random() * 10, channel->random() * 10, 1, drift), 0x10 + i);
+    }
+
+    profile.start(0, 0, 0);
+    for (uint64_t t = 0; t < (uint64_t)seconds * 1000000; t += STEP_US)
+    {
+        channel->advance(STEP_US);
+        for (int i = 0; i < ANCHORS; i++)
+        {
+            handleAnchor(anchors[i]);
+        }
+        for (int i = 0; i < tagCount; i++)
+        {
+            handleTag(tags[i]);
+        }
+    }
+
+    const SimChannel::Stats &stats = channel->getStats();
+    printf("%d tags, %d anchors, %d s, seed %u, loss %.3f, drift up to %.1f ppm\n", tagCount, ANCHORS, seconds, seed, lossRate, maxDrift);
+    printf("frames     %u sent, %u delivered, %u lost, %u collided, %u late delayed transmits\n", stats.sent, stats.delivered, stats.lost, stats.collided, stats.lateTransmits);
+    uint32_t lateReplies = 0;
+    for (int i = 0; i < ANCHORS; i++)
+    {
+        lateReplies += anchors[i].ranging->getLateReplies();
+    }
+    for (int i = 0; i < tagCount; i++)
+    {
+        lateReplies += tags[i].ranging->getLateReplies();
+    }
+    printf("exchanges  %u attempted, %u succeeded (%.1f%%), %.1f ranges/s, %u late replies\n", results.attempts, results.successes,
+           results.attempts ? 100.0 * results.successes / results.attempts : 0.0, (double)results.successes / seconds, lateReplies);
+    if (results.successes > 0)
+    {
+        double mean = results.errorSum / results.successes;
+        printf("error      mean %.3f m, rms %.3f m (report rounds to 1 cm)\n", mean, sqrt(results.errorSquaredSum / results.successes));
+    }
+    if (results.anchorRanges > 0)
+    {
+        printf("clock      offset estimate rms error %.3f ppm\n", sqrt(results.offsetErrorSquaredSum / results.anchorRanges));
+    }
+
+    // everything the tags sent, fixes per second are for all tags together
+    uint32_t frames = 0;
+    uint32_t bytes = 0;
+    for (int i = 0; i < tagCount; i++)
+    {
+        frames += tags[i].radio->getFramesSent();
+        bytes += tags[i].radio->getBytesSent();
+    }
+    profile.print(channel->micros(), frames, bytes, [](const char *line) { fputs(line, stdout); });
+    return 0;
+}
+#endif
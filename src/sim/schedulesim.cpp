@@ -0,0 +1,358 @@
+/**
+ * Host simulation of one tag's ranging schedule (RangingScheduler) against 6 anchors, one of them behind a wall
+ * that loses badly. The tag stands still, walks a circle at 1 m/s, and so on. Each run goes once with the old
+ * fixed schedule, every anchor every 100-500 ms, once adaptive on the fixes alone, and once with the IMU reporting
+ * motion too, and prints airtime, fixes and how far the predicted position is from the truth while still and walking.
+ *
+ * .pio/build/native/program schedule [seconds] [seed] [loss rate] [bad anchor loss rate]
+ *
+ * The tag knows every anchor and its coordinates from the start, and the IMU sees motion exactly while it walks.
+ */
+#include "schedulesim.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../ranging.hpp"
+#include "../frame.hpp"
+#include "../multilateration.hpp"
+#include "../positionpredictor.hpp"
+#include "../rangingscheduler.hpp"
+#include "simchannel.hpp"
+
+#define ANCHORS 6
+#define STEP_US 20
+// the one behind the wall
+#define BAD_ANCHOR 1
+// same as DW1000's tag
+#define MAX_RANGE_AGE_MS 1000
+// walking: STILL_MS stood still, then WALK_MS around the circle, over and over
+#define STILL_MS 15000
+#define WALK_MS 10000
+#define WALK_SPEED 1.0f // m/s
+#define WALK_RADIUS 3.0f // m
+
+typedef Multilateration<ANCHORS> Solver;
+typedef RangingScheduler<ANCHORS> Scheduler;
+
+enum Mode
+{
+    FIXED,
+    ADAPTIVE,
+    ADAPTIVE_IMU
+};
+
+typedef struct
+{
+    SimRadio *radio;
+    TwoWayRanging *ranging;
+    FramePool<4> frames;
+    uint8_t eui[8];
+} Node;
+
+// what DW1000 keeps per anchor in its table
+typedef struct
+{
+    uint8_t reliability;
+    float distance;
+    uint32_t lastRange;   // ms
+    uint32_t lastAttempt; // ms
+} AnchorState;
+
+typedef struct
+{
+    uint32_t sessions;
+    uint32_t exchanges;
+    uint32_t badExchanges; // with the anchor behind the wall
+    uint32_t fixes;
+    double stillErrorSquaredSum;
+    uint32_t stillSamples;
+    double walkErrorSquaredSum;
+    uint32_t walkSamples;
+    float maxWalkError;
+} Results;
+
+static SimChannel *channel;
+static Node anchors[ANCHORS];
+static Node tag;
+static AnchorState anchorStates[ANCHORS];
+static Scheduler scheduler;
+static PositionPredictor predictor;
+static Results results;
+
+static void initNode(Node &node, SimRadio *radio, uint8_t id)
+{
+    node.radio = radio;
+    node.ranging = new TwoWayRanging(*radio);
+    for (uint8_t i = 0; i < 8; i++)
+    {
+        node.eui[i] = i == 0 ? id : 0xD0 + i;
+    }
+    node.ranging->setEUI(node.eui);
+}
+
+// DW1000::processRadioEvents()
+static void processRadioEvents(Node &node)
+{
+    Radio::Event event;
+    while ((event = node.radio->pollEvent()) != Radio::NONE)
+    {
+        if (event == Radio::TRANSMIT_DONE)
+        {
+            node.ranging->onTransmitDone(channel->micros());
+        }
+        else if (event == Radio::RECEIVE_DONE)
+        {
+            Frame *frame = node.frames.acquire();
+            if (frame != nullptr)
+            {
+                frame->length = node.radio->getReceivedFrame(frame->data, sizeof(frame->data), &frame->received);
+                frame->carrierOffset = node.radio->getCarrierOffset();
+                if (frame->length > 0)
+                {
+                    node.frames.commit();
+                }
+            }
+        }
+    }
+
+    Frame *frame;
+    while ((frame = node.frames.front()) != nullptr)
+    {
+        node.ranging->onReceive(frame->data, frame->length, frame->received, channel->micros(), frame->carrierOffset);
+        node.frames.release();
+    }
+    node.ranging->tick(channel->micros());
+    if (!node.radio->isTransmitting() && !node.radio->isReceiving())
+    {
+        node.radio->startReceive();
+    }
+}
+
+static bool isWalking(uint32_t ms)
+{
+    return ms % (STILL_MS + WALK_MS) >= STILL_MS;
+}
+
+static Solver::Point truthAt(uint32_t ms)
+{
+    uint32_t cycle = ms / (STILL_MS + WALK_MS);
+    uint32_t inCycle = ms % (STILL_MS + WALK_MS);
+    uint32_t walked = cycle * WALK_MS + (inCycle > STILL_MS ? inCycle - STILL_MS : 0);
+    float angle = walked / 1000.0f * WALK_SPEED / WALK_RADIUS;
+    Solver::Point point = {5 + WALK_RADIUS * cosf(angle), 5 + WALK_RADIUS * sinf(angle), 1};
+    return point;
+}
+
+// DW1000::updatePosition()
+static void updatePosition(uint32_t now, bool &hasPosition, Solver::Point &position)
+{
+    Solver solver;
+    for (int i = 0; i < ANCHORS; i++)
+    {
+        if (anchorStates[i].lastRange != 0 && now - anchorStates[i].lastRange < MAX_RANGE_AGE_MS)
+        {
+            Solver::Point anchor = {anchors[i].radio->x, anchors[i].radio->y, anchors[i].radio->z};
+            solver.addMeasurement(anchor, anchorStates[i].distance);
+        }
+    }
+    if (solver.getMeasurementCount() < Solver::MIN_ANCHORS)
+    {
+        return;
+    }
+    Solver::Result result = solver.solve(hasPosition ? position : solver.centroid());
+    if (!result.success)
+    {
+        return;
+    }
+    position = result.position;
+    hasPosition = true;
+    predictor.update(PositionPredictor::Vector{position.x, position.y, position.z}, now);
+    PositionPredictor::Vector velocity = predictor.getVelocity();
+    scheduler.updateSpeed(sqrtf(velocity.x * velocity.x + velocity.y * velocity.y + velocity.z * velocity.z), now);
+    results.fixes++;
+}
+
+static void runMode(Mode mode, int seconds, uint32_t seed, float lossRate, float badLossRate)
+{
+    channel = new SimChannel(seed);
+    SimChannel::Config config = {lossRate, 0.05f, 130, 6.8e6f};
+    channel->setConfig(config);
+
+    // corners of a 10 x 10 m room near the ceiling, and two low on the walls so height isn't left to guesswork
+    const float positions[ANCHORS][3] = {{0, 0, 2.5f}, {10, 0, 2.5f}, {10, 10, 2.5f}, {0, 10, 2.5f}, {5, 0, 0.3f}, {5, 10, 0.3f}};
+    for (int i = 0; i < ANCHORS; i++)
+    {
+        float drift = (channel->random() * 2 - 1) * 10;
+        initNode(anchors[i], channel->addNode(positions[i][0], positions[i][1], positions[i][2], drift), 0xA0 + i);
+        anchorStates[i] = AnchorState{100, 0, 0, 0};
+    }
+    anchors[BAD_ANCHOR].radio->lossRate = badLossRate;
+    Solver::Point start = truthAt(0);
+    initNode(tag, channel->addNode(start.x, start.y, start.z, (channel->random() * 2 - 1) * 10), 0x10);
+
+    // DW1000's defaults, the fixed schedule is what the tag did before it had a scheduler: every anchor, never skipped
+    scheduler = Scheduler();
+    if (mode == FIXED)
+    {
+        scheduler.setConfig({300, 300, 0, 0, 0, 0, 0, 0});
+    }
+    predictor = PositionPredictor();
+    predictor.setConfig({0.15f, 2.0f, 2000, 300});
+    memset(&results, 0, sizeof(results));
+
+    bool hasPosition = false;
+    Solver::Point position = {0, 0, 0};
+    uint16_t slots[ANCHORS];
+    uint8_t sessionCount = 0;
+    uint8_t sessionIndex = 0;
+    int16_t sessionAnchor = -1;
+    uint32_t nextSession = 0; // ms
+
+    for (uint64_t t = 0; t < (uint64_t)seconds * 1000000; t += STEP_US)
+    {
+        channel->advance(STEP_US);
+        uint32_t now = (uint32_t)(t / 1000);
+        bool newMs = t % 1000 == 0;
+        if (newMs)
+        {
+            Solver::Point truth = truthAt(now);
+            tag.radio->x = truth.x;
+            tag.radio->y = truth.y;
+            tag.radio->z = truth.z;
+            if (mode == ADAPTIVE_IMU && isWalking(now))
+            {
+                scheduler.reportMotion(now);
+            }
+            // where a consumer of the fixes thinks the tag is right now
+            if (predictor.hasFix())
+            {
+                PositionPredictor::Vector predicted = predictor.predict(now);
+                float dx = predicted.x - truth.x;
+                float dy = predicted.y - truth.y;
+                float dz = predicted.z - truth.z;
+                float error = dx * dx + dy * dy + dz * dz;
+                if (isWalking(now))
+                {
+                    results.walkErrorSquaredSum += error;
+                    results.walkSamples++;
+                    results.maxWalkError = fmaxf(results.maxWalkError, sqrtf(error));
+                }
+                else
+                {
+                    results.stillErrorSquaredSum += error;
+                    results.stillSamples++;
+                }
+            }
+        }
+
+        for (int i = 0; i < ANCHORS; i++)
+        {
+            processRadioEvents(anchors[i]);
+            if (anchors[i].ranging->isFinished())
+            {
+                anchors[i].ranging->reset();
+            }
+        }
+
+        // tag half of DW1000::handle()
+        processRadioEvents(tag);
+        if (sessionAnchor < 0 && (int32_t)(now - nextSession) >= 0 && !tag.ranging->isBusy())
+        {
+            // DW1000::planSession()
+            scheduler.clearCandidates();
+            for (int i = 0; i < ANCHORS; i++)
+            {
+                scheduler.addCandidate({(uint16_t)i, true, {anchors[i].radio->x, anchors[i].radio->y, anchors[i].radio->z},
+                                        anchorStates[i].reliability, anchorStates[i].lastAttempt});
+            }
+            Scheduler::Point from = {position.x, position.y, position.z};
+            sessionCount = scheduler.select(hasPosition, from, now, slots);
+            sessionIndex = 0;
+            sessionAnchor = sessionCount > 0 ? slots[sessionIndex++] : ANCHORS;
+            results.sessions++;
+        }
+        if (sessionAnchor < 0)
+        {
+            continue;
+        }
+
+        if (tag.ranging->isFinished())
+        {
+            // DW1000::finishAnchorRange()
+            AnchorState &anchor = anchorStates[sessionAnchor];
+            if (tag.ranging->getState() == TwoWayRanging::SUCCEEDED)
+            {
+                anchor.distance = tag.ranging->getReport().range;
+                anchor.lastRange = now;
+                anchor.reliability = (anchor.reliability + 100) / 2;
+            }
+            else
+            {
+                anchor.reliability /= 2;
+            }
+            tag.ranging->reset();
+            sessionAnchor = sessionIndex < sessionCount ? slots[sessionIndex++] : ANCHORS;
+        }
+        if (!tag.ranging->isBusy() && !tag.radio->isTransmitting())
+        {
+            if (sessionAnchor >= ANCHORS)
+            {
+                // DW1000::finishRangingSession()
+                updatePosition(now, hasPosition, position);
+                sessionAnchor = -1;
+                if (mode == FIXED)
+                {
+                    nextSession = now + 100 + (uint32_t)(channel->random() * 400);
+                }
+                else
+                {
+                    uint32_t interval = scheduler.getInterval(now);
+                    nextSession = now + interval * 3 / 4 + (uint32_t)(channel->random() * interval / 2);
+                }
+            }
+            else
+            {
+                anchorStates[sessionAnchor].lastAttempt = now;
+                results.exchanges++;
+                if (sessionAnchor == BAD_ANCHOR)
+                {
+                    results.badExchanges++;
+                }
+                tag.ranging->startTag(TwoWayRanging::shortId(anchors[sessionAnchor].eui), channel->micros());
+            }
+        }
+    }
+
+    const char *names[] = {"fixed", "adaptive", "adaptive+imu"};
+    const SimChannel::Stats &stats = channel->getStats();
+    printf("%-13s %6.1f %7.1f %6.1f %8.1f %7u %9.3f %9.3f %8.3f\n", names[mode], (double)stats.sent / seconds, (double)results.sessions / seconds,
+           (double)results.exchanges / seconds, 100.0 * results.badExchanges / (results.exchanges ? results.exchanges : 1), scheduler.getSkipped(),
+           results.stillSamples ? sqrt(results.stillErrorSquaredSum / results.stillSamples) : 0.0,
+           results.walkSamples ? sqrt(results.walkErrorSquaredSum / results.walkSamples) : 0.0, results.maxWalkError);
+    for (int i = 0; i < ANCHORS; i++)
+    {
+        delete anchors[i].ranging;
+    }
+    delete tag.ranging;
+    delete channel;
+}
+
+int runSchedule(int argc, char **argv)
+{
+    int seconds = argc > 0 ? atoi(argv[0]) : 100;
+    uint32_t seed = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1;
+    float lossRate = argc > 2 ? atof(argv[2]) : 0.01f;
+    float badLossRate = argc > 3 ? atof(argv[3]) : 0.3f;
+
+    printf("schedule, 1 tag, %d anchors (anchor %d losing %.2f more), %d s, seed %u, loss %.3f, still %d s / walking %d s at %.1f m/s\n", ANCHORS,
+           BAD_ANCHOR, badLossRate, seconds, seed, lossRate, STILL_MS / 1000, WALK_MS / 1000, WALK_SPEED);
+    printf("%-13s %6s %7s %6s %8s %7s %9s %9s %8s\n", "", "frames", "session", "ranges", "bad", "skipped", "still rms", "walk rms", "walk max");
+    printf("%-13s %6s %7s %6s %8s %7s %9s %9s %8s\n", "", "/s", "/s", "/s", "%", "", "m", "m", "m");
+    runMode(FIXED, seconds, seed, lossRate, badLossRate);
+    runMode(ADAPTIVE, seconds, seed, lossRate, badLossRate);
+    runMode(ADAPTIVE_IMU, seconds, seed, lossRate, badLossRate);
+    return 0;
+}
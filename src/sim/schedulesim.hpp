@@ -0,0 +1,4 @@
+#pragma once
+
+// program schedule ..., argv starts after "schedule"
+int runSchedule(int argc, char **argv);
@@ -0,0 +1,292 @@
+#include "simchannel.hpp"
+
+#include <math.h>
+#include <string.h>
+
+// DW1000 timestamps are 40 bits and wrap
+#define TIMESTAMP_MASK 0xFFFFFFFFFFULL
+// one DW1000 time unit, s
+#define TICK (1.0 / (128 * 499.2e6))
+#define SPEED_OF_LIGHT 299702547.0 // m/s, in air
+// frames that ended longer ago than this can't overlap anything still to be delivered
+#define FRAME_KEEP 0.01 // s
+// standard deviation of the carrier integrator's clock offset, ppm
+#define CARRIER_NOISE 0.1
+
+uint64_t SimRadio::clockAt(double t)
+{
+    // the integral of the drift since time 0
+    double ticks = (t * (1 + driftPpm * 1e-6) + 0.5 * driftRate * 1e-6 * t * t) / TICK;
+    return (mClockOffset + (uint64_t)ticks) & TIMESTAMP_MASK;
+}
+
+double SimRadio::timeOf(uint64_t timestamp)
+{
+    double now = mChannel->getTime();
+    uint64_t ahead = (timestamp - this->clockAt(now)) & TIMESTAMP_MASK;
+    if (ahead > TIMESTAMP_MASK / 2)
+    {
+        // the real chip would wait for the clock to wrap around, ~17s
+        mChannel->mStats.lateTransmits++;
+    }
+    return now + ahead * TICK / (1 + this->driftAt(now) * 1e-6);
+}
+
+Radio::Event SimRadio::pollEvent()
+{
+    if (mTransmitDone)
+    {
+        mTransmitDone = false;
+        mTransmitting = false;
+        return TRANSMIT_DONE;
+    }
+    if (mReceiveDone)
+    {
+        mReceiveDone = false;
+        mReceiving = false;
+        return RECEIVE_DONE;
+    }
+    if (mReceiveFailed)
+    {
+        mReceiveFailed = false;
+        mReceiving = false;
+        return RECEIVE_FAILED;
+    }
+    return NONE;
+}
+
+void SimRadio::transmit(const uint8_t *data, size_t len, bool delayed, bool receiveAfter)
+{
+    mReceiveAfter = receiveAfter;
+    mReceiving = false;
+    mReceiveDone = false;
+    mReceiveFailed = false;
+    mTransmitting = true;
+    mFramesSent++;
+    mBytesSent += len;
+
+    double start = mChannel->getTime();
+    if (delayed)
+    {
+        mTransmitTimestamp = mDelayedTimestamp;
+        // the timestamp marks the end of the preamble
+        start = this->timeOf(mDelayedTimestamp) - mChannel->mConfig.preambleUs * 1e-6;
+    }
+    else
+    {
+        mTransmitTimestamp = this->clockAt(start + mChannel->mConfig.preambleUs * 1e-6);
+    }
+    mChannel->send(this, data, len, start);
+}
+
+uint64_t SimRadio::scheduleTransmit(uint64_t reference, uint32_t delayUs)
+{
+    uint64_t sendTime = (reference + (uint64_t)(delayUs * 1e-6 / TICK)) & TIMESTAMP_MASK;
+    // same as the chip, the low 9 bits are ignored. There's no antenna delay in here
+    mDelayedTimestamp = sendTime & ~0x1FFULL;
+    return mDelayedTimestamp;
+}
+
+void SimRadio::startReceive()
+{
+    mReceiving = true;
+    mReceiveStart = mChannel->getTime();
+}
+
+void SimRadio::idle()
+{
+    // drop a delayed transmit that hasn't started yet
+    for (uint8_t i = 0; i < SimChannel::MAX_FRAMES; i++)
+    {
+        SimChannel::Frame &frame = mChannel->mFrames[i];
+        if (frame.active && frame.sender == this && frame.start > mChannel->getTime())
+        {
+            frame.active = false;
+        }
+    }
+    mTransmitting = false;
+    mReceiving = false;
+    mTransmitDone = false;
+    mReceiveAfter = false;
+}
+
+size_t SimRadio::getReceivedData(uint8_t *data, size_t maxLen)
+{
+    if (mReceivedLength == 0 || mReceivedLength > maxLen)
+    {
+        return 0;
+    }
+    memcpy(data, mReceived, mReceivedLength);
+    return mReceivedLength;
+}
+
+uint64_t SimRadio::getSystemTimestamp()
+{
+    return this->clockAt(mChannel->getTime());
+}
+
+SimChannel::SimChannel(uint32_t seed)
+{
+    mConfig = Config{0.01f, 0.05f, 130, 6.8e6f};
+    memset(&mStats, 0, sizeof(mStats));
+    mNow = 0;
+    mRandom = seed == 0 ? 1 : seed;
+    mNodeCount = 0;
+    memset(mFrames, 0, sizeof(mFrames));
+}
+
+SimRadio *SimChannel::addNode(float x, float y, float z, float driftPpm)
+{
+    if (mNodeCount >= MAX_NODES)
+    {
+        return nullptr;
+    }
+    SimRadio *node = &mNodes[mNodeCount++];
+    memset(node->mReceived, 0, sizeof(node->mReceived));
+    node->x = x;
+    node->y = y;
+    node->z = z;
+    node->driftPpm = driftPpm;
+    node->driftRate = 0;
+    node->lossRate = 0;
+    node->mChannel = this;
+    // every chip powers up at a different time
+    node->mClockOffset = ((uint64_t)(this->random() * 0xFFFFFFFF) << 8) & TIMESTAMP_MASK;
+    node->mDelayedTimestamp = 0;
+    node->mTransmitTimestamp = 0;
+    node->mTransmitDone = false;
+    node->mReceiveAfter = false;
+    node->mReceiveStart = 0;
+    node->mReceivedLength = 0;
+    node->mReceiveTimestamp = 0;
+    node->mCarrierOffset = NAN;
+    node->mReceiveDone = false;
+    node->mReceiveFailed = false;
+    return node;
+}
+
+void SimChannel::send(SimRadio *sender, const uint8_t *data, size_t len, double start)
+{
+    for (uint8_t i = 0; i < MAX_FRAMES; i++)
+    {
+        Frame &frame = mFrames[i];
+        // slots are kept a little after delivery so later frames can still collide with them
+        if (frame.active && (!frame.delivered || frame.end > mNow - FRAME_KEEP))
+        {
+            continue;
+        }
+        frame.active = true;
+        frame.delivered = false;
+        frame.sender = sender;
+        frame.start = start;
+        frame.length = len < SimRadio::MAX_FRAME_LENGTH ? len : SimRadio::MAX_FRAME_LENGTH;
+        frame.end = start + mConfig.preambleUs * 1e-6 + frame.length * 8 / mConfig.bitrate;
+        memcpy(frame.data, data, frame.length);
+        mStats.sent++;
+        return;
+    }
+}
+
+void SimChannel::advance(uint32_t us)
+{
+    double until = mNow + us * 1e-6;
+    // deliver in the order frames end, so receivers see them the way they'd come in
+    while (true)
+    {
+        Frame *next = nullptr;
+        for (uint8_t i = 0; i < MAX_FRAMES; i++)
+        {
+            Frame &frame = mFrames[i];
+            if (frame.active && !frame.delivered && frame.end <= until && (next == nullptr || frame.end < next->end))
+            {
+                next = &frame;
+            }
+        }
+        if (next == nullptr)
+        {
+            break;
+        }
+        mNow = next->end;
+        this->deliver(*next);
+    }
+    mNow = until;
+}
+
+void SimChannel::deliver(Frame &frame)
+{
+    frame.delivered = true;
+    frame.sender->mTransmitDone = true;
+    if (frame.sender->mReceiveAfter)
+    {
+        frame.sender->mReceiving = true;
+        frame.sender->mReceiveStart = frame.end;
+    }
+
+    for (uint8_t n = 0; n < mNodeCount; n++)
+    {
+        SimRadio *node = &mNodes[n];
+        // half duplex, and the receiver has to be on for the whole frame
+        if (node == frame.sender || !node->mReceiving || node->mReceiveDone || node->mReceiveFailed || node->mReceiveStart > frame.start)
+        {
+            continue;
+        }
+
+        bool collided = false;
+        for (uint8_t i = 0; i < MAX_FRAMES; i++)
+        {
+            Frame &other = mFrames[i];
+            if (&other != &frame && other.active && other.sender != node && other.start < frame.end && other.end > frame.start)
+            {
+                collided = true;
+                break;
+            }
+        }
+        if (collided)
+        {
+            node->mReceiveFailed = true;
+            mStats.collided++;
+            continue;
+        }
+        if (this->random() < mConfig.lossRate + frame.sender->lossRate + node->lossRate)
+        {
+            mStats.lost++;
+            continue;
+        }
+
+        double timeOfFlight = (distance(frame.sender, node) + this->gaussian() * mConfig.timestampNoise) / SPEED_OF_LIGHT;
+        memcpy(node->mReceived, frame.data, frame.length);
+        node->mReceivedLength = frame.length;
+        node->mReceiveTimestamp = node->clockAt(frame.start + mConfig.preambleUs * 1e-6 + timeOfFlight);
+        node->mCarrierOffset = frame.sender->driftAt(mNow) - node->driftAt(mNow) + this->gaussian() * CARRIER_NOISE;
+        node->mReceiveDone = true;
+        mStats.delivered++;
+    }
+}
+
+float SimChannel::distance(const SimRadio *a, const SimRadio *b)
+{
+    float dx = a->x - b->x;
+    float dy = a->y - b->y;
+    float dz = a->z - b->z;
+    return sqrtf(dx * dx + dy * dy + dz * dz);
+}
+
+// xorshift32, so runs are the same everywhere
+float SimChannel::random()
+{
+    mRandom ^= mRandom << 13;
+    mRandom ^= mRandom >> 17;
+    mRandom ^= mRandom << 5;
+    return (mRandom >> 8) / 16777216.0f;
+}
+
+// Box-Muller
+float SimChannel::gaussian()
+{
+    float u = this->random();
+    if (u < 1e-7f)
+    {
+        u = 1e-7f;
+    }
+    return sqrtf(-2 * logf(u)) * cosf(6.2831853f * this->random());
+}
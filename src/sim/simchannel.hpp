@@ -0,0 +1,131 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "../radio.hpp"
+
+class SimChannel;
+
+/**
+ * A DW1000 on the simulated channel. Timestamps are in DW1000 time units (~15.65ps, 40 bit)
+ * on the node's own clock, which runs driftPpm fast or slow and starts at a random offset.
+ * driftRate makes driftPpm wander over time, the way a crystal does as it warms up.
+ */
+class SimRadio : public Radio
+{
+public:
+    static const size_t MAX_FRAME_LENGTH = 127;
+
+    Event pollEvent() override;
+    void transmit(const uint8_t *data, size_t len, bool delayed = false, bool receiveAfter = false) override;
+    uint64_t scheduleTransmit(uint64_t reference, uint32_t delayUs) override;
+    void startReceive() override;
+    void idle() override;
+
+    size_t getReceivedData(uint8_t *data, size_t maxLen) override;
+    uint64_t getReceiveTimestamp() override { return mReceiveTimestamp; }
+    float getCarrierOffset() override { return mCarrierOffset; }
+    uint64_t getTransmitTimestamp() override { return mTransmitTimestamp; }
+    uint64_t getSystemTimestamp() override;
+
+    float x, y, z; // m
+    float driftPpm;  // at time 0
+    float driftRate; // ppm/s
+    float lossRate;  // 0..1, on top of the channel's for every frame to or from this node, say it's behind a wall
+    // ppm, at the channel's time t
+    double driftAt(double t) { return driftPpm + driftRate * t; }
+
+private:
+    friend class SimChannel;
+    SimChannel *mChannel;
+    uint64_t mClockOffset;
+
+    uint64_t mDelayedTimestamp;
+    uint64_t mTransmitTimestamp;
+    bool mTransmitDone;
+    bool mReceiveAfter;
+
+    double mReceiveStart; // s, when the receiver was turned on
+    uint8_t mReceived[MAX_FRAME_LENGTH];
+    size_t mReceivedLength;
+    uint64_t mReceiveTimestamp;
+    float mCarrierOffset; // ppm
+    bool mReceiveDone;
+    bool mReceiveFailed;
+
+    // local clock at the channel's time t
+    uint64_t clockAt(double t);
+    // channel time the local clock reads timestamp, the next time after now
+    double timeOf(uint64_t timestamp);
+};
+
+/**
+ * Simulated UWB channel for running the ranging state machines of many nodes on the host.
+ * Models time of flight, each node's clock drift, random packet loss and collisions: a receiver that
+ * hears two frames overlapping gets neither. Time only moves on advance(), so runs are reproducible from the seed.
+ */
+class SimChannel
+{
+public:
+    static const uint8_t MAX_NODES = 32;
+    static const uint8_t MAX_FRAMES = 16;
+
+    typedef struct
+    {
+        float lossRate;      // 0..1, chance a receiver misses a frame it should have heard
+        float timestampNoise; // m, standard deviation of the RX timestamp error, as a distance
+        uint32_t preambleUs; // airtime before the first data bit, the timestamp is taken after it
+        float bitrate;       // bits/s
+    } Config;
+
+    typedef struct
+    {
+        uint32_t sent;
+        uint32_t delivered;
+        uint32_t lost;
+        uint32_t collided;
+        uint32_t lateTransmits; // delayed transmits scheduled in the past
+    } Stats;
+
+    SimChannel(uint32_t seed);
+
+    void setConfig(const Config &config) { mConfig = config; }
+    SimRadio *addNode(float x, float y, float z, float driftPpm);
+
+    // moves time on, delivering every frame that finishes in that time
+    void advance(uint32_t us);
+    // channel time, for the state machines' nowUs
+    uint32_t micros() { return (uint32_t)(uint64_t)(mNow * 1e6); }
+    double getTime() { return mNow; }
+
+    const Stats &getStats() { return mStats; }
+    static float distance(const SimRadio *a, const SimRadio *b);
+    float random(); // 0..1
+    float gaussian();
+
+private:
+    friend class SimRadio;
+
+    typedef struct
+    {
+        bool active;
+        bool delivered;
+        SimRadio *sender;
+        double start; // s, first bit of the preamble
+        double end;   // s
+        uint8_t data[SimRadio::MAX_FRAME_LENGTH];
+        size_t length;
+    } Frame;
+
+    Config mConfig;
+    Stats mStats;
+    double mNow;
+    uint32_t mRandom;
+    SimRadio mNodes[MAX_NODES];
+    uint8_t mNodeCount;
+    Frame mFrames[MAX_FRAMES];
+
+    void send(SimRadio *sender, const uint8_t *data, size_t len, double start);
+    void deliver(Frame &frame);
+};
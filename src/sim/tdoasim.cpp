@@ -0,0 +1,315 @@
+/**
+ * Host simulation of a TDOA cell (-DDW1000_TDOA): tags only blink, anchor 0 is the master sending syncs, the others
+ * keep a TdoaClock against it, and every anchor's arrivals go through the same batch encoding HomeAssistant publishes
+ * into a TdoaLocator. Prints how far the synced clocks and the fixes are from the truth.
+ *
+ * .pio/build/native/program tdoa [tags] [seconds] [seed] [loss rate] [max drift ppm] [max drift rate ppm/s]
+ *
+ * MQTT is instant in here, batches are handed over as soon as they're flushed.
+ */
+#include "tdoasim.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../tdoa.hpp"
+#include "simchannel.hpp"
+
+#define ANCHORS 6
+#define MAX_TAGS (SimChannel::MAX_NODES - ANCHORS)
+#define STEP_US 20
+// same as DW1000's tag mMinBlinkDelay / mMaxBlinkDelay
+#define MIN_BLINK_DELAY_US 100000
+#define MAX_BLINK_DELAY_US 500000
+// how often anchors publish their arrivals, HomeAssistant's TDOA_BATCH_INTERVAL
+#define BATCH_INTERVAL_US 100000
+// the first syncs are spent estimating the rate
+#define WARMUP_US 1000000
+#define CLOCK_CHECK_US 10000
+
+typedef struct
+{
+    SimRadio *radio;
+    uint8_t eui[8];
+    uint8_t sequence;
+    uint32_t next; // us, next sync or blink
+    // anchors only
+    TdoaClock clock;
+    Tdoa::Arrival arrivals[Tdoa::MAX_RECORDS];
+    uint8_t arrivalCount;
+    uint32_t overflow;
+    uint32_t nextBatch; // us
+} Node;
+
+typedef struct
+{
+    uint32_t blinks;
+    uint32_t syncs;
+    uint32_t unsynced; // arrivals dropped by an anchor that wasn't synced yet
+    uint32_t fixes;
+    double errorSquaredSum;
+    double horizontalErrorSquaredSum;
+    float maxError;
+    double clockErrorSquaredSum; // ticks
+    double driftErrorSquaredSum; // ppm
+    uint32_t clockChecks;
+} Results;
+
+static SimChannel *channel;
+static Node anchors[ANCHORS];
+static Node tags[MAX_TAGS];
+static int tagCount;
+static Results results;
+static TdoaLocator<ANCHORS, MAX_TAGS> locator;
+
+static void initNode(Node &node, SimRadio *radio, uint8_t id)
+{
+    node.radio = radio;
+    for (uint8_t i = 0; i < 8; i++)
+    {
+        node.eui[i] = i == 0 ? id : 0xD0 + i;
+    }
+    node.sequence = 0;
+    node.next = 0;
+    node.arrivalCount = 0;
+    node.overflow = 0;
+    node.nextBatch = BATCH_INTERVAL_US;
+}
+
+static Tdoa::Point positionOf(const SimRadio *radio)
+{
+    Tdoa::Point point = {radio->x, radio->y, radio->z};
+    return point;
+}
+
+// DW1000 anchor's handleFrame()
+static void onAnchorFrame(Node &node, bool master, const uint8_t *frame, size_t len)
+{
+    uint64_t received = node.radio->getReceiveTimestamp();
+    Tdoa::Sync sync;
+    if (!master && Tdoa::decodeSync(frame, len, sync))
+    {
+        Tdoa::Point own = positionOf(node.radio);
+        float dx = own.x - sync.master.x;
+        float dy = own.y - sync.master.y;
+        float dz = own.z - sync.master.z;
+        node.clock.update(sync.sent, received, sqrtf(dx * dx + dy * dy + dz * dz) / Tdoa::DISTANCE_PER_TICK);
+        return;
+    }
+
+    Tdoa::Arrival arrival;
+    if (!Tdoa::decodeBlink(frame, len, &arrival.sequence, arrival.tagEui))
+    {
+        return;
+    }
+    if (master)
+    {
+        arrival.arrival = received;
+    }
+    else if (!node.clock.toMaster(received, &arrival.arrival))
+    {
+        results.unsynced++;
+        return;
+    }
+    if (node.arrivalCount >= Tdoa::MAX_RECORDS)
+    {
+        node.overflow++;
+        return;
+    }
+    node.arrivals[node.arrivalCount++] = arrival;
+}
+
+// what HomeAssistant does with the batch on either side of MQTT
+static void flushArrivals(Node &node)
+{
+    uint8_t batch[Tdoa::MAX_BATCH_LENGTH];
+    size_t len = Tdoa::encodeBatch(node.eui, positionOf(node.radio), node.arrivals, node.arrivalCount, batch, sizeof(batch));
+    node.arrivalCount = 0;
+
+    uint8_t eui[8];
+    Tdoa::Point position;
+    int16_t count = Tdoa::decodeBatch(batch, len, eui, position);
+    for (int16_t i = 0; i < count; i++)
+    {
+        Tdoa::Arrival arrival;
+        Tdoa::decodeRecord(batch, i, arrival);
+        locator.addArrival(eui, position, arrival, channel->micros() / 1000);
+    }
+}
+
+static void handleAnchor(Node &node, bool master)
+{
+    uint8_t frame[128];
+    Radio::Event event;
+    while ((event = node.radio->pollEvent()) != Radio::NONE)
+    {
+        if (event == Radio::RECEIVE_DONE)
+        {
+            size_t len = node.radio->getReceivedData(frame, sizeof(frame));
+            onAnchorFrame(node, master, frame, len);
+        }
+    }
+
+    uint32_t now = channel->micros();
+    if (master && (int32_t)(now - node.next) >= 0 && !node.radio->isTransmitting())
+    {
+        Tdoa::Sync sync;
+        sync.sequence = node.sequence++;
+        memcpy(sync.masterEui, node.eui, 8);
+        sync.sent = node.radio->scheduleTransmit(node.radio->getSystemTimestamp(), Tdoa::SYNC_DELAY_US);
+        sync.master = positionOf(node.radio);
+        size_t len = Tdoa::encodeSync(sync, frame, sizeof(frame));
+        node.radio->transmit(frame, len, true);
+        node.next = now + Tdoa::SYNC_INTERVAL_MS * 1000;
+        results.syncs++;
+    }
+    if ((int32_t)(now - node.nextBatch) >= 0)
+    {
+        flushArrivals(node);
+        node.nextBatch = now + BATCH_INTERVAL_US;
+    }
+
+    if (!node.radio->isTransmitting() && !node.radio->isReceiving())
+    {
+        node.radio->startReceive();
+    }
+}
+
+static void handleTag(Node &node)
+{
+    while (node.radio->pollEvent() != Radio::NONE)
+        ;
+    uint32_t now = channel->micros();
+    if ((int32_t)(now - node.next) >= 0 && !node.radio->isTransmitting())
+    {
+        uint8_t frame[Tdoa::BLINK_LENGTH];
+        size_t len = Tdoa::encodeBlink(node.sequence++, node.eui, frame, sizeof(frame));
+        node.radio->transmit(frame, len);
+        node.next = now + MIN_BLINK_DELAY_US + (uint32_t)(channel->random() * (MAX_BLINK_DELAY_US - MIN_BLINK_DELAY_US));
+        results.blinks++;
+    }
+}
+
+// every slave's idea of the master's clock right now, against the master's clock itself
+static void checkClocks()
+{
+    uint64_t master = anchors[0].radio->getSystemTimestamp();
+    double masterDrift = anchors[0].radio->driftAt(channel->getTime());
+    for (int i = 1; i < ANCHORS; i++)
+    {
+        uint64_t estimate;
+        if (!anchors[i].clock.toMaster(anchors[i].radio->getSystemTimestamp(), &estimate))
+        {
+            continue;
+        }
+        double error = (double)Tdoa::difference(master, estimate);
+        double drift = ((1 + masterDrift * 1e-6) / (1 + anchors[i].radio->driftAt(channel->getTime()) * 1e-6) - 1) * 1e6;
+        double driftError = anchors[i].clock.getDriftPpm() - drift;
+        results.clockErrorSquaredSum += error * error;
+        results.driftErrorSquaredSum += driftError * driftError;
+        results.clockChecks++;
+    }
+}
+
+static void pollFixes()
+{
+    TdoaLocator<ANCHORS, MAX_TAGS>::Fix fix;
+    while (locator.poll(channel->micros() / 1000, fix))
+    {
+        for (int i = 0; i < tagCount; i++)
+        {
+            if (memcmp(tags[i].eui, fix.tagEui, 8) != 0)
+            {
+                continue;
+            }
+            float dx = fix.position.x - tags[i].radio->x;
+            float dy = fix.position.y - tags[i].radio->y;
+            float dz = fix.position.z - tags[i].radio->z;
+            float error = sqrtf(dx * dx + dy * dy + dz * dz);
+            results.fixes++;
+            results.errorSquaredSum += error * error;
+            results.horizontalErrorSquaredSum += dx * dx + dy * dy;
+            if (error > results.maxError)
+            {
+                results.maxError = error;
+            }
+        }
+    }
+}
+
+int runTdoa(int argc, char **argv)
+{
+    tagCount = argc > 0 ? atoi(argv[0]) : 10;
+    int seconds = argc > 1 ? atoi(argv[1]) : 60;
+    uint32_t seed = argc > 2 ? strtoul(argv[2], nullptr, 10) : 1;
+    float lossRate = argc > 3 ? atof(argv[3]) : 0.01f;
+    float maxDrift = argc > 4 ? atof(argv[4]) : 10;
+    float maxDriftRate = argc > 5 ? atof(argv[5]) : 0.01f;
+    if (tagCount < 1 || tagCount > MAX_TAGS)
+    {
+        fprintf(stderr, "1 to %d tags\n", MAX_TAGS);
+        return 1;
+    }
+
+    channel = new SimChannel(seed);
+    SimChannel::Config config = {lossRate, 0.05f, 130, 6.8e6f};
+    channel->setConfig(config);
+
+    // corners of a 10 x 10 m room near the ceiling, and two low on the walls so height isn't left to guesswork
+    const float positions[ANCHORS][3] = {{0, 0, 2.5f}, {10, 0, 2.5f}, {10, 10, 2.5f}, {0, 10, 2.5f}, {5, 0, 0.3f}, {5, 10, 0.3f}};
+    for (int i = 0; i < ANCHORS; i++)
+    {
+        float drift = (channel->random() * 2 - 1) * maxDrift;
+        initNode(anchors[i], channel->addNode(positions[i][0], positions[i][1], positions[i][2], drift), 0xA0 + i);
+        anchors[i].radio->driftRate = (channel->random() * 2 - 1) * maxDriftRate;
+    }
+    for (int i = 0; i < tagCount; i++)
+    {
+        float drift = (channel->random() * 2 - 1) * maxDrift;
+        initNode(tags[i], channel->addNode(channel->random() * 10, channel->random() * 10, 1, drift), 0x10 + i);
+        tags[i].next = (uint32_t)(channel->random() * MAX_BLINK_DELAY_US);
+    }
+
+    for (uint64_t t = 0; t < (uint64_t)seconds * 1000000; t += STEP_US)
+    {
+        channel->advance(STEP_US);
+        for (int i = 0; i < ANCHORS; i++)
+        {
+            handleAnchor(anchors[i], i == 0);
+        }
+        for (int i = 0; i < tagCount; i++)
+        {
+            handleTag(tags[i]);
+        }
+        if (t >= WARMUP_US && t % CLOCK_CHECK_US == 0)
+        {
+            checkClocks();
+        }
+        if (t % 1000 == 0)
+        {
+            pollFixes();
+        }
+    }
+
+    const SimChannel::Stats &stats = channel->getStats();
+    const TdoaLocator<ANCHORS, MAX_TAGS>::Stats &locatorStats = locator.getStats();
+    printf("TDOA, %d tags, %d anchors, %d s, seed %u, loss %.3f, drift up to %.1f ppm changing up to %.3f ppm/s\n", tagCount, ANCHORS,
+           seconds, seed, lossRate, maxDrift, maxDriftRate);
+    printf("frames     %u sent (%u syncs, %u blinks), %u delivered, %u lost, %u collided\n", stats.sent, results.syncs, results.blinks,
+           stats.delivered, stats.lost, stats.collided);
+    printf("blinks     %u heard, %u solved, %u too few anchors, %u failed, %u overrun, %u arrivals before sync\n", locatorStats.blinks,
+           locatorStats.solved, locatorStats.tooFewAnchors, locatorStats.failed, locatorStats.overrun, results.unsynced);
+    if (results.clockChecks > 0)
+    {
+        printf("clock      rms error against the master %.3f ns, drift estimate rms error %.4f ppm\n",
+               sqrt(results.clockErrorSquaredSum / results.clockChecks) * 1e9 / (128 * 499.2e6), sqrt(results.driftErrorSquaredSum / results.clockChecks));
+    }
+    if (results.fixes > 0)
+    {
+        printf("fixes      %.1f/s, rms error %.3f m (%.3f m horizontal), max %.3f m\n", (double)results.fixes / seconds,
+               sqrt(results.errorSquaredSum / results.fixes), sqrt(results.horizontalErrorSquaredSum / results.fixes), results.maxError);
+    }
+    return 0;
+}
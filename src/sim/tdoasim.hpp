@@ -0,0 +1,4 @@
+#pragma once
+
+// program tdoa ..., argv starts after "tdoa"
+int runTdoa(int argc, char **argv);
@@ -0,0 +1,46 @@
+#include "taskstats.hpp"
+
+#include "network.hpp"
+
+TaskStats::TaskStats(const char *name)
+{
+    mName = name;
+    mHandle = nullptr;
+    mWorkStart = 0;
+    mBusyMicros = 0;
+    mMaxWorkMicros = 0;
+    mLastPrintMicros = micros();
+    mLastBusyMicros = 0;
+}
+
+void TaskStats::beginWork()
+{
+    mWorkStart = micros();
+}
+
+void TaskStats::endWork()
+{
+    uint32_t work = micros() - mWorkStart;
+    mBusyMicros += work;
+    if (work > mMaxWorkMicros)
+    {
+        mMaxWorkMicros = work;
+    }
+}
+
+void TaskStats::print()
+{
+    uint32_t now = micros();
+    uint32_t busy = mBusyMicros;
+    uint32_t elapsed = now - mLastPrintMicros;
+    float load = elapsed == 0 ? 0 : 100.0f * (busy - mLastBusyMicros) / elapsed;
+
+    // on the ESP32 the stack high water mark is in bytes, not words
+    Debug.printf("%-8s load %5.1f%%, longest pass %lu us, stack free %u bytes\n", mName, load, (unsigned long)mMaxWorkMicros,
+                 mHandle == nullptr ? 0 : (unsigned)uxTaskGetStackHighWaterMark(mHandle));
+
+    mLastPrintMicros = now;
+    mLastBusyMicros = busy;
+    // racing the task here only loses a single pass, good enough for a debug print
+    mMaxWorkMicros = 0;
+}
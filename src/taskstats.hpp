@@ -0,0 +1,38 @@
+#pragma once
+
+#include <Arduino.h>
+
+/**
+ * Keeps track of how busy a FreeRTOS task is. The task wraps each pass of its loop in beginWork()/endWork(),
+ * everything else (vTaskDelay etc.) counts as idle.
+ * Counters are only written by the task being measured, print() can be called from any other task.
+ */
+class TaskStats
+{
+public:
+    TaskStats(const char *name);
+
+    void setHandle(TaskHandle_t handle) { mHandle = handle; }
+    TaskHandle_t getHandle() { return mHandle; }
+
+    void beginWork();
+    void endWork();
+
+    /**
+     * Prints CPU load since the previous print(), the longest single pass and the stack high water mark over RemoteDebug.
+     */
+    void print();
+
+private:
+    const char *mName;
+    TaskHandle_t mHandle;
+
+    // written by the measured task only, these wrap along with micros()
+    volatile uint32_t mWorkStart;
+    volatile uint32_t mBusyMicros;
+    volatile uint32_t mMaxWorkMicros;
+
+    // owned by whoever calls print()
+    uint32_t mLastPrintMicros;
+    uint32_t mLastBusyMicros;
+};
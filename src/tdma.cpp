@@ -0,0 +1,130 @@
+#include "tdma.hpp"
+
+Superframe::Superframe(uint8_t slotCount, uint16_t slotLength)
+{
+    // need at least one tag slot on top of the contention slot
+    if (slotCount < 2)
+    {
+        slotCount = 2;
+    }
+    if (slotCount > MAX_SLOTS)
+    {
+        slotCount = MAX_SLOTS;
+    }
+    mSlotCount = slotCount;
+    mSlotLength = slotLength;
+    mSequence = 0;
+    for (uint8_t i = 0; i < MAX_SLOTS; i++)
+    {
+        mSlotOwner[i] = NO_TAG;
+        mSlotLastSeen[i] = 0;
+    }
+}
+
+uint8_t Superframe::assign(uint16_t tagId)
+{
+    if (tagId == NO_TAG)
+    {
+        return CONTENTION_SLOT;
+    }
+
+    uint8_t slot = this->findSlot(tagId);
+    if (slot != CONTENTION_SLOT)
+    {
+        mSlotLastSeen[slot] = mSequence;
+        return slot;
+    }
+
+    for (uint8_t i = 1; i < mSlotCount; i++)
+    {
+        if (mSlotOwner[i] == NO_TAG)
+        {
+            mSlotOwner[i] = tagId;
+            mSlotLastSeen[i] = mSequence;
+            return i;
+        }
+    }
+    return CONTENTION_SLOT;
+}
+
+void Superframe::markSeen(uint16_t tagId)
+{
+    uint8_t slot = this->findSlot(tagId);
+    if (slot != CONTENTION_SLOT)
+    {
+        mSlotLastSeen[slot] = mSequence;
+    }
+}
+
+void Superframe::next()
+{
+    mSequence++;
+    for (uint8_t i = 1; i < mSlotCount; i++)
+    {
+        // unsigned maths so the sequence wrapping around is fine
+        if (mSlotOwner[i] != NO_TAG && (uint8_t)(mSequence - mSlotLastSeen[i]) > SLOT_EXPIRY)
+        {
+            mSlotOwner[i] = NO_TAG;
+        }
+    }
+}
+
+size_t Superframe::encodeBeacon(uint8_t *payload, size_t length)
+{
+    size_t needed = 4 + (mSlotCount - 1) * 2;
+    if (length < needed)
+    {
+        return 0;
+    }
+
+    payload[0] = mSequence;
+    payload[1] = mSlotCount;
+    payload[2] = mSlotLength & 0xFF;
+    payload[3] = mSlotLength >> 8;
+    for (uint8_t i = 1; i < mSlotCount; i++)
+    {
+        payload[4 + (i - 1) * 2] = mSlotOwner[i] & 0xFF;
+        payload[5 + (i - 1) * 2] = mSlotOwner[i] >> 8;
+    }
+    return needed;
+}
+
+bool Superframe::decodeBeacon(const uint8_t *payload, size_t length)
+{
+    if (length < 4)
+    {
+        return false;
+    }
+
+    uint8_t slotCount = payload[1];
+    if (slotCount < 2 || slotCount > MAX_SLOTS || length < (size_t)(4 + (slotCount - 1) * 2))
+    {
+        return false;
+    }
+
+    mSequence = payload[0];
+    mSlotCount = slotCount;
+    mSlotLength = payload[2] | (payload[3] << 8);
+    mSlotOwner[CONTENTION_SLOT] = NO_TAG;
+    for (uint8_t i = 1; i < mSlotCount; i++)
+    {
+        mSlotOwner[i] = payload[4 + (i - 1) * 2] | (payload[5 + (i - 1) * 2] << 8);
+    }
+    return true;
+}
+
+uint8_t Superframe::findSlot(uint16_t tagId)
+{
+    if (tagId == NO_TAG)
+    {
+        return CONTENTION_SLOT;
+    }
+    for (uint8_t i = 1; i < mSlotCount; i++)
+    {
+        if (mSlotOwner[i] == tagId)
+        {
+            return i;
+        }
+    }
+    return CONTENTION_SLOT;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * TDMA superframe used instead of ALOHA when built with -DDW1000_TDMA.
+ *
+ * The coordinator anchor (-DDW1000_TDMA_COORDINATOR) broadcasts a beacon at the start of every superframe.
+ * Slot 0 straight after the beacon is the contention slot, used for tag join requests and anchor advertise blinks.
+ * Every other slot is owned by at most one tag, which only ranges inside its own slot so tags never collide.
+ *
+ * Beacon payload (follows the 12 byte blink header):
+ * [0] superframe sequence, [1] slot count (including contention slot), [2..3] slot length (ms),
+ * [4..] owner tag id of slots 1..count-1, 2 bytes each, 0 if free
+ *
+ * No Arduino dependencies, so it also builds on the host.
+ */
+class Superframe
+{
+public:
+    static const uint8_t MAX_SLOTS = 16;
+    static const uint8_t CONTENTION_SLOT = 0;
+    static const uint16_t NO_TAG = 0;
+    // superframes a tag can go unheard before the coordinator gives its slot away
+    static const uint8_t SLOT_EXPIRY = 8;
+    static const size_t MAX_BEACON_PAYLOAD = 4 + (MAX_SLOTS - 1) * 2;
+
+    Superframe(uint8_t slotCount = 8, uint16_t slotLength = 50);
+
+    uint8_t getSequence() { return mSequence; }
+    uint8_t getSlotCount() { return mSlotCount; }
+    uint16_t getSlotLength() { return mSlotLength; }
+    uint32_t getLength() { return (uint32_t)mSlotCount * mSlotLength; }
+    // ms from the start of the beacon
+    uint32_t getSlotOffset(uint8_t slot) { return (uint32_t)slot * mSlotLength; }
+
+    /**
+     * COORDINATOR ONLY
+     * Gives the tag a slot if it doesn't have one already. Returns CONTENTION_SLOT if every slot is taken.
+     */
+    uint8_t assign(uint16_t tagId);
+    /**
+     * COORDINATOR ONLY
+     * Keeps the tag's slot alive, call whenever anything is heard from it.
+     */
+    void markSeen(uint16_t tagId);
+    /**
+     * COORDINATOR ONLY
+     * Advances to the next superframe and frees slots of tags that have gone quiet.
+     */
+    void next();
+    size_t encodeBeacon(uint8_t *payload, size_t length);
+
+    /**
+     * Updates the schedule from a received beacon, returns false if the payload is malformed.
+     */
+    bool decodeBeacon(const uint8_t *payload, size_t length);
+    // returns CONTENTION_SLOT if the tag has no slot
+    uint8_t findSlot(uint16_t tagId);
+
+private:
+    uint8_t mSlotCount;
+    uint16_t mSlotLength;
+    uint8_t mSequence;
+    uint16_t mSlotOwner[MAX_SLOTS];
+    uint8_t mSlotLastSeen[MAX_SLOTS]; // superframe sequence the owner was last heard in
+};
@@ -0,0 +1,214 @@
+#include "tdoa.hpp"
+
+#include <string.h>
+
+// same first bytes as DW1000Ng's blinks
+#define FRAME_BLINK 0xC5
+#define BLINK_FLAGS 0x43 // NO_BATTERY_STATUS | NO_EX_ID
+#define TIMESTAMP_LENGTH 5
+#define HALF_RANGE (1ULL << 39)
+
+size_t Tdoa::encodeBlink(uint8_t sequence, const uint8_t tagEui[8], uint8_t *frame, size_t length)
+{
+    if (length < BLINK_LENGTH)
+    {
+        return 0;
+    }
+
+    frame[0] = FRAME_BLINK;
+    frame[1] = sequence;
+    memcpy(&frame[2], tagEui, 8);
+    frame[10] = BLINK_FLAGS;
+    frame[11] = TAG_BLINK;
+    return BLINK_LENGTH;
+}
+
+size_t Tdoa::encodeSync(const Sync &sync, uint8_t *frame, size_t length)
+{
+    if (length < SYNC_LENGTH)
+    {
+        return 0;
+    }
+
+    frame[0] = FRAME_BLINK;
+    frame[1] = sync.sequence;
+    memcpy(&frame[2], sync.masterEui, 8);
+    frame[10] = BLINK_FLAGS;
+    frame[11] = SYNC;
+    writeValue(&frame[12], sync.sent, TIMESTAMP_LENGTH);
+    writePoint(&frame[17], sync.master);
+    return SYNC_LENGTH;
+}
+
+size_t Tdoa::encodeBatch(const uint8_t anchorEui[8], const Point &anchor, const Arrival *arrivals, uint8_t count, uint8_t *batch, size_t length)
+{
+    size_t total = BATCH_HEADER_LENGTH + count * RECORD_LENGTH;
+    if (count > MAX_RECORDS || length < total)
+    {
+        return 0;
+    }
+
+    batch[0] = VERSION;
+    memcpy(&batch[1], anchorEui, 8);
+    writePoint(&batch[9], anchor);
+    batch[15] = count;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        uint8_t *record = &batch[BATCH_HEADER_LENGTH + i * RECORD_LENGTH];
+        memcpy(record, arrivals[i].tagEui, 8);
+        record[8] = arrivals[i].sequence;
+        writeValue(&record[9], arrivals[i].arrival, TIMESTAMP_LENGTH);
+    }
+    return total;
+}
+
+bool Tdoa::decodeBlink(const uint8_t *frame, size_t length, uint8_t *sequence, uint8_t tagEui[8])
+{
+    if (length != BLINK_LENGTH || frame[0] != FRAME_BLINK || frame[11] != TAG_BLINK)
+    {
+        return false;
+    }
+
+    *sequence = frame[1];
+    memcpy(tagEui, &frame[2], 8);
+    return true;
+}
+
+bool Tdoa::decodeSync(const uint8_t *frame, size_t length, Sync &sync)
+{
+    if (length != SYNC_LENGTH || frame[0] != FRAME_BLINK || frame[11] != SYNC)
+    {
+        return false;
+    }
+
+    sync.sequence = frame[1];
+    memcpy(sync.masterEui, &frame[2], 8);
+    sync.sent = readValue(&frame[12], TIMESTAMP_LENGTH);
+    sync.master = readPoint(&frame[17]);
+    return true;
+}
+
+int16_t Tdoa::decodeBatch(const uint8_t *batch, size_t length, uint8_t anchorEui[8], Point &anchor)
+{
+    if (length < BATCH_HEADER_LENGTH || batch[0] != VERSION || batch[15] > MAX_RECORDS ||
+        length != BATCH_HEADER_LENGTH + batch[15] * RECORD_LENGTH)
+    {
+        return -1;
+    }
+
+    memcpy(anchorEui, &batch[1], 8);
+    anchor = readPoint(&batch[9]);
+    return batch[15];
+}
+
+void Tdoa::decodeRecord(const uint8_t *batch, uint8_t index, Arrival &arrival)
+{
+    const uint8_t *record = &batch[BATCH_HEADER_LENGTH + index * RECORD_LENGTH];
+    memcpy(arrival.tagEui, record, 8);
+    arrival.sequence = record[8];
+    arrival.arrival = readValue(&record[9], TIMESTAMP_LENGTH);
+}
+
+int64_t Tdoa::difference(uint64_t a, uint64_t b)
+{
+    uint64_t d = (b - a) & TIMESTAMP_MASK;
+    return d >= HALF_RANGE ? (int64_t)d - (int64_t)(TIMESTAMP_MASK + 1) : (int64_t)d;
+}
+
+void Tdoa::writeValue(uint8_t *bytes, uint64_t value, uint8_t n)
+{
+    for (uint8_t i = 0; i < n; i++)
+    {
+        bytes[i] = (value >> (i * 8)) & 0xFF;
+    }
+}
+
+uint64_t Tdoa::readValue(const uint8_t *bytes, uint8_t n)
+{
+    uint64_t value = 0;
+    for (uint8_t i = 0; i < n; i++)
+    {
+        value |= (uint64_t)bytes[i] << (i * 8);
+    }
+    return value;
+}
+
+void Tdoa::writePoint(uint8_t *bytes, const Point &point)
+{
+    writeValue(&bytes[0], (uint16_t)(int16_t)lroundf(point.x * 100), 2);
+    writeValue(&bytes[2], (uint16_t)(int16_t)lroundf(point.y * 100), 2);
+    writeValue(&bytes[4], (uint16_t)(int16_t)lroundf(point.z * 100), 2);
+}
+
+Tdoa::Point Tdoa::readPoint(const uint8_t *bytes)
+{
+    Point point;
+    point.x = (int16_t)readValue(&bytes[0], 2) / 100.0f;
+    point.y = (int16_t)readValue(&bytes[2], 2) / 100.0f;
+    point.z = (int16_t)readValue(&bytes[4], 2) / 100.0f;
+    return point;
+}
+
+TdoaClock::TdoaClock()
+{
+    this->reset();
+}
+
+void TdoaClock::reset()
+{
+    mHasSync = false;
+    mHasRate = false;
+    mLastLocal = 0;
+    mLastMaster = 0;
+    mLastFraction = 0;
+    mRate = 1;
+}
+
+void TdoaClock::update(uint64_t masterSent, uint64_t localReceived, double tof)
+{
+    // master clock when the sync arrived
+    double whole = floor(tof);
+    uint64_t master = (masterSent + (uint64_t)whole) & Tdoa::TIMESTAMP_MASK;
+    double fraction = tof - whole;
+
+    if (mHasSync)
+    {
+        int64_t local = Tdoa::difference(mLastLocal, localReceived);
+        if (local > 0 && (uint64_t)local < MAX_SYNC_GAP)
+        {
+            double rate = (Tdoa::difference(mLastMaster, master) + fraction - mLastFraction) / local;
+            // a missed sync only stretches the interval, a rate this far off is a bad timestamp
+            if (fabs(rate - 1) < 100e-6)
+            {
+                mRate = mHasRate ? mRate + RATE_SMOOTHING * (rate - mRate) : rate;
+                mHasRate = true;
+            }
+        }
+    }
+
+    mHasSync = true;
+    mLastLocal = localReceived;
+    mLastMaster = master;
+    mLastFraction = fraction;
+}
+
+bool TdoaClock::isSynced(uint64_t local)
+{
+    if (!mHasRate)
+    {
+        return false;
+    }
+    int64_t elapsed = Tdoa::difference(mLastLocal, local);
+    return (uint64_t)(elapsed < 0 ? -elapsed : elapsed) < MAX_SYNC_GAP;
+}
+
+bool TdoaClock::toMaster(uint64_t local, uint64_t *master)
+{
+    if (!this->isSynced(local))
+    {
+        return false;
+    }
+    double elapsed = Tdoa::difference(mLastLocal, local) * mRate + mLastFraction;
+    *master = (mLastMaster + (uint64_t)(int64_t)llround(elapsed)) & Tdoa::TIMESTAMP_MASK;
+    return true;
+}
@@ -0,0 +1,563 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+#include <string.h>
+
+#include "peertable.hpp"
+
+/**
+ * Uplink time difference of arrival, used instead of two way ranging when built with -DDW1000_TDOA.
+ *
+ * Tags only send a short blink. Every anchor timestamps it on arrival, and turns that into the master anchor's
+ * clock (-DDW1000_TDOA_MASTER) with a TdoaClock kept in step by the master's sync blinks. The anchors publish their
+ * arrivals over MQTT, and the master collects everyone's with a TdoaLocator and solves the tag's position from the
+ * differences between them. A tag costs one frame per fix however many anchors hear it.
+ *
+ * Frames use the blink layout, all multi byte values are little endian and timestamps are 40 bit DW1000 time (5 bytes).
+ *
+ * TAG BLINK [0] BLINK, [1] sequence, [2..9] tag eui, [10] flags, [11] TAG_BLINK
+ * SYNC      [0] BLINK, [1] sequence, [2..9] master eui, [10] flags, [11] SYNC,
+ *           [12..16] send time of this frame (master clock), [17..22] master x, y, z (cm, signed)
+ *
+ * Arrival batch, published by every anchor on dw1000/<anchor>/tdoa:
+ * Header    [0] VERSION, [1..8] anchor eui, [9..14] anchor x, y, z (cm, signed), [15] record count n
+ * Record    [0..7] tag eui, [8] blink sequence, [9..13] arrival time (master clock)
+ *
+ * No Arduino dependencies, so it also builds on the host.
+ */
+class Tdoa
+{
+public:
+    // blink specifiers, the byte after the flags
+    static const uint8_t TAG_BLINK = 0x06;
+    static const uint8_t SYNC = 0x07;
+
+    static const size_t BLINK_LENGTH = 12;
+    static const size_t SYNC_LENGTH = 23;
+
+    // the master sends the sync this long after deciding to, so its send time can go inside it
+    static const uint32_t SYNC_DELAY_US = 1000;
+    static const uint32_t SYNC_INTERVAL_MS = 100;
+
+    static const uint8_t VERSION = 1;
+    static const uint8_t MAX_RECORDS = 32;
+    static const size_t BATCH_HEADER_LENGTH = 16;
+    static const size_t RECORD_LENGTH = 14;
+    static const size_t MAX_BATCH_LENGTH = BATCH_HEADER_LENGTH + MAX_RECORDS * RECORD_LENGTH;
+
+    static const uint64_t TIMESTAMP_MASK = 0xFFFFFFFFFFULL;
+    // 499.2 MHz * 128
+    static const uint64_t TICKS_PER_MS = 63897600;
+    // m per DW1000 time unit, at the speed of light in air
+    static constexpr double DISTANCE_PER_TICK = 0.0046917639786159;
+
+    typedef struct
+    {
+        float x;
+        float y;
+        float z;
+    } Point;
+
+    typedef struct
+    {
+        uint8_t sequence;
+        uint8_t masterEui[8];
+        uint64_t sent;
+        Point master; // m
+    } Sync;
+
+    typedef struct
+    {
+        uint8_t tagEui[8];
+        uint8_t sequence;
+        uint64_t arrival; // master clock
+    } Arrival;
+
+    // encoders return the frame length, or 0 if it doesn't fit in the buffer
+    static size_t encodeBlink(uint8_t sequence, const uint8_t tagEui[8], uint8_t *frame, size_t length);
+    static size_t encodeSync(const Sync &sync, uint8_t *frame, size_t length);
+    static size_t encodeBatch(const uint8_t anchorEui[8], const Point &anchor, const Arrival *arrivals, uint8_t count, uint8_t *batch, size_t length);
+
+    // decoders return false if the frame isn't that type or is malformed
+    static bool decodeBlink(const uint8_t *frame, size_t length, uint8_t *sequence, uint8_t tagEui[8]);
+    static bool decodeSync(const uint8_t *frame, size_t length, Sync &sync);
+    /**
+     * Checks the batch and returns how many records it has, records are then read with decodeRecord(). -1 if malformed.
+     */
+    static int16_t decodeBatch(const uint8_t *batch, size_t length, uint8_t anchorEui[8], Point &anchor);
+    static void decodeRecord(const uint8_t *batch, uint8_t index, Arrival &arrival);
+
+    // b - a on a wrapping 40 bit clock, in timestamp units
+    static int64_t difference(uint64_t a, uint64_t b);
+
+private:
+    static void writeValue(uint8_t *bytes, uint64_t value, uint8_t n);
+    static uint64_t readValue(const uint8_t *bytes, uint8_t n);
+    static void writePoint(uint8_t *bytes, const Point &point);
+    static Point readPoint(const uint8_t *bytes);
+};
+
+/**
+ * An anchor's clock against the master's, from the master's sync blinks.
+ * Every sync gives one point where the two clocks are known to line up: the master's send time plus the time of flight
+ * between the two anchors (their surveyed distance) is our receive time. Between syncs the clocks are assumed to run
+ * at a steady rate, estimated from consecutive syncs and smoothed a little. Receive timestamps only jitter by ~0.2ns
+ * over a 100ms sync interval, so smoothing harder just lags behind a crystal that's still warming up.
+ */
+class TdoaClock
+{
+public:
+    // syncs further apart than this don't give a usable rate, and arrivals this long after the last sync are dropped
+    static const uint64_t MAX_SYNC_GAP = Tdoa::TICKS_PER_MS * Tdoa::SYNC_INTERVAL_MS * 3;
+    // weight of each new rate estimate
+    static constexpr double RATE_SMOOTHING = 0.5;
+
+    TdoaClock();
+
+    void reset();
+    /**
+     * A sync sent at masterSent on the master's clock arrived at localReceived on ours, tof timestamp units later.
+     */
+    void update(uint64_t masterSent, uint64_t localReceived, double tof);
+    // a rate has been estimated and the last sync isn't too old for local
+    bool isSynced(uint64_t local);
+    /**
+     * Our timestamp on the master's clock, false if not synced.
+     */
+    bool toMaster(uint64_t local, uint64_t *master);
+    // how much faster the master's crystal runs than ours
+    double getDriftPpm() { return (mRate - 1) * 1e6; }
+
+private:
+    bool mHasSync;
+    bool mHasRate;
+    uint64_t mLastLocal;
+    // master clock at mLastLocal
+    uint64_t mLastMaster;
+    double mLastFraction; // below a timestamp unit, the time of flight isn't a whole number of them
+    // master units per local unit
+    double mRate;
+};
+
+/**
+ * Levenberg-Marquardt TDOA solver: finds the point whose differences in distance to each anchor, against the first
+ * one added, best fit the measured ones. Fixed size like Multilateration so it doesn't touch the heap.
+ */
+template <uint8_t MaxAnchors>
+class TdoaSolver
+{
+public:
+    // 3 differences for 3 unknowns
+    static const uint8_t MIN_ANCHORS = 4;
+
+    typedef Tdoa::Point Point;
+
+    typedef struct
+    {
+        bool success;
+        Point position;
+        uint8_t iterations;
+        float rmsError; // m, of the distance differences
+    } Result;
+
+    TdoaSolver() : mCount(0) {}
+
+    void reset() { mCount = 0; }
+    uint8_t getMeasurementCount() const { return mCount; }
+
+    /**
+     * Adds an anchor and how much further from it the tag is than from the first anchor (m, 0 for the first).
+     * Returns false if there is no room left.
+     */
+    bool addMeasurement(const Point &anchor, float rangeDifference)
+    {
+        if (mCount >= MaxAnchors)
+        {
+            return false;
+        }
+        mAnchors[mCount] = anchor;
+        mDifferences[mCount] = rangeDifference;
+        mCount++;
+        return true;
+    }
+
+    // same guess as Multilateration::centroid(), tags are somewhere below ceiling mounted anchors
+    Point centroid() const
+    {
+        Point guess = {0, 0, 0};
+        if (mCount == 0)
+        {
+            return guess;
+        }
+        float maxZ = mAnchors[0].z;
+        for (uint8_t i = 0; i < mCount; i++)
+        {
+            guess.x += mAnchors[i].x;
+            guess.y += mAnchors[i].y;
+            if (mAnchors[i].z > maxZ)
+            {
+                maxZ = mAnchors[i].z;
+            }
+        }
+        guess.x /= mCount;
+        guess.y /= mCount;
+        guess.z = maxZ / 2;
+        return guess;
+    }
+
+    Result solve(const Point &initialGuess, uint8_t maxIterations = 50, float tolerance = 0.001f) const
+    {
+        Result result = {false, initialGuess, 0, 0};
+        if (mCount < MIN_ANCHORS)
+        {
+            return result;
+        }
+
+        Point p = initialGuess;
+        float cost = this->cost(p);
+        float lambda = 0.001f;
+
+        while (result.iterations < maxIterations)
+        {
+            result.iterations++;
+
+            float reference[3];
+            float referenceRange = this->direction(p, mAnchors[0], reference);
+            float jtj[3][3] = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}};
+            float jtr[3] = {0, 0, 0};
+            for (uint8_t i = 1; i < mCount; i++)
+            {
+                float d[3];
+                float range = this->direction(p, mAnchors[i], d);
+                float residual = range - referenceRange - mDifferences[i];
+                float j[3] = {d[0] - reference[0], d[1] - reference[1], d[2] - reference[2]};
+                for (uint8_t r = 0; r < 3; r++)
+                {
+                    jtr[r] += j[r] * residual;
+                    for (uint8_t c = 0; c < 3; c++)
+                    {
+                        jtj[r][c] += j[r] * j[c];
+                    }
+                }
+            }
+
+            float a[3][3];
+            for (uint8_t r = 0; r < 3; r++)
+            {
+                for (uint8_t c = 0; c < 3; c++)
+                {
+                    a[r][c] = jtj[r][c];
+                }
+                a[r][r] += lambda * (jtj[r][r] + 1e-6f);
+            }
+
+            float b[3] = {-jtr[0], -jtr[1], -jtr[2]};
+            float delta[3];
+            if (!solve3x3(a, b, delta))
+            {
+                lambda *= 10;
+                continue;
+            }
+
+            Point candidate = {p.x + delta[0], p.y + delta[1], p.z + delta[2]};
+            float candidateCost = this->cost(candidate);
+            if (candidateCost < cost)
+            {
+                p = candidate;
+                cost = candidateCost;
+                lambda = fmaxf(lambda / 10, 1e-7f);
+
+                float step = sqrtf(delta[0] * delta[0] + delta[1] * delta[1] + delta[2] * delta[2]);
+                if (step < tolerance)
+                {
+                    result.success = true;
+                    break;
+                }
+            }
+            else
+            {
+                lambda *= 10;
+                if (lambda > 1e7f)
+                {
+                    result.success = true;
+                    break;
+                }
+            }
+        }
+
+        result.position = p;
+        result.rmsError = sqrtf(cost / (mCount - 1));
+        return result;
+    }
+
+private:
+    Point mAnchors[MaxAnchors];
+    float mDifferences[MaxAnchors];
+    uint8_t mCount;
+
+    // distance from the anchor to p, and the unit vector along it
+    static float direction(const Point &p, const Point &anchor, float d[3])
+    {
+        d[0] = p.x - anchor.x;
+        d[1] = p.y - anchor.y;
+        d[2] = p.z - anchor.z;
+        float range = sqrtf(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+        if (range < 1e-6f)
+        {
+            d[0] = d[1] = d[2] = 0;
+            return range;
+        }
+        for (uint8_t i = 0; i < 3; i++)
+        {
+            d[i] /= range;
+        }
+        return range;
+    }
+
+    float cost(const Point &p) const
+    {
+        float d[3];
+        float referenceRange = direction(p, mAnchors[0], d);
+        float sum = 0;
+        for (uint8_t i = 1; i < mCount; i++)
+        {
+            float residual = direction(p, mAnchors[i], d) - referenceRange - mDifferences[i];
+            sum += residual * residual;
+        }
+        return sum;
+    }
+
+    // cramer's rule, same as Multilateration's
+    static bool solve3x3(const float a[3][3], const float b[3], float x[3])
+    {
+        float det = a[0][0] * (a[1][1] * a[2][2] - a[1][2] * a[2][1]) -
+                    a[0][1] * (a[1][0] * a[2][2] - a[1][2] * a[2][0]) +
+                    a[0][2] * (a[1][0] * a[2][1] - a[1][1] * a[2][0]);
+        if (fabsf(det) < 1e-12f)
+        {
+            return false;
+        }
+
+        x[0] = (b[0] * (a[1][1] * a[2][2] - a[1][2] * a[2][1]) -
+                a[0][1] * (b[1] * a[2][2] - a[1][2] * b[2]) +
+                a[0][2] * (b[1] * a[2][1] - a[1][1] * b[2])) /
+               det;
+        x[1] = (a[0][0] * (b[1] * a[2][2] - a[1][2] * b[2]) -
+                b[0] * (a[1][0] * a[2][2] - a[1][2] * a[2][0]) +
+                a[0][2] * (a[1][0] * b[2] - b[1] * a[2][0])) /
+               det;
+        x[2] = (a[0][0] * (a[1][1] * b[2] - b[1] * a[2][1]) -
+                a[0][1] * (a[1][0] * b[2] - b[1] * a[2][0]) +
+                b[0] * (a[1][0] * a[2][1] - a[1][1] * a[2][0])) /
+               det;
+        return true;
+    }
+};
+
+/**
+ * MASTER ANCHOR ONLY
+ * Gathers every anchor's arrival of each tag blink and solves it once the stragglers have had COLLECT_MS to turn up.
+ * Up to PENDING_BLINKS blinks per tag can be collecting at once, a tag blinking faster than that drops its oldest.
+ * Anchors are kept in their own table so a pending blink only holds an index and a timestamp per arrival.
+ */
+template <uint8_t MaxAnchors, uint16_t MaxTags>
+class TdoaLocator
+{
+public:
+    // arrival batches go out every TDOA_BATCH_INTERVAL, see HomeAssistant, this leaves room for MQTT on top
+    static const uint32_t COLLECT_MS = 250;
+    // blinks are at least 100ms apart, so 3 cover COLLECT_MS
+    static const uint8_t PENDING_BLINKS = 3;
+
+    typedef TdoaSolver<MaxAnchors> Solver;
+
+    typedef struct
+    {
+        uint8_t tagEui[8];
+        Tdoa::Point position; // m
+        float rmsError;       // m
+        uint8_t anchors;
+        uint32_t timestamp; // ms, when the blink was first heard of
+    } Fix;
+
+    typedef struct
+    {
+        uint32_t blinks;
+        uint32_t solved;
+        uint32_t tooFewAnchors;
+        uint32_t failed;
+        uint32_t overrun; // blinks dropped for a newer one from the same tag
+    } Stats;
+
+    TdoaLocator() : mStats{0, 0, 0, 0, 0} {}
+
+    /**
+     * One anchor's arrival time (master clock) of a tag's blink, received at now (ms).
+     */
+    void addArrival(const uint8_t anchorEui[8], const Tdoa::Point &anchor, const Tdoa::Arrival &arrival, uint32_t now)
+    {
+        // anchors are surveyed once, the latest position wins
+        *mAnchors.insert(anchorEui, now) = anchor;
+        uint8_t anchorSlot = mAnchors.slotOf(anchorEui);
+
+        Tag *tag = mTags.insert(arrival.tagEui, now);
+        Pending *pending = nullptr;
+        for (uint8_t i = 0; i < PENDING_BLINKS && pending == nullptr; i++)
+        {
+            if (tag->pending[i].count > 0 && tag->pending[i].sequence == arrival.sequence)
+            {
+                pending = &tag->pending[i];
+            }
+        }
+        if (pending == nullptr)
+        {
+            pending = &tag->pending[0];
+            for (uint8_t i = 1; i < PENDING_BLINKS; i++)
+            {
+                Pending &other = tag->pending[i];
+                if (pending->count > 0 && (other.count == 0 || now - other.firstHeard > now - pending->firstHeard))
+                {
+                    pending = &other;
+                }
+            }
+            if (pending->count > 0)
+            {
+                mStats.overrun++;
+            }
+            pending->sequence = arrival.sequence;
+            pending->firstHeard = now;
+            pending->count = 0;
+            mStats.blinks++;
+        }
+
+        for (uint8_t i = 0; i < pending->count; i++)
+        {
+            if (pending->anchors[i] == anchorSlot)
+            {
+                return;
+            }
+        }
+        if (pending->count >= MaxAnchors)
+        {
+            return;
+        }
+        pending->anchors[pending->count] = anchorSlot;
+        pending->arrivals[pending->count] = arrival.arrival;
+        pending->count++;
+    }
+
+    /**
+     * Solves the next blink that has finished collecting, returns false once there are none left.
+     */
+    bool poll(uint32_t now, Fix &fix)
+    {
+        for (uint16_t t = 0; t < mTags.capacity(); t++)
+        {
+            if (!mTags.isUsed(t))
+            {
+                continue;
+            }
+            Tag &tag = mTags.get(t);
+            for (uint8_t p = 0; p < PENDING_BLINKS; p++)
+            {
+                Pending &pending = tag.pending[p];
+                if (pending.count == 0 || now - pending.firstHeard < COLLECT_MS)
+                {
+                    continue;
+                }
+
+                uint8_t count = pending.count;
+                pending.count = 0;
+                if (count < Solver::MIN_ANCHORS)
+                {
+                    mStats.tooFewAnchors++;
+                    continue;
+                }
+
+                mSolver.reset();
+                for (uint8_t a = 0; a < count; a++)
+                {
+                    double ticks = (double)Tdoa::difference(pending.arrivals[0], pending.arrivals[a]);
+                    mSolver.addMeasurement(mAnchors.get(pending.anchors[a]), (float)(ticks * Tdoa::DISTANCE_PER_TICK));
+                }
+                typename Solver::Result result = mSolver.solve(tag.hasFix ? tag.lastFix : mSolver.centroid());
+                if (tag.hasFix && !this->isPlausible(result, pending, count))
+                {
+                    // the last fix can be a bad place to start from after a gap
+                    result = mSolver.solve(mSolver.centroid());
+                }
+                if (!this->isPlausible(result, pending, count))
+                {
+                    tag.hasFix = false;
+                    mStats.failed++;
+                    continue;
+                }
+                tag.lastFix = result.position;
+                tag.hasFix = true;
+                mStats.solved++;
+
+                memcpy(fix.tagEui, mTags.getEui(t), 8);
+                fix.position = result.position;
+                fix.rmsError = result.rmsError;
+                fix.anchors = count;
+                fix.timestamp = pending.firstHeard;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const Stats &getStats() { return mStats; }
+
+private:
+    // with only a few anchors the differences can also fit a point on the far branch of a hyperbola
+    static constexpr float MAX_OUTSIDE = 5;    // m, beyond the box around the anchors
+    static constexpr float MAX_RMS_ERROR = 0.5f; // m
+
+    typedef struct
+    {
+        uint8_t sequence;
+        uint8_t count; // 0 while free
+        uint32_t firstHeard; // ms
+        uint8_t anchors[MaxAnchors]; // slots in mAnchors, which only moves on if there are more than MaxAnchors
+        uint64_t arrivals[MaxAnchors];
+    } Pending;
+
+    typedef struct
+    {
+        Pending pending[PENDING_BLINKS];
+        // the next solve starts from here
+        Tdoa::Point lastFix;
+        bool hasFix;
+    } Tag;
+
+    PeerTable<Tdoa::Point, MaxAnchors> mAnchors;
+    PeerTable<Tag, MaxTags> mTags;
+    Solver mSolver;
+    Stats mStats;
+
+    bool isPlausible(const typename Solver::Result &result, const Pending &pending, uint8_t count)
+    {
+        if (!result.success || !(result.rmsError < MAX_RMS_ERROR))
+        {
+            return false;
+        }
+        Tdoa::Point low = mAnchors.get(pending.anchors[0]);
+        Tdoa::Point high = low;
+        for (uint8_t a = 1; a < count; a++)
+        {
+            const Tdoa::Point &anchor = mAnchors.get(pending.anchors[a]);
+            low.x = fminf(low.x, anchor.x);
+            low.y = fminf(low.y, anchor.y);
+            low.z = fminf(low.z, anchor.z);
+            high.x = fmaxf(high.x, anchor.x);
+            high.y = fmaxf(high.y, anchor.y);
+            high.z = fmaxf(high.z, anchor.z);
+        }
+        const Tdoa::Point &p = result.position;
+        return p.x > low.x - MAX_OUTSIDE && p.x < high.x + MAX_OUTSIDE && p.y > low.y - MAX_OUTSIDE && p.y < high.y + MAX_OUTSIDE &&
+               p.z > low.z - MAX_OUTSIDE && p.z < high.z + MAX_OUTSIDE;
+    }
+};
@@ -0,0 +1,72 @@
+#include "telemetry.hpp"
+
+#include <string.h>
+#include <math.h>
+
+static void writeValue(uint8_t *bytes, uint32_t value, uint8_t n)
+{
+    for (uint8_t i = 0; i < n; i++)
+    {
+        bytes[i] = (value >> (i * 8)) & 0xFF;
+    }
+}
+
+TelemetryBatch::TelemetryBatch()
+{
+    memset(mAnchorMac, 0, sizeof(mAnchorMac));
+    mSequence = 0;
+    mCount = 0;
+}
+
+void TelemetryBatch::setAnchorMac(const uint8_t mac[6])
+{
+    memcpy(mAnchorMac, mac, 6);
+}
+
+bool TelemetryBatch::add(const Record &record)
+{
+    if (this->isFull())
+    {
+        return false;
+    }
+    mRecords[mCount++] = record;
+    return true;
+}
+
+size_t TelemetryBatch::encode(uint32_t now, uint8_t *frame, size_t length)
+{
+    size_t frameLength = HEADER_LENGTH + mCount * RECORD_LENGTH;
+    if (length < frameLength)
+    {
+        return 0;
+    }
+
+    frame[0] = VERSION;
+    frame[1] = mSequence++;
+    frame[2] = mCount;
+    memcpy(&frame[3], mAnchorMac, 6);
+    writeValue(&frame[9], now, 4);
+
+    for (uint8_t i = 0; i < mCount; i++)
+    {
+        const Record &record = mRecords[i];
+        uint8_t *out = &frame[HEADER_LENGTH + i * RECORD_LENGTH];
+
+        // first 2 bytes of the EUI are dummy - the mac address is the next 6, reversed
+        for (uint8_t j = 0; j < 6; j++)
+        {
+            out[j] = record.tagEui[5 - j];
+        }
+        float distanceMm = record.distance * 1000;
+        writeValue(&out[6], distanceMm < 0 ? 0 : distanceMm > 65535 ? 65535 : (uint16_t)distanceMm, 2);
+        uint32_t age = now - record.timestamp;
+        writeValue(&out[8], age > 65535 ? 65535 : age, 2);
+        writeValue(&out[10], (uint16_t)(int16_t)(record.rxPower * 100), 2);
+        out[12] = record.sequence;
+        float deviationMm = sqrtf(record.variance) * 1000;
+        writeValue(&out[13], deviationMm > 65535 ? 65535 : (uint16_t)deviationMm, 2);
+    }
+
+    mCount = 0;
+    return frameLength;
+}
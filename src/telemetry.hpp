@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Packed binary batch of an anchor's tag ranges, published once per flush interval instead of one JSON message per range
+ * when built with -DTELEMETRY_BATCHED.
+ *
+ * All multi byte values are little endian.
+ *
+ * Header  [0] VERSION, [1] batch sequence (wraps, gaps mean a lost batch), [2] record count n,
+ *         [3..8] anchor mac, [9..12] flush time (anchor millis())
+ * Record  [0..5] tag mac, [6..7] distance (mm), [8..9] age at flush time (ms),
+ *         [10..11] RX power (0.01 dBm, signed), [12] ranging sequence, [13..14] distance standard deviation (mm)
+ *
+ * Version 2 added the standard deviation, distances are filtered since then.
+ *
+ * No Arduino dependencies, so it also builds on the host.
+ */
+class TelemetryBatch
+{
+public:
+    static const uint8_t VERSION = 2;
+    static const uint8_t MAX_RECORDS = 32;
+    static const size_t HEADER_LENGTH = 13;
+    static const size_t RECORD_LENGTH = 15;
+    static const size_t MAX_FRAME_LENGTH = HEADER_LENGTH + MAX_RECORDS * RECORD_LENGTH;
+
+    typedef struct
+    {
+        uint8_t tagEui[8];
+        float distance;     // m
+        float variance;     // m^2
+        uint32_t timestamp; // ms
+        float rxPower;      // dBm
+        uint8_t sequence;
+    } Record;
+
+    TelemetryBatch();
+
+    void setAnchorMac(const uint8_t mac[6]);
+
+    /**
+     * Returns false if the batch is full, encode() it first.
+     */
+    bool add(const Record &record);
+    uint8_t getCount() { return mCount; }
+    bool isFull() { return mCount >= MAX_RECORDS; }
+
+    /**
+     * Writes the batch into frame and empties it. Returns the frame length, or 0 if it doesn't fit.
+     */
+    size_t encode(uint32_t now, uint8_t *frame, size_t length);
+
+private:
+    uint8_t mAnchorMac[6];
+    uint8_t mSequence;
+    uint8_t mCount;
+    Record mRecords[MAX_RECORDS];
+};
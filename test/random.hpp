@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+
+/**
+ * Reproducible noise for the host tests, shared by the suites that include it.
+ * Each suite sets seed in setUp() so every test sees the same numbers whatever order they run in.
+ */
+static uint32_t seed;
+
+// 0..2^24
+static inline uint32_t nextRandom()
+{
+    seed = seed * 1664525 + 1013904223;
+    return seed >> 8;
+}
+
+// 0..1
+static inline float uniform()
+{
+    return nextRandom() / 16777216.0f;
+}
+
+// standard normal, Box-Muller
+static inline float gaussian()
+{
+    float u = uniform() + 1e-7f;
+    return sqrtf(-2 * logf(u)) * cosf(2 * (float)M_PI * uniform());
+}
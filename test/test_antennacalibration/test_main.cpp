@@ -0,0 +1,258 @@
+#include <unity.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "antennacalibration.hpp"
+#include "../random.hpp"
+
+// distance light travels in one DW1000 time unit, m
+static const float DISTANCE_PER_TICK = 0.0046917639786159f;
+
+// anchors round a 6 x 5 m room, alternating heights
+static const float ROOM[8][3] = {{0, 0, 2.5f}, {6, 0, 1}, {6, 5, 2.5f}, {0, 5, 1}, {3, 0, 2.5f}, {3, 5, 1}, {0, 2.5f, 2}, {6, 2.5f, 1.5f}};
+
+// how far each board's real antenna delay is above the programmed one, DW1000 time units
+static const float DELAYS[8] = {12, -20, 35, 5, -8, 27, 0, -15};
+
+static void eui(uint8_t index, uint8_t out[8])
+{
+    const uint8_t batch[8] = {0, 0x02, 0x01, 0x28, 0x6F, 0x24, 0x00, 0x00};
+    memcpy(out, batch, 8);
+    out[0] = 0x10 + index;
+}
+
+static float surveyed(uint8_t a, uint8_t b)
+{
+    float dx = ROOM[a][0] - ROOM[b][0];
+    float dy = ROOM[a][1] - ROOM[b][1];
+    float dz = ROOM[a][2] - ROOM[b][2];
+    return sqrtf(dx * dx + dy * dy + dz * dz);
+}
+
+static void setNodes(AntennaCalibration &calibration, uint8_t count)
+{
+    uint8_t id[8];
+    for (uint8_t i = 0; i < count; i++)
+    {
+        eui(i, id);
+        TEST_ASSERT_TRUE(calibration.setNode(id, ROOM[i][0], ROOM[i][1], ROOM[i][2]));
+    }
+}
+
+// what DS-TWR between a and b would measure with DELAYS, plus noise, m
+static void addRange(AntennaCalibration &calibration, uint8_t a, uint8_t b, float noise)
+{
+    uint8_t ida[8], idb[8];
+    eui(a, ida);
+    eui(b, idb);
+    float range = surveyed(a, b) + (DELAYS[a] + DELAYS[b]) * DISTANCE_PER_TICK + noise * gaussian();
+    TEST_ASSERT_TRUE(calibration.addRange(ida, idb, range));
+}
+
+// every pair, both directions
+static void addAllRanges(AntennaCalibration &calibration, uint8_t count, float noise)
+{
+    for (uint8_t a = 0; a < count; a++)
+    {
+        for (uint8_t b = 0; b < count; b++)
+        {
+            if (a != b)
+            {
+                addRange(calibration, a, b, noise);
+            }
+        }
+    }
+}
+
+static float correctionOf(AntennaCalibration &calibration, uint8_t index)
+{
+    uint8_t id[8];
+    eui(index, id);
+    float correction = 0;
+    TEST_ASSERT_TRUE(calibration.getCorrection(id, correction));
+    return correction;
+}
+
+void setUp(void)
+{
+    seed = 1;
+}
+
+void tearDown(void) {}
+
+void test_recovers_exact_delays(void)
+{
+    AntennaCalibration calibration;
+    setNodes(calibration, 4);
+    addAllRanges(calibration, 4, 0);
+    AntennaCalibration::Result result = calibration.solve();
+    TEST_ASSERT_TRUE(result.success);
+    TEST_ASSERT_EQUAL_UINT8(4, result.nodes);
+    TEST_ASSERT_EQUAL_UINT8(12, result.ranges);
+    TEST_ASSERT_TRUE(result.rmsBefore > 0.1f);
+    TEST_ASSERT_FLOAT_WITHIN(1e-4f, 0, result.rmsAfter);
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        TEST_ASSERT_FLOAT_WITHIN(0.05f, DELAYS[i], correctionOf(calibration, i));
+    }
+}
+
+void test_recovers_noisy_delays(void)
+{
+    // 2 cm of ranging noise is about 4 time units per range, each node is in 14 of them which leaves a little over 1 unit
+    AntennaCalibration calibration;
+    setNodes(calibration, AntennaCalibration::MAX_NODES);
+    addAllRanges(calibration, AntennaCalibration::MAX_NODES, 0.02f);
+    AntennaCalibration::Result result = calibration.solve();
+    TEST_ASSERT_TRUE(result.success);
+    TEST_ASSERT_EQUAL_UINT8(AntennaCalibration::MAX_RANGES, result.ranges);
+
+    float worst = 0;
+    for (uint8_t i = 0; i < AntennaCalibration::MAX_NODES; i++)
+    {
+        float error = fabsf(correctionOf(calibration, i) - DELAYS[i]);
+        worst = error > worst ? error : worst;
+    }
+    char message[128];
+    snprintf(message, sizeof(message), "rms %.3f m before, %.3f m after, worst delay off by %.2f time units (%.1f mm)", result.rmsBefore,
+             result.rmsAfter, worst, worst * DISTANCE_PER_TICK * 1000);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_FLOAT_WITHIN(4, 0, worst);
+    // all that's left is the noise
+    TEST_ASSERT_FLOAT_WITHIN(0.005f, 0.02f, result.rmsAfter);
+}
+
+void test_one_direction_is_enough(void)
+{
+    AntennaCalibration calibration;
+    setNodes(calibration, 5);
+    for (uint8_t a = 0; a < 5; a++)
+    {
+        for (uint8_t b = a + 1; b < 5; b++)
+        {
+            addRange(calibration, b, a, 0);
+        }
+    }
+    TEST_ASSERT_TRUE(calibration.solve().success);
+    for (uint8_t i = 0; i < 5; i++)
+    {
+        TEST_ASSERT_FLOAT_WITHIN(0.05f, DELAYS[i], correctionOf(calibration, i));
+    }
+}
+
+void test_positions_after_ranges(void)
+{
+    AntennaCalibration calibration;
+    addAllRanges(calibration, 3, 0);
+    setNodes(calibration, 3);
+    TEST_ASSERT_TRUE(calibration.solve().success);
+    TEST_ASSERT_FLOAT_WITHIN(0.05f, DELAYS[2], correctionOf(calibration, 2));
+}
+
+void test_triangle_is_the_minimum(void)
+{
+    AntennaCalibration calibration;
+    setNodes(calibration, 2);
+    addAllRanges(calibration, 2, 0);
+    AntennaCalibration::Result result = calibration.solve();
+    TEST_ASSERT_FALSE(result.success);
+    TEST_ASSERT_EQUAL_UINT8(2, result.ranges);
+    uint8_t id[8];
+    eui(0, id);
+    float correction;
+    TEST_ASSERT_FALSE(calibration.getCorrection(id, correction));
+
+    // a chain a - b - c: 3 nodes but only 2 equations
+    calibration.reset();
+    setNodes(calibration, 3);
+    addRange(calibration, 0, 1, 0);
+    addRange(calibration, 1, 2, 0);
+    TEST_ASSERT_FALSE(calibration.solve().success);
+
+    // closing the triangle settles it
+    addRange(calibration, 2, 0, 0);
+    TEST_ASSERT_TRUE(calibration.solve().success);
+    TEST_ASSERT_FLOAT_WITHIN(0.05f, DELAYS[1], correctionOf(calibration, 1));
+}
+
+void test_even_ring_is_ambiguous(void)
+{
+    // round a ring of 4, +x on 0 and 2 and -x on 1 and 3 fits just as well
+    AntennaCalibration calibration;
+    setNodes(calibration, 4);
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        addRange(calibration, i, (i + 1) % 4, 0);
+    }
+    TEST_ASSERT_FALSE(calibration.solve().success);
+
+    // a ring of 5 is fine
+    calibration.reset();
+    setNodes(calibration, 5);
+    for (uint8_t i = 0; i < 5; i++)
+    {
+        addRange(calibration, i, (i + 1) % 5, 0);
+    }
+    TEST_ASSERT_TRUE(calibration.solve().success);
+    for (uint8_t i = 0; i < 5; i++)
+    {
+        TEST_ASSERT_FLOAT_WITHIN(0.05f, DELAYS[i], correctionOf(calibration, i));
+    }
+}
+
+void test_unknown_nodes_are_left_out(void)
+{
+    AntennaCalibration calibration;
+    setNodes(calibration, 3);
+    addAllRanges(calibration, 4, 0);
+    // a surveyed node nobody ranged to
+    uint8_t idle[8];
+    eui(5, idle);
+    calibration.setNode(idle, 1, 1, 1);
+
+    AntennaCalibration::Result result = calibration.solve();
+    TEST_ASSERT_TRUE(result.success);
+    TEST_ASSERT_EQUAL_UINT8(3, result.nodes);
+    TEST_ASSERT_EQUAL_UINT8(6, result.ranges);
+    TEST_ASSERT_FLOAT_WITHIN(0.05f, DELAYS[0], correctionOf(calibration, 0));
+    float correction;
+    TEST_ASSERT_FALSE(calibration.getCorrection(idle, correction));
+    uint8_t unsurveyed[8];
+    eui(3, unsurveyed);
+    TEST_ASSERT_FALSE(calibration.getCorrection(unsurveyed, correction));
+}
+
+void test_limits(void)
+{
+    AntennaCalibration calibration;
+    setNodes(calibration, AntennaCalibration::MAX_NODES);
+    uint8_t id[8];
+    eui(AntennaCalibration::MAX_NODES, id);
+    TEST_ASSERT_FALSE(calibration.setNode(id, 0, 0, 0));
+    // moving a node that's already there is fine
+    eui(0, id);
+    TEST_ASSERT_TRUE(calibration.setNode(id, ROOM[0][0], ROOM[0][1], ROOM[0][2]));
+
+    // a node can't range itself
+    TEST_ASSERT_FALSE(calibration.addRange(id, id, 1));
+    addAllRanges(calibration, AntennaCalibration::MAX_NODES, 0);
+    uint8_t other[8];
+    eui(1, other);
+    TEST_ASSERT_FALSE(calibration.addRange(id, other, 1));
+    TEST_ASSERT_TRUE(calibration.solve().success);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_recovers_exact_delays);
+    RUN_TEST(test_recovers_noisy_delays);
+    RUN_TEST(test_one_direction_is_enough);
+    RUN_TEST(test_positions_after_ranges);
+    RUN_TEST(test_triangle_is_the_minimum);
+    RUN_TEST(test_even_ring_is_ambiguous);
+    RUN_TEST(test_unknown_nodes_are_left_out);
+    RUN_TEST(test_limits);
+    return UNITY_END();
+}
@@ -0,0 +1,376 @@
+#include <unity.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "broadcastranging.hpp"
+#include "rangingprofile.hpp"
+#include "frame.hpp"
+#include "sim/simchannel.hpp"
+
+static const uint8_t TAG_EUI[8] = {0x10, 0x20, 0x30, 0x40, 0x50, 0x60, 0x70, 0x80};
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_poll_round_trip(void)
+{
+    BroadcastRanging::Poll poll = {0x7F, {0}, 3, {0xA001, 0x00A2, 0xFFFF}};
+    memcpy(poll.tagEui, TAG_EUI, 8);
+    uint8_t frame[BroadcastRanging::POLL_LENGTH_MAX];
+    size_t length = BroadcastRanging::encodePoll(poll, frame, sizeof(frame));
+    TEST_ASSERT_EQUAL_UINT32(12 + 3 * 2, length);
+
+    // the layout in broadcastranging.hpp, 0x41 is the DATA frame control byte
+    const uint8_t expected[] = {0x41, BroadcastRanging::BROADCAST_POLL, 0x7F, 0x10, 0x20, 0x30, 0x40, 0x50, 0x60, 0x70, 0x80, 3,
+                                0x01, 0xA0, 0xA2, 0x00, 0xFF, 0xFF};
+    TEST_ASSERT_EQUAL_MEMORY(expected, frame, sizeof(expected));
+
+    BroadcastRanging::Poll decoded;
+    TEST_ASSERT_TRUE(BroadcastRanging::decodePoll(frame, length, decoded));
+    TEST_ASSERT_EQUAL_UINT8(poll.sequence, decoded.sequence);
+    TEST_ASSERT_EQUAL_MEMORY(TAG_EUI, decoded.tagEui, 8);
+    TEST_ASSERT_EQUAL_UINT8(3, decoded.anchorCount);
+    TEST_ASSERT_EQUAL_UINT16_ARRAY(poll.anchors, decoded.anchors, 3);
+}
+
+void test_response_round_trip(void)
+{
+    BroadcastRanging::Response response = {200, {0xA0, 1, 2, 3, 4, 5, 6, 7}};
+    uint8_t frame[BroadcastRanging::RESPONSE_LENGTH];
+    TEST_ASSERT_EQUAL_UINT32(BroadcastRanging::RESPONSE_LENGTH, BroadcastRanging::encodeResponse(response, frame, sizeof(frame)));
+    BroadcastRanging::Response decoded;
+    TEST_ASSERT_TRUE(BroadcastRanging::decodeResponse(frame, sizeof(frame), decoded));
+    TEST_ASSERT_EQUAL_UINT8(200, decoded.sequence);
+    TEST_ASSERT_EQUAL_MEMORY(response.anchorEui, decoded.anchorEui, 8);
+}
+
+void test_final_round_trip(void)
+{
+    // every anchor, and timestamps using all 40 bits
+    BroadcastRanging::Final final;
+    final.sequence = 1;
+    memcpy(final.tagEui, TAG_EUI, 8);
+    final.pollSent = 0xFFFFFFFFFFULL;
+    final.finalSent = 0x0123456789ULL;
+    final.anchorCount = BroadcastRanging::MAX_ANCHORS;
+    for (uint8_t i = 0; i < BroadcastRanging::MAX_ANCHORS; i++)
+    {
+        final.anchors[i] = 0xA000 + i;
+        final.responseReceived[i] = 0xFEDCBA9876ULL - i * 0x10000000ULL;
+    }
+
+    uint8_t frame[BroadcastRanging::FINAL_LENGTH_MAX];
+    size_t length = BroadcastRanging::encodeFinal(final, frame, sizeof(frame));
+    TEST_ASSERT_EQUAL_UINT32(BroadcastRanging::FINAL_LENGTH_MAX, length);
+
+    BroadcastRanging::Final decoded;
+    TEST_ASSERT_TRUE(BroadcastRanging::decodeFinal(frame, length, decoded));
+    TEST_ASSERT_EQUAL_UINT8(1, decoded.sequence);
+    TEST_ASSERT_EQUAL_MEMORY(TAG_EUI, decoded.tagEui, 8);
+    TEST_ASSERT_TRUE(decoded.pollSent == final.pollSent);
+    TEST_ASSERT_TRUE(decoded.finalSent == final.finalSent);
+    TEST_ASSERT_EQUAL_UINT8(BroadcastRanging::MAX_ANCHORS, decoded.anchorCount);
+    for (uint8_t i = 0; i < BroadcastRanging::MAX_ANCHORS; i++)
+    {
+        TEST_ASSERT_EQUAL_UINT16(final.anchors[i], decoded.anchors[i]);
+        TEST_ASSERT_TRUE(decoded.responseReceived[i] == final.responseReceived[i]);
+    }
+}
+
+void test_final_without_responses(void)
+{
+    BroadcastRanging::Final final;
+    memset(&final, 0, sizeof(final));
+    uint8_t frame[BroadcastRanging::FINAL_LENGTH_MAX];
+    size_t length = BroadcastRanging::encodeFinal(final, frame, sizeof(frame));
+    TEST_ASSERT_EQUAL_UINT32(22, length);
+    BroadcastRanging::Final decoded;
+    TEST_ASSERT_TRUE(BroadcastRanging::decodeFinal(frame, length, decoded));
+    TEST_ASSERT_EQUAL_UINT8(0, decoded.anchorCount);
+}
+
+void test_encoders_check_room(void)
+{
+    BroadcastRanging::Poll poll = {0, {0}, 4, {1, 2, 3, 4}};
+    uint8_t frame[BroadcastRanging::FINAL_LENGTH_MAX];
+    TEST_ASSERT_EQUAL_UINT32(0, BroadcastRanging::encodePoll(poll, frame, 12 + 4 * 2 - 1));
+    poll.anchorCount = BroadcastRanging::MAX_ANCHORS + 1;
+    TEST_ASSERT_EQUAL_UINT32(0, BroadcastRanging::encodePoll(poll, frame, sizeof(frame)));
+
+    BroadcastRanging::Response response = {0, {0}};
+    TEST_ASSERT_EQUAL_UINT32(0, BroadcastRanging::encodeResponse(response, frame, BroadcastRanging::RESPONSE_LENGTH - 1));
+
+    BroadcastRanging::Final final;
+    memset(&final, 0, sizeof(final));
+    final.anchorCount = 2;
+    TEST_ASSERT_EQUAL_UINT32(0, BroadcastRanging::encodeFinal(final, frame, 22 + 2 * 7 - 1));
+    final.anchorCount = BroadcastRanging::MAX_ANCHORS + 1;
+    TEST_ASSERT_EQUAL_UINT32(0, BroadcastRanging::encodeFinal(final, frame, sizeof(frame)));
+}
+
+void test_malformed_frames_are_rejected(void)
+{
+    BroadcastRanging::Poll poll = {0, {0}, 2, {1, 2}};
+    uint8_t frame[BroadcastRanging::FINAL_LENGTH_MAX];
+    size_t length = BroadcastRanging::encodePoll(poll, frame, sizeof(frame));
+    BroadcastRanging::Poll decodedPoll;
+    // truncated, trailing bytes, a count the frame doesn't have room for, too many anchors
+    TEST_ASSERT_FALSE(BroadcastRanging::decodePoll(frame, length - 1, decodedPoll));
+    TEST_ASSERT_FALSE(BroadcastRanging::decodePoll(frame, length + 1, decodedPoll));
+    TEST_ASSERT_FALSE(BroadcastRanging::decodePoll(frame, 11, decodedPoll));
+    frame[11] = 3;
+    TEST_ASSERT_FALSE(BroadcastRanging::decodePoll(frame, length, decodedPoll));
+    frame[11] = BroadcastRanging::MAX_ANCHORS + 1;
+    TEST_ASSERT_FALSE(BroadcastRanging::decodePoll(frame, 12 + frame[11] * 2, decodedPoll));
+
+    // each decoder only takes its own type
+    BroadcastRanging::Response response = {0, {0}};
+    length = BroadcastRanging::encodeResponse(response, frame, sizeof(frame));
+    BroadcastRanging::Final decodedFinal;
+    TEST_ASSERT_FALSE(BroadcastRanging::decodePoll(frame, length, decodedPoll));
+    TEST_ASSERT_FALSE(BroadcastRanging::decodeFinal(frame, length, decodedFinal));
+    frame[0] = 0;
+    BroadcastRanging::Response decodedResponse;
+    TEST_ASSERT_FALSE(BroadcastRanging::decodeResponse(frame, length, decodedResponse));
+
+    BroadcastRanging::Final final;
+    memset(&final, 0, sizeof(final));
+    final.anchorCount = 3;
+    length = BroadcastRanging::encodeFinal(final, frame, sizeof(frame));
+    TEST_ASSERT_FALSE(BroadcastRanging::decodeFinal(frame, length - 7, decodedFinal));
+    TEST_ASSERT_FALSE(BroadcastRanging::decodeResponse(frame, length, decodedResponse));
+}
+
+void test_index_of(void)
+{
+    const uint16_t anchors[] = {0xA001, 0xA002, 0xA003};
+    TEST_ASSERT_EQUAL_INT8(0, BroadcastRanging::indexOf(anchors, 3, 0xA001));
+    TEST_ASSERT_EQUAL_INT8(2, BroadcastRanging::indexOf(anchors, 3, 0xA003));
+    TEST_ASSERT_EQUAL_INT8(-1, BroadcastRanging::indexOf(anchors, 2, 0xA003));
+    TEST_ASSERT_EQUAL_INT8(-1, BroadcastRanging::indexOf(anchors, 3, 0xB000));
+}
+
+/**
+ * One tag and 4 anchors over SimChannel, the same fix with one broadcast exchange and with a TwoWayRanging exchange per anchor.
+ */
+
+#define ANCHORS 4
+#define STEP_US 20
+
+template <class Ranging>
+struct Node
+{
+    SimRadio *radio;
+    Ranging *ranging;
+    FramePool<4> frames;
+    uint8_t eui[8];
+};
+
+static SimChannel *channel;
+
+// DW1000::processRadioEvents()
+template <class Ranging>
+static void processRadioEvents(Node<Ranging> &node)
+{
+    Radio::Event event;
+    while ((event = node.radio->pollEvent()) != Radio::NONE)
+    {
+        if (event == Radio::TRANSMIT_DONE)
+        {
+            node.ranging->onTransmitDone(channel->micros());
+        }
+        else if (event == Radio::RECEIVE_DONE)
+        {
+            Frame *frame = node.frames.acquire();
+            if (frame != nullptr)
+            {
+                frame->length = node.radio->getReceivedFrame(frame->data, sizeof(frame->data), &frame->received);
+                frame->carrierOffset = node.radio->getCarrierOffset();
+                if (frame->length > 0)
+                {
+                    node.frames.commit();
+                }
+            }
+        }
+    }
+
+    Frame *frame;
+    while ((frame = node.frames.front()) != nullptr)
+    {
+        node.ranging->onReceive(frame->data, frame->length, frame->received, channel->micros(), frame->carrierOffset);
+        node.frames.release();
+    }
+    node.ranging->tick(channel->micros());
+    if (!node.radio->isTransmitting() && !node.radio->isReceiving())
+    {
+        node.radio->startReceive();
+    }
+}
+
+template <class Ranging>
+static void step(Node<Ranging> *anchors, Node<Ranging> &tag)
+{
+    channel->advance(STEP_US);
+    for (uint8_t i = 0; i < ANCHORS; i++)
+    {
+        processRadioEvents(anchors[i]);
+        if (anchors[i].ranging->isFinished())
+        {
+            anchors[i].ranging->reset();
+        }
+    }
+    processRadioEvents(tag);
+}
+
+template <class Ranging>
+static void setUpCell(Node<Ranging> *anchors, Node<Ranging> &tag)
+{
+    channel = new SimChannel(5);
+    SimChannel::Config config = {0, 0.05f, 130, 6.8e6f};
+    channel->setConfig(config);
+    const float corners[ANCHORS][3] = {{0, 0, 2.5f}, {10, 0, 2.5f}, {10, 10, 2.5f}, {0, 10, 2.5f}};
+    for (uint8_t i = 0; i <= ANCHORS; i++)
+    {
+        Node<Ranging> &node = i < ANCHORS ? anchors[i] : tag;
+        node.radio = i < ANCHORS ? channel->addNode(corners[i][0], corners[i][1], corners[i][2], i * 3.0f - 5) : channel->addNode(3, 4, 1, 7);
+        node.ranging = new Ranging(*node.radio);
+        for (uint8_t j = 0; j < 8; j++)
+        {
+            node.eui[j] = j == 0 ? (i < ANCHORS ? 0xA0 + i : 0x10) : 0xD0 + j;
+        }
+        node.ranging->setEUI(node.eui);
+    }
+    // everyone listening before the first poll
+    step(anchors, tag);
+}
+
+template <class Ranging>
+static void tearDownCell(Node<Ranging> *anchors, Node<Ranging> &tag)
+{
+    for (uint8_t i = 0; i < ANCHORS; i++)
+    {
+        delete anchors[i].ranging;
+    }
+    delete tag.ranging;
+    delete channel;
+}
+
+static uint32_t framesSent(SimRadio *const radios[], uint8_t count)
+{
+    uint32_t frames = 0;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        frames += radios[i]->getFramesSent();
+    }
+    return frames;
+}
+
+// one broadcast exchange with every anchor, returns how long it took (us)
+static uint32_t rangeBroadcast()
+{
+    Node<BroadcastRanging> anchors[ANCHORS];
+    Node<BroadcastRanging> tag;
+    setUpCell(anchors, tag);
+    uint16_t ids[ANCHORS];
+    for (uint8_t i = 0; i < ANCHORS; i++)
+    {
+        ids[i] = TwoWayRanging::shortId(anchors[i].eui);
+    }
+
+    TEST_ASSERT_TRUE(tag.ranging->startTag(ids, ANCHORS, channel->micros()));
+    uint32_t start = channel->micros();
+    while (!tag.ranging->isFinished() && channel->micros() - start < 100000)
+    {
+        step(anchors, tag);
+    }
+    uint32_t duration = channel->micros() - start;
+
+    TEST_ASSERT_EQUAL(BroadcastRanging::SUCCEEDED, tag.ranging->getState());
+    for (uint8_t i = 0; i < ANCHORS; i++)
+    {
+        TEST_ASSERT_TRUE(tag.ranging->hasReport(i));
+        TEST_ASSERT_FLOAT_WITHIN(0.2f, SimChannel::distance(tag.radio, anchors[i].radio), tag.ranging->getReport(i).range);
+    }
+    SimRadio *radios[] = {anchors[0].radio, anchors[1].radio, anchors[2].radio, anchors[3].radio, tag.radio};
+    // poll, final, and a response and report from every anchor
+    TEST_ASSERT_EQUAL_UINT32(2, tag.radio->getFramesSent());
+    TEST_ASSERT_EQUAL_UINT32(2 + 2 * ANCHORS, framesSent(radios, ANCHORS + 1));
+
+    char message[96];
+    snprintf(message, sizeof(message), "broadcast: %u frames, %u from the tag, %u us", framesSent(radios, ANCHORS + 1), tag.radio->getFramesSent(),
+             duration);
+    TEST_MESSAGE(message);
+    tearDownCell(anchors, tag);
+    return duration;
+}
+
+// a TwoWayRanging exchange with each anchor in turn, returns how long they took (us)
+static uint32_t rangePerAnchor()
+{
+    Node<TwoWayRanging> anchors[ANCHORS];
+    Node<TwoWayRanging> tag;
+    setUpCell(anchors, tag);
+
+    uint32_t start = channel->micros();
+    uint8_t ranges = 0;
+    for (uint8_t i = 0; i < ANCHORS; i++)
+    {
+        TEST_ASSERT_TRUE(tag.ranging->startTag(TwoWayRanging::shortId(anchors[i].eui), channel->micros()));
+        while (!tag.ranging->isFinished())
+        {
+            step(anchors, tag);
+        }
+        ranges += tag.ranging->getState() == TwoWayRanging::SUCCEEDED;
+        tag.ranging->reset();
+        while (tag.radio->isTransmitting())
+        {
+            step(anchors, tag);
+        }
+    }
+    uint32_t duration = channel->micros() - start;
+    TEST_ASSERT_EQUAL_UINT8(ANCHORS, ranges);
+
+    SimRadio *radios[] = {anchors[0].radio, anchors[1].radio, anchors[2].radio, anchors[3].radio, tag.radio};
+    // poll, response, final and report for every anchor
+    TEST_ASSERT_EQUAL_UINT32(4 * ANCHORS, framesSent(radios, ANCHORS + 1));
+    TEST_ASSERT_EQUAL_UINT32(2 * ANCHORS, tag.radio->getFramesSent());
+
+    char message[96];
+    snprintf(message, sizeof(message), "per anchor: %u frames, %u from the tag, %u us", framesSent(radios, ANCHORS + 1), tag.radio->getFramesSent(),
+             duration);
+    TEST_MESSAGE(message);
+    tearDownCell(anchors, tag);
+    return duration;
+}
+
+void test_one_exchange_ranges_every_anchor(void)
+{
+    rangeBroadcast();
+}
+
+void test_against_an_exchange_per_anchor(void)
+{
+    // the slots hold the frames they're for
+    TEST_ASSERT_TRUE(BroadcastRanging::RESPONSE_AIRTIME_US >= RangingProfile::getAirtime(1, BroadcastRanging::RESPONSE_LENGTH));
+    TEST_ASSERT_TRUE(BroadcastRanging::REPORT_AIRTIME_US >= RangingProfile::getAirtime(1, TwoWayRanging::REPORT_LENGTH));
+    // 2 + 2n frames instead of 4n only pays off if the slots aren't longer than the exchanges they replace
+    uint32_t perAnchor = rangePerAnchor();
+    uint32_t broadcast = rangeBroadcast();
+    TEST_ASSERT_TRUE(broadcast < perAnchor);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_poll_round_trip);
+    RUN_TEST(test_response_round_trip);
+    RUN_TEST(test_final_round_trip);
+    RUN_TEST(test_final_without_responses);
+    RUN_TEST(test_encoders_check_room);
+    RUN_TEST(test_malformed_frames_are_rejected);
+    RUN_TEST(test_index_of);
+    RUN_TEST(test_one_exchange_ranges_every_anchor);
+    RUN_TEST(test_against_an_exchange_per_anchor);
+    return UNITY_END();
+}
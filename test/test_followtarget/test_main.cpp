@@ -0,0 +1,192 @@
+#include <unity.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "followtarget.hpp"
+
+// the motor tag, standing still
+static const float OWN_X = 2;
+static const float OWN_Y = 3;
+
+// a target walking a 3 m circle round the motor at 1.5 m/s, fast enough that latency shows
+static void target(float t, float *x, float *y, float *vx, float *vy)
+{
+    const float radius = 3;
+    const float rate = 1.5f / radius;
+    *x = OWN_X + radius * cosf(rate * t);
+    *y = OWN_Y + radius * sinf(rate * t);
+    *vx = -radius * rate * sinf(rate * t);
+    *vy = radius * rate * cosf(rate * t);
+}
+
+// clockwise from y, like FollowTarget
+static float bearing(float dx, float dy)
+{
+    float angle = atan2f(dx, dy) * 180 / (float)M_PI;
+    return angle < 0 ? angle + 360 : angle;
+}
+
+static float angleBetween(float a, float b)
+{
+    float difference = fmodf(fabsf(a - b), 360);
+    return difference > 180 ? 360 - difference : difference;
+}
+
+/**
+ * A track every 200 ms, handed to the motor latency ms after its fix, and scored against where the target is
+ * by the time the motor gets there, moveTime ms later. Returns the rms pointing error, degrees.
+ */
+static float pointingError(uint32_t leadTime, uint32_t latency, uint32_t moveTime)
+{
+    FollowTarget follow;
+    FollowTarget::Config config = follow.getConfig();
+    config.leadTime = leadTime;
+    follow.setConfig(config);
+    follow.setOwnPosition(OWN_X, OWN_Y);
+
+    float squared = 0;
+    int count = 0;
+    for (uint32_t fixTime = 0; fixTime < 60000; fixTime += 200)
+    {
+        float x, y, vx, vy;
+        target(fixTime / 1000.0f, &x, &y, &vx, &vy);
+        float angle;
+        TEST_ASSERT_TRUE(follow.update(x, y, vx, vy, &angle));
+        float tx, ty;
+        target((fixTime + latency + moveTime) / 1000.0f, &tx, &ty, &vx, &vy);
+        float error = angleBetween(angle, bearing(tx - OWN_X, ty - OWN_Y));
+        squared += error * error;
+        count++;
+    }
+    return sqrtf(squared / count);
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_bearings(void)
+{
+    FollowTarget follow;
+    float angle;
+    // nowhere to point from yet
+    TEST_ASSERT_FALSE(follow.hasOwnPosition());
+    TEST_ASSERT_FALSE(follow.update(1, 1, 0, 0, &angle));
+
+    follow.setOwnPosition(OWN_X, OWN_Y);
+    TEST_ASSERT_TRUE(follow.update(OWN_X, OWN_Y + 2, 0, 0, &angle));
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 0, angle);
+    TEST_ASSERT_TRUE(follow.update(OWN_X + 2, OWN_Y, 0, 0, &angle));
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 90, angle);
+    TEST_ASSERT_TRUE(follow.update(OWN_X, OWN_Y - 2, 0, 0, &angle));
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 180, angle);
+    TEST_ASSERT_TRUE(follow.update(OWN_X - 2, OWN_Y, 0, 0, &angle));
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 270, angle);
+
+    // the motor's zero points east: north is a quarter turn back, wrapped into 0..360
+    follow.setAngleOffset(90);
+    TEST_ASSERT_TRUE(follow.update(OWN_X, OWN_Y + 2, 0, 0, &angle));
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 270, angle);
+    follow.setAngleOffset(-450);
+    TEST_ASSERT_TRUE(follow.update(OWN_X, OWN_Y + 2, 0, 0, &angle));
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 90, angle);
+}
+
+void test_too_close_holds_still(void)
+{
+    FollowTarget follow;
+    follow.setOwnPosition(OWN_X, OWN_Y);
+    float angle = -1;
+    TEST_ASSERT_FALSE(follow.update(OWN_X + 0.2f, OWN_Y, 0, 0, &angle));
+    TEST_ASSERT_EQUAL_FLOAT(-1, angle);
+    // it's the led position that counts
+    TEST_ASSERT_TRUE(follow.update(OWN_X + 0.2f, OWN_Y, 4, 0, &angle));
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 90, angle);
+}
+
+void test_lead(void)
+{
+    FollowTarget follow;
+    FollowTarget::Config config = follow.getConfig();
+    config.leadTime = 500;
+    follow.setConfig(config);
+    follow.setOwnPosition(0, 0);
+    // 2 m north heading east at 4 m/s, 2 m east of there in 500 ms
+    float angle;
+    TEST_ASSERT_TRUE(follow.update(0, 2, 4, 0, &angle));
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 45, angle);
+}
+
+void test_own_position_is_averaged(void)
+{
+    FollowTarget follow;
+    follow.setOwnPosition(1, 1);
+    // one bad fix of our own only moves it by ownSmoothing of the way
+    follow.setOwnPosition(11, 1);
+    float angle;
+    TEST_ASSERT_TRUE(follow.update(2, 11, 0, 0, &angle));
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 0, angle);
+
+    // but it does get there when it really has moved
+    for (int i = 0; i < 100; i++)
+    {
+        follow.setOwnPosition(11, 1);
+    }
+    TEST_ASSERT_TRUE(follow.update(11, 11, 0, 0, &angle));
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 0, angle);
+}
+
+void test_fix_latency(void)
+{
+    const uint64_t epoch = 1760000000000ULL;
+    TEST_ASSERT_EQUAL_INT32(85, FollowTarget::fixLatency(epoch, epoch + 85));
+    TEST_ASSERT_EQUAL_INT32(0, FollowTarget::fixLatency(epoch, epoch));
+    // either clock not set by SNTP yet
+    TEST_ASSERT_EQUAL_INT32(-1, FollowTarget::fixLatency(0, epoch));
+    TEST_ASSERT_EQUAL_INT32(-1, FollowTarget::fixLatency(epoch, 0));
+    // the target's clock ahead of ours by more than the latency
+    TEST_ASSERT_EQUAL_INT32(-1, FollowTarget::fixLatency(epoch + 20, epoch + 5));
+    // the target's clock set and ours still counting from boot, or the other way round
+    TEST_ASSERT_EQUAL_INT32(-1, FollowTarget::fixLatency(epoch, epoch + 0x100000000ULL));
+    TEST_ASSERT_EQUAL_INT32(INT32_MAX, FollowTarget::fixLatency(epoch, epoch + INT32_MAX));
+}
+
+/**
+ * How far off the motor points for a given latency, with and without leading the target by it.
+ * The motor takes another 100 ms to get there.
+ */
+void test_pointing_error_against_latency(void)
+{
+    const uint32_t moveTime = 100;
+    const uint32_t latencies[] = {25, 50, 100, 200, 400};
+    float previous = 0;
+    for (uint8_t i = 0; i < sizeof(latencies) / sizeof(latencies[0]); i++)
+    {
+        uint32_t latency = latencies[i];
+        float unled = pointingError(0, latency, moveTime);
+        float defaultLead = pointingError(50, latency, moveTime);
+        float matched = pointingError(latency + moveTime, latency, moveTime);
+        char message[128];
+        snprintf(message, sizeof(message), "%3u ms latency: %.2f deg off unled, %.2f deg with the default lead, %.2f deg with a matched lead", latency,
+                 unled, defaultLead, matched);
+        TEST_MESSAGE(message);
+        // at 0.5 rad/s every ms costs about 0.029 deg
+        TEST_ASSERT_FLOAT_WITHIN(0.5f, (latency + moveTime) * 0.5f * 180 / (float)M_PI / 1000, unled);
+        TEST_ASSERT_TRUE(unled > previous);
+        TEST_ASSERT_TRUE(defaultLead < unled);
+        // a straight line lead only misses the curve of the circle
+        TEST_ASSERT_TRUE(matched < unled / 4);
+        previous = unled;
+    }
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_bearings);
+    RUN_TEST(test_too_close_holds_still);
+    RUN_TEST(test_lead);
+    RUN_TEST(test_own_position_is_averaged);
+    RUN_TEST(test_fix_latency);
+    RUN_TEST(test_pointing_error_against_latency);
+    return UNITY_END();
+}
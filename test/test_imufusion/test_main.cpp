@@ -0,0 +1,331 @@
+#include <unity.h>
+#include <stdio.h>
+#include <math.h>
+#include <chrono>
+
+#include "imufusion.hpp"
+#include "../random.hpp"
+
+typedef ImuFusion::Vector Vector;
+
+static const float GRAVITY = 9.80665f;
+// 200 Hz like Imu::PERIOD_US, a fix every 200 ms
+static const float DT = 0.005f;
+static const int SAMPLES_PER_FIX = 40;
+
+/**
+ * A tag carried round a 2 m circle, facing where it's going, with the LSM6DSL's noise and some bias.
+ * The pace surges and slows: at a steady pace the acceleration is the same in the tag's own axes all the way round,
+ * and a heading error would look just like an accelerometer bias.
+ * Slightly tilted on the lanyard by roll, which the first sample has to pick up.
+ */
+typedef struct
+{
+    float radius;
+    float speed;     // m/s on average
+    float surge;     // m ahead of and behind the steady pace
+    float surgeRate; // rad/s
+    float roll;
+    Vector accelBias;
+    float gyroBiasZ;
+    float accelNoise;
+    float gyroNoise;
+} Walk;
+
+static const Walk WALK = {2, 1, 0.5f, 1.5f, 0.1f, {0.08f, -0.05f, 0.1f}, 0.004f, 0.05f, 0.003f};
+
+// round the circle, rad
+static float angle(const Walk &walk, float t)
+{
+    return (walk.speed * t + walk.surge * sinf(walk.surgeRate * t)) / walk.radius;
+}
+
+static Vector position(const Walk &walk, float t)
+{
+    return Vector{3 + walk.radius * cosf(angle(walk, t)), 3 + walk.radius * sinf(angle(walk, t)), 1.2f};
+}
+
+static float heading(const Walk &walk, float t)
+{
+    return angle(walk, t) + (float)M_PI / 2;
+}
+
+// what the IMU reads at t: specific force and rate in its own axes, heading then roll
+static void sample(const Walk &walk, float t, Vector &accel, Vector &gyro)
+{
+    float speed = walk.speed + walk.surge * walk.surgeRate * cosf(walk.surgeRate * t);
+    // in the heading frame, along the way, towards the middle and gravity's reaction
+    float forward = -walk.surge * walk.surgeRate * walk.surgeRate * sinf(walk.surgeRate * t);
+    float left = speed * speed / walk.radius;
+    float up = GRAVITY;
+    // and rolled about forward
+    float cr = cosf(walk.roll), sr = sinf(walk.roll);
+    accel = Vector{forward + walk.accelBias.x + walk.accelNoise * gaussian(), cr * left + sr * up + walk.accelBias.y + walk.accelNoise * gaussian(),
+                   -sr * left + cr * up + walk.accelBias.z + walk.accelNoise * gaussian()};
+    float rate = speed / walk.radius;
+    gyro = Vector{walk.gyroNoise * gaussian(), sr * rate + walk.gyroNoise * gaussian(), cr * rate + walk.gyroBiasZ + walk.gyroNoise * gaussian()};
+}
+
+static Vector fix(const Walk &walk, float t, float sd)
+{
+    Vector p = position(walk, t);
+    return Vector{p.x + sd * gaussian(), p.y + sd * gaussian(), p.z + sd * gaussian()};
+}
+
+static float distance(const Vector &a, const Vector &b)
+{
+    return sqrtf((a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y) + (a.z - b.z) * (a.z - b.z));
+}
+
+static float angleBetween(float a, float b)
+{
+    float difference = fmodf(a - b, 2 * (float)M_PI);
+    if (difference > M_PI)
+    {
+        difference -= 2 * M_PI;
+    }
+    if (difference < -M_PI)
+    {
+        difference += 2 * M_PI;
+    }
+    return fabsf(difference);
+}
+
+typedef struct
+{
+    float fixRms;   // the latest fix, held until the next one
+    float fusedRms; // the filter, at every IMU sample
+    float headingError;
+} Replay;
+
+/**
+ * Runs the walk for seconds, fixes with sd every SAMPLES_PER_FIX samples, and scores the last 20 s at the IMU's rate.
+ */
+static Replay replay(ImuFusion &fusion, const Walk &walk, float seconds, float sd)
+{
+    Replay result = {0, 0, 0};
+    Vector held = {0, 0, 0};
+    int samples = (int)(seconds / DT);
+    int scored = 0;
+    for (int i = 0; i < samples; i++)
+    {
+        float t = i * DT;
+        Vector accel, gyro;
+        sample(walk, t, accel, gyro);
+        fusion.predict(accel, gyro, DT);
+        if (i % SAMPLES_PER_FIX == 0)
+        {
+            held = fix(walk, t, sd);
+            fusion.correct(held);
+        }
+        if (t >= seconds - 20)
+        {
+            Vector truth = position(walk, t);
+            float fixError = distance(held, truth);
+            float fusedError = distance(fusion.getPosition(), truth);
+            result.fixRms += fixError * fixError;
+            result.fusedRms += fusedError * fusedError;
+            scored++;
+        }
+    }
+    result.fixRms = sqrtf(result.fixRms / scored);
+    result.fusedRms = sqrtf(result.fusedRms / scored);
+    result.headingError = angleBetween(fusion.getHeading(), heading(walk, (samples - 1) * DT));
+    return result;
+}
+
+void setUp(void)
+{
+    seed = 1;
+}
+
+void tearDown(void) {}
+
+void test_still_tag_stays_put(void)
+{
+    Walk still = WALK;
+    still.speed = 0;
+    still.surge = 0;
+    ImuFusion fusion;
+    TEST_ASSERT_FALSE(fusion.hasFix());
+    Replay result = replay(fusion, still, 30, 0.15f);
+    TEST_ASSERT_TRUE(fusion.hasFix());
+    // averaging fixes, it knows better than any one of them
+    TEST_ASSERT_TRUE(result.fusedRms < 0.6f * result.fixRms);
+    TEST_ASSERT_TRUE(fusion.getPositionError() < 0.15f);
+
+    // and doesn't think it's going anywhere
+    float speedRms = 0;
+    const int samples = 2000;
+    for (int i = 0; i < samples; i++)
+    {
+        Vector accel, gyro;
+        sample(still, 30 + i * DT, accel, gyro);
+        fusion.predict(accel, gyro, DT);
+        if (i % SAMPLES_PER_FIX == 0)
+        {
+            fusion.correct(fix(still, 0, 0.15f));
+        }
+        Vector velocity = fusion.getVelocity();
+        speedRms += velocity.x * velocity.x + velocity.y * velocity.y + velocity.z * velocity.z;
+    }
+    speedRms = sqrtf(speedRms / samples);
+    char message[96];
+    snprintf(message, sizeof(message), "standing still: last fix rms %.3f m, fused rms %.3f m, speed rms %.3f m/s", result.fixRms, result.fusedRms,
+             speedRms);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_FLOAT_WITHIN(0.15f, 0, speedRms);
+}
+
+void test_walking_replay(void)
+{
+    ImuFusion fusion;
+    Replay result = replay(fusion, WALK, 60, 0.15f);
+    char message[128];
+    snprintf(message, sizeof(message), "walking: last fix rms %.3f m, fused rms %.3f m at 200 Hz, heading off by %.1f deg", result.fixRms,
+             result.fusedRms, result.headingError * 180 / M_PI);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_TRUE(result.fusedRms < 0.6f * result.fixRms);
+    // heading comes from walking around, there's nothing else to see it by
+    TEST_ASSERT_FLOAT_WITHIN(0.2f, 0, result.headingError);
+    // 99.9% gate, so the odd good fix goes too
+    TEST_ASSERT_LESS_THAN_UINT32(10, fusion.getRejectedFixes());
+}
+
+void test_dead_reckoning_through_a_gap(void)
+{
+    ImuFusion fusion;
+    replay(fusion, WALK, 30, 0.15f);
+    // a second without fixes, carrying on at the IMU's rate
+    float start = 30;
+    float worst = 0;
+    for (int i = 0; i < 200; i++)
+    {
+        float t = start + i * DT;
+        Vector accel, gyro;
+        sample(WALK, t, accel, gyro);
+        fusion.predict(accel, gyro, DT);
+        float error = distance(fusion.getPosition(), position(WALK, t));
+        worst = error > worst ? error : worst;
+    }
+    char message[64];
+    snprintf(message, sizeof(message), "1 s without fixes: %.3f m off at worst", worst);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_TRUE(fusion.hasFix());
+    TEST_ASSERT_FLOAT_WITHIN(0.4f, 0, worst);
+    // the fix after the gap is believed
+    TEST_ASSERT_TRUE(fusion.correct(position(WALK, start + 1)));
+}
+
+void test_long_gap_starts_over(void)
+{
+    ImuFusion fusion;
+    replay(fusion, WALK, 10, 0.15f);
+    Vector accel, gyro;
+    for (int i = 0; i <= 2000 / 5; i++)
+    {
+        sample(WALK, 10 + i * DT, accel, gyro);
+        fusion.predict(accel, gyro, DT);
+    }
+    TEST_ASSERT_FALSE(fusion.hasFix());
+    // anywhere at all is taken as the new start
+    TEST_ASSERT_TRUE(fusion.correct(Vector{20, 20, 1}));
+    TEST_ASSERT_EQUAL_FLOAT(20, fusion.getPosition().x);
+    TEST_ASSERT_EQUAL_FLOAT(0, fusion.getVelocity().x);
+}
+
+void test_bad_fixes_are_gated(void)
+{
+    ImuFusion fusion;
+    replay(fusion, WALK, 30, 0.15f);
+    Vector accel, gyro;
+    float t = 30;
+    // a reflection puts one fix 3 m off
+    Vector bad = position(WALK, t);
+    bad.x += 3;
+    uint32_t rejected = fusion.getRejectedFixes();
+    TEST_ASSERT_FALSE(fusion.correct(bad));
+    TEST_ASSERT_EQUAL_UINT32(rejected + 1, fusion.getRejectedFixes());
+    TEST_ASSERT_TRUE(fusion.hasFix());
+    TEST_ASSERT_FLOAT_WITHIN(0.3f, 0, distance(fusion.getPosition(), position(WALK, t)));
+
+    // enough of them in a row and it's the filter that's lost
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        sample(WALK, t, accel, gyro);
+        fusion.predict(accel, gyro, DT);
+        TEST_ASSERT_FALSE(fusion.correct(bad));
+    }
+    TEST_ASSERT_FALSE(fusion.hasFix());
+    TEST_ASSERT_TRUE(fusion.correct(bad));
+    TEST_ASSERT_EQUAL_FLOAT(bad.x, fusion.getPosition().x);
+}
+
+void test_reset(void)
+{
+    ImuFusion fusion;
+    replay(fusion, WALK, 5, 0.15f);
+    fusion.reset();
+    TEST_ASSERT_FALSE(fusion.hasFix());
+    TEST_ASSERT_EQUAL_FLOAT(0, fusion.getHeading());
+}
+
+/**
+ * CPU cost per call on the host, predict() runs 200 times a second and correct() 5.
+ * Allows the ESP32-S3 20x as long as the host, Imu::printStats() has the real numbers.
+ */
+void test_cpu_cost(void)
+{
+    ImuFusion fusion;
+    replay(fusion, WALK, 5, 0.15f);
+    const int samples = 100000;
+    Vector accels[64], gyros[64], fixes[64];
+    for (int i = 0; i < 64; i++)
+    {
+        sample(WALK, 5 + i * DT, accels[i], gyros[i]);
+        fixes[i] = fix(WALK, 5 + i * DT, 0.15f);
+    }
+
+    double predictNs = 0;
+    double correctNs = 0;
+    int corrections = 0;
+    volatile float sink = 0;
+    for (int i = 0; i < samples; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        fusion.predict(accels[i % 64], gyros[i % 64], DT);
+        auto end = std::chrono::steady_clock::now();
+        predictNs += std::chrono::duration<double, std::nano>(end - start).count();
+        if (i % SAMPLES_PER_FIX == 0)
+        {
+            start = std::chrono::steady_clock::now();
+            fusion.correct(fixes[i % 64]);
+            end = std::chrono::steady_clock::now();
+            correctNs += std::chrono::duration<double, std::nano>(end - start).count();
+            corrections++;
+        }
+        sink = sink + fusion.getPosition().x;
+    }
+    predictNs /= samples;
+    correctNs /= corrections;
+    double load = (predictNs * 200 + correctNs * 5) / 1e9;
+    char message[128];
+    snprintf(message, sizeof(message), "predict %.0f ns, correct %.0f ns, %.3f%% of a core at 200 Hz with 5 fixes/s", predictNs, correctNs,
+             load * 100);
+    TEST_MESSAGE(message);
+    // a few % of one ESP32-S3 core
+    TEST_ASSERT_TRUE(load * 20 < 0.05);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_still_tag_stays_put);
+    RUN_TEST(test_walking_replay);
+    RUN_TEST(test_dead_reckoning_through_a_gap);
+    RUN_TEST(test_long_gap_starts_over);
+    RUN_TEST(test_bad_fixes_are_gated);
+    RUN_TEST(test_reset);
+    RUN_TEST(test_cpu_cost);
+    return UNITY_END();
+}
@@ -0,0 +1,305 @@
+#include <unity.h>
+#include <stdio.h>
+#include <math.h>
+#include <chrono>
+
+#include "motionplanner.hpp"
+
+/**
+ * Runs the planner like the step timer does, recording when each step happens (us).
+ * Returns the number of steps made, or stops at maxSteps.
+ */
+typedef struct
+{
+    int32_t position;
+    int8_t direction;
+    uint64_t time;
+    uint32_t interval;
+} Step;
+
+static Step steps[40000];
+
+static uint32_t run(MotionPlanner &planner, uint32_t maxSteps, uint64_t &now)
+{
+    uint32_t count = 0;
+    while (count < maxSteps)
+    {
+        int8_t direction = 0;
+        uint32_t interval = planner.next(&direction);
+        if (interval == 0)
+        {
+            break;
+        }
+        steps[count] = Step{planner.getPosition(), direction, now, interval};
+        now += interval;
+        count++;
+    }
+    return count;
+}
+
+// when an ideal trapezoid profile gets to step n of a move of length steps, s
+static double trapezoid(uint32_t n, uint32_t length, double speed, double acceleration)
+{
+    double rampSteps = speed * speed / (2 * acceleration);
+    if (2 * rampSteps > length)
+    {
+        // never gets to the top speed
+        rampSteps = length / 2.0;
+        speed = sqrt(2 * acceleration * rampSteps);
+    }
+    double rampTime = speed / acceleration;
+    double cruiseTime = (length - 2 * rampSteps) / speed;
+    if (n <= rampSteps)
+    {
+        return sqrt(2 * n / acceleration);
+    }
+    if (n <= length - rampSteps)
+    {
+        return rampTime + (n - rampSteps) / speed;
+    }
+    double left = length - n;
+    return 2 * rampTime + cruiseTime - sqrt(2 * left / acceleration);
+}
+
+/**
+ * The speed can't change faster than the acceleration, with some slack for Austin's approximation.
+ * Intervals are whole us, so speeds are taken over WINDOW steps rather than step by step.
+ */
+static void checkAcceleration(uint32_t count, double acceleration)
+{
+    const uint32_t WINDOW = 32;
+    for (uint32_t i = 2 * WINDOW; i < count; i++)
+    {
+        const Step &first = steps[i - 2 * WINDOW];
+        const Step &middle = steps[i - WINDOW];
+        const Step &last = steps[i];
+        if (first.direction != last.direction || middle.direction != last.direction)
+        {
+            continue;
+        }
+        double before = WINDOW / ((middle.time - first.time) / 1e6);
+        double after = WINDOW / ((last.time - middle.time) / 1e6);
+        double dt = (last.time - first.time) / 2e6;
+        TEST_ASSERT_TRUE(fabs(after - before) / dt < 1.15 * acceleration);
+    }
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_stopped_on_target(void)
+{
+    MotionPlanner planner;
+    int8_t direction = 0;
+    TEST_ASSERT_EQUAL_UINT32(0, planner.next(&direction));
+    TEST_ASSERT_FALSE(planner.isMoving());
+    planner.setPosition(500);
+    TEST_ASSERT_EQUAL_INT32(500, planner.getTarget());
+    TEST_ASSERT_EQUAL_UINT32(0, planner.next(&direction));
+}
+
+void test_follows_trapezoid(void)
+{
+    // 333.33 us a step at the top speed, the fractions have to add up
+    const double speed = 3000;
+    const double acceleration = 8000;
+    const uint32_t length = 10000;
+    MotionPlanner planner;
+    planner.setLimits(speed, acceleration);
+    planner.moveTo(length);
+    uint64_t now = 0;
+    uint32_t count = run(planner, 40000, now);
+    TEST_ASSERT_EQUAL_UINT32(length, count);
+    TEST_ASSERT_EQUAL_INT32(length, planner.getPosition());
+    TEST_ASSERT_FALSE(planner.isMoving());
+
+    // step n is made at the start of its interval, when the ideal profile has done n - 1
+    double worst = 0;
+    double errors[length];
+    for (uint32_t i = 0; i < count; i++)
+    {
+        errors[i] = steps[i].time / 1e6 - trapezoid(i, length, speed, acceleration);
+        worst = fabs(errors[i]) > worst ? fabs(errors[i]) : worst;
+    }
+    double ideal = trapezoid(length, length, speed, acceleration);
+    // the last step's interval is the wait after it, the move is done when it's made
+    double actual = steps[count - 1].time / 1e6;
+    // from the end of the ramp up to the start of the ramp down
+    double cruiseDrift = errors[9000] - errors[1000];
+    char message[160];
+    snprintf(message, sizeof(message), "%u steps in %.4f s, ideal %.4f s, worst step %.2f ms off the profile, %.3f ms drift cruising", length, actual,
+             ideal, worst * 1000, cruiseDrift * 1000);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_FLOAT_WITHIN(0.005 * ideal, ideal, actual);
+    // mostly the first step, which the 0.676 correction shortens by a third of the ideal sqrt(2 / a)
+    TEST_ASSERT_FLOAT_WITHIN(sqrt(2 / acceleration) / 2, 0, worst);
+    TEST_ASSERT_FLOAT_WITHIN(0.0001, 0, cruiseDrift);
+    checkAcceleration(count, acceleration);
+}
+
+void test_short_move_is_a_triangle(void)
+{
+    const double speed = 4000;
+    const double acceleration = 8000;
+    const uint32_t length = 200;
+    MotionPlanner planner;
+    planner.setLimits(speed, acceleration);
+    planner.moveTo(-(int32_t)length);
+    uint64_t now = 0;
+    uint32_t count = run(planner, 40000, now);
+    TEST_ASSERT_EQUAL_UINT32(length, count);
+    TEST_ASSERT_EQUAL_INT32(-(int32_t)length, planner.getPosition());
+    TEST_ASSERT_EQUAL_INT8(-1, steps[0].direction);
+
+    // fastest in the middle, nowhere near the top speed, and about as fast out as in
+    uint32_t fastest = 0;
+    for (uint32_t i = 1; i < count; i++)
+    {
+        fastest = steps[i].interval < steps[fastest].interval ? i : fastest;
+    }
+    TEST_ASSERT_UINT32_WITHIN(length / 20, length / 2, fastest);
+    TEST_ASSERT_TRUE(steps[fastest].interval > 1e6 / speed);
+    TEST_ASSERT_UINT32_WITHIN(steps[0].interval / 10, steps[0].interval, steps[count - 2].interval);
+    // the shortened first and last steps show more on a short move
+    double ideal = trapezoid(length, length, speed, acceleration);
+    TEST_ASSERT_FLOAT_WITHIN(0.05 * ideal, ideal, steps[count - 1].time / 1e6);
+    checkAcceleration(count, acceleration);
+}
+
+void test_target_moves_behind(void)
+{
+    const double acceleration = 8000;
+    MotionPlanner planner;
+    planner.setLimits(4000, acceleration);
+    planner.moveTo(10000);
+    uint64_t now = 0;
+    run(planner, 2000, now);
+    TEST_ASSERT_EQUAL_INT32(2000, planner.getPosition());
+
+    // behind us at full speed: slows to a stop past 2000, then comes back
+    planner.moveTo(0);
+    uint32_t count = run(planner, 40000, now);
+    TEST_ASSERT_EQUAL_INT32(0, planner.getPosition());
+    TEST_ASSERT_FALSE(planner.isMoving());
+    uint32_t turn = 0;
+    int32_t furthest = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        furthest = steps[i].position > furthest ? steps[i].position : furthest;
+        if (turn == 0 && steps[i].direction < 0)
+        {
+            turn = i;
+        }
+    }
+    // 4000 steps/s takes v^2 / 2a = 1000 steps to stop
+    TEST_ASSERT_INT32_WITHIN(20, 3000, furthest);
+    // stopped before turning round
+    TEST_ASSERT_TRUE(steps[turn - 1].interval > 2000);
+    TEST_ASSERT_TRUE(steps[turn].interval > 2000);
+    checkAcceleration(count, acceleration);
+}
+
+void test_target_moves_ahead(void)
+{
+    MotionPlanner planner;
+    planner.setLimits(4000, 8000);
+    planner.moveTo(1500);
+    uint64_t now = 0;
+    run(planner, 1200, now);
+    // already slowing down for 1500, then carries on to 3000 without stopping
+    uint32_t slowing = steps[1199].interval;
+    TEST_ASSERT_TRUE(slowing > 250);
+    planner.moveTo(3000);
+    uint32_t count = run(planner, 40000, now);
+    TEST_ASSERT_EQUAL_UINT32(1800, count);
+    uint32_t slowest = 0;
+    for (uint32_t i = 0; i < count / 2; i++)
+    {
+        slowest = steps[i].interval > slowest ? steps[i].interval : slowest;
+    }
+    TEST_ASSERT_TRUE(slowest <= slowing);
+    checkAcceleration(count, 8000);
+}
+
+void test_lowering_top_speed_decelerates(void)
+{
+    const double acceleration = 8000;
+    MotionPlanner planner;
+    planner.setLimits(4000, acceleration);
+    planner.moveTo(20000);
+    uint64_t now = 0;
+    run(planner, 2000, now);
+    planner.setLimits(1000, acceleration);
+    uint32_t count = run(planner, 40000, now);
+    TEST_ASSERT_EQUAL_INT32(20000, planner.getPosition());
+    // slows down over v^2 / 2a steps instead of at once
+    TEST_ASSERT_TRUE(steps[0].interval < 300);
+    TEST_ASSERT_UINT32_WITHIN(10, 1000, steps[1000].interval);
+    checkAcceleration(count, acceleration);
+}
+
+void test_halt(void)
+{
+    MotionPlanner planner;
+    planner.setLimits(4000, 8000);
+    planner.moveTo(10000);
+    uint64_t now = 0;
+    run(planner, 500, now);
+    // can't move the position while it's going
+    planner.setPosition(0);
+    TEST_ASSERT_EQUAL_INT32(500, planner.getPosition());
+    planner.halt();
+    TEST_ASSERT_FALSE(planner.isMoving());
+    TEST_ASSERT_EQUAL_INT32(500, planner.getTarget());
+    planner.setPosition(0);
+    TEST_ASSERT_EQUAL_INT32(0, planner.getPosition());
+    // and starts from standing again
+    planner.moveTo(10);
+    int8_t direction;
+    TEST_ASSERT_TRUE(planner.next(&direction) > 1000);
+}
+
+/**
+ * next() runs in the step timer's ISR, at up to the top speed's rate.
+ */
+void test_next_cost(void)
+{
+    MotionPlanner planner;
+    planner.setLimits(20000, 40000);
+    const uint32_t calls = 2000000;
+    volatile uint32_t sink = 0;
+    int32_t target = 100000;
+    planner.moveTo(target);
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < calls; i++)
+    {
+        int8_t direction;
+        uint32_t interval = planner.next(&direction);
+        if (interval == 0)
+        {
+            target = -target;
+            planner.moveTo(target);
+        }
+        sink = sink + interval;
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / calls;
+    char message[64];
+    snprintf(message, sizeof(message), "next() %.1f ns per step", ns);
+    TEST_MESSAGE(message);
+    // nowhere near the 50 us between steps at the top speed
+    TEST_ASSERT_TRUE(ns < 1000);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_stopped_on_target);
+    RUN_TEST(test_follows_trapezoid);
+    RUN_TEST(test_short_move_is_a_triangle);
+    RUN_TEST(test_target_moves_behind);
+    RUN_TEST(test_target_moves_ahead);
+    RUN_TEST(test_lowering_top_speed_decelerates);
+    RUN_TEST(test_halt);
+    RUN_TEST(test_next_cost);
+    return UNITY_END();
+}
@@ -0,0 +1,200 @@
+#include <unity.h>
+#include <math.h>
+#include <stdio.h>
+#include <chrono>
+
+#include "multilateration.hpp"
+#include "../random.hpp"
+
+typedef Multilateration<8> Solver;
+
+static float distance(const Solver::Point &a, const Solver::Point &b)
+{
+    float dx = a.x - b.x;
+    float dy = a.y - b.y;
+    float dz = a.z - b.z;
+    return sqrtf(dx * dx + dy * dy + dz * dz);
+}
+
+static void addRanges(Solver &solver, const Solver::Point *anchors, uint8_t count, const Solver::Point &tag, float noise)
+{
+    solver.reset();
+    for (uint8_t i = 0; i < count; i++)
+    {
+        solver.addMeasurement(anchors[i], distance(anchors[i], tag) + noise * gaussian());
+    }
+}
+
+// a 10 x 10 m room with anchors in the corners, alternating between the ceiling and waist height
+static const Solver::Point ROOM[] = {{0, 0, 2.5f}, {10, 0, 1}, {10, 10, 2.5f}, {0, 10, 1}, {5, 0, 2.5f}, {5, 10, 1}};
+
+void setUp(void)
+{
+    seed = 1;
+}
+
+void tearDown(void) {}
+
+void test_exact_ranges_give_the_point(void)
+{
+    Solver solver;
+    Solver::Point tag = {3.2f, 6.7f, 1.4f};
+    addRanges(solver, ROOM, 4, tag, 0);
+    Solver::Result result = solver.solve(solver.centroid());
+    TEST_ASSERT_TRUE(result.success);
+    TEST_ASSERT_FLOAT_WITHIN(0.002f, tag.x, result.position.x);
+    TEST_ASSERT_FLOAT_WITHIN(0.002f, tag.y, result.position.y);
+    TEST_ASSERT_FLOAT_WITHIN(0.002f, tag.z, result.position.z);
+    TEST_ASSERT_FLOAT_WITHIN(0.001f, 0, result.rmsError);
+}
+
+void test_too_few_anchors_fail(void)
+{
+    Solver solver;
+    addRanges(solver, ROOM, Solver::MIN_ANCHORS - 1, {5, 5, 1}, 0);
+    TEST_ASSERT_FALSE(solver.solve(solver.centroid()).success);
+}
+
+void test_no_room_past_max_anchors(void)
+{
+    Multilateration<4> solver;
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        TEST_ASSERT_TRUE(solver.addMeasurement({ROOM[i].x, ROOM[i].y, ROOM[i].z}, 1));
+    }
+    TEST_ASSERT_FALSE(solver.addMeasurement({0, 0, 0}, 1));
+    TEST_ASSERT_EQUAL_UINT8(4, solver.getMeasurementCount());
+}
+
+void test_noisy_ranges_converge(void)
+{
+    // 5 cm range noise, what the anchors' filters let through, over the whole room
+    Solver solver;
+    double horizontal = 0;
+    double vertical = 0;
+    const int solves = 500;
+    for (int i = 0; i < solves; i++)
+    {
+        Solver::Point tag = {uniform() * 10, uniform() * 10, 0.5f + uniform()};
+        addRanges(solver, ROOM, 6, tag, 0.05f);
+        Solver::Result result = solver.solve(solver.centroid());
+        TEST_ASSERT_TRUE(result.success);
+        horizontal += (result.position.x - tag.x) * (result.position.x - tag.x) + (result.position.y - tag.y) * (result.position.y - tag.y);
+        vertical += (result.position.z - tag.z) * (result.position.z - tag.z);
+    }
+    horizontal = sqrt(horizontal / solves);
+    vertical = sqrt(vertical / solves);
+    char message[96];
+    snprintf(message, sizeof(message), "rms error %.3f m horizontal, %.3f m vertical with 0.05 m range noise", horizontal, vertical);
+    TEST_MESSAGE(message);
+    // the anchors only span 1.5 m of height, so z is a lot weaker than x and y
+    TEST_ASSERT_FLOAT_WITHIN(0.08, 0, horizontal);
+    TEST_ASSERT_FLOAT_WITHIN(0.25, 0, vertical);
+}
+
+void test_starting_from_the_last_fix(void)
+{
+    Solver solver;
+    Solver::Point tag = {7, 2, 1.2f};
+    addRanges(solver, ROOM, 6, tag, 0.02f);
+    Solver::Result cold = solver.solve(solver.centroid());
+    Solver::Result warm = solver.solve({tag.x + 0.1f, tag.y - 0.1f, tag.z});
+    TEST_ASSERT_TRUE(warm.success);
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, cold.position.x, warm.position.x);
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, cold.position.y, warm.position.y);
+    TEST_ASSERT_LESS_OR_EQUAL(cold.iterations, warm.iterations);
+}
+
+void test_coplanar_anchors_keep_the_tag_below(void)
+{
+    // every anchor on the ceiling: z has a mirror image above it, the centroid guess starts on the right side
+    const Solver::Point ceiling[] = {{0, 0, 2.5f}, {10, 0, 2.5f}, {10, 10, 2.5f}, {0, 10, 2.5f}};
+    Solver solver;
+    Solver::Point tag = {4, 6, 1};
+    addRanges(solver, ceiling, 4, tag, 0.02f);
+    Solver::Result result = solver.solve(solver.centroid());
+    TEST_ASSERT_TRUE(result.success);
+    TEST_ASSERT_FLOAT_WITHIN(0.1f, tag.x, result.position.x);
+    TEST_ASSERT_FLOAT_WITHIN(0.1f, tag.y, result.position.y);
+    TEST_ASSERT_TRUE(result.position.z < 2.5f);
+}
+
+void test_collinear_anchors_stay_finite(void)
+{
+    // no unique answer at all, the solver has to give up or settle somewhere without blowing up
+    const Solver::Point line[] = {{0, 0, 2}, {3, 0, 2}, {6, 0, 2}, {9, 0, 2}};
+    Solver solver;
+    addRanges(solver, line, 4, {4, 5, 1}, 0.02f);
+    Solver::Result result = solver.solve(solver.centroid());
+    TEST_ASSERT_FALSE(isnan(result.position.x) || isnan(result.position.y) || isnan(result.position.z));
+    TEST_ASSERT_FALSE(isnan(result.rmsError));
+    TEST_ASSERT_FLOAT_WITHIN(0.1f, 4, result.position.x);
+}
+
+void test_guess_on_an_anchor(void)
+{
+    // the gradient of that anchor's range is undefined right on it
+    Solver solver;
+    Solver::Point tag = {2, 3, 1};
+    addRanges(solver, ROOM, 6, tag, 0);
+    Solver::Result result = solver.solve(ROOM[0]);
+    TEST_ASSERT_TRUE(result.success);
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 0, distance(result.position, tag));
+}
+
+void test_outlier_range_shows_in_rms_error(void)
+{
+    Solver solver;
+    Solver::Point tag = {5, 5, 1};
+    addRanges(solver, ROOM, 6, tag, 0);
+    Solver::Result clean = solver.solve(solver.centroid());
+    addRanges(solver, ROOM, 5, tag, 0);
+    solver.addMeasurement(ROOM[5], distance(ROOM[5], tag) + 1.5f);
+    Solver::Result multipath = solver.solve(solver.centroid());
+    TEST_ASSERT_TRUE(multipath.rmsError > clean.rmsError + 0.2f);
+}
+
+void test_benchmark(void)
+{
+    // solves per second and iterations on the host, a rough guide to the ESP32-S3 at ~1/20th the speed
+    Solver solver;
+    const int solves = 20000;
+    uint32_t iterations = 0;
+    uint8_t maxIterations = 0;
+    // keeps the optimiser from dropping the solves
+    volatile float sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < solves; i++)
+    {
+        addRanges(solver, ROOM, 6, {uniform() * 10, uniform() * 10, 0.5f + uniform()}, 0.05f);
+        Solver::Result result = solver.solve(solver.centroid());
+        iterations += result.iterations;
+        if (result.iterations > maxIterations)
+        {
+            maxIterations = result.iterations;
+        }
+        sink = sink + result.position.x;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    char message[128];
+    snprintf(message, sizeof(message), "%.0f solves/s, %.1f iterations on average, %d at most", solves / seconds, (double)iterations / solves,
+             maxIterations);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_LESS_THAN_UINT32(10 * solves, iterations);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_exact_ranges_give_the_point);
+    RUN_TEST(test_too_few_anchors_fail);
+    RUN_TEST(test_no_room_past_max_anchors);
+    RUN_TEST(test_noisy_ranges_converge);
+    RUN_TEST(test_starting_from_the_last_fix);
+    RUN_TEST(test_coplanar_anchors_keep_the_tag_below);
+    RUN_TEST(test_collinear_anchors_stay_finite);
+    RUN_TEST(test_guess_on_an_anchor);
+    RUN_TEST(test_outlier_range_shows_in_rms_error);
+    RUN_TEST(test_benchmark);
+    return UNITY_END();
+}
@@ -0,0 +1,323 @@
+#include <unity.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+
+#include "ranging.hpp"
+#include "broadcastranging.hpp"
+
+/**
+ * The ranging state machines DW1000::handle() drives, against a radio that never finishes anything by itself.
+ * Every call has to come straight back: nothing may poll the radio or wait for it, the test moves the radio on.
+ */
+
+#define TICKS_PER_US 63897.6
+// a few metres of flight
+#define FLIGHT_TICKS 1000
+
+class MockRadio : public Radio
+{
+public:
+    uint32_t polls = 0;
+    uint32_t transmits = 0;
+    uint32_t idles = 0;
+    uint8_t sent[BroadcastRanging::FINAL_LENGTH_MAX];
+    size_t sentLength = 0;
+    bool delayed = false;
+    bool receiveAfter = false;
+    uint64_t reference = 0;
+    uint32_t delayUs = 0;
+    uint64_t systemTime = 1000000;
+    uint64_t transmitTime = 0;
+
+    Event pollEvent() override
+    {
+        polls++;
+        return NONE;
+    }
+    void transmit(const uint8_t *data, size_t len, bool delayed, bool receiveAfter) override
+    {
+        memcpy(sent, data, len);
+        sentLength = len;
+        this->delayed = delayed;
+        this->receiveAfter = receiveAfter;
+        transmits++;
+        mTransmitting = true;
+        if (!delayed)
+        {
+            transmitTime = systemTime;
+        }
+    }
+    uint64_t scheduleTransmit(uint64_t reference, uint32_t delayUs) override
+    {
+        this->reference = reference;
+        this->delayUs = delayUs;
+        transmitTime = reference + (uint64_t)(delayUs * TICKS_PER_US);
+        return transmitTime;
+    }
+    void startReceive() override { mReceiving = true; }
+    void idle() override
+    {
+        idles++;
+        mTransmitting = false;
+        mReceiving = false;
+    }
+    size_t getReceivedData(uint8_t *, size_t) override { return 0; }
+    uint64_t getReceiveTimestamp() override { return 0; }
+    uint64_t getTransmitTimestamp() override { return transmitTime; }
+    uint64_t getSystemTimestamp() override { return systemTime; }
+
+    // the frame is out, the radio's clock has moved on to it
+    void finishTransmit()
+    {
+        mTransmitting = false;
+        systemTime = transmitTime + 100;
+    }
+};
+
+static const uint8_t TAG_EUI[8] = {0x10, 0xD1, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7};
+static const uint8_t ANCHOR_EUI[8] = {0xA0, 0xD1, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7};
+
+// the longest any single call took, us
+static double slowestCall;
+
+static void timed(std::chrono::steady_clock::time_point start)
+{
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    slowestCall = us > slowestCall ? us : slowestCall;
+}
+
+void setUp(void)
+{
+    slowestCall = 0;
+}
+
+void tearDown(void) {}
+
+void test_tag_returns_before_the_poll_is_out(void)
+{
+    MockRadio radio;
+    TwoWayRanging tag(radio);
+    tag.setEUI(TAG_EUI);
+
+    TEST_ASSERT_TRUE(tag.startTag(TwoWayRanging::shortId(ANCHOR_EUI), 0));
+    TEST_ASSERT_EQUAL(TwoWayRanging::TAG_SENDING_POLL, tag.getState());
+    TEST_ASSERT_EQUAL_UINT32(1, radio.transmits);
+    TEST_ASSERT_FALSE(radio.delayed);
+    TEST_ASSERT_TRUE(radio.receiveAfter);
+    // already busy, the caller gets told rather than made to wait
+    TEST_ASSERT_FALSE(tag.startTag(TwoWayRanging::shortId(ANCHOR_EUI), 0));
+
+    // the radio never says it's done, handle() keeps coming back until the step times out
+    for (uint32_t now = 0; now <= TwoWayRanging::STEP_TIMEOUT_US; now += 100)
+    {
+        tag.tick(now);
+        TEST_ASSERT_TRUE(tag.isBusy());
+    }
+    tag.tick(TwoWayRanging::STEP_TIMEOUT_US + 100);
+    TEST_ASSERT_EQUAL(TwoWayRanging::FAILED, tag.getState());
+    // the stuck transmit is cancelled rather than left to go out later
+    TEST_ASSERT_EQUAL_UINT32(1, radio.idles);
+    TEST_ASSERT_EQUAL_UINT32(0, radio.polls);
+}
+
+void test_anchor_reply_is_a_delayed_transmit(void)
+{
+    MockRadio tagRadio;
+    TwoWayRanging tag(tagRadio);
+    tag.setEUI(TAG_EUI);
+    tag.startTag(TwoWayRanging::shortId(ANCHOR_EUI), 0);
+
+    MockRadio radio;
+    TwoWayRanging anchor(radio);
+    anchor.setEUI(ANCHOR_EUI);
+    uint64_t received = radio.systemTime - 200 * TICKS_PER_US;
+    TEST_ASSERT_TRUE(anchor.onReceive(tagRadio.sent, tagRadio.sentLength, received, 0));
+
+    // handed to the radio timed off the poll, the anchor doesn't wait for it to go out
+    TEST_ASSERT_EQUAL(TwoWayRanging::ANCHOR_SENDING_RESPONSE, anchor.getState());
+    TEST_ASSERT_TRUE(radio.delayed);
+    TEST_ASSERT_TRUE(radio.receiveAfter);
+    TEST_ASSERT_TRUE(radio.reference == received);
+    TEST_ASSERT_EQUAL_UINT32(TwoWayRanging::RESPONSE_DELAY_US, radio.delayUs);
+    TEST_ASSERT_EQUAL_UINT32(0, anchor.getLateReplies());
+    TEST_ASSERT_EQUAL_UINT32(0, radio.polls);
+}
+
+void test_late_handle_still_returns(void)
+{
+    MockRadio tagRadio;
+    TwoWayRanging tag(tagRadio);
+    tag.setEUI(TAG_EUI);
+    tag.startTag(TwoWayRanging::shortId(ANCHOR_EUI), 0);
+
+    // handle() got to the poll 2 ms after it arrived, the reply slot is gone
+    MockRadio radio;
+    TwoWayRanging anchor(radio);
+    anchor.setEUI(ANCHOR_EUI);
+    uint64_t received = radio.systemTime - 2000 * TICKS_PER_US;
+    TEST_ASSERT_TRUE(anchor.onReceive(tagRadio.sent, tagRadio.sentLength, received, 0));
+    TEST_ASSERT_TRUE(radio.reference == radio.systemTime);
+    TEST_ASSERT_EQUAL_UINT32(TwoWayRanging::MIN_REPLY_LEAD_US, radio.delayUs);
+    TEST_ASSERT_EQUAL_UINT32(1, anchor.getLateReplies());
+}
+
+// the last frame from one radio arrives at the other FLIGHT_TICKS later, with the same clock on both
+static bool deliver(MockRadio &from, MockRadio &to, TwoWayRanging &receiver, uint32_t nowUs)
+{
+    from.finishTransmit();
+    to.systemTime = from.systemTime + FLIGHT_TICKS;
+    auto start = std::chrono::steady_clock::now();
+    bool handled = receiver.onReceive(from.sent, from.sentLength, from.transmitTime + FLIGHT_TICKS, nowUs);
+    timed(start);
+    return handled;
+}
+
+static void transmitDone(MockRadio &radio, TwoWayRanging &ranging, uint32_t nowUs)
+{
+    radio.finishTransmit();
+    auto start = std::chrono::steady_clock::now();
+    ranging.onTransmitDone(nowUs);
+    timed(start);
+}
+
+void test_whole_exchange_from_events(void)
+{
+    MockRadio tagRadio;
+    MockRadio anchorRadio;
+    TwoWayRanging tag(tagRadio);
+    TwoWayRanging anchor(anchorRadio);
+    tag.setEUI(TAG_EUI);
+    anchor.setEUI(ANCHOR_EUI);
+
+    const int exchanges = 1000;
+    int succeeded = 0;
+    for (int i = 0; i < exchanges; i++)
+    {
+        uint32_t now = i * 10000;
+        auto start = std::chrono::steady_clock::now();
+        tag.startTag(TwoWayRanging::shortId(ANCHOR_EUI), now);
+        timed(start);
+        transmitDone(tagRadio, tag, now);
+        TEST_ASSERT_TRUE(deliver(tagRadio, anchorRadio, anchor, now));
+        transmitDone(anchorRadio, anchor, now + 500);
+        TEST_ASSERT_TRUE(deliver(anchorRadio, tagRadio, tag, now + 500));
+        transmitDone(tagRadio, tag, now + 1000);
+        TEST_ASSERT_TRUE(deliver(tagRadio, anchorRadio, anchor, now + 1000));
+        transmitDone(anchorRadio, anchor, now + 1500);
+        TEST_ASSERT_TRUE(deliver(anchorRadio, tagRadio, tag, now + 1500));
+
+        succeeded += tag.getState() == TwoWayRanging::SUCCEEDED && anchor.getState() == TwoWayRanging::SUCCEEDED;
+        tag.reset();
+        anchor.reset();
+    }
+    TEST_ASSERT_EQUAL_INT(exchanges, succeeded);
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, FLIGHT_TICKS * 0.0046917639786159, tag.getReport().range);
+    // neither side ever went looking for radio events itself
+    TEST_ASSERT_EQUAL_UINT32(0, tagRadio.polls + anchorRadio.polls);
+
+    char message[64];
+    snprintf(message, sizeof(message), "slowest call %.1f us", slowestCall);
+    TEST_MESSAGE(message);
+    // the blocking version sat in here for the whole exchange, milliseconds at best
+    TEST_ASSERT_TRUE(slowestCall < 500);
+}
+
+void test_broadcast_tag_gives_up_without_responses(void)
+{
+    MockRadio radio;
+    BroadcastRanging tag(radio);
+    tag.setEUI(TAG_EUI);
+    const uint16_t anchors[] = {0xD1A0, 0xD1A1, 0xD1A2};
+
+    TEST_ASSERT_TRUE(tag.startTag(anchors, 3, 0));
+    TEST_ASSERT_EQUAL(BroadcastRanging::TAG_SENDING_POLL, tag.getState());
+    radio.finishTransmit();
+    tag.onTransmitDone(0);
+
+    // nobody answers: handle() keeps returning until the last response slot has gone by
+    uint32_t window = BroadcastRanging::RESPONSE_DELAY_US + 2 * BroadcastRanging::RESPONSE_SLOT_US + BroadcastRanging::SLOT_MARGIN_US;
+    for (uint32_t now = 0; now <= window; now += 100)
+    {
+        tag.tick(now);
+        TEST_ASSERT_EQUAL(BroadcastRanging::TAG_WAITING_RESPONSES, tag.getState());
+    }
+    tag.tick(window + 100);
+    TEST_ASSERT_EQUAL(BroadcastRanging::FAILED, tag.getState());
+    TEST_ASSERT_EQUAL_UINT32(1, radio.transmits);
+    TEST_ASSERT_EQUAL_UINT32(0, radio.polls);
+}
+
+void test_broadcast_tag_finals_after_a_missing_slot(void)
+{
+    MockRadio radio;
+    BroadcastRanging tag(radio);
+    tag.setEUI(TAG_EUI);
+    const uint8_t firstEui[8] = {0xA0, 0xD1, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7};
+    const uint16_t anchors[] = {TwoWayRanging::shortId(firstEui), 0xD1A1, 0xD1A2};
+
+    tag.startTag(anchors, 3, 0);
+    radio.finishTransmit();
+    tag.onTransmitDone(0);
+
+    BroadcastRanging::Response response = {tag.getSequence(), {0}};
+    memcpy(response.anchorEui, firstEui, 8);
+    uint8_t frame[BroadcastRanging::RESPONSE_LENGTH];
+    BroadcastRanging::encodeResponse(response, frame, sizeof(frame));
+    TEST_ASSERT_TRUE(tag.onReceive(frame, sizeof(frame), radio.systemTime + 1000 * TICKS_PER_US, 1000));
+    // the other two slots are still open
+    TEST_ASSERT_EQUAL(BroadcastRanging::TAG_WAITING_RESPONSES, tag.getState());
+
+    // the window closes in tick(), the final is handed to the radio as a delayed transmit, not waited on
+    radio.systemTime += 3000 * TICKS_PER_US;
+    tag.tick(10000);
+    TEST_ASSERT_EQUAL(BroadcastRanging::TAG_SENDING_FINAL, tag.getState());
+    TEST_ASSERT_EQUAL_UINT32(2, radio.transmits);
+    TEST_ASSERT_TRUE(radio.delayed);
+    TEST_ASSERT_TRUE(radio.reference == radio.systemTime);
+    TEST_ASSERT_EQUAL_UINT32(TwoWayRanging::MIN_REPLY_LEAD_US, radio.delayUs);
+
+    BroadcastRanging::Final final;
+    TEST_ASSERT_TRUE(BroadcastRanging::decodeFinal(radio.sent, radio.sentLength, final));
+    TEST_ASSERT_EQUAL_UINT8(1, final.anchorCount);
+    TEST_ASSERT_TRUE(final.finalSent == radio.transmitTime);
+}
+
+void test_broadcast_anchor_answers_in_its_slot(void)
+{
+    MockRadio tagRadio;
+    BroadcastRanging tag(tagRadio);
+    tag.setEUI(TAG_EUI);
+    const uint16_t anchors[] = {0xD1A1, 0xD1A2, TwoWayRanging::shortId(ANCHOR_EUI)};
+    tag.startTag(anchors, 3, 0);
+
+    MockRadio radio;
+    BroadcastRanging anchor(radio);
+    anchor.setEUI(ANCHOR_EUI);
+    uint64_t received = radio.systemTime - 100 * TICKS_PER_US;
+    TEST_ASSERT_TRUE(anchor.onReceive(tagRadio.sent, tagRadio.sentLength, received, 0));
+    TEST_ASSERT_EQUAL(BroadcastRanging::ANCHOR_SENDING_RESPONSE, anchor.getState());
+    TEST_ASSERT_TRUE(radio.delayed);
+    TEST_ASSERT_TRUE(radio.reference == received);
+    TEST_ASSERT_EQUAL_UINT32(BroadcastRanging::RESPONSE_DELAY_US + 2 * BroadcastRanging::RESPONSE_SLOT_US, radio.delayUs);
+    TEST_ASSERT_EQUAL_UINT32(0, radio.polls);
+
+    // a poll that doesn't list us is left to the caller
+    BroadcastRanging other(radio);
+    other.setEUI(TAG_EUI);
+    TEST_ASSERT_FALSE(other.onReceive(tagRadio.sent, tagRadio.sentLength, received, 0));
+    TEST_ASSERT_EQUAL(BroadcastRanging::IDLE, other.getState());
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_tag_returns_before_the_poll_is_out);
+    RUN_TEST(test_anchor_reply_is_a_delayed_transmit);
+    RUN_TEST(test_late_handle_still_returns);
+    RUN_TEST(test_whole_exchange_from_events);
+    RUN_TEST(test_broadcast_tag_gives_up_without_responses);
+    RUN_TEST(test_broadcast_tag_finals_after_a_missing_slot);
+    RUN_TEST(test_broadcast_anchor_answers_in_its_slot);
+    return UNITY_END();
+}
@@ -0,0 +1,300 @@
+#include <unity.h>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <chrono>
+
+#include "peertable.hpp"
+#include "../random.hpp"
+
+typedef struct
+{
+    uint32_t id;
+    int32_t priority;
+} Peer;
+
+// boards from one batch share most of their EUI
+static void eui(uint32_t id, uint8_t out[8])
+{
+    const uint8_t batch[8] = {0, 0, 0x1A, 0x28, 0x6F, 0x24, 0xD6, 0xD7};
+    memcpy(out, batch, 8);
+    out[0] = id & 0xFF;
+    out[1] = (id >> 8) & 0xFF;
+}
+
+static int32_t byPriority(const Peer &peer)
+{
+    return peer.priority;
+}
+
+void setUp(void)
+{
+    seed = 1;
+}
+
+void tearDown(void) {}
+
+void test_insert_find_remove(void)
+{
+    PeerTable<Peer, 4> table;
+    uint8_t a[8], b[8];
+    eui(1, a);
+    eui(2, b);
+
+    bool created = false;
+    Peer *peer = table.insert(a, 0, &created);
+    TEST_ASSERT_TRUE(created);
+    peer->id = 1;
+    TEST_ASSERT_EQUAL_PTR(peer, table.insert(a, 1, &created));
+    TEST_ASSERT_FALSE(created);
+    TEST_ASSERT_NULL(table.find(b));
+    TEST_ASSERT_EQUAL_INT16(-1, table.slotOf(b));
+
+    int16_t slot = table.slotOf(a);
+    TEST_ASSERT_EQUAL_UINT32(1, table.get(slot).id);
+    TEST_ASSERT_EQUAL_MEMORY(a, table.getEui(slot), 8);
+    table.remove(slot);
+    TEST_ASSERT_NULL(table.find(a));
+    TEST_ASSERT_EQUAL_UINT16(0, table.size());
+    // removing an empty slot or one past the end is harmless
+    table.remove(slot);
+    table.remove(100);
+    TEST_ASSERT_EQUAL_UINT16(0, table.size());
+
+    // values come back initialised
+    peer = table.insert(a, 2, &created);
+    TEST_ASSERT_TRUE(created);
+    TEST_ASSERT_EQUAL_UINT32(0, peer->id);
+}
+
+void test_slots_dont_move(void)
+{
+    PeerTable<Peer, 8> table;
+    uint8_t id[8];
+    for (uint32_t i = 0; i < 8; i++)
+    {
+        eui(i, id);
+        table.insert(id, i)->id = i;
+    }
+    eui(3, id);
+    int16_t slot = table.slotOf(id);
+    for (uint32_t i = 0; i < 8; i += 2)
+    {
+        eui(i, id);
+        table.remove(table.slotOf(id));
+    }
+    eui(3, id);
+    TEST_ASSERT_EQUAL_INT16(slot, table.slotOf(id));
+    TEST_ASSERT_EQUAL_UINT32(3, table.get(slot).id);
+}
+
+void test_full_table_evicts_least_recently_used(void)
+{
+    PeerTable<Peer, 3> table;
+    uint8_t id[8];
+    for (uint32_t i = 0; i < 3; i++)
+    {
+        eui(i, id);
+        table.insert(id, 100 + i);
+    }
+    // 0 is the oldest until it's used again
+    eui(0, id);
+    table.touch(table.slotOf(id), 200);
+    eui(3, id);
+    table.insert(id, 201);
+    TEST_ASSERT_EQUAL_UINT16(3, table.size());
+    eui(1, id);
+    TEST_ASSERT_NULL(table.find(id));
+    eui(0, id);
+    TEST_ASSERT_NOT_NULL(table.find(id));
+}
+
+void test_eviction_across_millis_wrap(void)
+{
+    PeerTable<Peer, 2> table;
+    uint8_t id[8];
+    eui(0, id);
+    table.insert(id, 0xFFFFFF00);
+    eui(1, id);
+    table.insert(id, 0x00000010);
+    // 0 was used before the wrap, it's the older one
+    eui(2, id);
+    table.insert(id, 0x00000020);
+    eui(0, id);
+    TEST_ASSERT_NULL(table.find(id));
+    eui(1, id);
+    TEST_ASSERT_NOT_NULL(table.find(id));
+}
+
+void test_priority_before_age(void)
+{
+    PeerTable<Peer, 3> table;
+    table.setPriority(byPriority);
+    uint8_t id[8];
+    const int32_t priorities[] = {5, 1, 5};
+    for (uint32_t i = 0; i < 3; i++)
+    {
+        eui(i, id);
+        table.insert(id, i)->priority = priorities[i];
+    }
+    // 1 is the newest of the three but the least important
+    eui(1, id);
+    table.touch(table.slotOf(id), 10);
+    eui(3, id);
+    table.insert(id, 11)->priority = 5;
+    eui(1, id);
+    TEST_ASSERT_NULL(table.find(id));
+
+    // with equal priorities it falls back to the oldest
+    eui(4, id);
+    table.insert(id, 12)->priority = 5;
+    eui(0, id);
+    TEST_ASSERT_NULL(table.find(id));
+}
+
+/**
+ * Random inserts, lookups and removals against a std::map doing the same, eviction included.
+ * Every EUI shares 6 bytes, and the churn leaves plenty of tombstones behind to probe past and rebuild.
+ */
+void test_matches_reference_map(void)
+{
+    const uint16_t capacity = 16;
+    PeerTable<Peer, capacity> table;
+    // id -> last used
+    std::map<uint32_t, uint32_t> reference;
+
+    for (uint32_t now = 1; now < 200000; now++)
+    {
+        uint32_t id = nextRandom() % 48;
+        uint8_t key[8];
+        eui(id, key);
+        uint32_t op = nextRandom() % 10;
+        if (op < 5)
+        {
+            if (reference.count(id) == 0 && reference.size() >= capacity)
+            {
+                // the least recently used goes, times are unique so there's no tie
+                auto victim = reference.begin();
+                for (auto it = reference.begin(); it != reference.end(); ++it)
+                {
+                    if (it->second < victim->second)
+                    {
+                        victim = it;
+                    }
+                }
+                reference.erase(victim);
+            }
+            bool created;
+            Peer *peer = table.insert(key, now, &created);
+            TEST_ASSERT_EQUAL(reference.count(id) == 0, created);
+            if (created)
+            {
+                peer->id = id;
+            }
+            reference[id] = now;
+        }
+        else if (op < 8)
+        {
+            Peer *peer = table.find(key);
+            TEST_ASSERT_EQUAL(reference.count(id) == 1, peer != nullptr);
+            if (peer != nullptr)
+            {
+                TEST_ASSERT_EQUAL_UINT32(id, peer->id);
+            }
+        }
+        else
+        {
+            int16_t slot = table.slotOf(key);
+            TEST_ASSERT_EQUAL(reference.count(id) == 1, slot >= 0);
+            if (slot >= 0)
+            {
+                table.remove(slot);
+                reference.erase(id);
+            }
+        }
+        TEST_ASSERT_EQUAL_UINT16(reference.size(), table.size());
+    }
+
+    // and iterating the slots sees exactly the same peers
+    uint16_t used = 0;
+    for (uint16_t slot = 0; slot < table.capacity(); slot++)
+    {
+        if (table.isUsed(slot))
+        {
+            used++;
+            TEST_ASSERT_EQUAL_UINT32(1, reference.count(table.get(slot).id));
+        }
+    }
+    TEST_ASSERT_EQUAL_UINT16(reference.size(), used);
+}
+
+// what the tables replaced: memcmp down a fixed array
+template <uint16_t Capacity>
+static int16_t linearFind(const uint8_t euis[][8], const uint8_t key[8])
+{
+    for (uint16_t i = 0; i < Capacity; i++)
+    {
+        if (memcmp(euis[i], key, 8) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+template <uint16_t Capacity>
+static void benchmark()
+{
+    static PeerTable<Peer, Capacity> table;
+    static uint8_t euis[Capacity][8];
+    table.clear();
+    for (uint16_t i = 0; i < Capacity; i++)
+    {
+        eui(i, euis[i]);
+        table.insert(euis[i], i)->id = i;
+    }
+
+    const uint32_t lookups = 1000000;
+    volatile uint32_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < lookups; i++)
+    {
+        sink = sink + table.find(euis[nextRandom() % Capacity])->id;
+    }
+    double tableNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / lookups;
+
+    start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < lookups; i++)
+    {
+        sink = sink + linearFind<Capacity>(euis, euis[nextRandom() % Capacity]);
+    }
+    double linearNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / lookups;
+
+    char message[96];
+    snprintf(message, sizeof(message), "%u peers: %.1f ns per lookup, %.1f ns for a linear scan", Capacity, tableNs, linearNs);
+    TEST_MESSAGE(message);
+    if (Capacity >= 64)
+    {
+        TEST_ASSERT_TRUE(tableNs < linearNs);
+    }
+}
+
+void test_lookup_benchmark(void)
+{
+    benchmark<8>();
+    benchmark<64>();
+    benchmark<256>();
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_insert_find_remove);
+    RUN_TEST(test_slots_dont_move);
+    RUN_TEST(test_full_table_evicts_least_recently_used);
+    RUN_TEST(test_eviction_across_millis_wrap);
+    RUN_TEST(test_priority_before_age);
+    RUN_TEST(test_matches_reference_map);
+    RUN_TEST(test_lookup_benchmark);
+    return UNITY_END();
+}
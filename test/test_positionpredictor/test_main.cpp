@@ -0,0 +1,237 @@
+#include <unity.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "positionpredictor.hpp"
+#include "../random.hpp"
+
+typedef PositionPredictor::Vector Vector;
+
+// walking a 2 m circle at about 1 m/s, the tag on a lanyard
+static Vector truth(uint32_t ms)
+{
+    float angle = ms / 2000.0f;
+    return Vector{3 + 2 * cosf(angle), 3 + 2 * sinf(angle), 1.2f};
+}
+
+static float distance(const Vector &a, const Vector &b)
+{
+    return sqrtf((a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y) + (a.z - b.z) * (a.z - b.z));
+}
+
+static Vector noisy(const Vector &position, float sd)
+{
+    return Vector{position.x + sd * gaussian(), position.y + sd * gaussian(), position.z + sd * gaussian()};
+}
+
+typedef struct
+{
+    float rawRms;       // aiming at the last fix
+    float predictedRms; // aiming at predict(fix + lookAhead)
+    float predictedMax;
+    float reportedRms; // what getPredictionError() said it would be
+} Replay;
+
+/**
+ * A fix every 200 ms with 15 cm noise, a bad solve 1 m off every outlierEvery, and no fixes for a second every gapEvery.
+ * Scores where the motor would be pointed lookAhead after each fix against where the tag is by then.
+ */
+static Replay replay(PositionPredictor &predictor, uint32_t start, uint32_t duration, int outlierEvery, int gapEvery)
+{
+    const uint32_t lookAhead = predictor.getConfig().lookAhead;
+    Replay result = {0, 0, 0, 0};
+    int count = 0;
+    int index = 0;
+    for (uint32_t t = 0; t < duration; t += 200, index++)
+    {
+        if (gapEvery > 0 && index % gapEvery >= gapEvery - 5)
+        {
+            continue;
+        }
+        Vector fix = noisy(truth(t), 0.15f);
+        if (outlierEvery > 0 && index % outlierEvery == outlierEvery - 1)
+        {
+            fix.x += 1;
+        }
+        predictor.update(fix, start + t);
+        // the first few seconds are the filter settling
+        if (t < 3000)
+        {
+            continue;
+        }
+        Vector later = truth(t + lookAhead);
+        float raw = distance(fix, later);
+        float predicted = distance(predictor.predict(start + t + lookAhead), later);
+        float reported = predictor.getPredictionError(start + t + lookAhead);
+        result.rawRms += raw * raw;
+        result.predictedRms += predicted * predicted;
+        result.predictedMax = predicted > result.predictedMax ? predicted : result.predictedMax;
+        // 3 axes
+        result.reportedRms += 3 * reported * reported;
+        count++;
+    }
+    result.rawRms = sqrtf(result.rawRms / count);
+    result.predictedRms = sqrtf(result.predictedRms / count);
+    result.reportedRms = sqrtf(result.reportedRms / count);
+    return result;
+}
+
+static void report(const char *name, const Replay &result)
+{
+    char message[160];
+    snprintf(message, sizeof(message), "%s: last fix rms %.3f m, predicted rms %.3f m (max %.3f m, reported %.3f m)", name, result.rawRms,
+             result.predictedRms, result.predictedMax, result.reportedRms);
+    TEST_MESSAGE(message);
+}
+
+void setUp(void)
+{
+    seed = 1;
+}
+
+void tearDown(void) {}
+
+void test_first_fix_passes_through(void)
+{
+    PositionPredictor predictor;
+    TEST_ASSERT_FALSE(predictor.hasFix());
+    predictor.update(Vector{1, 2, 3}, 1000);
+    TEST_ASSERT_TRUE(predictor.hasFix());
+    Vector predicted = predictor.predict(1300);
+    TEST_ASSERT_EQUAL_FLOAT(1, predicted.x);
+    TEST_ASSERT_EQUAL_FLOAT(2, predicted.y);
+    TEST_ASSERT_EQUAL_FLOAT(3, predicted.z);
+    TEST_ASSERT_EQUAL_FLOAT(0.15f, predictor.getPredictionError(1000));
+}
+
+void test_prediction_beats_last_fix(void)
+{
+    PositionPredictor predictor;
+    Replay result = replay(predictor, 1000, 120000, 0, 0);
+    report("clean", result);
+    TEST_ASSERT_TRUE(result.predictedRms < 0.85f * result.rawRms);
+    TEST_ASSERT_FLOAT_WITHIN(0.8f, 0, result.predictedMax);
+    // the reported error is the right size, not just a number
+    TEST_ASSERT_FLOAT_WITHIN(0.5f * result.predictedRms, result.predictedRms, result.reportedRms);
+}
+
+void test_outliers_and_gaps(void)
+{
+    PositionPredictor predictor;
+    // a bad solve 1 in 20, and a second without fixes every 6 s
+    Replay result = replay(predictor, 1000, 120000, 20, 30);
+    report("outliers and gaps", result);
+    TEST_ASSERT_TRUE(result.predictedRms < result.rawRms);
+    TEST_ASSERT_FLOAT_WITHIN(0.45f, 0, result.predictedRms);
+    TEST_ASSERT_TRUE(predictor.hasFix());
+}
+
+void test_velocity(void)
+{
+    PositionPredictor predictor;
+    // straight along y at 1.5 m/s, a single estimate is noisy with walking sized accelNoise so average the last 5 s
+    Vector velocity = {0, 0, 0};
+    for (uint32_t t = 0; t <= 10000; t += 200)
+    {
+        predictor.update(noisy(Vector{1, 1.5f * t / 1000, 1}, 0.15f), t);
+        if (t > 5000)
+        {
+            Vector v = predictor.getVelocity();
+            velocity = Vector{velocity.x + v.x / 25, velocity.y + v.y / 25, velocity.z + v.z / 25};
+        }
+    }
+    TEST_ASSERT_FLOAT_WITHIN(0.15f, 0, velocity.x);
+    TEST_ASSERT_FLOAT_WITHIN(0.15f, 1.5f, velocity.y);
+    TEST_ASSERT_FLOAT_WITHIN(0.15f, 0, velocity.z);
+    // ahead of the fix, and back in time just before it
+    float latest = predictor.getPosition().y;
+    float speed = predictor.getVelocity().y;
+    TEST_ASSERT_EQUAL_FLOAT(latest + 0.3f * speed, predictor.predict(10300).y);
+    TEST_ASSERT_EQUAL_FLOAT(latest - 0.1f * speed, predictor.predict(9900).y);
+    TEST_ASSERT_FLOAT_WITHIN(0.3f, 15.45f, predictor.predict(10300).y);
+}
+
+void test_long_gap_starts_over(void)
+{
+    PositionPredictor predictor;
+    for (uint32_t t = 0; t <= 5000; t += 200)
+    {
+        predictor.update(noisy(Vector{1.0f * t / 1000, 0, 1}, 0.15f), t);
+    }
+    // back after more than maxGap somewhere else, standing still
+    predictor.update(Vector{-2, 4, 1}, 5000 + 2001);
+    Vector predicted = predictor.predict(5000 + 2001 + 300);
+    TEST_ASSERT_EQUAL_FLOAT(-2, predicted.x);
+    TEST_ASSERT_EQUAL_FLOAT(4, predicted.y);
+    TEST_ASSERT_EQUAL_FLOAT(0, predictor.getVelocity().x);
+}
+
+void test_reset_starts_over(void)
+{
+    PositionPredictor predictor;
+    predictor.update(Vector{1, 1, 1}, 0);
+    predictor.update(Vector{2, 1, 1}, 200);
+    predictor.reset();
+    TEST_ASSERT_FALSE(predictor.hasFix());
+    predictor.update(Vector{5, 5, 5}, 400);
+    TEST_ASSERT_EQUAL_FLOAT(5, predictor.predict(700).x);
+}
+
+void test_error_grows_with_horizon(void)
+{
+    PositionPredictor predictor;
+    for (uint32_t t = 0; t <= 5000; t += 200)
+    {
+        predictor.update(noisy(truth(t), 0.15f), t);
+    }
+    float previous = predictor.getPredictionError(5000);
+    TEST_ASSERT_TRUE(previous < 0.15f);
+    for (uint32_t ahead = 100; ahead <= 2000; ahead += 100)
+    {
+        float error = predictor.getPredictionError(5000 + ahead);
+        TEST_ASSERT_TRUE(error > previous);
+        previous = error;
+    }
+}
+
+void test_millis_wrap(void)
+{
+    // the same fixes either side of millis() wrapping around give the same predictions
+    PositionPredictor before;
+    PositionPredictor across;
+    uint32_t start = 0xFFFFFFFF - 2500;
+    for (uint32_t t = 0; t <= 6000; t += 200)
+    {
+        Vector fix = noisy(truth(t), 0.15f);
+        before.update(fix, 1000 + t);
+        across.update(fix, start + t);
+        Vector expected = before.predict(1000 + t + 300);
+        Vector predicted = across.predict(start + t + 300);
+        TEST_ASSERT_EQUAL_FLOAT(expected.x, predicted.x);
+        TEST_ASSERT_EQUAL_FLOAT(expected.y, predicted.y);
+        float expectedError = before.getPredictionError(1000 + t + 300);
+        TEST_ASSERT_EQUAL_FLOAT(expectedError, across.getPredictionError(start + t + 300));
+    }
+    // the whole replay across the wrap scores the same as one that doesn't
+    seed = 1;
+    PositionPredictor plain;
+    Replay expected = replay(plain, 1000, 20000, 20, 30);
+    seed = 1;
+    PositionPredictor wrapped;
+    Replay result = replay(wrapped, 0xFFFFFFFF - 10000, 20000, 20, 30);
+    TEST_ASSERT_EQUAL_FLOAT(expected.predictedRms, result.predictedRms);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_first_fix_passes_through);
+    RUN_TEST(test_prediction_beats_last_fix);
+    RUN_TEST(test_outliers_and_gaps);
+    RUN_TEST(test_velocity);
+    RUN_TEST(test_long_gap_starts_over);
+    RUN_TEST(test_reset_starts_over);
+    RUN_TEST(test_error_grows_with_horizon);
+    RUN_TEST(test_millis_wrap);
+    return UNITY_END();
+}
@@ -0,0 +1,220 @@
+#include <unity.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "rangefilter.hpp"
+#include "../random.hpp"
+
+// someone walking to and fro in front of the anchor, m
+static float truth(uint32_t ms)
+{
+    return 5 + 2 * sinf(ms / 4000.0f);
+}
+
+typedef struct
+{
+    float rawRms;
+    float filteredRms;
+    float filteredMax;
+} Replay;
+
+/**
+ * A range every 100 ms with 5 cm noise, and a multipath outlier (always long, the direct path is blocked) every outlierEvery.
+ */
+static Replay replay(RangeFilter &filter, uint32_t start, uint32_t duration, int outlierEvery)
+{
+    Replay result = {0, 0, 0};
+    int count = 0;
+    for (uint32_t t = 0; t < duration; t += 100, count++)
+    {
+        float range = truth(t) + 0.05f * gaussian();
+        if (outlierEvery > 0 && count % outlierEvery == outlierEvery - 1)
+        {
+            range += 0.5f + 2.5f * uniform();
+        }
+        float filtered = filter.update(range, start + t);
+        float rawError = range - truth(t);
+        float error = filtered - truth(t);
+        result.rawRms += rawError * rawError;
+        // the first second is the filter settling
+        if (t >= 1000)
+        {
+            result.filteredRms += error * error;
+            result.filteredMax = fabsf(error) > result.filteredMax ? fabsf(error) : result.filteredMax;
+        }
+    }
+    result.rawRms = sqrtf(result.rawRms / count);
+    result.filteredRms = sqrtf(result.filteredRms / (count - 10));
+    return result;
+}
+
+void setUp(void)
+{
+    seed = 1;
+}
+
+void tearDown(void) {}
+
+void test_first_range_passes_through(void)
+{
+    RangeFilter filter;
+    TEST_ASSERT_EQUAL_FLOAT(4.2f, filter.update(4.2f, 1000));
+    TEST_ASSERT_EQUAL_FLOAT(4.2f, filter.getRange());
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.01f, filter.getVariance());
+    TEST_ASSERT_EQUAL_FLOAT(0, filter.getVelocity());
+}
+
+void test_noise_is_smoothed(void)
+{
+    // a tag standing still, with the noise the filter is set up for
+    RangeFilter filter;
+    float rawRms = 0;
+    float filteredRms = 0;
+    const int count = 600;
+    for (int i = 0; i < count; i++)
+    {
+        float range = 4 + 0.1f * gaussian();
+        float filtered = filter.update(range, 1000 + i * 100);
+        rawRms += (range - 4) * (range - 4);
+        filteredRms += (filtered - 4) * (filtered - 4);
+    }
+    rawRms = sqrtf(rawRms / count);
+    filteredRms = sqrtf(filteredRms / count);
+    char message[96];
+    snprintf(message, sizeof(message), "standing still: raw rms %.3f m, filtered rms %.3f m", rawRms, filteredRms);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_TRUE(filteredRms < 0.65f * rawRms);
+    TEST_ASSERT_TRUE(sqrtf(filter.getVariance()) < 0.1f);
+}
+
+void test_walking_lag(void)
+{
+    // the median's delay is what's left when the tag moves, it stays well under the noise the filter gets rid of
+    RangeFilter filter;
+    Replay result = replay(filter, 1000, 60000, 0);
+    char message[96];
+    snprintf(message, sizeof(message), "walking: raw rms %.3f m, filtered rms %.3f m, max %.3f m", result.rawRms, result.filteredRms,
+             result.filteredMax);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_FLOAT_WITHIN(0.1f, 0, result.filteredRms);
+    TEST_ASSERT_FLOAT_WITHIN(0.25f, 0, result.filteredMax);
+}
+
+void test_outliers_are_rejected(void)
+{
+    RangeFilter filter;
+    // one in 4 is more than the median of 5 can ever let through
+    Replay result = replay(filter, 1000, 60000, 4);
+    char message[96];
+    snprintf(message, sizeof(message), "1 in 4 outliers: raw rms %.3f m, filtered rms %.3f m, max %.3f m", result.rawRms, result.filteredRms,
+             result.filteredMax);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_FLOAT_WITHIN(0.1f, 0, result.filteredRms);
+    TEST_ASSERT_FLOAT_WITHIN(0.3f, 0, result.filteredMax);
+    TEST_ASSERT_TRUE(result.rawRms > 5 * result.filteredRms);
+}
+
+void test_velocity_follows_the_tag(void)
+{
+    RangeFilter filter;
+    // walking straight away at 1 m/s
+    for (uint32_t t = 0; t <= 10000; t += 100)
+    {
+        filter.update(2 + t / 1000.0f + 0.05f * gaussian(), t);
+    }
+    TEST_ASSERT_FLOAT_WITHIN(0.2f, 1, filter.getVelocity());
+    TEST_ASSERT_FLOAT_WITHIN(0.2f, 12, filter.getRange());
+}
+
+void test_short_gap_keeps_going(void)
+{
+    RangeFilter filter;
+    for (uint32_t t = 0; t <= 5000; t += 100)
+    {
+        filter.update(2 + t / 1000.0f, t);
+    }
+    // a few lost ranges while the tag kept walking: the window still holds the old ranges,
+    // but the velocity is kept and it has caught up again once the window has turned over
+    float range = 0;
+    for (uint32_t t = 7000; t < 7000 + RangeFilter::WINDOW * 100; t += 100)
+    {
+        range = filter.update(2 + t / 1000.0f, t);
+    }
+    TEST_ASSERT_FLOAT_WITHIN(0.3f, 2 + 7.4f, range);
+    TEST_ASSERT_FLOAT_WITHIN(0.3f, 1, filter.getVelocity());
+}
+
+void test_long_gap_starts_over(void)
+{
+    RangeFilter filter;
+    for (uint32_t t = 0; t <= 5000; t += 100)
+    {
+        filter.update(3 + 0.05f * gaussian(), t);
+    }
+    // the tag comes back somewhere else after more than maxGap, nothing of before should drag on it
+    TEST_ASSERT_EQUAL_FLOAT(8, filter.update(8, 5000 + 5001));
+    TEST_ASSERT_EQUAL_FLOAT(0, filter.getVelocity());
+    // the old ranges are out of the median window too
+    TEST_ASSERT_FLOAT_WITHIN(0.05f, 8, filter.update(8.02f, 5000 + 5101));
+}
+
+void test_reset_starts_over(void)
+{
+    RangeFilter filter;
+    filter.update(3, 0);
+    filter.update(3, 100);
+    filter.reset();
+    TEST_ASSERT_EQUAL_FLOAT(6, filter.update(6, 200));
+}
+
+void test_millis_wrap(void)
+{
+    // the same ranges either side of millis() wrapping around give the same output
+    RangeFilter before;
+    RangeFilter across;
+    uint32_t start = 0xFFFFFFFF - 2500;
+    for (uint32_t t = 0; t <= 6000; t += 100)
+    {
+        float range = truth(t) + 0.05f * gaussian();
+        float expected = before.update(range, 1000 + t);
+        TEST_ASSERT_EQUAL_FLOAT(expected, across.update(range, start + t));
+    }
+    // and a long gap across the wrap is still a long gap
+    TEST_ASSERT_EQUAL_FLOAT(1, across.update(1, start + 6000 + 6000));
+}
+
+void test_step_settles(void)
+{
+    RangeFilter filter;
+    for (uint32_t t = 0; t < 3000; t += 100)
+    {
+        filter.update(4, t);
+    }
+    // someone stepped in front of the anchor for good: the median holds out for half a window, then the filter follows
+    int updates = 0;
+    for (uint32_t t = 3000; fabsf(filter.update(3, t) - 3) > 0.1f; t += 100)
+    {
+        updates++;
+        TEST_ASSERT_TRUE(updates < 30);
+    }
+    char message[64];
+    snprintf(message, sizeof(message), "1 m step within 10 cm after %d ranges", updates + 1);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_TRUE(updates >= RangeFilter::WINDOW / 2);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_first_range_passes_through);
+    RUN_TEST(test_noise_is_smoothed);
+    RUN_TEST(test_walking_lag);
+    RUN_TEST(test_outliers_are_rejected);
+    RUN_TEST(test_velocity_follows_the_tag);
+    RUN_TEST(test_short_gap_keeps_going);
+    RUN_TEST(test_long_gap_starts_over);
+    RUN_TEST(test_reset_starts_over);
+    RUN_TEST(test_millis_wrap);
+    RUN_TEST(test_step_settles);
+    return UNITY_END();
+}
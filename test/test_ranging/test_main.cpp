@@ -0,0 +1,309 @@
+#include <unity.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "ranging.hpp"
+#include "frame.hpp"
+#include "sim/simchannel.hpp"
+
+// distance light travels in one DW1000 time unit, m
+static const double DISTANCE_PER_TICK = 0.0046917639786159;
+static const double TICKS_PER_US = 63897.6;
+static const uint64_t TIMESTAMP_MASK = 0xFFFFFFFFFFULL;
+
+/**
+ * The six timestamps of an exchange between a tag and an anchor range m apart, each crystal ppm fast, with the replies
+ * taking the given us on the replier's own clock. Both clocks start close to the 40 bit wrap so the exchange crosses it.
+ */
+typedef struct
+{
+    uint64_t pollSent;
+    uint64_t pollReceived;
+    uint64_t responseSent;
+    uint64_t responseReceived;
+    uint64_t finalSent;
+    uint64_t finalReceived;
+} Exchange;
+
+static uint64_t timestamp(double ticks)
+{
+    return (uint64_t)llround(ticks) & TIMESTAMP_MASK;
+}
+
+static Exchange exchange(double range, double tagPpm, double anchorPpm, double responseUs = TwoWayRanging::RESPONSE_DELAY_US,
+                         double finalUs = TwoWayRanging::FINAL_DELAY_US)
+{
+    const double tagStart = TIMESTAMP_MASK - 100 * TICKS_PER_US;
+    const double anchorStart = TIMESTAMP_MASK - 700 * TICKS_PER_US;
+    const double tagRate = 1 + tagPpm * 1e-6;
+    const double anchorRate = 1 + anchorPpm * 1e-6;
+    const double tof = range / DISTANCE_PER_TICK;
+
+    // true time, in time units of a perfect crystal
+    double poll = 0;
+    double response = poll + tof + responseUs * TICKS_PER_US / anchorRate;
+    double final = response + tof + finalUs * TICKS_PER_US / tagRate;
+    Exchange e;
+    e.pollSent = timestamp(tagStart + poll * tagRate);
+    e.pollReceived = timestamp(anchorStart + (poll + tof) * anchorRate);
+    e.responseSent = timestamp(anchorStart + response * anchorRate);
+    e.responseReceived = timestamp(tagStart + (response + tof) * tagRate);
+    e.finalSent = timestamp(tagStart + final * tagRate);
+    e.finalReceived = timestamp(anchorStart + (final + tof) * anchorRate);
+    return e;
+}
+
+// how much faster the anchor's crystal runs than the tag's, what estimateClockOffset() is after
+static double offsetOf(double tagPpm, double anchorPpm)
+{
+    return ((1 + anchorPpm * 1e-6) / (1 + tagPpm * 1e-6) - 1) * 1e6;
+}
+
+static double rangeOf(const Exchange &e, double clockOffset)
+{
+    return TwoWayRanging::computeRange(e.pollSent, e.pollReceived, e.responseSent, e.responseReceived, e.finalSent, e.finalReceived, clockOffset);
+}
+
+static bool fromFinal(const Exchange &e, float carrierOffset, double *range, double *clockOffset)
+{
+    return TwoWayRanging::rangeFromFinal(e.pollSent, e.pollReceived, e.responseSent, e.responseReceived, e.finalSent, e.finalReceived,
+                                         carrierOffset, range, clockOffset);
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_range_without_drift(void)
+{
+    const double ranges[] = {0.3, 5, 42.7};
+    for (uint8_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++)
+    {
+        // whole time unit timestamps are good to about a mm
+        TEST_ASSERT_FLOAT_WITHIN(0.003, ranges[i], rangeOf(exchange(ranges[i], 0, 0), 0));
+        TEST_ASSERT_FLOAT_WITHIN(0.003, ranges[i], rangeOf(exchange(ranges[i], 0, 0, 500, 3000), 0));
+    }
+}
+
+void test_range_with_drift(void)
+{
+    // a crystal at either end of the DW1000's 20 ppm, both ways round, and reply times far apart
+    const double drifts[][2] = {{20, -20}, {-20, 20}, {20, 20}, {-20, 0}};
+    for (uint8_t i = 0; i < sizeof(drifts) / sizeof(drifts[0]); i++)
+    {
+        Exchange e = exchange(12, drifts[i][0], drifts[i][1], 300, 5000);
+        double offset = offsetOf(drifts[i][0], drifts[i][1]);
+        double corrected = rangeOf(e, offset);
+        double uncorrected = rangeOf(e, 0);
+        char message[128];
+        snprintf(message, sizeof(message), "tag %+.0f ppm, anchor %+.0f ppm: %.4f m corrected, %.4f m without", drifts[i][0], drifts[i][1], corrected,
+                 uncorrected);
+        TEST_MESSAGE(message);
+        // what's left is the anchor's own crystal error on 12 m, 0.24 mm
+        TEST_ASSERT_FLOAT_WITHIN(0.003, 12, corrected);
+        // the asymmetric formula cancels nearly all of the offset even with replies this uneven
+        TEST_ASSERT_FLOAT_WITHIN(0.003, 12, uncorrected);
+    }
+}
+
+void test_estimate_clock_offset(void)
+{
+    const double drifts[][2] = {{0, 0}, {20, -20}, {-20, 20}, {-13.5, 4}, {7, 7}};
+    for (uint8_t i = 0; i < sizeof(drifts) / sizeof(drifts[0]); i++)
+    {
+        Exchange e = exchange(8, drifts[i][0], drifts[i][1]);
+        double estimated = TwoWayRanging::estimateClockOffset(e.pollSent, e.pollReceived, e.finalSent, e.finalReceived);
+        // a time unit over the 1 ms from poll to final is 0.016 ppm
+        TEST_ASSERT_FLOAT_WITHIN(0.05, offsetOf(drifts[i][0], drifts[i][1]), estimated);
+    }
+    // the flight time cancels out
+    Exchange near = exchange(1, 10, 0);
+    Exchange far = exchange(80, 10, 0);
+    TEST_ASSERT_FLOAT_WITHIN(0.05, TwoWayRanging::estimateClockOffset(near.pollSent, near.pollReceived, near.finalSent, near.finalReceived),
+                             TwoWayRanging::estimateClockOffset(far.pollSent, far.pollReceived, far.finalSent, far.finalReceived));
+    // no span to measure over
+    TEST_ASSERT_EQUAL_FLOAT(0, TwoWayRanging::estimateClockOffset(100, 200, 100, 300));
+}
+
+void test_implausible_offset_is_rejected(void)
+{
+    double range = -1;
+    double clockOffset = 0;
+    // 45 ppm apart is two crystals at the ends of their tolerance
+    TEST_ASSERT_TRUE(fromFinal(exchange(6, 25, -20), NAN, &range, &clockOffset));
+    TEST_ASSERT_FLOAT_WITHIN(0.05, offsetOf(25, -20), clockOffset);
+    TEST_ASSERT_FLOAT_WITHIN(0.003, 6, range);
+
+    // 55 ppm isn't, the offset is still reported for the stats
+    range = -1;
+    TEST_ASSERT_FALSE(fromFinal(exchange(6, 30, -25), NAN, &range, &clockOffset));
+    TEST_ASSERT_FLOAT_WITHIN(0.05, offsetOf(30, -25), clockOffset);
+    TEST_ASSERT_EQUAL_FLOAT(-1, range);
+    TEST_ASSERT_FALSE(fromFinal(exchange(6, -30, 25), NAN, &range, &clockOffset));
+
+    // a final sent timestamp 100 ns out looks like a 100 ppm crystal
+    Exchange e = exchange(6, 0, 0);
+    e.finalSent = (e.finalSent + (uint64_t)(0.1 * TICKS_PER_US)) & TIMESTAMP_MASK;
+    TEST_ASSERT_FALSE(fromFinal(e, NAN, &range, &clockOffset));
+
+    TEST_ASSERT_TRUE(TwoWayRanging::isClockOffsetPlausible(49.9));
+    TEST_ASSERT_FALSE(TwoWayRanging::isClockOffsetPlausible(50));
+    TEST_ASSERT_FALSE(TwoWayRanging::isClockOffsetPlausible(-50));
+}
+
+void test_carrier_disagreement_is_rejected(void)
+{
+    // the tag 12 ppm fast: its carrier looks +12 ppm to the anchor
+    Exchange e = exchange(6, 12, 0);
+    double range;
+    double clockOffset;
+    TEST_ASSERT_TRUE(fromFinal(e, 12.0f + 1.9f, &range, &clockOffset));
+    TEST_ASSERT_FALSE(fromFinal(e, 12.0f + 2.1f, &range, &clockOffset));
+    TEST_ASSERT_FALSE(fromFinal(e, 12.0f - 2.1f, &range, &clockOffset));
+
+    // a final received timestamp 3 ns late only moves the estimate 3 ppm, too little for the plausibility check
+    // but caught by the carrier, and it puts 22 cm on the range
+    e.finalReceived = (e.finalReceived + 192) & TIMESTAMP_MASK;
+    TEST_ASSERT_TRUE(fromFinal(e, NAN, &range, &clockOffset));
+    TEST_ASSERT_FLOAT_WITHIN(0.03, 6.22, range);
+    TEST_ASSERT_FALSE(fromFinal(e, 12.0f, &range, &clockOffset));
+
+    TEST_ASSERT_TRUE(TwoWayRanging::isClockOffsetConsistent(10, 11.9));
+    TEST_ASSERT_FALSE(TwoWayRanging::isClockOffsetConsistent(10, 12));
+}
+
+void test_carrier_offset_sign(void)
+{
+    // carrierOffset is how much faster the sender runs than us, the clock offset the other way round
+    Exchange e = exchange(20, 15, 0, 300, 5000);
+    double range;
+    double clockOffset;
+    TEST_ASSERT_TRUE(fromFinal(e, 15.0f, &range, &clockOffset));
+    TEST_ASSERT_EQUAL_FLOAT(-15, clockOffset);
+    TEST_ASSERT_FLOAT_WITHIN(0.003, 20, range);
+    // the wrong sign is 30 ppm out from the timestamps
+    TEST_ASSERT_FALSE(fromFinal(e, -15.0f, &range, &clockOffset));
+
+    // the carrier's offset is the one used, within MAX_CLOCK_DISAGREEMENT of the timestamps'
+    TEST_ASSERT_TRUE(fromFinal(e, 16.0f, &range, &clockOffset));
+    TEST_ASSERT_EQUAL_FLOAT(-16, clockOffset);
+    TEST_ASSERT_EQUAL_FLOAT(rangeOf(e, -16), range);
+}
+
+/**
+ * A whole exchange over SimChannel, whose radios report the carrier offset the way the DW1000's integrator does.
+ */
+#define STEP_US 20
+
+struct Node
+{
+    SimRadio *radio;
+    TwoWayRanging *ranging;
+    FramePool<4> frames;
+};
+
+static SimChannel *channel;
+
+// DW1000::processRadioEvents()
+static void processRadioEvents(Node &node)
+{
+    Radio::Event event;
+    while ((event = node.radio->pollEvent()) != Radio::NONE)
+    {
+        if (event == Radio::TRANSMIT_DONE)
+        {
+            node.ranging->onTransmitDone(channel->micros());
+        }
+        else if (event == Radio::RECEIVE_DONE)
+        {
+            Frame *frame = node.frames.acquire();
+            if (frame != nullptr)
+            {
+                frame->length = node.radio->getReceivedFrame(frame->data, sizeof(frame->data), &frame->received);
+                frame->carrierOffset = node.radio->getCarrierOffset();
+                // SimRadio has no receive power, each frame gets its own from its length
+                frame->rxPower = -70.0f - frame->length;
+                if (frame->length > 0)
+                {
+                    node.frames.commit();
+                }
+            }
+        }
+    }
+
+    Frame *frame;
+    while ((frame = node.frames.front()) != nullptr)
+    {
+        node.ranging->onReceive(frame->data, frame->length, frame->received, channel->micros(), frame->carrierOffset, frame->rxPower);
+        node.frames.release();
+    }
+    node.ranging->tick(channel->micros());
+    if (!node.radio->isTransmitting() && !node.radio->isReceiving())
+    {
+        node.radio->startReceive();
+    }
+}
+
+static float correctedPower;
+
+static double correction(double range, float rxPower)
+{
+    correctedPower = rxPower;
+    return range + 0.5;
+}
+
+void test_exchange_over_the_channel(void)
+{
+    channel = new SimChannel(3);
+    SimChannel::Config config = {0, 0, 130, 6.8e6f};
+    channel->setConfig(config);
+    const uint8_t anchorEui[8] = {0xA0, 0xD1, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7};
+    const uint8_t tagEui[8] = {0x10, 0xD1, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7};
+    Node anchor;
+    Node tag;
+    anchor.radio = channel->addNode(0, 0, 2.5f, -18);
+    tag.radio = channel->addNode(9, 4, 1, 17);
+    anchor.ranging = new TwoWayRanging(*anchor.radio);
+    tag.ranging = new TwoWayRanging(*tag.radio);
+    anchor.ranging->setEUI(anchorEui);
+    anchor.ranging->setRangeCorrection(correction);
+    tag.ranging->setEUI(tagEui);
+    correctedPower = 0;
+    processRadioEvents(anchor);
+    processRadioEvents(tag);
+
+    TEST_ASSERT_TRUE(tag.ranging->startTag(TwoWayRanging::shortId(anchorEui), channel->micros()));
+    while (!tag.ranging->isFinished())
+    {
+        channel->advance(STEP_US);
+        processRadioEvents(anchor);
+        processRadioEvents(tag);
+    }
+    TEST_ASSERT_EQUAL(TwoWayRanging::SUCCEEDED, tag.ranging->getState());
+    TEST_ASSERT_EQUAL(TwoWayRanging::SUCCEEDED, anchor.ranging->getState());
+    float distance = SimChannel::distance(tag.radio, anchor.radio) + 0.5f;
+    // the report carries cm
+    TEST_ASSERT_FLOAT_WITHIN(0.02f, distance, anchor.ranging->getRange());
+    TEST_ASSERT_FLOAT_WITHIN(0.02f, distance, tag.ranging->getReport().range);
+    // the correction had the FINAL's own power, not whatever came in last
+    TEST_ASSERT_EQUAL_FLOAT(-70.0f - TwoWayRanging::FINAL_LENGTH, correctedPower);
+    TEST_ASSERT_EQUAL_FLOAT(-70.0f - TwoWayRanging::FINAL_LENGTH, anchor.ranging->getReceivePower());
+    // the anchor runs 35 ppm slower than the tag, and the carrier check passed to get here
+    TEST_ASSERT_FLOAT_WITHIN(0.5f, offsetOf(17, -18), anchor.ranging->getClockOffset());
+
+    delete anchor.ranging;
+    delete tag.ranging;
+    delete channel;
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_range_without_drift);
+    RUN_TEST(test_range_with_drift);
+    RUN_TEST(test_estimate_clock_offset);
+    RUN_TEST(test_implausible_offset_is_rejected);
+    RUN_TEST(test_carrier_disagreement_is_rejected);
+    RUN_TEST(test_carrier_offset_sign);
+    RUN_TEST(test_exchange_over_the_channel);
+    return UNITY_END();
+}
@@ -0,0 +1,357 @@
+#include <unity.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "tdma.hpp"
+#include "ranging.hpp"
+#include "frame.hpp"
+#include "sim/simchannel.hpp"
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_assign_and_find(void)
+{
+    Superframe superframe(4, 50);
+    TEST_ASSERT_EQUAL_UINT8(1, superframe.assign(0x1001));
+    TEST_ASSERT_EQUAL_UINT8(2, superframe.assign(0x1002));
+    // asking again keeps the slot
+    TEST_ASSERT_EQUAL_UINT8(1, superframe.assign(0x1001));
+    TEST_ASSERT_EQUAL_UINT8(3, superframe.assign(0x1003));
+    // 3 tag slots on top of the contention slot, the 4th tag has to wait
+    TEST_ASSERT_EQUAL_UINT8(Superframe::CONTENTION_SLOT, superframe.assign(0x1004));
+    TEST_ASSERT_EQUAL_UINT8(2, superframe.findSlot(0x1002));
+    TEST_ASSERT_EQUAL_UINT8(Superframe::CONTENTION_SLOT, superframe.findSlot(0x1004));
+    TEST_ASSERT_EQUAL_UINT8(Superframe::CONTENTION_SLOT, superframe.assign(Superframe::NO_TAG));
+    TEST_ASSERT_EQUAL_UINT32(150, superframe.getSlotOffset(3));
+    TEST_ASSERT_EQUAL_UINT32(200, superframe.getLength());
+}
+
+void test_slot_count_is_clamped(void)
+{
+    TEST_ASSERT_EQUAL_UINT8(2, Superframe(0, 50).getSlotCount());
+    TEST_ASSERT_EQUAL_UINT8(Superframe::MAX_SLOTS, Superframe(200, 50).getSlotCount());
+}
+
+void test_quiet_tags_lose_their_slot(void)
+{
+    Superframe superframe(3, 50);
+    superframe.assign(0x1001);
+    superframe.assign(0x1002);
+    // run the sequence past 255 on the way, the expiry is unsigned maths
+    for (int i = 0; i < 300; i++)
+    {
+        superframe.markSeen(0x1001);
+        superframe.next();
+    }
+    TEST_ASSERT_EQUAL_UINT8(1, superframe.findSlot(0x1001));
+    TEST_ASSERT_EQUAL_UINT8(Superframe::CONTENTION_SLOT, superframe.findSlot(0x1002));
+    TEST_ASSERT_EQUAL_UINT8(2, superframe.assign(0x1003));
+}
+
+void test_beacon_round_trip(void)
+{
+    Superframe coordinator(6, 30);
+    coordinator.assign(0x1001);
+    coordinator.assign(0xBEEF);
+    coordinator.next();
+
+    uint8_t payload[Superframe::MAX_BEACON_PAYLOAD];
+    size_t length = coordinator.encodeBeacon(payload, sizeof(payload));
+    TEST_ASSERT_EQUAL_UINT32(4 + 5 * 2, length);
+
+    Superframe tag;
+    TEST_ASSERT_TRUE(tag.decodeBeacon(payload, length));
+    TEST_ASSERT_EQUAL_UINT8(coordinator.getSequence(), tag.getSequence());
+    TEST_ASSERT_EQUAL_UINT8(6, tag.getSlotCount());
+    TEST_ASSERT_EQUAL_UINT16(30, tag.getSlotLength());
+    TEST_ASSERT_EQUAL_UINT8(2, tag.findSlot(0xBEEF));
+    TEST_ASSERT_EQUAL_UINT8(Superframe::CONTENTION_SLOT, tag.findSlot(0x1002));
+
+    TEST_ASSERT_EQUAL_UINT32(0, coordinator.encodeBeacon(payload, length - 1));
+}
+
+void test_malformed_beacons_are_ignored(void)
+{
+    Superframe superframe(4, 50);
+    superframe.assign(0x1001);
+    uint8_t payload[Superframe::MAX_BEACON_PAYLOAD] = {7, 4, 50, 0, 0x01, 0x10, 0, 0, 0, 0};
+    // too short for its own slot count, too few slots, too many
+    TEST_ASSERT_FALSE(superframe.decodeBeacon(payload, 3));
+    TEST_ASSERT_FALSE(superframe.decodeBeacon(payload, 9));
+    payload[1] = 1;
+    TEST_ASSERT_FALSE(superframe.decodeBeacon(payload, sizeof(payload)));
+    payload[1] = Superframe::MAX_SLOTS + 1;
+    TEST_ASSERT_FALSE(superframe.decodeBeacon(payload, sizeof(payload)));
+    // a bad beacon leaves the schedule alone
+    TEST_ASSERT_EQUAL_UINT8(0, superframe.getSequence());
+    TEST_ASSERT_EQUAL_UINT8(1, superframe.findSlot(0x1001));
+}
+
+/**
+ * Collision simulator: N tags ranging 4 anchors one after the other with the real TwoWayRanging state machines
+ * over SimChannel, once with ALOHA spacing and once in TDMA slots, at the same mean update rate.
+ * Beacons aren't sent over the air, every tag already knows the schedule and the channel's clock is everyone's.
+ */
+
+#define ANCHORS 4
+#define MAX_TAGS 12
+#define STEP_US 20
+// ms, DW1000's SLOT_GUARD_TIME
+#define SLOT_GUARD 5
+
+typedef struct
+{
+    SimRadio *radio;
+    TwoWayRanging *ranging;
+    FramePool<4> frames;
+    uint8_t eui[8];
+    // tags only
+    int8_t sessionAnchor;
+    uint32_t nextSession; // us
+    uint32_t slotEnd;     // us, only if slotted
+    uint8_t sessionRanges;
+    uint32_t fixes;
+} Node;
+
+typedef struct
+{
+    uint32_t collided;
+    uint32_t attempts;
+    uint32_t successes;
+    float fixRate;    // fixes/s per tag, on average
+    float minFixRate; // of the worst off tag
+} CellResults;
+
+static SimChannel *channel;
+static bool slotted;
+static Node anchors[ANCHORS];
+static Node tags[MAX_TAGS];
+
+static void initNode(Node &node, SimRadio *radio, uint8_t id)
+{
+    node.radio = radio;
+    node.ranging = new TwoWayRanging(*radio);
+    for (uint8_t i = 0; i < 8; i++)
+    {
+        node.eui[i] = i == 0 ? id : 0xD0 + i;
+    }
+    node.ranging->setEUI(node.eui);
+    node.sessionAnchor = -1;
+    node.nextSession = 0;
+    node.fixes = 0;
+}
+
+// DW1000::processRadioEvents()
+static void processRadioEvents(Node &node)
+{
+    Radio::Event event;
+    while ((event = node.radio->pollEvent()) != Radio::NONE)
+    {
+        if (event == Radio::TRANSMIT_DONE)
+        {
+            node.ranging->onTransmitDone(channel->micros());
+        }
+        else if (event == Radio::RECEIVE_DONE)
+        {
+            Frame *frame = node.frames.acquire();
+            if (frame != nullptr)
+            {
+                frame->length = node.radio->getReceivedFrame(frame->data, sizeof(frame->data), &frame->received);
+                frame->carrierOffset = node.radio->getCarrierOffset();
+                if (frame->length > 0)
+                {
+                    node.frames.commit();
+                }
+            }
+        }
+    }
+
+    Frame *frame;
+    while ((frame = node.frames.front()) != nullptr)
+    {
+        node.ranging->onReceive(frame->data, frame->length, frame->received, channel->micros(), frame->carrierOffset);
+        node.frames.release();
+    }
+    node.ranging->tick(channel->micros());
+    if (!node.radio->isTransmitting() && !node.radio->isReceiving())
+    {
+        node.radio->startReceive();
+    }
+}
+
+static void handleAnchor(Node &node)
+{
+    processRadioEvents(node);
+    if (node.ranging->isFinished())
+    {
+        node.ranging->reset();
+    }
+}
+
+// a session is one exchange with every anchor, a fix needs them all
+static void handleTag(Node &node, CellResults &results)
+{
+    processRadioEvents(node);
+    uint32_t now = channel->micros();
+    if (node.sessionAnchor < 0)
+    {
+        if ((int32_t)(now - node.nextSession) < 0)
+        {
+            return;
+        }
+        node.sessionAnchor = 0;
+        node.sessionRanges = 0;
+    }
+
+    if (node.ranging->isFinished())
+    {
+        results.attempts++;
+        if (node.ranging->getState() == TwoWayRanging::SUCCEEDED)
+        {
+            results.successes++;
+            node.sessionRanges++;
+        }
+        node.ranging->reset();
+        node.sessionAnchor++;
+    }
+    if (!node.ranging->isBusy() && !node.radio->isTransmitting())
+    {
+        // DW1000::handle() doesn't start an exchange that could spill over into the next slot
+        if (node.sessionAnchor >= ANCHORS || (slotted && (int32_t)(now - node.slotEnd) >= 0))
+        {
+            if (node.sessionRanges == ANCHORS)
+            {
+                node.fixes++;
+            }
+            node.sessionAnchor = -1;
+            // the scheduler picks nextSession
+            node.nextSession = 0xFFFFFFFF;
+        }
+        else
+        {
+            node.ranging->startTag(TwoWayRanging::shortId(anchors[node.sessionAnchor].eui), now);
+        }
+    }
+}
+
+static CellResults runCell(bool tdma, int tagCount, int seconds)
+{
+    channel = new SimChannel(7);
+    slotted = tdma;
+    SimChannel::Config config = {0.01f, 0.05f, 130, 6.8e6f};
+    channel->setConfig(config);
+    const float corners[ANCHORS][3] = {{0, 0, 2.5f}, {10, 0, 2.5f}, {10, 10, 2.5f}, {0, 10, 2.5f}};
+    for (int i = 0; i < ANCHORS; i++)
+    {
+        initNode(anchors[i], channel->addNode(corners[i][0], corners[i][1], corners[i][2], (channel->random() * 2 - 1) * 10), 0xA0 + i);
+    }
+
+    // a slot per tag after the contention slot, 20 ms fits a 4 anchor session with room to spare
+    Superframe superframe(tagCount + 1, 20);
+    uint32_t superframeUs = superframe.getLength() * 1000;
+    for (int i = 0; i < tagCount; i++)
+    {
+        initNode(tags[i], channel->addNode(channel->random() * 10, channel->random() * 10, 1, (channel->random() * 2 - 1) * 10), 0x10 + i);
+        uint8_t slot = superframe.assign(TwoWayRanging::shortId(tags[i].eui));
+        TEST_ASSERT_NOT_EQUAL(Superframe::CONTENTION_SLOT, slot);
+        tags[i].nextSession = tdma ? superframe.getSlotOffset(slot) * 1000 : (uint32_t)(channel->random() * superframeUs);
+        if (tdma)
+        {
+            tags[i].slotEnd = tags[i].nextSession + (superframe.getSlotLength() - SLOT_GUARD) * 1000;
+        }
+    }
+
+    CellResults results = {0, 0, 0, 0, 0};
+    for (uint64_t t = 0; t < (uint64_t)seconds * 1000000; t += STEP_US)
+    {
+        channel->advance(STEP_US);
+        uint32_t now = channel->micros();
+        for (int i = 0; i < ANCHORS; i++)
+        {
+            handleAnchor(anchors[i]);
+        }
+        for (int i = 0; i < tagCount; i++)
+        {
+            Node &tag = tags[i];
+            bool wasRanging = tag.sessionAnchor >= 0;
+            handleTag(tag, results);
+            if (wasRanging && tag.sessionAnchor < 0)
+            {
+                if (tdma)
+                {
+                    // same slot in the next superframe
+                    uint8_t slot = superframe.findSlot(TwoWayRanging::shortId(tag.eui));
+                    tag.nextSession = (now / superframeUs + 1) * superframeUs + superframe.getSlotOffset(slot) * 1000;
+                    tag.slotEnd = tag.nextSession + (superframe.getSlotLength() - SLOT_GUARD) * 1000;
+                }
+                else
+                {
+                    // ALOHA, random spacing with the superframe's length on average
+                    tag.nextSession = now + superframeUs / 2 + (uint32_t)(channel->random() * superframeUs);
+                }
+            }
+        }
+    }
+
+    results.collided = channel->getStats().collided;
+    results.minFixRate = INFINITY;
+    for (int i = 0; i < tagCount; i++)
+    {
+        float rate = (float)tags[i].fixes / seconds;
+        results.fixRate += rate / tagCount;
+        results.minFixRate = rate < results.minFixRate ? rate : results.minFixRate;
+        delete tags[i].ranging;
+    }
+    for (int i = 0; i < ANCHORS; i++)
+    {
+        delete anchors[i].ranging;
+    }
+    delete channel;
+
+    char message[160];
+    snprintf(message, sizeof(message), "%s %d tags: %u collided frames, %u/%u exchanges, %.2f fixes/s per tag, %.2f for the worst",
+             tdma ? "TDMA " : "ALOHA", tagCount, results.collided, results.successes, results.attempts, results.fixRate, results.minFixRate);
+    TEST_MESSAGE(message);
+    return results;
+}
+
+void test_tdma_has_no_collisions(void)
+{
+    for (int tagCount = 2; tagCount <= 8; tagCount += 3)
+    {
+        CellResults results = runCell(true, tagCount, 10);
+        TEST_ASSERT_EQUAL_UINT32(0, results.collided);
+        // every tag gets its slot every superframe, only the 1% frame loss takes fixes away:
+        // 16 frames have to make it, 85% of sessions on average and a little less for the unluckiest tag
+        float expected = 1000.0f / ((tagCount + 1) * 20);
+        TEST_ASSERT_TRUE(results.minFixRate > expected * 0.65f);
+    }
+}
+
+void test_aloha_degrades_with_tags(void)
+{
+    CellResults few = runCell(false, 2, 10);
+    CellResults many = runCell(false, 8, 10);
+    CellResults tdma = runCell(true, 8, 10);
+    TEST_ASSERT_GREATER_THAN(0, many.collided);
+    float fewSuccess = (float)few.successes / few.attempts;
+    float manySuccess = (float)many.successes / many.attempts;
+    TEST_ASSERT_TRUE(fewSuccess > manySuccess);
+    // same offered load, TDMA turns it into fixes
+    TEST_ASSERT_TRUE(tdma.fixRate > many.fixRate);
+    TEST_ASSERT_TRUE(tdma.minFixRate > many.minFixRate);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_assign_and_find);
+    RUN_TEST(test_slot_count_is_clamped);
+    RUN_TEST(test_quiet_tags_lose_their_slot);
+    RUN_TEST(test_beacon_round_trip);
+    RUN_TEST(test_malformed_beacons_are_ignored);
+    RUN_TEST(test_tdma_has_no_collisions);
+    RUN_TEST(test_aloha_degrades_with_tags);
+    return UNITY_END();
+}
@@ -0,0 +1,407 @@
+#include <unity.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "tdoa.hpp"
+#include "../random.hpp"
+
+static const double TICKS_PER_SECOND = Tdoa::TICKS_PER_MS * 1000.0;
+static const uint64_t SYNC_TICKS = Tdoa::TICKS_PER_MS * Tdoa::SYNC_INTERVAL_MS;
+
+/**
+ * A crystal against true time, both in DW1000 time units. The count isn't wrapped, timestamp() does that, so the
+ * offsets can start the clocks just short of the 40 bit wrap.
+ */
+typedef struct
+{
+    double offset;
+    double ppm;
+    double slope; // ppm per second, for a crystal still warming up
+} Crystal;
+
+static double ticksAt(const Crystal &crystal, double t)
+{
+    double seconds = t / TICKS_PER_SECOND;
+    return crystal.offset + t + (crystal.ppm * seconds + crystal.slope * seconds * seconds / 2) * 1e-6 * TICKS_PER_SECOND;
+}
+
+static uint64_t timestamp(double ticks)
+{
+    return (uint64_t)llround(ticks) & Tdoa::TIMESTAMP_MASK;
+}
+
+static double driftAt(const Crystal &crystal, double t)
+{
+    return crystal.ppm + crystal.slope * t / TICKS_PER_SECOND;
+}
+
+typedef struct
+{
+    double worst; // timestamp units
+    double worstPpm;
+    bool synced;
+} ClockRun;
+
+/**
+ * An anchor tof units from the master gets a sync every SYNC_INTERVAL_MS for seconds, and is asked for the master's time
+ * of something it timestamped a quarter, half and three quarters of the way to the next one.
+ */
+static ClockRun runClock(const Crystal &master, const Crystal &local, double tof, double seconds)
+{
+    TdoaClock clock;
+    ClockRun run = {0, 0, true};
+    for (double t = 0; t < seconds * TICKS_PER_SECOND; t += SYNC_TICKS)
+    {
+        clock.update(timestamp(ticksAt(master, t)), timestamp(ticksAt(local, t + tof)), tof);
+        // the first two syncs are needed for a rate
+        if (t < 2 * SYNC_TICKS)
+        {
+            continue;
+        }
+        for (uint8_t quarter = 1; quarter < 4; quarter++)
+        {
+            double at = t + tof + quarter * SYNC_TICKS / 4.0;
+            uint64_t converted;
+            if (!clock.toMaster(timestamp(ticksAt(local, at)), &converted))
+            {
+                run.synced = false;
+                continue;
+            }
+            double error = fabs((double)Tdoa::difference(timestamp(ticksAt(master, at)), converted));
+            run.worst = error > run.worst ? error : run.worst;
+        }
+        // how much faster the master runs than us
+        double ppm = ((1 + driftAt(master, t) * 1e-6) / (1 + driftAt(local, t) * 1e-6) - 1) * 1e6;
+        double ppmError = fabs(clock.getDriftPpm() - ppm);
+        run.worstPpm = ppmError > run.worstPpm ? ppmError : run.worstPpm;
+    }
+    return run;
+}
+
+static float distance(const Tdoa::Point &a, const Tdoa::Point &b)
+{
+    return sqrtf((a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y) + (a.z - b.z) * (a.z - b.z));
+}
+
+static void eui(uint8_t index, uint8_t out[8])
+{
+    const uint8_t batch[8] = {0, 0x02, 0x01, 0x28, 0x6F, 0x24, 0x00, 0x00};
+    memcpy(out, batch, 8);
+    out[0] = 0x10 + index;
+}
+
+void setUp(void)
+{
+    seed = 1;
+}
+
+void tearDown(void) {}
+
+void test_difference_wraps(void)
+{
+    TEST_ASSERT_EQUAL_INT64(100, Tdoa::difference(1000, 1100));
+    TEST_ASSERT_EQUAL_INT64(-100, Tdoa::difference(1100, 1000));
+    // across the 40 bit wrap, either way round
+    TEST_ASSERT_EQUAL_INT64(300, Tdoa::difference(Tdoa::TIMESTAMP_MASK - 99, 200));
+    TEST_ASSERT_EQUAL_INT64(-300, Tdoa::difference(200, Tdoa::TIMESTAMP_MASK - 99));
+    // bits above the 40 don't count
+    TEST_ASSERT_EQUAL_INT64(5, Tdoa::difference(Tdoa::TIMESTAMP_MASK + 1 + 10, 15));
+}
+
+void test_clock_fixed_drift(void)
+{
+    // 40 bits are 17.2 s, both clocks wrap twice at different times, and the master runs 20.5 ppm fast
+    const Crystal master = {(double)Tdoa::TIMESTAMP_MASK - 1.5 * TICKS_PER_SECOND, 12.5, 0};
+    const Crystal local = {(double)Tdoa::TIMESTAMP_MASK - 4.2 * TICKS_PER_SECOND, -8, 0};
+    // anchors 7.3 m apart, not a whole number of time units
+    ClockRun run = runClock(master, local, 7.3 / Tdoa::DISTANCE_PER_TICK, 40);
+    char message[128];
+    snprintf(message, sizeof(message), "fixed drift: worst %.1f time units (%.1f cm) off the master, rate within %.4f ppm", run.worst,
+             run.worst * Tdoa::DISTANCE_PER_TICK * 100, run.worstPpm);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_TRUE(run.synced);
+    // only the whole unit timestamps are left
+    TEST_ASSERT_FLOAT_WITHIN(2, 0, run.worst);
+    TEST_ASSERT_FLOAT_WITHIN(0.001f, 0, run.worstPpm);
+}
+
+void test_clock_wandering_drift(void)
+{
+    // both crystals still warming up and pulling apart by 0.01 ppm a second, the most the simulation's do
+    const Crystal master = {(double)Tdoa::TIMESTAMP_MASK - 3 * TICKS_PER_SECOND, 5, 0.006};
+    const Crystal local = {1000, -3, -0.004};
+    ClockRun run = runClock(master, local, 4.0 / Tdoa::DISTANCE_PER_TICK, 40);
+    char message[128];
+    snprintf(message, sizeof(message), "wandering drift: worst %.1f time units (%.1f cm) off the master, rate within %.4f ppm", run.worst,
+             run.worst * Tdoa::DISTANCE_PER_TICK * 100, run.worstPpm);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_TRUE(run.synced);
+    // the smoothed rate lags about 1.5 sync intervals behind, 0.0015 ppm over 75 ms is 0.11 ns
+    TEST_ASSERT_FLOAT_WITHIN(0.002f, 0, run.worstPpm);
+    TEST_ASSERT_FLOAT_WITHIN(16, 0, run.worst);
+}
+
+void test_bad_sync_is_ignored(void)
+{
+    const Crystal master = {0, 10, 0};
+    const Crystal local = {5e9, 0, 0};
+    TdoaClock clock;
+    double t = 0;
+    for (uint8_t i = 0; i < 10; i++, t += SYNC_TICKS)
+    {
+        clock.update(timestamp(ticksAt(master, t)), timestamp(ticksAt(local, t)), 0);
+    }
+    TEST_ASSERT_FLOAT_WITHIN(0.001f, 10, clock.getDriftPpm());
+    // a sync timestamped 20 us out is a 200 ppm jump, and so is the one after it, back again
+    clock.update(timestamp(ticksAt(master, t) + 20 * Tdoa::TICKS_PER_MS / 1000), timestamp(ticksAt(local, t)), 0);
+    TEST_ASSERT_FLOAT_WITHIN(0.001f, 10, clock.getDriftPpm());
+    t += SYNC_TICKS;
+    clock.update(timestamp(ticksAt(master, t)), timestamp(ticksAt(local, t)), 0);
+    TEST_ASSERT_FLOAT_WITHIN(0.001f, 10, clock.getDriftPpm());
+    uint64_t converted;
+    TEST_ASSERT_TRUE(clock.toMaster(timestamp(ticksAt(local, t + SYNC_TICKS / 2)), &converted));
+    TEST_ASSERT_INT32_WITHIN(1, 0, Tdoa::difference(timestamp(ticksAt(master, t + SYNC_TICKS / 2)), converted));
+}
+
+void test_sync_goes_stale(void)
+{
+    TdoaClock clock;
+    uint64_t local = 0;
+    TEST_ASSERT_FALSE(clock.isSynced(local));
+    // one sync gives an offset but no rate yet
+    clock.update(0, local, 0);
+    TEST_ASSERT_FALSE(clock.isSynced(local));
+    uint64_t master;
+    TEST_ASSERT_FALSE(clock.toMaster(local, &master));
+
+    // the last sync just before the 40 bit wrap, so the gap is measured across it
+    local = Tdoa::TIMESTAMP_MASK - SYNC_TICKS;
+    clock.reset();
+    clock.update(0, local - SYNC_TICKS, 0);
+    clock.update(SYNC_TICKS, local, 0);
+    TEST_ASSERT_TRUE(clock.isSynced(local));
+    uint64_t last = (local + TdoaClock::MAX_SYNC_GAP - 1) & Tdoa::TIMESTAMP_MASK;
+    TEST_ASSERT_TRUE(last < local);
+    TEST_ASSERT_TRUE(clock.isSynced(last));
+    TEST_ASSERT_TRUE(clock.toMaster(last, &master));
+    TEST_ASSERT_EQUAL_UINT64(SYNC_TICKS + TdoaClock::MAX_SYNC_GAP - 1, master);
+    uint64_t stale = (local + TdoaClock::MAX_SYNC_GAP) & Tdoa::TIMESTAMP_MASK;
+    TEST_ASSERT_FALSE(clock.isSynced(stale));
+    TEST_ASSERT_FALSE(clock.toMaster(stale, &master));
+    // and the same before it
+    TEST_ASSERT_FALSE(clock.isSynced(local - TdoaClock::MAX_SYNC_GAP));
+
+    // syncs too far apart keep the offset but don't give a rate
+    clock.reset();
+    clock.update(0, 0, 0);
+    clock.update(TdoaClock::MAX_SYNC_GAP, TdoaClock::MAX_SYNC_GAP, 0);
+    TEST_ASSERT_FALSE(clock.isSynced(TdoaClock::MAX_SYNC_GAP));
+}
+
+/**
+ * Six anchors, each with its own drifting crystal and a TdoaClock against the master's sync blinks, and a tag blinking
+ * between the syncs. The solver gets nothing but the arrivals turned into master time.
+ */
+void test_solver_recovers_position(void)
+{
+    const uint8_t ANCHORS = 6;
+    const Tdoa::Point anchors[ANCHORS] = {{0, 0, 2.5f}, {6, 0, 1}, {6, 5, 2.5f}, {0, 5, 1}, {3, 0, 2.5f}, {3, 5, 1.2f}};
+    const Crystal crystals[ANCHORS] = {{(double)Tdoa::TIMESTAMP_MASK - 2 * TICKS_PER_SECOND, 0, 0}, {3e11, 12, 0.005},
+                                       {(double)Tdoa::TIMESTAMP_MASK - 7 * TICKS_PER_SECOND, -7, 0}, {0, 20, -0.005},
+                                       {8e11, -15, 0},                                               {1e9, 3, 0.01}};
+    TdoaClock clocks[ANCHORS];
+    TdoaSolver<ANCHORS> solver;
+    float worst = 0;
+    float squared = 0;
+    int fixes = 0;
+    for (double t = 0; t < 20 * TICKS_PER_SECOND; t += SYNC_TICKS)
+    {
+        // anchor 0 is the master, the others hear its sync after the surveyed distance
+        for (uint8_t a = 1; a < ANCHORS; a++)
+        {
+            double tof = distance(anchors[0], anchors[a]) / Tdoa::DISTANCE_PER_TICK;
+            clocks[a].update(timestamp(ticksAt(crystals[0], t)), timestamp(ticksAt(crystals[a], t + tof)), tof);
+        }
+        if (t < 2 * SYNC_TICKS)
+        {
+            continue;
+        }
+
+        // a tag blinks somewhere in the room between the syncs
+        Tdoa::Point tag = {0.5f + 5 * uniform(), 0.5f + 4 * uniform(), 0.5f + 1.5f * uniform()};
+        double blink = t + (0.1 + 0.8 * uniform()) * SYNC_TICKS;
+        uint64_t arrivals[ANCHORS];
+        for (uint8_t a = 0; a < ANCHORS; a++)
+        {
+            uint64_t local = timestamp(ticksAt(crystals[a], blink + distance(tag, anchors[a]) / Tdoa::DISTANCE_PER_TICK));
+            if (a == 0)
+            {
+                arrivals[a] = local;
+                continue;
+            }
+            TEST_ASSERT_TRUE(clocks[a].toMaster(local, &arrivals[a]));
+        }
+
+        solver.reset();
+        for (uint8_t a = 0; a < ANCHORS; a++)
+        {
+            solver.addMeasurement(anchors[a], (float)(Tdoa::difference(arrivals[0], arrivals[a]) * Tdoa::DISTANCE_PER_TICK));
+        }
+        TdoaSolver<ANCHORS>::Result result = solver.solve(solver.centroid());
+        TEST_ASSERT_TRUE(result.success);
+        float error = distance(result.position, tag);
+        worst = error > worst ? error : worst;
+        squared += error * error;
+        fixes++;
+    }
+    float rms = sqrtf(squared / fixes);
+    char message[128];
+    snprintf(message, sizeof(message), "%d fixes, rms %.1f cm, worst %.1f cm", fixes, rms * 100, worst * 100);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_FLOAT_WITHIN(0.03f, 0, rms);
+    TEST_ASSERT_FLOAT_WITHIN(0.1f, 0, worst);
+}
+
+void test_solver_needs_four_anchors(void)
+{
+    TdoaSolver<4> solver;
+    const Tdoa::Point anchors[5] = {{0, 0, 2}, {5, 0, 2}, {5, 5, 2}, {0, 5, 1}, {2, 2, 2}};
+    for (uint8_t a = 0; a < 3; a++)
+    {
+        solver.addMeasurement(anchors[a], 0);
+    }
+    TEST_ASSERT_FALSE(solver.solve(solver.centroid()).success);
+    TEST_ASSERT_TRUE(solver.addMeasurement(anchors[3], 0));
+    TEST_ASSERT_FALSE(solver.addMeasurement(anchors[4], 0));
+    TEST_ASSERT_EQUAL_UINT8(4, solver.getMeasurementCount());
+}
+
+void test_blink_and_sync_round_trip(void)
+{
+    uint8_t frame[Tdoa::SYNC_LENGTH];
+    uint8_t tag[8], decoded[8];
+    eui(3, tag);
+    TEST_ASSERT_EQUAL_UINT32(0, Tdoa::encodeBlink(9, tag, frame, Tdoa::BLINK_LENGTH - 1));
+    TEST_ASSERT_EQUAL_UINT32(Tdoa::BLINK_LENGTH, Tdoa::encodeBlink(200, tag, frame, sizeof(frame)));
+    uint8_t sequence = 0;
+    TEST_ASSERT_TRUE(Tdoa::decodeBlink(frame, Tdoa::BLINK_LENGTH, &sequence, decoded));
+    TEST_ASSERT_EQUAL_UINT8(200, sequence);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(tag, decoded, 8);
+    Tdoa::Sync sync;
+    TEST_ASSERT_FALSE(Tdoa::decodeSync(frame, Tdoa::BLINK_LENGTH, sync));
+    TEST_ASSERT_FALSE(Tdoa::decodeBlink(frame, Tdoa::BLINK_LENGTH - 1, &sequence, decoded));
+
+    Tdoa::Sync sent = {77, {0}, Tdoa::TIMESTAMP_MASK - 5, {-1.23f, 4.56f, 2.5f}};
+    eui(0, sent.masterEui);
+    TEST_ASSERT_EQUAL_UINT32(0, Tdoa::encodeSync(sent, frame, Tdoa::SYNC_LENGTH - 1));
+    TEST_ASSERT_EQUAL_UINT32(Tdoa::SYNC_LENGTH, Tdoa::encodeSync(sent, frame, sizeof(frame)));
+    TEST_ASSERT_TRUE(Tdoa::decodeSync(frame, Tdoa::SYNC_LENGTH, sync));
+    TEST_ASSERT_EQUAL_UINT8(77, sync.sequence);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(sent.masterEui, sync.masterEui, 8);
+    TEST_ASSERT_EQUAL_UINT64(sent.sent, sync.sent);
+    // to the cm
+    TEST_ASSERT_FLOAT_WITHIN(0.001f, -1.23f, sync.master.x);
+    TEST_ASSERT_FLOAT_WITHIN(0.001f, 4.56f, sync.master.y);
+    TEST_ASSERT_FLOAT_WITHIN(0.001f, 2.5f, sync.master.z);
+    TEST_ASSERT_FALSE(Tdoa::decodeBlink(frame, Tdoa::SYNC_LENGTH, &sequence, decoded));
+}
+
+void test_batch_round_trip(void)
+{
+    uint8_t anchor[8], decodedAnchor[8];
+    eui(1, anchor);
+    const Tdoa::Point position = {12.34f, -0.05f, 3};
+    Tdoa::Arrival arrivals[Tdoa::MAX_RECORDS + 1];
+    for (uint8_t i = 0; i < Tdoa::MAX_RECORDS + 1; i++)
+    {
+        eui(i, arrivals[i].tagEui);
+        arrivals[i].sequence = i * 7;
+        arrivals[i].arrival = ((uint64_t)nextRandom() << 16 ^ nextRandom()) & Tdoa::TIMESTAMP_MASK;
+    }
+    uint8_t batch[Tdoa::MAX_BATCH_LENGTH + Tdoa::RECORD_LENGTH];
+
+    const uint8_t counts[] = {0, 1, 5, Tdoa::MAX_RECORDS};
+    for (uint8_t c = 0; c < sizeof(counts); c++)
+    {
+        uint8_t count = counts[c];
+        size_t length = Tdoa::encodeBatch(anchor, position, arrivals, count, batch, sizeof(batch));
+        TEST_ASSERT_EQUAL_UINT32(Tdoa::BATCH_HEADER_LENGTH + count * Tdoa::RECORD_LENGTH, length);
+        Tdoa::Point decoded;
+        TEST_ASSERT_EQUAL_INT16(count, Tdoa::decodeBatch(batch, length, decodedAnchor, decoded));
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(anchor, decodedAnchor, 8);
+        TEST_ASSERT_FLOAT_WITHIN(0.001f, position.x, decoded.x);
+        TEST_ASSERT_FLOAT_WITHIN(0.001f, position.y, decoded.y);
+        TEST_ASSERT_FLOAT_WITHIN(0.001f, position.z, decoded.z);
+        for (uint8_t i = 0; i < count; i++)
+        {
+            Tdoa::Arrival arrival;
+            Tdoa::decodeRecord(batch, i, arrival);
+            TEST_ASSERT_EQUAL_UINT8_ARRAY(arrivals[i].tagEui, arrival.tagEui, 8);
+            TEST_ASSERT_EQUAL_UINT8(arrivals[i].sequence, arrival.sequence);
+            TEST_ASSERT_EQUAL_UINT64(arrivals[i].arrival, arrival.arrival);
+        }
+    }
+
+    // too many records, or not enough room for them
+    TEST_ASSERT_EQUAL_UINT32(0, Tdoa::encodeBatch(anchor, position, arrivals, Tdoa::MAX_RECORDS + 1, batch, sizeof(batch)));
+    TEST_ASSERT_EQUAL_UINT32(0, Tdoa::encodeBatch(anchor, position, arrivals, 3, batch, Tdoa::BATCH_HEADER_LENGTH + 2 * Tdoa::RECORD_LENGTH));
+}
+
+void test_malformed_batches(void)
+{
+    uint8_t anchor[8];
+    eui(1, anchor);
+    const Tdoa::Point position = {1, 2, 3};
+    Tdoa::Arrival arrivals[3];
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        eui(i, arrivals[i].tagEui);
+        arrivals[i].sequence = i;
+        arrivals[i].arrival = i * 1000;
+    }
+    uint8_t batch[Tdoa::MAX_BATCH_LENGTH + 1];
+    size_t length = Tdoa::encodeBatch(anchor, position, arrivals, 3, batch, sizeof(batch));
+    uint8_t decodedAnchor[8];
+    Tdoa::Point decoded;
+    TEST_ASSERT_EQUAL_INT16(3, Tdoa::decodeBatch(batch, length, decodedAnchor, decoded));
+
+    // cut short, a byte over, or shorter than the header
+    TEST_ASSERT_EQUAL_INT16(-1, Tdoa::decodeBatch(batch, length - 1, decodedAnchor, decoded));
+    TEST_ASSERT_EQUAL_INT16(-1, Tdoa::decodeBatch(batch, length + 1, decodedAnchor, decoded));
+    TEST_ASSERT_EQUAL_INT16(-1, Tdoa::decodeBatch(batch, Tdoa::BATCH_HEADER_LENGTH - 1, decodedAnchor, decoded));
+    TEST_ASSERT_EQUAL_INT16(-1, Tdoa::decodeBatch(batch, 0, decodedAnchor, decoded));
+
+    // a count that doesn't match the length
+    batch[15] = 4;
+    TEST_ASSERT_EQUAL_INT16(-1, Tdoa::decodeBatch(batch, length, decodedAnchor, decoded));
+    batch[15] = 2;
+    TEST_ASSERT_EQUAL_INT16(-1, Tdoa::decodeBatch(batch, length, decodedAnchor, decoded));
+    // more records than anyone sends, even if the length agrees
+    batch[15] = Tdoa::MAX_RECORDS + 1;
+    TEST_ASSERT_EQUAL_INT16(-1, Tdoa::decodeBatch(batch, Tdoa::BATCH_HEADER_LENGTH + (Tdoa::MAX_RECORDS + 1) * Tdoa::RECORD_LENGTH,
+                                                  decodedAnchor, decoded));
+    batch[15] = 3;
+
+    // another version
+    batch[0] = Tdoa::VERSION + 1;
+    TEST_ASSERT_EQUAL_INT16(-1, Tdoa::decodeBatch(batch, length, decodedAnchor, decoded));
+    batch[0] = Tdoa::VERSION;
+    TEST_ASSERT_EQUAL_INT16(3, Tdoa::decodeBatch(batch, length, decodedAnchor, decoded));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_difference_wraps);
+    RUN_TEST(test_clock_fixed_drift);
+    RUN_TEST(test_clock_wandering_drift);
+    RUN_TEST(test_bad_sync_is_ignored);
+    RUN_TEST(test_sync_goes_stale);
+    RUN_TEST(test_solver_recovers_position);
+    RUN_TEST(test_solver_needs_four_anchors);
+    RUN_TEST(test_blink_and_sync_round_trip);
+    RUN_TEST(test_batch_round_trip);
+    RUN_TEST(test_malformed_batches);
+    return UNITY_END();
+}
@@ -0,0 +1,196 @@
+#include <unity.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+
+#include "telemetry.hpp"
+
+static const uint8_t ANCHOR_MAC[6] = {0x24, 0x6F, 0x28, 0x01, 0x02, 0x03};
+
+// EUIs as DW1000 has them: 2 dummy bytes and then the tag's mac, reversed
+static void tagEui(uint8_t index, uint8_t eui[8])
+{
+    const uint8_t eui0[8] = {0x03, 0x02, 0x01, 0x28, 0x6F, 0x24, 0x00, 0x00};
+    memcpy(eui, eui0, 8);
+    eui[0] = 0x10 + index;
+}
+
+static TelemetryBatch::Record record(uint8_t index, float distance, uint32_t timestamp)
+{
+    TelemetryBatch::Record record;
+    tagEui(index, record.tagEui);
+    record.distance = distance;
+    record.variance = 0.0004f;
+    record.timestamp = timestamp;
+    record.rxPower = -81.25f;
+    record.sequence = index * 3;
+    return record;
+}
+
+static uint32_t readValue(const uint8_t *bytes, uint8_t n)
+{
+    uint32_t value = 0;
+    for (uint8_t i = 0; i < n; i++)
+    {
+        value |= (uint32_t)bytes[i] << (i * 8);
+    }
+    return value;
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_frame_layout(void)
+{
+    TelemetryBatch batch;
+    batch.setAnchorMac(ANCHOR_MAC);
+    TEST_ASSERT_TRUE(batch.add(record(0, 3.2345f, 99900)));
+    TEST_ASSERT_TRUE(batch.add(record(1, 12.5f, 99990)));
+
+    uint8_t frame[TelemetryBatch::MAX_FRAME_LENGTH];
+    size_t length = batch.encode(100000, frame, sizeof(frame));
+    TEST_ASSERT_EQUAL_UINT32(TelemetryBatch::HEADER_LENGTH + 2 * TelemetryBatch::RECORD_LENGTH, length);
+    TEST_ASSERT_EQUAL_UINT8(0, batch.getCount());
+
+    TEST_ASSERT_EQUAL_UINT8(TelemetryBatch::VERSION, frame[0]);
+    TEST_ASSERT_EQUAL_UINT8(0, frame[1]);
+    TEST_ASSERT_EQUAL_UINT8(2, frame[2]);
+    TEST_ASSERT_EQUAL_MEMORY(ANCHOR_MAC, &frame[3], 6);
+    TEST_ASSERT_EQUAL_UINT32(100000, readValue(&frame[9], 4));
+
+    const uint8_t *first = &frame[TelemetryBatch::HEADER_LENGTH];
+    const uint8_t mac[6] = {0x24, 0x6F, 0x28, 0x01, 0x02, 0x10};
+    TEST_ASSERT_EQUAL_MEMORY(mac, first, 6);
+    TEST_ASSERT_UINT32_WITHIN(1, 3234, readValue(&first[6], 2));
+    TEST_ASSERT_EQUAL_UINT32(100, readValue(&first[8], 2));
+    TEST_ASSERT_EQUAL_INT16(-8125, (int16_t)readValue(&first[10], 2));
+    TEST_ASSERT_EQUAL_UINT8(0, first[12]);
+    TEST_ASSERT_UINT32_WITHIN(1, 20, readValue(&first[13], 2));
+
+    const uint8_t *second = first + TelemetryBatch::RECORD_LENGTH;
+    TEST_ASSERT_EQUAL_UINT8(0x11, second[5]);
+    TEST_ASSERT_EQUAL_UINT32(12500, readValue(&second[6], 2));
+    TEST_ASSERT_EQUAL_UINT32(10, readValue(&second[8], 2));
+    TEST_ASSERT_EQUAL_UINT8(3, second[12]);
+}
+
+void test_values_are_clamped(void)
+{
+    TelemetryBatch batch;
+    // a negative range from bad calibration, one past 65 m, and one 2 minutes old
+    batch.add(record(0, -0.1f, 0));
+    batch.add(record(1, 80, 120000));
+    TelemetryBatch::Record noisy = record(2, 1, 120000);
+    noisy.variance = 5000;
+    batch.add(noisy);
+
+    uint8_t frame[TelemetryBatch::MAX_FRAME_LENGTH];
+    batch.encode(120000, frame, sizeof(frame));
+    const uint8_t *records = &frame[TelemetryBatch::HEADER_LENGTH];
+    TEST_ASSERT_EQUAL_UINT32(0, readValue(&records[6], 2));
+    TEST_ASSERT_EQUAL_UINT32(65535, readValue(&records[8], 2));
+    TEST_ASSERT_EQUAL_UINT32(65535, readValue(&records[TelemetryBatch::RECORD_LENGTH + 6], 2));
+    TEST_ASSERT_EQUAL_UINT32(65535, readValue(&records[2 * TelemetryBatch::RECORD_LENGTH + 13], 2));
+}
+
+void test_batch_fills_up(void)
+{
+    TelemetryBatch batch;
+    for (uint8_t i = 0; i < TelemetryBatch::MAX_RECORDS; i++)
+    {
+        TEST_ASSERT_TRUE(batch.add(record(i, 1, 0)));
+    }
+    TEST_ASSERT_TRUE(batch.isFull());
+    TEST_ASSERT_FALSE(batch.add(record(0, 1, 0)));
+
+    // no room to encode into, the records stay for the next try
+    uint8_t frame[TelemetryBatch::MAX_FRAME_LENGTH];
+    TEST_ASSERT_EQUAL_UINT32(0, batch.encode(0, frame, sizeof(frame) - 1));
+    TEST_ASSERT_EQUAL_UINT8(TelemetryBatch::MAX_RECORDS, batch.getCount());
+    TEST_ASSERT_EQUAL_UINT32(TelemetryBatch::MAX_FRAME_LENGTH, batch.encode(0, frame, sizeof(frame)));
+    TEST_ASSERT_EQUAL_UINT8(0, frame[1]);
+}
+
+void test_sequence_wraps(void)
+{
+    TelemetryBatch batch;
+    uint8_t frame[TelemetryBatch::MAX_FRAME_LENGTH];
+    for (int i = 0; i < 257; i++)
+    {
+        batch.encode(0, frame, sizeof(frame));
+    }
+    TEST_ASSERT_EQUAL_UINT8(0, frame[1]);
+    // empty batches are still a valid frame, just a header
+    TEST_ASSERT_EQUAL_UINT32(TelemetryBatch::HEADER_LENGTH, batch.encode(0, frame, sizeof(frame)));
+    TEST_ASSERT_EQUAL_UINT8(1, frame[1]);
+}
+
+/**
+ * Bytes on the wire and serialisation time per range, counted the way HomeAssistant's stats do (topic + payload):
+ * the HA JSON publish per range from sendTagDistanceToAnchorEUI(), against one batch per flush from flushTelemetry().
+ * 8 tags at 10 Hz flushed every 400 ms fills a batch.
+ */
+void test_bytes_and_cost_per_report(void)
+{
+    const int tags = 8;
+    const int perBatch = TelemetryBatch::MAX_RECORDS;
+    const int rounds = 20000;
+    char topics[tags][64];
+    for (int i = 0; i < tags; i++)
+    {
+        snprintf(topics[i], sizeof(topics[i]), "homeassistant/sensor/dw1000-tag-246f28%02x0203-246f28010203/state", 0x10 + i);
+    }
+    const char *telemetryTopic = "dw1000/dw1000-anchor-246f28010203/ranges";
+
+    uint64_t jsonBytes = 0;
+    volatile char sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds * perBatch; i++)
+    {
+        char buffer[64];
+        int n = snprintf(buffer, sizeof(buffer), "{\"distance\":%g,\"variance\":%g}", 3 + (i % 1000) * 0.001f, 0.0004f);
+        jsonBytes += strlen(topics[i % tags]) + n;
+        sink = sink + buffer[n - 2];
+    }
+    double jsonNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / (rounds * perBatch);
+
+    TelemetryBatch batch;
+    batch.setAnchorMac(ANCHOR_MAC);
+    uint64_t batchBytes = 0;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++)
+    {
+        for (int j = 0; j < perBatch; j++)
+        {
+            TEST_ASSERT_TRUE(batch.add(record(j % tags, 3 + j * 0.001f, i * 400 + j)));
+        }
+        uint8_t frame[TelemetryBatch::MAX_FRAME_LENGTH];
+        size_t n = batch.encode(i * 400 + 400, frame, sizeof(frame));
+        batchBytes += strlen(telemetryTopic) + n;
+        sink = sink + frame[n - 1];
+    }
+    double batchNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / (rounds * perBatch);
+
+    double jsonPerReport = (double)jsonBytes / (rounds * perBatch);
+    double batchPerReport = (double)batchBytes / (rounds * perBatch);
+    char message[160];
+    snprintf(message, sizeof(message), "JSON %.1f bytes %.0f ns per range, batched %.1f bytes %.0f ns per range, 1 publish instead of %d",
+             jsonPerReport, jsonNs, batchPerReport, batchNs, perBatch);
+    TEST_MESSAGE(message);
+
+    // a record is 15 bytes, the topic and header spread over the batch
+    TEST_ASSERT_TRUE(batchPerReport < TelemetryBatch::RECORD_LENGTH + 3);
+    TEST_ASSERT_TRUE(jsonPerReport > 4 * batchPerReport);
+    TEST_ASSERT_TRUE(batchNs < jsonNs);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_frame_layout);
+    RUN_TEST(test_values_are_clamped);
+    RUN_TEST(test_batch_fills_up);
+    RUN_TEST(test_sequence_wraps);
+    RUN_TEST(test_bytes_and_cost_per_report);
+    return UNITY_END();
+}